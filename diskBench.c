@@ -0,0 +1,269 @@
+/* Program 4
+ * Daniel Foxhoven
+ * Geoff Wacker
+ * Adair Camacho
+ * Due Date: 3/19/17
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "tinyFS.h"
+#include "libDisk.h"
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+
+/* Measures libDisk on its own, below the file system:
+   diskBench [disk file] [seconds per run]
+Each run keeps issuing one kind of call for the given time, from one
+or more threads, at consecutive or random blocks, and reports blocks
+per second, bandwidth and the latency of each call. libDisk has no
+asynchronous calls, so a deeper queue means more blocks per call
+(readBlocks, or a batch of writeBlock calls and commitBatch) or more
+threads calling at once. The disk file is written in full first, so
+reads come from the page cache unless the run uses direct I/O. */
+
+#define DISK_BENCH_NAME "diskBenchDisk"
+#define DISK_BENCH_BYTES (64 * 1024 * 1024)
+#define DISK_BENCH_SECONDS 0.25
+#define DISK_BENCH_MAX_THREADS 8
+#define DISK_BENCH_MAX_DEPTH 64
+
+/* What each call does */
+#define MODE_READ 0
+#define MODE_WRITE 1
+#define MODE_BATCH 2
+#define MODE_MAP 3
+
+/* Block sizes to measure, smallest to largest */
+int diskBenchSizes[] = {512, 4096, 65536};
+
+/* One thread's share of a run and the latencies it saw, in seconds */
+typedef struct {
+    int disk, mode, random, blockSize, depth, first, span, failed;
+    unsigned int seed;
+    double seconds;
+    char *map;
+    double *times;
+    int count, cap;
+    long blocks;
+    unsigned int check;
+} bench_worker;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Issues calls until the run's time is up. A random read or write
+starts at a random block; each block of a random batch is picked on
+its own. Consecutive calls walk through the thread's own range of
+blocks and wrap at its end. */
+void *benchWorker(void *arg) {
+    bench_worker *me = arg;
+    char *buf;
+    int bNum = me->first, i, ret = 0;
+    double start, end = now() + me->seconds;
+
+    buf = malloc((size_t) me->depth * me->blockSize);
+    memset(buf, 'd', (size_t) me->depth * me->blockSize);
+    while ((start = now()) < end) {
+        if (me->random) {
+            bNum = me->first + rand_r(&me->seed) % (me->span - me->depth + 1);
+        }
+        switch (me->mode) {
+        case MODE_READ:
+            ret = readBlocks(me->disk, bNum, me->depth, buf);
+            break;
+        case MODE_WRITE:
+            ret = writeBlock(me->disk, bNum, buf);
+            break;
+        case MODE_BATCH:
+            beginBatch(me->disk);
+            for (i = 0; i < me->depth && ret == 0; i++) {
+                ret = writeBlock(me->disk, me->random ? me->first + rand_r(&me->seed) % me->span : bNum + i,
+                                 buf + i * me->blockSize);
+            }
+            ret = ret == 0 ? commitBatch(me->disk) : abortBatch(me->disk);
+            break;
+        case MODE_MAP:
+            memcpy(buf, me->map + (size_t) bNum * me->blockSize, (size_t) me->depth * me->blockSize);
+            break;
+        }
+        if (ret < 0) {
+            me->failed = 1;
+            break;
+        }
+
+        if (me->count == me->cap) {
+            me->cap = me->cap ? me->cap * 2 : 4096;
+            me->times = realloc(me->times, me->cap * sizeof(double));
+        }
+        me->times[me->count++] = now() - start;
+        me->blocks += me->depth;
+        me->check += buf[0];
+
+        if (!me->random && (bNum += me->depth) + me->depth > me->first + me->span) {
+            bNum = me->first;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Runs ‘threads’ workers at once with the given block size and prints
+one line for the run. Consecutive runs split the disk into one range
+per thread. Batches only reach the blocks a batch can stage. */
+int benchRun(char *name, int disk, int mode, int random, int blockSize, int depth, int threads, double seconds) {
+    bench_worker workers[DISK_BENCH_MAX_THREADS];
+    pthread_t handles[DISK_BENCH_MAX_THREADS];
+    double *times, elapsed, start;
+    int numBlocks, count = 0, failed = 0, i;
+    long blocks = 0;
+
+    if (setBlockSize(disk, blockSize) < 0) {
+        return ERR_BAD_REQUEST;
+    }
+    numBlocks = DISK_BENCH_BYTES / blockSize;
+    if (mode == MODE_BATCH && numBlocks > MAX_BLOCKS + 1) {
+        numBlocks = MAX_BLOCKS + 1;
+    }
+
+    memset(workers, 0, sizeof(workers));
+    start = now();
+    for (i = 0; i < threads; i++) {
+        workers[i].disk = disk;
+        workers[i].mode = mode;
+        workers[i].random = random;
+        workers[i].blockSize = blockSize;
+        workers[i].depth = depth;
+        workers[i].first = random ? 0 : i * (numBlocks / threads);
+        workers[i].span = random ? numBlocks : numBlocks / threads;
+        workers[i].seed = i + 1;
+        workers[i].seconds = seconds;
+        workers[i].map = mode == MODE_MAP ? mapDisk(disk) : NULL;
+        pthread_create(&handles[i], NULL, benchWorker, &workers[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(handles[i], NULL);
+        count += workers[i].count;
+        blocks += workers[i].blocks;
+        failed |= workers[i].failed;
+    }
+    elapsed = now() - start;
+
+    // Percentiles are over every call any thread made.
+    times = malloc((count ? count : 1) * sizeof(double));
+    for (i = 0, count = 0; i < threads; i++) {
+        memcpy(times + count, workers[i].times, workers[i].count * sizeof(double));
+        count += workers[i].count;
+        free(workers[i].times);
+    }
+    qsort(times, count, sizeof(double), compareDoubles);
+
+    if (failed || count == 0) {
+        printf("%-10s %-6s %6d %5d %7d     failed\n", name, random ? "random" : "seq", blockSize, depth, threads);
+    }
+    else {
+        printf("%-10s %-6s %6d %5d %7d %10.0f %9.1f %9.2f %9.2f %9.2f\n", name, random ? "random" : "seq",
+               blockSize, depth, threads, blocks / elapsed, (double) blocks * blockSize / elapsed / (1024 * 1024),
+               times[count / 2] * 1e6, times[count * 99 / 100] * 1e6, times[count * 999 / 1000] * 1e6);
+    }
+    fflush(stdout);
+    free(times);
+    return failed ? ERR_READ : SUCCESS;
+}
+
+/* Writes every byte of the disk once so no read lands in a hole. */
+int fillDisk(int disk) {
+    char *buf;
+    int i, ret = 0;
+
+    setBlockSize(disk, MAX_BLOCKSIZE);
+    buf = malloc(MAX_BLOCKSIZE);
+    for (i = 0; i < MAX_BLOCKSIZE; i++) {
+        buf[i] = 'a' + (i % 26);
+    }
+    for (i = 0; i < DISK_BENCH_BYTES / MAX_BLOCKSIZE && ret == 0; i++) {
+        ret = writeBlock(disk, i, buf);
+    }
+    free(buf);
+    return ret < 0 ? ret : syncDisk(disk);
+}
+
+int main(int argc, char *argv[]) {
+    char *name = argc > 1 ? argv[1] : DISK_BENCH_NAME;
+    double seconds = argc > 2 ? atof(argv[2]) : DISK_BENCH_SECONDS;
+    char journal[1024];
+    int disk, size, random, threads, depth;
+
+    if (seconds <= 0) {
+        fprintf(stderr, "usage: diskBench [disk file] [seconds per run]\n");
+        return 1;
+    }
+    if ((disk = openDisk(name, DISK_BENCH_BYTES)) < 0 || fillDisk(disk) < 0) {
+        fprintf(stderr, "diskBench: could not set up %s\n", name);
+        return 1;
+    }
+
+    printf("%-10s %-6s %6s %5s %7s %10s %9s %9s %9s %9s\n", "call", "order", "block", "depth", "threads",
+           "blocks/s", "MiB/s", "p50 us", "p99 us", "p999 us");
+
+    // One block per call from one thread, for each block size.
+    for (size = 0; size < sizeof(diskBenchSizes) / sizeof(int); size++) {
+        for (random = 0; random < 2; random++) {
+            benchRun("readBlock", disk, MODE_READ, random, diskBenchSizes[size], 1, 1, seconds);
+            benchRun("writeBlock", disk, MODE_WRITE, random, diskBenchSizes[size], 1, 1, seconds);
+        }
+    }
+
+    // More threads calling at once.
+    for (threads = 2; threads <= DISK_BENCH_MAX_THREADS; threads *= 2) {
+        benchRun("readBlock", disk, MODE_READ, 1, 4096, 1, threads, seconds);
+        benchRun("writeBlock", disk, MODE_WRITE, 1, 4096, 1, threads, seconds);
+    }
+
+    // More blocks per call: one read of consecutive blocks, or a batch
+    // committed with one journal sync.
+    for (depth = 4; depth <= DISK_BENCH_MAX_DEPTH; depth *= 4) {
+        for (random = 0; random < 2; random++) {
+            benchRun("readBlocks", disk, MODE_READ, random, 4096, depth, 1, seconds);
+        }
+    }
+    for (depth = 1; depth <= DISK_BENCH_MAX_DEPTH; depth *= 4) {
+        benchRun("batch", disk, MODE_BATCH, 1, 4096, depth, 1, seconds);
+    }
+
+    // Reads through the mapping, then around the page cache.
+    for (threads = 1; threads <= DISK_BENCH_MAX_THREADS; threads *= 4) {
+        for (random = 0; random < 2; random++) {
+            benchRun("mapDisk", disk, MODE_MAP, random, 4096, 1, threads, seconds);
+        }
+    }
+    if (setDirectIO(disk, 1) < 0) {
+        printf("direct I/O is not supported on this file system\n");
+    }
+    else {
+        for (threads = 1; threads <= DISK_BENCH_MAX_THREADS; threads *= 4) {
+            benchRun("direct rd", disk, MODE_READ, 1, 4096, 1, threads, seconds);
+            benchRun("direct wr", disk, MODE_WRITE, 1, 4096, 1, threads, seconds);
+        }
+        benchRun("direct rd", disk, MODE_READ, 0, 65536, 1, 1, seconds);
+        benchRun("direct wr", disk, MODE_WRITE, 0, 65536, 1, 1, seconds);
+    }
+
+    closeDisk(disk);
+    remove(name);
+    snprintf(journal, sizeof(journal), "%s%s", name, JOURNAL_SUFFIX);
+    remove(journal);
+    return 0;
+}
@@ -4,90 +4,1287 @@
  * Adair Camacho 
  * Due Date: 3/19/17
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include "libDisk.h"
 #include "tinyFS_errno.h"
 #include "libTinyFS.h"
+#include "tfsProbe.h"
+
+/* What is holding a disk's writes back, if anything */
+#define HOLD_BATCH 1
+#define HOLD_QUEUE 2
+
+/* Open disks, indexed by disk number. A slot is free when fd is 0.
+While a batch or the request queue is open, batching says which and
+staged holds the new content of every block written since. queueing
+stays set while the queue is wanted, so it opens again after a batch.
+The counters are the ones queueStats() and copyStats() report. A striped disk keeps
+one descriptor, path and lock per member, fd is the first member's. A
+read-only disk has every member open O_RDONLY. journalFd is the
+journal, kept open from the first commit until the disk closes, or -1. */
+typedef struct {
+	int fd;
+	int readOnly;
+	int blockSize;
+	char *map;
+	size_t mapLen;
+	char *journal;
+	int journalFd;
+	int batching;
+	int queueing;
+	char *staged[MAX_BLOCKS + 1];
+	long readRequests;
+	long readCalls;
+	long writeRequests;
+	long writeCalls;
+	long copies;
+	int direct;
+	int members;
+	int stripeUnit;
+	int fds[MAX_STRIPE_MEMBERS];
+	char *paths[MAX_STRIPE_MEMBERS];
+	pthread_mutex_t locks[MAX_STRIPE_MEMBERS];
+} tfs_disk;
+
+/* One member's share of a striped transfer. The pieces of the caller's
+buffer it covers sit back to back on the member, starting at offset. */
+typedef struct {
+	tfs_disk *d;
+	int member;
+	int write;
+	struct iovec *iov;
+	int count;
+	off_t offset;
+	size_t len;
+	ssize_t done;
+} tfs_stripePart;
+
+tfs_disk disks[MAX_DISKS];
 
 int openDisk(char *filename, int nBytes) {
+	return openStripedDisk(&filename, 1, nBytes, BLOCKSIZE);
+}
+
+/* Creates, or overwrites, ‘filename’ as nBytes of zeros and returns it
+open, or -1. */
+int createMember(char *filename, int nBytes) {
 	char *buf;
 	int i;
 	fileDescriptor fd;
-	if (nBytes == 0) {
-		return open(filename, O_RDWR);
+
+	if ((fd = open(filename, O_CREAT|O_RDWR, 0777)) < 0) {
+		return -1;
+	}
+	buf = (char*) malloc(nBytes * sizeof(char));
+	for (i = 0; i < nBytes; i++) {
+		buf[i] = '\0';
+	}
+	if (write(fd, buf, nBytes) < nBytes) {
+		free(buf);
+		close(fd);
+		errno = INIT_FILE_FAILURE;
+		return -1;
+	}
+	free(buf);
+	return fd;
+}
+
+int openStripedDisk(char **filenames, int count, int nBytes, int stripeUnit) {
+	return openDiskFiles(filenames, count, nBytes, stripeUnit, 0);
+}
+
+int openDiskReadOnly(char **filenames, int count, int stripeUnit) {
+	return openDiskFiles(filenames, count, 0, stripeUnit, 1);
+}
+
+int openDiskFiles(char **filenames, int count, int nBytes, int stripeUnit, int readOnly) {
+	int i, disk, saved, memberBytes;
+	fileDescriptor fds[MAX_STRIPE_MEMBERS];
+
+	// Find a free slot for the disk number.
+	for (disk = 0; disk < MAX_DISKS && disks[disk].fd > 0; disk++)
+		;
+	if (disk == MAX_DISKS) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	if (count < 1 || count > MAX_STRIPE_MEMBERS || stripeUnit < MIN_BLOCKSIZE ||
+	    (stripeUnit & (stripeUnit - 1))) {
+		errno = EINVAL;
+		return -1;
 	}
-	else if (nBytes < BLOCKSIZE) {
+	if (nBytes != 0 && nBytes < BLOCKSIZE) {
 		errno = BLOCKSIZE_FAILURE;
 		return -1;
 	}
-	else {
-		if ((fd = open(filename, O_CREAT|O_RDWR, 0777)) >= 0) {
-			while (nBytes % BLOCKSIZE != 0) {
-				nBytes--;
-			}
-			buf = (char*) malloc(nBytes * sizeof(char));
-			for (i = 0; i < nBytes; i++) {
-				buf[i] = '\0';
-			}
-			if (write(fd, buf, nBytes) < nBytes) {
-				free(buf);
-				errno = INIT_FILE_FAILURE;
-				return -1;
+	while (nBytes % BLOCKSIZE != 0) {
+		nBytes--;
+	}
+
+	// Each member holds one stripe unit of every row of the disk.
+	memberBytes = count == 1 ? nBytes : (nBytes + stripeUnit * count - 1) / (stripeUnit * count) * stripeUnit;
+	for (i = 0; i < count; i++) {
+		fds[i] = nBytes ? createMember(filenames[i], memberBytes) : open(filenames[i], readOnly ? O_RDONLY : O_RDWR);
+		if (fds[i] < 0) {
+			saved = errno;
+			while (i-- > 0) {
+				close(fds[i]);
 			}
-			free(buf);
+			errno = saved;
+			return -1;
 		}
 	}
-	return fd;
+
+	// Striped files are labelled, so a missing, foreign or misplaced one
+	// is refused before anything is read from it.
+	if (count > 1 && (nBytes ? labelMembers(fds, count, memberBytes) : checkMembers(fds, count)) < 0) {
+		saved = errno;
+		for (i = 0; i < count; i++) {
+			close(fds[i]);
+		}
+		errno = saved;
+		return -1;
+	}
+
+	disks[disk].fd = fds[0];
+	disks[disk].readOnly = readOnly;
+	disks[disk].blockSize = BLOCKSIZE;
+	disks[disk].map = NULL;
+	disks[disk].batching = 0;
+	disks[disk].queueing = 0;
+	memset(disks[disk].staged, 0, sizeof(disks[disk].staged));
+	disks[disk].readRequests = disks[disk].readCalls = 0;
+	disks[disk].writeRequests = disks[disk].writeCalls = disks[disk].copies = 0;
+	disks[disk].direct = 0;
+	disks[disk].members = count;
+	disks[disk].stripeUnit = stripeUnit;
+	for (i = 0; i < count; i++) {
+		disks[disk].fds[i] = fds[i];
+		disks[disk].paths[i] = strdup(filenames[i]);
+		pthread_mutex_init(&disks[disk].locks[i], NULL);
+	}
+
+	// A freshly formatted disk has nothing to recover.
+	disks[disk].journalFd = -1;
+	disks[disk].journal = malloc(strlen(filenames[0]) + sizeof(JOURNAL_SUFFIX));
+	sprintf(disks[disk].journal, "%s%s", filenames[0], JOURNAL_SUFFIX);
+	if (nBytes) {
+		i = errno;
+		unlink(disks[disk].journal);
+		errno = i;
+	}
+	return disk;
+}
+
+/* Writes each file's label right after its memberBytes of stripe units,
+where the file now ends. */
+int labelMembers(int *fds, int count, off_t memberBytes) {
+	tfs_memberLabel label;
+	struct timespec now;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	label.magic = MEMBER_MAGIC;
+	label.id = (unsigned int) now.tv_sec ^ (unsigned int) now.tv_nsec ^ ((unsigned int) getpid() << 16);
+	label.count = count;
+	for (i = 0; i < count; i++) {
+		label.index = i;
+		if (ftruncate(fds[i], memberBytes + sizeof(label)) < 0 ||
+		    pwrite(fds[i], &label, sizeof(label), memberBytes) < (ssize_t) sizeof(label)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Checks that the label at the end of every file names the same disk
+and the file's place in it. */
+int checkMembers(int *fds, int count) {
+	tfs_memberLabel label;
+	unsigned int id = 0;
+	struct stat st;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (fstat(fds[i], &st) < 0 || st.st_size < (off_t) sizeof(label) ||
+		    pread(fds[i], &label, sizeof(label), st.st_size - sizeof(label)) < (ssize_t) sizeof(label) ||
+		    label.magic != MEMBER_MAGIC || label.index != i || label.count != count || (i && label.id != id)) {
+			errno = EINVAL;
+			return -1;
+		}
+		id = label.id;
+	}
+	return 0;
+}
+
+int closeDisk(int disk) {
+	int i;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	if (disks[disk].map) {
+		munmap(disks[disk].map, disks[disk].mapLen);
+		disks[disk].map = NULL;
+	}
+	abortBatch(disk);
+	endQueue(disk);
+
+	// A journal whose batch is down in place is removed, one a failed
+	// commit left behind stays for the next mount to replay.
+	if (disks[disk].journalFd >= 0) {
+		close(disks[disk].journalFd);
+		if (!journalPending(disk)) {
+			unlink(disks[disk].journal);
+		}
+	}
+	free(disks[disk].journal);
+	for (i = 0; i < disks[disk].members; i++) {
+		free(disks[disk].paths[i]);
+		pthread_mutex_destroy(&disks[disk].locks[i]);
+		close(disks[disk].fds[i]);
+	}
+	disks[disk].fd = 0;
+	return 0;
+}
+
+int setBlockSize(int disk, int size) {
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	// Must be a power of two within the supported range.
+	if (size < MIN_BLOCKSIZE || size > MAX_BLOCKSIZE || (size & (size - 1))) {
+		return BLOCKSIZE_FAILURE;
+	}
+	disks[disk].blockSize = size;
+	return 0;
+}
+
+int getBlockSize(int disk) {
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	return disks[disk].blockSize;
+}
+
+/* Whether the content of block bNum is held in memory */
+int heldBlock(tfs_disk *d, int bNum) {
+	return d->batching && bNum <= MAX_BLOCKS && d->staged[bNum];
+}
+
+/* Whether a write to block bNum is held back. The queue lets the
+blocks it can't stage go straight through. */
+int holdsWrite(tfs_disk *d, int bNum) {
+	return d->batching == HOLD_BATCH || (d->batching == HOLD_QUEUE && bNum >= 0 && bNum <= MAX_BLOCKS);
 }
 
 int readBlock(int disk, int bNum, void *block) {
-	UINT byteOffset = bNum * BLOCKSIZE;
-	
-	// Seek to the specified offset on the disk, check for error.
-	if (lseek(disk, byteOffset, SEEK_SET) == -1) {
-		perror("readBlock: Seek error");
-		return ERR_SEEK;
-	}
-	
-	// Now try to read from the disk and copy to the local buffer, check for error.
-	if (read(disk, block, BLOCKSIZE) < -1) {
-		perror("readBlock: Read error");
-		return ERR_READ;
+	return readBlocks(disk, bNum, 1, block);
+}
+
+int readBlocks(int disk, int bNum, int count, void *blocks) {
+	off_t byteOffset;
+	size_t total, done = 0;
+	ssize_t got;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
 	}
-	
+	byteOffset = (off_t) bNum * disks[disk].blockSize;
+	total = (size_t) count * disks[disk].blockSize;
+	TFS_PROBE3(block__read, disk, bNum, total);
+
+	// Keep reading until the whole range is in, the kernel may return short reads.
+	while (done < total) {
+		if ((got = diskRead(disk, (char *) blocks + done, total - done, byteOffset + done)) <= 0) {
+			perror("readBlock: Read error");
+			TFS_PROBE3(block__read__done, disk, bNum, ERR_READ);
+			return ERR_READ;
+		}
+		done += got;
+	}
+
+	// Blocks written in an open batch read back as written.
+	if (disks[disk].batching) {
+		for (done = 0; done < count; done++) {
+			if (bNum + done <= MAX_BLOCKS && disks[disk].staged[bNum + done]) {
+				memcpy((char *) blocks + done * disks[disk].blockSize, disks[disk].staged[bNum + done],
+				       disks[disk].blockSize);
+			}
+		}
+	}
+
 	// If we reach here, we didn't have any errors so we return 0.
+	TFS_PROBE3(block__read__done, disk, bNum, 0);
 	return 0;
 }
 
 int writeBlock(int disk, int bNum, void *block) {
-   int ret = 0;
-   UINT offset = bNum * BLOCKSIZE;
-   
-   //Seek to specified offset, check for error
-   if (lseek(disk, offset, SEEK_SET) == -1)
-   {
-      perror("writeBlock: seek error");
-      return ERR_SEEK;
+   off_t offset;
+   int size;
+
+   if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+      return ERR_INVALID_DISK;
    }
-   //Write to file, if success set ret to 0
-   if ((write(disk, block, BLOCKSIZE)) <= 0)
-   {
-      perror("writeBlock: Write error");
-      ret  = ERR_WRITE;
+   size = disks[disk].blockSize;
+   offset = (off_t) bNum * size;
+
+   if (holdsWrite(&disks[disk], bNum)) {
+      return writeBlockPart(disk, bNum, 0, block, size);
    }
-	/*
-	I don't think we need to do this... -Geoff
-   //reset file to point to the beginning
-   if (lseek(disk, 0, SEEK_SET) < 0)
+
+   //Write to file at the block's offset, if success return 0
+   TFS_PROBE3(block__write, disk, bNum, size);
+   if (diskWrite(disk, block, size, offset) < size)
    {
-      perror("writeBlock: lseek:");
-      ret = ERR_SEEK;
+      perror("writeBlock: Write error");
+      TFS_PROBE3(block__write__done, disk, bNum, ERR_WRITE);
+      return ERR_WRITE;
    }
-	*/
+   TFS_PROBE3(block__write__done, disk, bNum, 0);
+	return 0;
+}
+
+int readBlockPart(int disk, int bNum, int offset, void *buf, int len) {
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	if (disks[disk].batching && bNum <= MAX_BLOCKS && disks[disk].staged[bNum]) {
+		memcpy(buf, disks[disk].staged[bNum] + offset, len);
+		return 0;
+	}
+	TFS_PROBE3(block__read, disk, bNum, len);
+	if (diskRead(disk, buf, len, (off_t) bNum * disks[disk].blockSize + offset) < len) {
+		perror("readBlockPart: Read error");
+		TFS_PROBE3(block__read__done, disk, bNum, ERR_READ);
+		return ERR_READ;
+	}
+	TFS_PROBE3(block__read__done, disk, bNum, 0);
+	return 0;
+}
+
+int writeBlockPart(int disk, int bNum, int offset, void *buf, int len) {
+	char *block;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	if (holdsWrite(&disks[disk], bNum)) {
+		if ((block = stageBlock(disk, bNum, offset == 0 && len == disks[disk].blockSize)) == NULL) {
+			return ERR_WRITE;
+		}
+		memcpy(block + offset, buf, len);
+		return 0;
+	}
+	TFS_PROBE3(block__write, disk, bNum, len);
+	if (diskWrite(disk, buf, len, (off_t) bNum * disks[disk].blockSize + offset) < len) {
+		perror("writeBlockPart: Write error");
+		TFS_PROBE3(block__write__done, disk, bNum, ERR_WRITE);
+		return ERR_WRITE;
+	}
+	TFS_PROBE3(block__write__done, disk, bNum, 0);
+	return 0;
+}
+
+/* Whether ‘disk’ is one file read through the page cache, which the
+kernel's copy and vectored calls can address as it is. Direct I/O has
+alignment rules they don't keep to, and a striped disk's bytes are
+spread over several files. */
+int plainFile(int disk) {
+	return !disks[disk].direct && disks[disk].members == 1;
+}
+
+/* copy_file_range() fails with one of these when the kernel or the
+file systems can't do the copy, rather than because of bad I/O. */
+int copyUnsupported(int err) {
+	return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == EBADF;
+}
+
+int compareRequests(const void *a, const void *b) {
+	const tfs_diskRequest *x = a, *y = b;
+
+	if (x->bNum != y->bNum) {
+		return x->bNum < y->bNum ? -1 : 1;
+	}
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+int readRequests(int disk, tfs_diskRequest *reqs, int count) {
+	tfs_disk *d;
+	struct iovec *iov;
+	char gap[MIN_BLOCKSIZE], *joined;
+	off_t start, end, next;
+	size_t at;
+	ssize_t got;
+	int i, j, n, run;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	d = &disks[disk];
+	if (count < 1) {
+		return 0;
+	}
+	qsort(reqs, count, sizeof(tfs_diskRequest), compareRequests);
+	__atomic_fetch_add(&d->readRequests, count, __ATOMIC_RELAXED);
+	if ((iov = malloc(2 * count * sizeof(struct iovec))) == NULL) {
+		return ERR_READ;
+	}
+
+	for (i = 0; i < count; i += run) {
+		if (heldBlock(d, reqs[i].bNum)) {
+			memcpy(reqs[i].buf, d->staged[reqs[i].bNum] + reqs[i].offset, reqs[i].len);
+			run = 1;
+			continue;
+		}
+
+		// Take in the requests that follow on, skipping gaps of less than
+		// the smallest block, such as extent headers, into a scratch buffer.
+		start = (off_t) reqs[i].bNum * d->blockSize + reqs[i].offset;
+		end = start + reqs[i].len;
+		iov[0].iov_base = reqs[i].buf;
+		iov[0].iov_len = reqs[i].len;
+		for (run = 1, n = 1; i + run < count && n + 2 <= IOV_MAX; run++) {
+			next = (off_t) reqs[i + run].bNum * d->blockSize + reqs[i + run].offset;
+			if (next < end || next - end >= MIN_BLOCKSIZE || heldBlock(d, reqs[i + run].bNum)) {
+				break;
+			}
+			if (next > end) {
+				iov[n].iov_base = gap;
+				iov[n++].iov_len = next - end;
+			}
+			iov[n].iov_base = reqs[i + run].buf;
+			iov[n++].iov_len = reqs[i + run].len;
+			end = next + reqs[i + run].len;
+		}
+
+		TFS_PROBE3(block__read, disk, reqs[i].bNum, end - start);
+		if (plainFile(disk)) {
+			got = preadv(d->fd, iov, n, start);
+		}
+		else if ((joined = malloc(end - start)) == NULL) {
+			got = -1;
+		}
+		else {
+			if ((got = diskRead(disk, joined, end - start, start)) == end - start) {
+				for (j = 0, at = 0; j < n; at += iov[j++].iov_len) {
+					memcpy(iov[j].iov_base, joined + at, iov[j].iov_len);
+				}
+			}
+			free(joined);
+		}
+		__atomic_fetch_add(&d->readCalls, 1, __ATOMIC_RELAXED);
+
+		// The kernel may come back short, the rest go one at a time.
+		for (j = i; got < end - start && j < i + run; j++) {
+			if (readBlockPart(disk, reqs[j].bNum, reqs[j].offset, reqs[j].buf, reqs[j].len) < 0) {
+				TFS_PROBE3(block__read__done, disk, reqs[i].bNum, ERR_READ);
+				free(iov);
+				return ERR_READ;
+			}
+		}
+		TFS_PROBE3(block__read__done, disk, reqs[i].bNum, 0);
+	}
+	free(iov);
+	return 0;
+}
+
+int copyToDisk(int disk, int bNum, int offset, int hostFd, off_t hostOffset, int len) {
+	off_t diskOffset;
+	ssize_t done = 0;
+	char *buf;
+	int ret = 0;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	diskOffset = (off_t) bNum * disks[disk].blockSize + offset;
+
+	// In a batch the content has to land in the staged block. The queue
+	// writes out what it holds for the block, and the copy goes on top.
+	if (disks[disk].batching == HOLD_BATCH) {
+		if ((buf = stageBlock(disk, bNum, 0)) == NULL || pread(hostFd, buf + offset, len, hostOffset) < len) {
+			return ERR_WRITE;
+		}
+		return 0;
+	}
+	if (flushBlock(disk, bNum) < 0) {
+		return ERR_WRITE;
+	}
+
+	while (len > 0) {
+		if (plainFile(disk) &&
+		    (done = copy_file_range(hostFd, &hostOffset, disks[disk].fd, &diskOffset, len, 0)) > 0) {
+			__atomic_fetch_add(&disks[disk].copies, 1, __ATOMIC_RELAXED);
+			len -= done;
+			continue;
+		}
+		if (plainFile(disk) && (done == 0 || !copyUnsupported(errno))) {
+			return ERR_READ;
+		}
+
+		// Fall back to a buffered copy of whatever is left.
+		buf = malloc(len);
+		if (pread(hostFd, buf, len, hostOffset) < len ||
+		    diskWrite(disk, buf, len, diskOffset) < len) {
+			ret = ERR_WRITE;
+		}
+		free(buf);
+		return ret;
+	}
+	return 0;
+}
+
+int copyFromDisk(int disk, int bNum, int offset, int hostFd, int len) {
+	off_t diskOffset;
+	ssize_t done = 0;
+	char *buf;
+	int ret = 0;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	diskOffset = (off_t) bNum * disks[disk].blockSize + offset;
+
+	if (disks[disk].batching && bNum <= MAX_BLOCKS && disks[disk].staged[bNum]) {
+		return write(hostFd, disks[disk].staged[bNum] + offset, len) < len ? ERR_WRITE : 0;
+	}
+
+	while (len > 0) {
+		if (plainFile(disk) &&
+		    (done = copy_file_range(disks[disk].fd, &diskOffset, hostFd, NULL, len, 0)) > 0) {
+			__atomic_fetch_add(&disks[disk].copies, 1, __ATOMIC_RELAXED);
+			len -= done;
+			continue;
+		}
+		if (plainFile(disk) && (done == 0 || !copyUnsupported(errno))) {
+			return ERR_WRITE;
+		}
+
+		// Pipes, sockets, direct I/O and striped disks can't take
+		// copy_file_range, go through a buffer.
+		buf = malloc(len);
+		if (diskRead(disk, buf, len, diskOffset) < len || write(hostFd, buf, len) < len) {
+			ret = ERR_WRITE;
+		}
+		free(buf);
+		return ret;
+	}
+	return 0;
+}
+
+void *mapDisk(int disk) {
+	struct stat st;
+	void *map;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return NULL;
+	}
+	// The mapping only shows what reached the file.
+	if (flushQueue(disk) < 0) {
+		return NULL;
+	}
+	if (disks[disk].map) {
+		return disks[disk].map;
+	}
+
+	// A striped disk isn't laid out in order in any one file.
+	if (disks[disk].members > 1) {
+		return NULL;
+	}
+
+	if (fstat(disks[disk].fd, &st) < 0 || st.st_size == 0) {
+		return NULL;
+	}
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, disks[disk].fd, 0)) == MAP_FAILED) {
+		return NULL;
+	}
+	disks[disk].map = map;
+	disks[disk].mapLen = st.st_size;
+	return map;
+}
+
+char *stageBlock(int disk, int bNum, int whole) {
+	tfs_disk *d = &disks[disk];
+
+	if (bNum < 0 || bNum > MAX_BLOCKS) {
+		return NULL;
+	}
+	__atomic_fetch_add(&d->writeRequests, 1, __ATOMIC_RELAXED);
+
+	// The first write to a block in a batch starts from what is on disk,
+	// unless it covers all of it.
+	if (!d->staged[bNum]) {
+		if ((d->staged[bNum] = malloc(d->blockSize)) == NULL) {
+			return NULL;
+		}
+		if (!whole &&
+		    diskRead(disk, d->staged[bNum], d->blockSize, (off_t) bNum * d->blockSize) < d->blockSize) {
+			memset(d->staged[bNum], 0, d->blockSize);
+		}
+	}
+	return d->staged[bNum];
+}
+
+int beginBatch(int disk) {
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	if (disks[disk].batching == HOLD_BATCH) {
+		return ERR_BAD_REQUEST;
+	}
+	// The journal is a file written next to the disk.
+	if (disks[disk].readOnly) {
+		return ERR_READ_ONLY;
+	}
+	// Queued writes aren't part of the batch, and an abort can't drop them.
+	if (flushQueue(disk) < 0) {
+		return ERR_WRITE;
+	}
+	disks[disk].batching = HOLD_BATCH;
+	return 0;
+}
+
+/* Frees every staged block. */
+void dropStaged(tfs_disk *d) {
+	int i;
+
+	for (i = 0; i <= MAX_BLOCKS; i++) {
+		free(d->staged[i]);
+		d->staged[i] = NULL;
+	}
+}
+
+int abortBatch(int disk) {
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	if (disks[disk].batching != HOLD_BATCH) {
+		return 0;
+	}
+	dropStaged(&disks[disk]);
+	disks[disk].batching = disks[disk].queueing ? HOLD_QUEUE : 0;
+	return 0;
+}
+
+int beginQueue(int disk) {
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	if (disks[disk].readOnly) {
+		return ERR_READ_ONLY;
+	}
+	disks[disk].queueing = 1;
+	if (!disks[disk].batching) {
+		disks[disk].batching = HOLD_QUEUE;
+	}
+	return 0;
+}
+
+int flushQueue(int disk) {
+	tfs_disk *d;
+	unsigned char bNums[MAX_BLOCKS + 1];
+	char *blocks[MAX_BLOCKS + 1];
+	int i, count = 0, ret;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	// In a batch the blocks wait for the commit.
+	d = &disks[disk];
+	if (d->batching != HOLD_QUEUE) {
+		return 0;
+	}
+	for (i = 0; i <= MAX_BLOCKS; i++) {
+		if (d->staged[i]) {
+			bNums[count] = i;
+			blocks[count++] = d->staged[i];
+		}
+	}
+	ret = count ? writeSorted(disk, bNums, blocks, count) : 0;
+	dropStaged(d);
 	return ret;
 }
+
+/* Writes out and drops the queue's copy of block bNum, if it holds one.
+Safe to call from several threads for different blocks. */
+int flushBlock(int disk, int bNum) {
+	tfs_disk *d = &disks[disk];
+	ssize_t done;
+
+	if (d->batching != HOLD_QUEUE || !heldBlock(d, bNum)) {
+		return 0;
+	}
+	done = diskWrite(disk, d->staged[bNum], d->blockSize, (off_t) bNum * d->blockSize);
+	__atomic_fetch_add(&d->writeCalls, 1, __ATOMIC_RELAXED);
+	free(d->staged[bNum]);
+	d->staged[bNum] = NULL;
+	return done < d->blockSize ? ERR_WRITE : 0;
+}
+
+int endQueue(int disk) {
+	int ret = flushQueue(disk);
+
+	if (ret == ERR_INVALID_DISK) {
+		return ret;
+	}
+	disks[disk].queueing = 0;
+	if (disks[disk].batching == HOLD_QUEUE) {
+		disks[disk].batching = 0;
+	}
+	return ret;
+}
+
+int queueStats(int disk, long *readRequests, long *readCalls, long *writeRequests, long *writeCalls) {
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	*readRequests = __atomic_load_n(&disks[disk].readRequests, __ATOMIC_RELAXED);
+	*readCalls = __atomic_load_n(&disks[disk].readCalls, __ATOMIC_RELAXED);
+	*writeRequests = disks[disk].writeRequests;
+	*writeCalls = __atomic_load_n(&disks[disk].writeCalls, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int copyStats(int disk, long *copies) {
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	*copies = __atomic_load_n(&disks[disk].copies, __ATOMIC_RELAXED);
+	return 0;
+}
+
+unsigned int journalChecksum(unsigned int sum, char *data, size_t len) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sum = (sum ^ (unsigned char) data[i]) * 16777619u;
+	}
+	return sum;
+}
+
+/* Writes the blocks listed in ‘bNums’, in ascending order, with one
+write per run of consecutive block numbers. */
+int writeSorted(int disk, unsigned char *bNums, char **blocks, int count) {
+	struct iovec iov[MAX_BLOCKS + 1];
+	int i, j, run, size = disks[disk].blockSize;
+	ssize_t done;
+	char *joined;
+
+	for (i = 0; i < count; i += run) {
+		for (run = 0; i + run < count && bNums[i + run] == bNums[i] + run; run++) {
+			iov[run].iov_base = blocks[i + run];
+			iov[run].iov_len = size;
+		}
+
+		// Direct I/O goes through an aligned buffer and striping splits
+		// the run up again, so it is joined up first.
+		if (!plainFile(disk)) {
+			joined = malloc((size_t) run * size);
+			for (j = 0; j < run; j++) {
+				memcpy(joined + (size_t) j * size, blocks[i + j], size);
+			}
+			done = diskWrite(disk, joined, (size_t) run * size, (off_t) bNums[i] * size);
+			free(joined);
+		}
+		else {
+			done = pwritev(disks[disk].fd, iov, run, (off_t) bNums[i] * size);
+		}
+		disks[disk].writeCalls++;
+		if (done < (ssize_t) run * size) {
+			perror("commitBatch: Write error");
+			return ERR_WRITE;
+		}
+	}
+	return 0;
+}
+
+/* fsyncs the directory holding ‘path’, so a file just created in it
+is still there after a crash. */
+int syncParent(char *path) {
+	char *dir = strdup(path), *slash = strrchr(dir, '/');
+	int fd, ret = -1;
+
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	}
+	else {
+		slash[slash == dir] = '\0';
+	}
+	if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) >= 0) {
+		ret = fsync(fd);
+		close(fd);
+	}
+	free(dir);
+	return ret;
+}
+
+/* Opens the disk's journal for the first commit, creating it if need
+be. Its directory entry is synced once, here, rather than every commit. */
+int openJournal(tfs_disk *d) {
+	if (d->journalFd >= 0) {
+		return 0;
+	}
+	if ((d->journalFd = open(d->journal, O_CREAT | O_RDWR, 0644)) < 0) {
+		return -1;
+	}
+	if (syncParent(d->journal) < 0) {
+		close(d->journalFd);
+		d->journalFd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* Closes and removes the disk's journal. */
+void dropJournal(tfs_disk *d) {
+	if (d->journalFd >= 0) {
+		close(d->journalFd);
+		d->journalFd = -1;
+	}
+	unlink(d->journal);
+}
+
+int commitBatch(int disk) {
+	tfs_disk *d;
+	tfs_journalHeader header;
+	unsigned char bNums[MAX_BLOCKS + 1];
+	char *blocks[MAX_BLOCKS + 1];
+	struct iovec iov[MAX_BLOCKS + 3];
+	unsigned int retired = 0;
+	ssize_t total;
+	int i, count = 0, ret = 0;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	d = &disks[disk];
+	if (d->batching != HOLD_BATCH) {
+		return ERR_BAD_REQUEST;
+	}
+	for (i = 0; i <= MAX_BLOCKS; i++) {
+		if (d->staged[i]) {
+			bNums[count] = i;
+			blocks[count++] = d->staged[i];
+		}
+	}
+	if (count == 0) {
+		return abortBatch(disk);
+	}
+
+	// The journal goes out, and to stable storage, before any block is
+	// written in place, so a crash in between is replayed at mount.
+	header.magic = JOURNAL_MAGIC;
+	header.blockSize = d->blockSize;
+	header.count = count;
+	header.checksum = journalChecksum(2166136261u, (char *) bNums, count);
+	for (i = 0; i < count; i++) {
+		header.checksum = journalChecksum(header.checksum, blocks[i], d->blockSize);
+	}
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = bNums;
+	iov[1].iov_len = count;
+	for (i = 0, total = sizeof(header) + count; i < count; i++, total += d->blockSize) {
+		iov[i + 2].iov_base = blocks[i];
+		iov[i + 2].iov_len = d->blockSize;
+	}
+	if (openJournal(d) < 0 || pwritev(d->journalFd, iov, count + 2, 0) < total || fdatasync(d->journalFd) < 0) {
+		if (d->journalFd >= 0) {
+			pwrite(d->journalFd, &retired, sizeof(retired), 0);
+		}
+		abortBatch(disk);
+		return ERR_WRITE;
+	}
+
+	// Then every block once, in order. Once they are down too the
+	// journal is retired by clearing its magic; that needs no sync, as
+	// replaying a batch that is already in place changes nothing.
+	if ((ret = writeSorted(disk, bNums, blocks, count)) == 0 && syncDisk(disk) == 0) {
+		pwrite(d->journalFd, &retired, sizeof(retired), 0);
+	}
+	abortBatch(disk);
+	return ret;
+}
+
+int recoverDisk(int disk) {
+	tfs_journalHeader header;
+	unsigned char bNums[MAX_BLOCKS + 1];
+	char **blocks;
+	unsigned int sum;
+	int i, jfd, saved, ret = 0;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	// No journal is the usual case, and not an error.
+	saved = errno;
+	if ((jfd = open(disks[disk].journal, O_RDONLY)) < 0) {
+		errno = saved;
+		return 0;
+	}
+
+	// A journal cut short by a crash fails the checksum, and then none of
+	// its batch was written in place yet.
+	if (read(jfd, &header, sizeof(header)) < (ssize_t) sizeof(header) || header.magic != JOURNAL_MAGIC ||
+	    header.count < 1 || header.count > MAX_BLOCKS + 1 || header.blockSize < MIN_BLOCKSIZE ||
+	    header.blockSize > MAX_BLOCKSIZE || read(jfd, bNums, header.count) < header.count) {
+		close(jfd);
+		dropJournal(&disks[disk]);
+		return 0;
+	}
+	blocks = calloc(header.count, sizeof(char *));
+	sum = journalChecksum(2166136261u, (char *) bNums, header.count);
+	for (i = 0; i < header.count && ret == 0; i++) {
+		blocks[i] = malloc(header.blockSize);
+		if (read(jfd, blocks[i], header.blockSize) < header.blockSize) {
+			ret = -1;
+		}
+		else {
+			sum = journalChecksum(sum, blocks[i], header.blockSize);
+		}
+	}
+	close(jfd);
+
+	if (ret == 0 && sum == header.checksum) {
+		i = disks[disk].blockSize;
+		disks[disk].blockSize = header.blockSize;
+		ret = writeSorted(disk, bNums, blocks, header.count);
+		disks[disk].blockSize = i;
+		if (ret == 0 && syncDisk(disk) == 0) {
+			ret = header.count;
+		}
+	}
+	else {
+		ret = 0;
+	}
+	if (ret >= 0) {
+		dropJournal(&disks[disk]);
+	}
+
+	for (i = 0; i < header.count; i++) {
+		free(blocks[i]);
+	}
+	free(blocks);
+	return ret;
+}
+
+int journalPending(int disk) {
+	unsigned int magic;
+	int saved = errno, pending = 0, jfd;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	// A retired journal is kept for the next commit, not replayed.
+	if ((jfd = open(disks[disk].journal, O_RDONLY)) >= 0) {
+		pending = read(jfd, &magic, sizeof(magic)) == sizeof(magic) && magic == JOURNAL_MAGIC;
+		close(jfd);
+	}
+	errno = saved;
+	return pending;
+}
+
+/* Reads or writes ‘len’ bytes at ‘offset’ of one member file, through
+an aligned bounce buffer when the disk uses direct I/O. */
+ssize_t memberRead(tfs_disk *d, int member, void *buf, size_t len, off_t offset) {
+	off_t start;
+	size_t span;
+	ssize_t got;
+	void *bounce;
+
+	if (!d->direct) {
+		return pread(d->fds[member], buf, len, offset);
+	}
+
+	// Read the aligned span around the range into an aligned buffer. The
+	// last span may run past the end of the file and come back short.
+	start = offset & ~(off_t) (DIRECT_ALIGN - 1);
+	span = (offset + len - start + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1);
+	if (posix_memalign(&bounce, DIRECT_ALIGN, span) != 0) {
+		return -1;
+	}
+	if ((got = pread(d->fds[member], bounce, span, start)) >= 0) {
+		got = got > offset - start ? got - (offset - start) : 0;
+		got = got < len ? got : len;
+		memcpy(buf, (char *) bounce + (offset - start), got);
+	}
+	free(bounce);
+	return got;
+}
+
+ssize_t memberWrite(tfs_disk *d, int member, void *buf, size_t len, off_t offset) {
+	off_t start;
+	size_t span;
+	ssize_t done = -1;
+	void *bounce;
+
+	if (!d->direct) {
+		return pwrite(d->fds[member], buf, len, offset);
+	}
+
+	// Blocks smaller than the alignment share a span, so the span is read,
+	// patched and written back whole. The lock keeps two threads from
+	// doing that to the same span at once.
+	start = offset & ~(off_t) (DIRECT_ALIGN - 1);
+	span = (offset + len - start + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1);
+	if (posix_memalign(&bounce, DIRECT_ALIGN, span) != 0) {
+		return -1;
+	}
+	memset(bounce, 0, span);
+	pthread_mutex_lock(&d->locks[member]);
+	if ((offset == start && len == span) || pread(d->fds[member], bounce, span, start) >= 0) {
+		memcpy((char *) bounce + (offset - start), buf, len);
+		if (pwrite(d->fds[member], bounce, span, start) == (ssize_t) span) {
+			done = len;
+		}
+	}
+	pthread_mutex_unlock(&d->locks[member]);
+	free(bounce);
+	return done;
+}
+
+/* Moves one member's share of a striped transfer: a single piece goes
+straight through, several go with one vectored call, or through one
+joined buffer under direct I/O. */
+void *memberTransfer(void *arg) {
+	tfs_stripePart *part = arg;
+	char *joined;
+	size_t at;
+	int i;
+
+	if (part->count == 1) {
+		part->done = part->write ? memberWrite(part->d, part->member, part->iov[0].iov_base, part->len, part->offset)
+		                         : memberRead(part->d, part->member, part->iov[0].iov_base, part->len, part->offset);
+		return NULL;
+	}
+	if (!part->d->direct && part->count <= IOV_MAX) {
+		part->done = part->write ? pwritev(part->d->fds[part->member], part->iov, part->count, part->offset)
+		                         : preadv(part->d->fds[part->member], part->iov, part->count, part->offset);
+		return NULL;
+	}
+
+	joined = malloc(part->len);
+	if (part->write) {
+		for (i = 0, at = 0; i < part->count; at += part->iov[i++].iov_len) {
+			memcpy(joined + at, part->iov[i].iov_base, part->iov[i].iov_len);
+		}
+		part->done = memberWrite(part->d, part->member, joined, part->len, part->offset);
+	}
+	else if ((part->done = memberRead(part->d, part->member, joined, part->len, part->offset)) > 0) {
+		for (i = 0, at = 0; i < part->count && at < part->done; at += part->iov[i++].iov_len) {
+			memcpy(part->iov[i].iov_base, joined + at,
+			       part->done - at < part->iov[i].iov_len ? part->done - at : part->iov[i].iov_len);
+		}
+	}
+	free(joined);
+	return NULL;
+}
+
+/* Splits a transfer on a striped disk into one part per member it
+touches and moves the parts, on threads of their own when the transfer
+is big enough to be worth it. Returns the bytes moved from the start
+of the range, like pread, or -1. */
+ssize_t stripeIO(tfs_disk *d, int write, char *buf, size_t len, off_t offset) {
+	tfs_stripePart parts[MAX_STRIPE_MEMBERS];
+	pthread_t threads[MAX_STRIPE_MEMBERS];
+	int started[MAX_STRIPE_MEMBERS];
+	size_t at, piece, left[MAX_STRIPE_MEMBERS];
+	size_t maxPieces = len / ((size_t) d->stripeUnit * d->members) + 2;
+	off_t unit;
+	int m, used = 0, first = -1, failed = 0;
+	ssize_t total = 0;
+
+	// Deal the range out a stripe unit at a time. Consecutive units of one
+	// member are consecutive in its file.
+	memset(parts, 0, sizeof(parts));
+	for (at = 0; at < len; at += piece) {
+		unit = (offset + at) / d->stripeUnit;
+		m = unit % d->members;
+		piece = d->stripeUnit - (offset + at) % d->stripeUnit;
+		piece = piece < len - at ? piece : len - at;
+		if (parts[m].iov == NULL) {
+			parts[m].d = d;
+			parts[m].member = m;
+			parts[m].write = write;
+			parts[m].iov = malloc(maxPieces * sizeof(struct iovec));
+			parts[m].offset = unit / d->members * d->stripeUnit + (offset + at) % d->stripeUnit;
+			used++;
+		}
+		parts[m].iov[parts[m].count].iov_base = buf + at;
+		parts[m].iov[parts[m].count++].iov_len = piece;
+		parts[m].len += piece;
+	}
+
+	// The caller moves the first part itself while threads move the rest.
+	for (m = 0; m < d->members; m++) {
+		started[m] = 0;
+		if (parts[m].iov == NULL) {
+			continue;
+		}
+		if (first < 0) {
+			first = m;
+		}
+		else if (used > 1 && len >= STRIPE_PARALLEL_BYTES &&
+		         pthread_create(&threads[m], NULL, memberTransfer, &parts[m]) == 0) {
+			started[m] = 1;
+		}
+		else {
+			memberTransfer(&parts[m]);
+		}
+	}
+	if (first >= 0) {
+		memberTransfer(&parts[first]);
+	}
+	for (m = 0; m < d->members; m++) {
+		if (started[m]) {
+			pthread_join(threads[m], NULL);
+		}
+		if (parts[m].iov && parts[m].done < 0) {
+			failed = 1;
+		}
+		left[m] = parts[m].done > 0 ? parts[m].done : 0;
+		free(parts[m].iov);
+	}
+	if (failed) {
+		return -1;
+	}
+
+	// A member that came up short ends the range there.
+	for (at = 0; at < len; at += piece) {
+		m = (offset + at) / d->stripeUnit % d->members;
+		piece = d->stripeUnit - (offset + at) % d->stripeUnit;
+		piece = piece < len - at ? piece : len - at;
+		if (left[m] < piece) {
+			return at + left[m];
+		}
+		left[m] -= piece;
+		total += piece;
+	}
+	return total;
+}
+
+ssize_t diskRead(int disk, void *buf, size_t len, off_t offset) {
+	if (disks[disk].members > 1) {
+		return stripeIO(&disks[disk], 0, buf, len, offset);
+	}
+	return memberRead(&disks[disk], 0, buf, len, offset);
+}
+
+ssize_t diskWrite(int disk, void *buf, size_t len, off_t offset) {
+	if (disks[disk].readOnly) {
+		errno = EBADF;
+		return -1;
+	}
+	if (disks[disk].members > 1) {
+		return stripeIO(&disks[disk], 1, buf, len, offset);
+	}
+	return memberWrite(&disks[disk], 0, buf, len, offset);
+}
+
+int setDirectIO(int disk, int enabled) {
+	fileDescriptor fds[MAX_STRIPE_MEMBERS];
+	int i;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	// Every member reopens before any is switched over.
+	for (i = 0; i < disks[disk].members; i++) {
+		if ((fds[i] = open(disks[disk].paths[i], (disks[disk].readOnly ? O_RDONLY : O_RDWR) | (enabled ? O_DIRECT : 0))) < 0) {
+			while (i-- > 0) {
+				close(fds[i]);
+			}
+			return ERR_INVALID_DISK;
+		}
+	}
+	for (i = 0; i < disks[disk].members; i++) {
+		close(disks[disk].fds[i]);
+		disks[disk].fds[i] = fds[i];
+	}
+	disks[disk].fd = fds[0];
+	disks[disk].direct = enabled;
+	return 0;
+}
+
+int punchBlocks(int disk, int bNum, int count) {
+	tfs_disk *d;
+	off_t offset, end, piece, row, start[MAX_STRIPE_MEMBERS], stop[MAX_STRIPE_MEMBERS];
+	int i, m;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	d = &disks[disk];
+	if (d->readOnly) {
+		return ERR_READ_ONLY;
+	}
+	// Queued writes go out first, or they would fill the holes again.
+	if (flushQueue(disk) < 0) {
+		return ERR_WRITE;
+	}
+	if (d->batching == HOLD_BATCH || count < 1) {
+		return ERR_BAD_REQUEST;
+	}
+	offset = (off_t) bNum * d->blockSize;
+	end = offset + (off_t) count * d->blockSize;
+
+	// A range of the disk is one range of each member it touches, whole
+	// rows in the middle and part of one at either end.
+	for (i = 0; i < d->members; i++) {
+		start[i] = stop[i] = 0;
+	}
+	while (offset < end) {
+		piece = d->members == 1 ? end - offset : d->stripeUnit - offset % d->stripeUnit;
+		piece = piece < end - offset ? piece : end - offset;
+		m = d->members == 1 ? 0 : (offset / d->stripeUnit) % d->members;
+		row = d->members == 1 ? offset : offset / ((off_t) d->stripeUnit * d->members) * d->stripeUnit + offset % d->stripeUnit;
+		if (stop[m] == 0) {
+			start[m] = row;
+		}
+		stop[m] = row + piece;
+		offset += piece;
+	}
+
+	// Partial pages would only be zeroed, not freed, so they are left
+	// as they are.
+	for (i = 0; i < d->members; i++) {
+		start[i] = (start[i] + PUNCH_ALIGN - 1) & ~(off_t) (PUNCH_ALIGN - 1);
+		stop[i] &= ~(off_t) (PUNCH_ALIGN - 1);
+		if (stop[i] > start[i] &&
+		    fallocate(d->fds[i], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start[i], stop[i] - start[i]) < 0) {
+			return errno == EOPNOTSUPP ? ERR_BAD_REQUEST : ERR_WRITE;
+		}
+	}
+	return 0;
+}
+
+int syncDisk(int disk) {
+	int i;
+
+	if (disk < 0 || disk >= MAX_DISKS || disks[disk].fd <= 0) {
+		return ERR_INVALID_DISK;
+	}
+	if (flushQueue(disk) < 0) {
+		return ERR_WRITE;
+	}
+	for (i = 0; i < disks[disk].members; i++) {
+		if (fdatasync(disks[disk].fds[i]) < 0) {
+			return ERR_WRITE;
+		}
+	}
+	return 0;
+}
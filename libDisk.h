@@ -5,8 +5,40 @@
  * Due Date: 3/19/17
  */
 
-/* The default size of the disk and file system block */
-#define BLOCKSIZE 256
+#include <sys/types.h>
+#include "tinyFS.h"
+
+/* Most disks that can be open at once */
+#define MAX_DISKS 16
+
+/* Most files one striped disk can span, and the smallest transfer that
+is sent to several of them at once on parallel threads */
+#define MAX_STRIPE_MEMBERS 8
+#define STRIPE_PARALLEL_BYTES (256 * 1024)
+
+/* A batch's journal sits next to the disk file, under its name with
+this suffix */
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_MAGIC 0x544a4e4c
+#define MEMBER_MAGIC 0x54534d42
+
+/* Journal file header, followed by ‘count’ block numbers and then the
+blocks themselves. The checksum, journalChecksum() started from
+2166136261, covers everything after the header. A magic of 0 marks a
+journal whose batch is already in place. */
+typedef struct {
+	unsigned int magic;
+	int blockSize;
+	int count;
+	unsigned int checksum;
+} tfs_journalHeader;
+
+/* Direct I/O moves whole spans of this many bytes, at offsets that are
+multiples of it, through buffers aligned to it */
+#define DIRECT_ALIGN 4096
+
+/* Hole punching frees whole host pages of this many bytes */
+#define PUNCH_ALIGN 4096
 
 #define UINT unsigned int
 
@@ -22,9 +54,52 @@ requirement to maintain integrity of any file content beyond nBytes.
 The return value is -1 on failure or a disk number on success. */
 int openDisk(char *filename, int nBytes);
 
-/* readBlock() reads an entire block of BLOCKSIZE bytes from the open
+/* openStripedDisk() opens the ‘count’ files in ‘filenames’ as one disk
+whose bytes are dealt out across them ‘stripeUnit’ bytes at a time, so
+byte n lives in file (n / stripeUnit) % count. stripeUnit is a power of
+two no smaller than MIN_BLOCKSIZE. With nBytes > 0 every file is
+created, or overwritten, with its share of nBytes, and a striped disk
+gets a tfs_memberLabel at the end of each file. Opening an existing
+striped disk fails with errno EINVAL unless every file carries the
+label of the same disk and they come in the order they were created
+in. A transfer spanning
+several files reaches each one with a single vectored call, and once
+it is STRIPE_PARALLEL_BYTES or more, all of them at the same time.
+Striped disks can't be mapped. Returns -1 on failure or a disk number. */
+int openStripedDisk(char **filenames, int count, int nBytes, int stripeUnit);
+
+/* Label after the last stripe unit of each file of a striped disk. id
+is picked when the disk is created and is the same in all of its
+files, index is the file's place in the stripe. */
+typedef struct {
+	unsigned int magic;
+	unsigned int id;
+	int index;
+	int count;
+} tfs_memberLabel;
+
+/* openDiskReadOnly() opens existing files like openStripedDisk() with
+nBytes 0, but O_RDONLY, so the disk works on images the process can't
+write and nothing written through it can reach them. Every write fails
+and batches can't begin. */
+int openDiskReadOnly(char **filenames, int count, int stripeUnit);
+int openDiskFiles(char **filenames, int count, int nBytes, int stripeUnit, int readOnly);
+int labelMembers(int *fds, int count, off_t memberBytes);
+int checkMembers(int *fds, int count);
+
+/* closeDisk() closes the disk and frees its disk number. */
+int closeDisk(int disk);
+
+/* setBlockSize() changes the block size used for every transfer on
+‘disk’. A disk starts out at BLOCKSIZE; the size must be a power of
+two between MIN_BLOCKSIZE and MAX_BLOCKSIZE. getBlockSize() returns
+the current size. */
+int setBlockSize(int disk, int size);
+int getBlockSize(int disk);
+
+/* readBlock() reads an entire block of the disk's block size from the open
 disk (identified by ‘disk’) and copies the result into a local buffer
-(must be at least of BLOCKSIZE bytes). The bNum is a logical block
+(must be at least one block). The bNum is a logical block
 number, which must be translated into a byte offset within the disk.
 The translation from logical to physical block is straightforward:
 bNum=0 is the very first byte of the file. bNum=1 is BLOCKSIZE bytes
@@ -34,11 +109,131 @@ it returns 0. -1 or smaller is returned if disk is not available
 error code system. */
 int readBlock(int disk, int bNum, void *block);
 
+/* readBlocks() reads ‘count’ consecutive blocks starting at logical
+block bNum with a single read, copying them into ‘blocks’ (must be at
+least count blocks). Used for whole-image metadata scans.
+Returns 0 on success or an error code like readBlock(). */
+int readBlocks(int disk, int bNum, int count, void *blocks);
+
 /* writeBlock() takes disk number ‘disk’ and logical block number
 ‘bNum’ and writes the content of the buffer ‘block’ to that location.
-‘block’ must be integral with BLOCKSIZE. Just as in readBlock(),
+‘block’ must be integral with the disk's block size. Just as in readBlock(),
 writeBlock() must translate the logical block bNum to the correct
 byte position in the file. On success, it returns 0. -1 or smaller is
 returned if disk is not available (i.e. hasn’t been opened) or any
 other failures. You must define your own error code system. */
 int writeBlock(int disk, int bNum, void *block);
+
+/* readBlockPart() and writeBlockPart() move ‘len’ bytes starting at
+byte ‘offset’ of block bNum, for callers that only need part of a
+block such as an extent header. Return 0 or an error code like
+readBlock(). Outside a batch readBlockPart() is a single positional
+read and safe to call from any number of threads at once. */
+int readBlockPart(int disk, int bNum, int offset, void *buf, int len);
+int writeBlockPart(int disk, int bNum, int offset, void *buf, int len);
+
+/* One read of a request list: ‘len’ bytes at byte ‘offset’ of block
+bNum go to ‘buf’ */
+typedef struct {
+	int bNum;
+	int offset;
+	int len;
+	char *buf;
+} tfs_diskRequest;
+
+/* readRequests() reads the ‘count’ requests in ‘reqs’, given in any
+order. It sorts the list in place by position on the disk, then reads
+each run of requests that follow on from one another, with gaps of
+less than MIN_BLOCKSIZE bytes between them, with a single preadv.
+Overlapping requests start a new run. Returns 0 or an error code like
+readBlock(). Safe to call from several threads at once outside a batch. */
+int readRequests(int disk, tfs_diskRequest *reqs, int count);
+int compareRequests(const void *a, const void *b);
+
+/* copyToDisk() copies ‘len’ bytes at ‘hostOffset’ in the host file
+‘hostFd’ to byte ‘offset’ of block bNum. copyFromDisk() copies ‘len’
+bytes at byte ‘offset’ of block bNum to the host file at its current
+position. Both copy inside the kernel with copy_file_range() when the
+two files allow it, and through a buffer otherwise. copyToDisk() in
+an open batch lands in the staged block instead; with the queue open
+it writes out the queue's copy of the block and copies around the
+queue. Return 0 or an error code. Safe to call from several threads
+for different blocks. */
+int copyToDisk(int disk, int bNum, int offset, int hostFd, off_t hostOffset, int len);
+int copyFromDisk(int disk, int bNum, int offset, int hostFd, int len);
+
+/* beginBatch() holds every write to ‘disk’ in memory until the batch
+ends; reads in the meantime see the new content. commitBatch() writes
+the held blocks to a journal beside the disk file, syncs it, then
+writes each block once, in block order, with one write per run of
+consecutive blocks, and retires the journal. The journal file is
+created, and its directory synced, at the first commit, and is reused
+until closeDisk() removes it. abortBatch() drops the held blocks.
+recoverDisk() replays a journal left by a commit that was cut short
+and returns the number of blocks it wrote, or 0 if there was none;
+run it before reading anything from a disk just opened. */
+int beginBatch(int disk);
+int commitBatch(int disk);
+int abortBatch(int disk);
+int recoverDisk(int disk);
+
+/* journalPending() returns 1 if ‘disk’ has a journal recoverDisk()
+would have to look at, whether or not it would replay it, and 0 if
+there is none or it is retired. */
+int journalPending(int disk);
+char *stageBlock(int disk, int bNum, int whole);
+int syncParent(char *path);
+int writeSorted(int disk, unsigned char *bNums, char **blocks, int count);
+unsigned int journalChecksum(unsigned int sum, char *data, size_t len);
+
+/* beginQueue() holds every write to ‘disk’ in memory, as a batch
+does but without a journal, until flushQueue(). That sorts the held
+blocks and writes each run of consecutive ones with one pwritev, like
+commitBatch(), then keeps holding new writes. Several writes to one
+block cost a single write. syncDisk(), mapDisk(), punchBlocks() and
+beginBatch() flush first, and closeDisk() flushes what is left. A batch
+begun with the queue open holds its own writes, and the queue resumes
+once it ends. endQueue() flushes and stops holding writes. All three
+return 0 or an error code. flushQueue() returns 0 when nothing is held. */
+int beginQueue(int disk);
+int flushQueue(int disk);
+int endQueue(int disk);
+
+/* queueStats() reports the block requests that went through the queue,
+a batch or readRequests(), and the calls that carried them to the
+file. Requests per call is the merge ratio. */
+int queueStats(int disk, long *readRequests, long *readCalls, long *writeRequests, long *writeCalls);
+
+/* copyStats() reports how many copy_file_range() calls copyToDisk()
+and copyFromDisk() have made on ‘disk’. flushBlock() writes out the
+queue's copy of block bNum, if it holds one. Both return 0 or an error
+code. */
+int copyStats(int disk, long *copies);
+int flushBlock(int disk, int bNum);
+
+/* setDirectIO() reopens ‘disk’ with O_DIRECT, or without it again, so
+transfers bypass the kernel's page cache. Blocks smaller than
+DIRECT_ALIGN are read and written as part of the aligned span around
+them. Fails if the file system doesn't support it. syncDisk() waits
+until everything written to ‘disk’ is on stable storage. Both return 0
+or an error code. */
+int setDirectIO(int disk, int enabled);
+int syncDisk(int disk);
+
+/* punchBlocks() hands the space behind the ‘count’ blocks starting at
+bNum back to the host file system with fallocate(FALLOC_FL_PUNCH_HOLE),
+one call per file the range touches. Only the whole PUNCH_ALIGN byte
+pages in the range are punched: what they held reads back as zeros,
+the rest of the range is left as it was. The disk keeps its size.
+Returns 0, ERR_BAD_REQUEST in a batch or when the host file system
+can't punch holes, or another error code. */
+int punchBlocks(int disk, int bNum, int count);
+ssize_t diskRead(int disk, void *buf, size_t len, off_t offset);
+ssize_t diskWrite(int disk, void *buf, size_t len, off_t offset);
+
+/* mapDisk() maps the whole disk read-only into memory and returns its
+first byte, so block bNum starts bNum * getBlockSize() bytes in. Writes
+made with writeBlock() show through the mapping. The mapping is made
+once and stays valid until closeDisk(). Returns NULL if the disk can't
+be mapped. */
+void *mapDisk(int disk);
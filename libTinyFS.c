@@ -4,6 +4,7 @@
  * Adair Camacho
  * Due Date: 3/19/17
  */
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -12,51 +13,209 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include "tinyFS_errno.h"
 #include "tinyFS.h"
 #include "libTinyFS.h"
 #include "libDisk.h"
+#include "tfsProbe.h"
 
 int diskFD;
 int freeBlocks;
 int numBlocks;
-int *openFilesLocation;
-char **openFilesTable;
+int numInodes;
+int blockSize = BLOCKSIZE;
+int rootDir;
+tfs_cachedBlock dirCache[DIR_CACHE_SIZE];
+tfs_openEntry *openFiles;
+int openFilesSize;
+int openFilesFree;
+int *openFilesByInode;
+int *blockPins;
+tfs_fileStat *inodeTable;
+tfs_extentIndex *extentIndexes;
+int pinnedViews;
+unsigned char *blockMap;
+unsigned char *blockRefs;
+int blockMapBlock;
+int blockRefsBlock;
+int snapshotBlock;
+int reclaimPending;
+int logMode;
+unsigned char *logState;
+int logHead;
+int logSegment;
+int logCleaning = -1;
+int mountReadOnly;
+int numNames;
+int dedupInline;
+unsigned char dedupIndex[DEDUP_BUCKETS];
+unsigned int dedupHashes[DEDUP_BUCKETS];
+int allocPolicy = ALLOC_HEAD;
+int allocCursor;
+unsigned char *freeNext;
+unsigned char *freePrev;
+unsigned char *freeState;
+int freeTail;
+unsigned char *trimPending;
+int trimCount;
+int batchOpen;
+int syncMode;
+int mountDirect;
+int mountNoWrite;
+int mountWriteThrough;
+char **mountMembers;
+int mountMemberCount;
+tfs_batchState batchSaved;
+tfs_arenaChunk *mountArena;
 char *mountedDisk = NULL;
+FILE *traceFile;
+struct timespec traceEpoch;
+pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+char holeBlock[MAX_BLOCKSIZE];
 
 int tfs_mkfs(char *filename, int nBytes) {
+    probeEnter("tfs_mkfs", 0, nBytes);
+    return probeReturn("tfs_mkfs", 0, formatImage(&filename, 1, nBytes, BLOCKSIZE, BLOCKSIZE));
+}
+
+int tfs_mkfsBlockSize(char *filename, int nBytes, int size) {
+    probeEnter("tfs_mkfsBlockSize", 0, nBytes);
+    return probeReturn("tfs_mkfsBlockSize", 0, formatImage(&filename, 1, nBytes, size, size));
+}
+
+int tfs_mkfsStriped(char **members, int count, int nBytes, int size, int stripeUnit) {
+    probeEnter("tfs_mkfsStriped", 0, nBytes);
+    return probeReturn("tfs_mkfsStriped", 0, formatImage(members, count, nBytes, size, stripeUnit));
+}
+
+int formatImage(char **members, int count, int nBytes, int size, int stripeUnit) {
     tfs_block buf;
 	fileDescriptor fd;
-	int traversed = 0;
-	if ((fd = openDisk(filename, nBytes)) >= 0) {
-		while (nBytes % BLOCKSIZE != 0) {
-			nBytes--;
-		}
-	    
-        /* init and write superblock */
-	    initSuperblock(&buf, 1, nBytes);
-		
-		if (writeBlock(fd, traversed, buf.mem) < 0) {
-			return MKFS_FAILURE;
-		}
+	int traversed, ret = SUCCESS, mountedSize = blockSize, shift = 0;
 
-        while ((++traversed * BLOCKSIZE) < nBytes) {
-		    /* init and write all free */
-		    if ((traversed + 1) * BLOCKSIZE >= nBytes) {
-		        initFreeblock(&buf, '\0');
-            }
-		    else {
-		        initFreeblock(&buf, traversed+1);
-            }
-			if (writeBlock(fd, traversed, buf.mem) < 0) {
-			    return MKFS_FAILURE;
-		    }
-        }
+	// Block size has to be a power of two the disk library supports.
+	if (size < MIN_BLOCKSIZE || size > MAX_BLOCKSIZE || (size & (size - 1))) {
+		fprintf(stderr, "mkfs: invalid block size %d\n", size);
+		return MKFS_FAILURE;
 	}
-	else {
+
+	// So does the stripe unit, which the superblock keeps as a shift.
+	while ((1 << shift) < stripeUnit && shift < MAX_STRIPE_SHIFT) {
+		shift++;
+	}
+	if (count < 1 || count > MAX_STRIPE_MEMBERS || stripeUnit < MIN_BLOCKSIZE || (1 << shift) != stripeUnit) {
+		fprintf(stderr, "mkfs: invalid stripe of %d files, %d bytes\n", count, stripeUnit);
+		return MKFS_FAILURE;
+	}
+
+	// Block addresses are one byte, so anything past MAX_BLOCKS is unusable.
+	if (nBytes > MAX_BLOCKS * size) {
+		nBytes = MAX_BLOCKS * size;
+	}
+	while (nBytes % size != 0) {
+		nBytes--;
+	}
+
+	// Need room for the superblock and the root directory.
+	if (nBytes < 2 * size) {
+		return MKFS_FAILURE;
+	}
+
+	if ((fd = openStripedDisk(members, count, nBytes, stripeUnit)) < 0) {
 	    return MKFS_FAILURE;
 	}
-	return SUCCESS;
+	setBlockSize(fd, size);
+
+	// The init functions work in the block size being formatted.
+	blockSize = size;
+
+    /* init and write superblock, an image of two blocks has none free */
+    initSuperblock(&buf, nBytes > 2 * size ? 2 : 0, nBytes);
+    if (count > 1) {
+        buf.mem[SUPER_STRIPE_SHIFT] = shift;
+        buf.mem[SUPER_STRIPE_MEMBERS] = count;
+    }
+	if (writeBlock(fd, 0, buf.mem) < 0) {
+		ret = MKFS_FAILURE;
+	}
+
+    /* root directory always lives in block 1 */
+    initDirectoryblock(&buf, "", 0);
+    if (ret == SUCCESS && writeBlock(fd, 1, buf.mem) < 0) {
+        ret = MKFS_FAILURE;
+    }
+
+    for (traversed = 2; ret == SUCCESS && traversed * size < nBytes; traversed++) {
+	    /* init and write all free */
+	    if ((traversed + 1) * size >= nBytes) {
+	        initFreeblock(&buf, '\0');
+        }
+	    else {
+	        initFreeblock(&buf, traversed+1);
+        }
+		if (writeBlock(fd, traversed, buf.mem) < 0) {
+		    ret = MKFS_FAILURE;
+	    }
+    }
+
+	blockSize = mountedSize;
+	closeDisk(fd);
+	return ret;
+}
+
+int tfs_mkfsLog(char *filename, int nBytes, int size) {
+    probeEnter("tfs_mkfsLog", 0, nBytes);
+    return probeReturn("tfs_mkfsLog", 0, formatLog(filename, nBytes, size));
+}
+
+int formatLog(char *filename, int nBytes, int size) {
+    tfs_block super, buf;
+    fileDescriptor fd;
+    int blocks, names, ret = SUCCESS;
+
+    if (formatImage(&filename, 1, nBytes, size, size) < 0 || (fd = openDisk(filename, 0)) < 0) {
+        return MKFS_FAILURE;
+    }
+    setBlockSize(fd, size);
+    if (readBlock(fd, 0, super.mem) < 0 || (blocks = (unsigned char) super.mem[4]) < LOG_RESERVE + LOG_SEGMENT + 4) {
+        closeDisk(fd);
+        return MKFS_FAILURE;
+    }
+    names = logNames(blocks);
+
+    // Blocks 2 to 4 become the map, the counts and an empty snapshot
+    // table. Only the superblock and the root directory are mapped, every
+    // other block number is free and every other block is log.
+    memset(buf.mem, 0, size);
+    buf.mem[1] = 1;
+    if (writeBlock(fd, 2, buf.mem) < 0) {
+        ret = MKFS_FAILURE;
+    }
+    memset(buf.mem, 1, 5);
+    if (writeBlock(fd, 3, buf.mem) < 0) {
+        ret = MKFS_FAILURE;
+    }
+    memset(buf.mem, 0, size);
+    if (writeBlock(fd, 4, buf.mem) < 0) {
+        ret = MKFS_FAILURE;
+    }
+
+    // The superblock is the switch, so it goes last.
+    super.mem[2] = 0;
+    super.mem[SUPER_FREE_COUNT] = names - 2;
+    super.mem[SUPER_BLOCK_MAP] = 2;
+    super.mem[SUPER_BLOCK_REFS] = 3;
+    super.mem[SUPER_SNAPSHOTS] = 4;
+    super.mem[SUPER_LOG] = 1;
+    if (ret == SUCCESS && writeBlock(fd, 0, super.mem) < 0) {
+        ret = MKFS_FAILURE;
+    }
+
+    closeDisk(fd);
+    return ret;
 }
 
 void initFreeblock(tfs_block *buf, unsigned char nextFree) {
@@ -65,23 +224,33 @@ void initFreeblock(tfs_block *buf, unsigned char nextFree) {
     buf->mem[1] = MAGIC_NUM;
     buf->mem[2] = nextFree;
 
-	for (i = 3; i < BLOCKSIZE; i++) {
+	for (i = 3; i < blockSize; i++) {
 		buf->mem[i] = 0x00;
 	}
 }
 
 void initSuperblock(tfs_block *buf, unsigned char firstFree, int nBytes) {
     int i;
-    unsigned char blocks;
-    blocks = (unsigned char) (nBytes / BLOCKSIZE);
+    unsigned char blocks, shift = 0;
+    blocks = (unsigned char) (nBytes / blockSize);
+    while ((1 << shift) < blockSize) {
+        shift++;
+    }
 
     buf->mem[0] = 1;
     buf->mem[1] = MAGIC_NUM;
     buf->mem[2] = firstFree;
-    buf->mem[3] = '\0';
+    buf->mem[SUPER_ROOT] = 1;
     buf->mem[4] = blocks;
 
-	for (i = 5; i < BLOCKSIZE; i++) {
+    // Allocation summary, trusted by mount only while the clean flag is set.
+    // Only the superblock and the root directory are in use.
+    buf->mem[SUPER_FREE_COUNT] = blocks - 2;
+    buf->mem[SUPER_INODE_COUNT] = 1;
+    buf->mem[SUPER_CLEAN_FLAG] = SUPER_CLEAN;
+    buf->mem[SUPER_BLOCK_SHIFT] = shift;
+
+	for (i = SUPER_BLOCK_SHIFT + 1; i < blockSize; i++) {
 		buf->mem[i] = 0x00;
 	}
 }
@@ -99,761 +268,4028 @@ void initInodeblock(tfs_block *buf, char* name) {
 
 	// Write the name.
     strncpy(&(buf->mem[5]), name, 9);
+
+    // New files keep their size in bytes.
+    setFileSize(buf, 0);
 }
 
-int tfs_mount(char *diskname) {
-	char buf[BLOCKSIZE];
-	int diskNum, i;
+void initDirectoryblock(tfs_block *buf, char *name, unsigned char parent) {
+    int i;
+    time_t curTime;
 
-	// TFS is already mounted.
-	if (mountedDisk) {
-	    perror("mount: TFS already mounted");
-		return ERR_TFS_MOUNT;
-	}
+    for (i = 0; i < blockSize; i++) {
+        buf->mem[i] = 0x00;
+    }
+    buf->mem[0] = DIRECTORY_TYPE;
+    buf->mem[1] = MAGIC_NUM;
+    buf->mem[INODE_PARENT] = parent;
+    strncpy(&(buf->mem[5]), name, 9);
 
-	// Not mounted, so mount it and verify the TFS type.
-	else {
-	    // Open the disk.
-		diskNum = openDisk(diskname, 0);
-        diskFD = diskNum;
+    // Creation, last modified and last accessed all start out equal.
+    time(&curTime);
+    for (i = 0; i < 3; i++) {
+        memcpy(&(buf->mem[18 + (i * sizeof(time_t))]), &curTime, sizeof(time_t));
+    }
+}
+
+void initDirEntryblock(tfs_block *buf, unsigned char next) {
+    int i;
+    buf->mem[0] = DIRENTRY_TYPE;
+    buf->mem[1] = MAGIC_NUM;
+    buf->mem[2] = next;
 
-		// Read the superblock.
-		readBlock(diskNum, 0, &buf);
+    // Byte 3 counts the entries in use.
+	for (i = 3; i < blockSize; i++) {
+		buf->mem[i] = 0x00;
+	}
+}
 
-		// Check that the block is valid.
-		if (buf[1] != 0x44) {
-			perror("mount: TFS is invalid");
-			return ERR_INVALID_TFS;
-		}
+/* Adds the entries of the host directory ‘path’ to the node list as
+children of node ‘parent’, recursing into subdirectories. Names that
+don't fit in a TinyFS name and anything that isn't a regular file or
+directory are skipped. */
+int scanHostDir(char *path, int parent, tfs_imageNode **nodes, int *count, int *cap) {
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    tfs_imageNode *node;
+    char *childPath;
+    int idx, ret = SUCCESS;
+
+    if ((dir = opendir(path)) == NULL) {
+        perror("mkimage: could not open host directory");
+        return ERR_READ;
     }
-    numBlocks = buf[4];
-    freeBlocks = numBlocks - 1;
-	mountedDisk = diskname;
-	openFilesTable = (char**) malloc(sizeof(char*) * numBlocks);
-	openFilesLocation = (int*) malloc(sizeof(int) * numBlocks);
 
-	for (i = 0; i < numBlocks; i++) {
-	    openFilesTable[i] = (char*) malloc(sizeof(char) * 9);
-	    openFilesTable[i][0] = '\0';
-	    openFilesLocation[i] = 0;
-	}
+    while (ret == SUCCESS && (entry = readdir(dir)) != NULL) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        childPath = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        sprintf(childPath, "%s/%s", path, entry->d_name);
 
-	return SUCCESS;
-}
+        if (strlen(entry->d_name) > MAX_FILE_NAME_LENGTH || stat(childPath, &st) < 0 ||
+            (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))) {
+            fprintf(stderr, "mkimage: skipping %s\n", childPath);
+            free(childPath);
+            continue;
+        }
 
-int checkMountAndFile(fileDescriptor FD)
-{
-   if (mountedDisk == NULL) {
-      perror("Error: disk not mounted");
-      return ERR_TFS_NOT_MOUNTED;
-   }
-   if(openFilesTable[FD] == '\0') {
-      perror("Error: file closed or does not exist");
-      return ERR_INVALID_TFS;
-   }
+        // Every node takes at least its inode block, so MAX_BLOCKS bounds the list.
+        if (*count == MAX_BLOCKS) {
+            free(childPath);
+            ret = ERR_INVALID_SPACE;
+            break;
+        }
+        if (*count == *cap) {
+            *cap = *cap ? *cap * 2 : 16;
+            *nodes = realloc(*nodes, sizeof(tfs_imageNode) * *cap);
+        }
+        idx = (*count)++;
+        node = &(*nodes)[idx];
+        memset(node, 0, sizeof(tfs_imageNode));
+        strcpy(node->name, entry->d_name);
+        node->hostPath = childPath;
+        node->parent = parent;
+        node->modified = st.st_mtime;
+
+        if (S_ISDIR(st.st_mode)) {
+            node->type = DIRECTORY_TYPE;
+            ret = scanHostDir(childPath, idx, nodes, count, cap);
+        }
+        else if (st.st_size > MAX_BLOCKS * EXTENT_PAYLOAD) {
+            ret = ERR_INVALID_SPACE;
+        }
+        else {
+            node->type = 2;
+            node->size = st.st_size;
+            node->numBlocks = getNumBlocks(node->size);
+        }
+    }
 
-   return SUCCESS;
+    closedir(dir);
+    return ret;
 }
 
-int tfs_unmount(void) {
-    int i;
-	// TFS is already unmounted, so throw error.
-	if (!mountedDisk) {
-		perror("unmount: TFS already unmounted");
-		return ERR_TFS_UNMOUNT;
+/* Gives directory ‘dir’ its inode, then its entry blocks bucket by
+bucket, then each file in it followed by that file's extents, then
+does the same for each subdirectory. ‘layout’ records what every block
+will hold. Returns the next unused block or an error code. */
+int layoutImageDir(tfs_imageNode *nodes, int count, int dir, int next, int numBlocks, tfs_imageBlock *layout) {
+    int bucketSize[DIR_BUCKETS] = {0};
+    int i, j, chunks;
 
-	}
-	// TFS is mounted, so unmount it.
-	else {
-		mountedDisk = NULL;
-        diskFD = -1;
-		
-        for (i = 0; i < numBlocks; i++) {
-		    free(openFilesTable[i]);
-		}
+    if (next >= numBlocks) {
+        return ERR_INVALID_SPACE;
+    }
+    nodes[dir].inode = next;
+    layout[next].kind = IMAGE_INODE;
+    layout[next++].node = dir;
 
-		free(openFilesTable);
-		free(openFilesLocation);
-		numBlocks = -1;
-	}
+    for (i = 0; i < count; i++) {
+        if (nodes[i].parent == dir) {
+            bucketSize[dirHash(nodes[i].name) % DIR_BUCKETS]++;
+        }
+    }
+    for (i = 0; i < DIR_BUCKETS; i++) {
+        chunks = (bucketSize[i] + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+        if (next + chunks > numBlocks) {
+            return ERR_INVALID_SPACE;
+        }
+        nodes[dir].buckets[i] = chunks ? next : 0;
+        for (j = 0; j < chunks; j++, next++) {
+            layout[next].kind = IMAGE_DIRENTS;
+            layout[next].node = dir;
+            layout[next].index = (i << 8) | j;
+        }
+    }
 
-	return SUCCESS;
+    for (i = 0; i < count; i++) {
+        if (nodes[i].parent != dir || nodes[i].type != 2) {
+            continue;
+        }
+        if (next + 1 + nodes[i].numBlocks > numBlocks) {
+            return ERR_INVALID_SPACE;
+        }
+        nodes[i].inode = next;
+        layout[next].kind = IMAGE_INODE;
+        layout[next++].node = i;
+        nodes[i].firstBlock = nodes[i].numBlocks ? next : 0;
+        for (j = 0; j < nodes[i].numBlocks; j++, next++) {
+            layout[next].kind = IMAGE_EXTENT;
+            layout[next].node = i;
+            layout[next].index = j;
+        }
+    }
+
+    for (i = 0; i < count && next >= 0; i++) {
+        if (nodes[i].parent == dir && nodes[i].type == DIRECTORY_TYPE) {
+            next = layoutImageDir(nodes, count, i, next, numBlocks, layout);
+        }
+    }
+    return next;
 }
 
-fileDescriptor tfs_openFile(char *name) {
-	fileDescriptor fd;
-	int fileExists;
-	tfs_block buf, super;
-	int diskNum;
-	char tempName[9];
-	unsigned char firstFree;
-    fileExists = 0;
+/* Fills ‘buf’ with block bNum of the image being built. File extents
+come in order, so the host file is read sequentially through ‘hostFd’. */
+int buildImageBlock(tfs_imageNode *nodes, int count, tfs_imageBlock *layout, int bNum, int total, int *hostFd, tfs_block *buf) {
+    tfs_imageNode *node = &nodes[layout[bNum].node];
+    int i, bucket, skip, slot = 0, got;
+    char *entry;
     time_t curTime;
 
-	// Make sure we have a valid name length.
-	if ((strlen(name) > MAX_FILE_NAME_LENGTH) || !strlen(name)) {
-		perror("openFile: Invalid file name length");
-		return ERR_FILE_NAME_LENGTH;
-	}
-
-	// If we have a mounted disk, check if the file is already open.
-	if (mountedDisk) {
-		// Open the disk.
-		diskNum = openDisk(mountedDisk, 0);
-
-		// Read the superblock from the disk.
-		readBlock(diskNum, 0, &(buf.mem));
+    switch (layout[bNum].kind) {
+    case IMAGE_INODE:
+        time(&curTime);
+        if (node->type == DIRECTORY_TYPE) {
+            initDirectoryblock(buf, node->name, node->parent < 0 ? 0 : nodes[node->parent].inode);
+            memcpy(buf->mem + DIR_BUCKET_START, node->buckets, DIR_BUCKETS);
+            break;
+        }
+        memset(buf->mem, 0, blockSize);
+        initInodeblock(buf, node->name);
+        buf->mem[1] = MAGIC_NUM;
+        buf->mem[2] = node->firstBlock;
+        buf->mem[INODE_PARENT] = nodes[node->parent].inode;
+        buf->mem[14] = node->numBlocks;
+        setFileSize(buf, node->size);
+        memcpy(&(buf->mem[18]), &curTime, sizeof(time_t));
+        memcpy(&(buf->mem[18 + sizeof(time_t)]), &node->modified, sizeof(time_t));
+        memcpy(&(buf->mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
+        break;
+
+    case IMAGE_EXTENT:
+        initExtent(buf, layout[bNum].index + 1 < node->numBlocks ? bNum + 1 : 0);
+        buf->mem[EXTENT_INDEX] = layout[bNum].index;
+        if (layout[bNum].index == 0 && (*hostFd = open(node->hostPath, O_RDONLY)) < 0) {
+            perror("mkimage: could not open host file");
+            return ERR_READ;
+        }
+        // A file that shrank since the scan just leaves zeros behind.
+        for (i = 0; i < EXTENT_PAYLOAD && (got = read(*hostFd, buf->mem + 4 + i, EXTENT_PAYLOAD - i)) > 0; i += got)
+            ;
+        if (layout[bNum].index + 1 == node->numBlocks) {
+            close(*hostFd);
+            *hostFd = -1;
+        }
+        break;
+
+    case IMAGE_DIRENTS:
+        bucket = layout[bNum].index >> 8;
+        skip = (layout[bNum].index & 0xff) * DIRENTS_PER_BLOCK;
+        initDirEntryblock(buf, bNum + 1 < total && layout[bNum + 1].kind == IMAGE_DIRENTS &&
+                          layout[bNum + 1].node == layout[bNum].node &&
+                          layout[bNum + 1].index >> 8 == bucket ? bNum + 1 : 0);
+        for (i = 0; i < count && slot < DIRENTS_PER_BLOCK; i++) {
+            if (nodes[i].parent != layout[bNum].node || dirHash(nodes[i].name) % DIR_BUCKETS != bucket || skip-- > 0) {
+                continue;
+            }
+            entry = DIRENT(buf, slot++);
+            entry[0] = nodes[i].inode;
+            entry[1] = nodes[i].type;
+            strncpy(entry + 2, nodes[i].name, MAX_FILE_NAME_LENGTH + 1);
+        }
+        buf->mem[3] = slot;
+        break;
 
-		// Get the address of the first free block.
-		firstFree = buf.mem[2];
+    default:
+        // Everything past the laid out blocks is chained onto the free list.
+        initFreeblock(buf, bNum + 1 < total ? bNum + 1 : 0);
+        break;
+    }
 
-		// Use that as the upper bound for the open files table so we can iterate through it.
-		// Iterate through the table, and check if we find an entry that equals our name.
-		for (int i = 1; i < numBlocks; i++) {
+    return SUCCESS;
+}
 
-            if(openFilesTable[i] != '\0') {
-			    strcpy(tempName, openFilesTable[i]);
+/* Streams the laid out image to ‘out’ front to back, a stage of
+blocks per write. */
+int writeImage(tfs_imageNode *nodes, int count, tfs_imageBlock *layout, int used, int total, int out) {
+    tfs_block buf;
+    char *stage = malloc(IMAGE_STAGE_BLOCKS * blockSize);
+    int bNum, staged = 0, hostFd = -1, ret = SUCCESS;
+
+    for (bNum = 0; bNum < total && ret == SUCCESS; bNum++) {
+        if (bNum == 0) {
+            initSuperblock(&buf, used < total ? used : 0, total * blockSize);
+            buf.mem[SUPER_FREE_COUNT] = total - used;
+            buf.mem[SUPER_INODE_COUNT] = count;
+        }
+        else if ((ret = buildImageBlock(nodes, count, layout, bNum, total, &hostFd, &buf)) < 0) {
+            break;
+        }
 
-			    // If we find one, return the index of that as the FD.
-			    if (!strcmp(tempName, name)) {
-				    return i;
-			    }
+        memcpy(stage + staged * blockSize, buf.mem, blockSize);
+        if (++staged == IMAGE_STAGE_BLOCKS || bNum + 1 == total) {
+            if (write(out, stage, staged * blockSize) < staged * blockSize) {
+                perror("mkimage: write error");
+                ret = ERR_WRITE;
             }
-	    }
-	}
+            staged = 0;
+        }
+    }
 
-	// Disk is not already mounted, so we can't open the file.
-	else {
-		perror("openFile: TFS not mounted");
-		return ERR_TFS_NOT_MOUNTED;
-	}
+    if (hostFd >= 0) {
+        close(hostFd);
+    }
+    free(stage);
+    return ret;
+}
 
-	// Loop through the inodes and see if we have one that matches the specified name.
-	for (int i = 1; i <= numBlocks && !fileExists; i++) {
-		// Read the block.
-		readBlock(diskNum, i, &(buf.mem));
+int tfs_mkimage(char *hostDir, char *filename, int nBytes, int size) {
+    probeEnter("tfs_mkimage", 0, nBytes);
+    return probeReturn("tfs_mkimage", 0, buildImage(hostDir, filename, nBytes, size));
+}
 
-		// Check if this block is an inode.
-		if (buf.mem[0] == 2) {
+int buildImage(char *hostDir, char *filename, int nBytes, int size) {
+    tfs_imageNode *nodes;
+    tfs_imageBlock layout[MAX_BLOCKS];
+    int count = 1, cap = 16, used = 0, total, out, i, ret, mountedSize = blockSize;
+    char *journal;
 
-			// Now check if the names equal.
-			if(!strcmp(name, buf.mem+5)) {
-				fileExists = 1;
-				fd = i;
-				break;
-			}
-		}
-	}
+    if (size < MIN_BLOCKSIZE || size > MAX_BLOCKSIZE || (size & (size - 1))) {
+        fprintf(stderr, "mkimage: invalid block size %d\n", size);
+        return MKFS_FAILURE;
+    }
+    if (nBytes > MAX_BLOCKS * size) {
+        nBytes = MAX_BLOCKS * size;
+    }
+    if ((total = nBytes / size) < 2) {
+        return MKFS_FAILURE;
+    }
 
-	// Existing file wasn't found, so we need to create one.
-	if (!fileExists) {
+    // The layout and init functions work in the block size being built.
+    blockSize = size;
 
-        // Read in the super block.
-        readBlock(diskNum, 0, &(super.mem));
+    // Node 0 is the root directory, the superblock is layout slot 0.
+    nodes = calloc(cap, sizeof(tfs_imageNode));
+    nodes[0].type = DIRECTORY_TYPE;
+    nodes[0].parent = -1;
+    memset(layout, 0, sizeof(layout));
+    layout[0].kind = IMAGE_SUPER;
 
-		// Read in the first free block.
-		readBlock(diskNum, firstFree, &(buf.mem));
+    if ((ret = scanHostDir(hostDir, 0, &nodes, &count, &cap)) == SUCCESS &&
+        (used = layoutImageDir(nodes, count, 0, 1, total, layout)) < 0) {
+        ret = used;
+    }
 
-        // Get reference.
-        super.mem[2] = buf.mem[2];
+    if (ret < 0) {
+        fprintf(stderr, "mkimage: %s does not fit in %d blocks\n", hostDir, total);
+    }
+    else if ((out = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0777)) < 0) {
+        ret = MKFS_FAILURE;
+    }
+    else {
+        ret = writeImage(nodes, count, layout, used, total, out);
+        close(out);
+
+        // A journal left by the image this one replaces doesn't apply.
+        journal = malloc(strlen(filename) + sizeof(JOURNAL_SUFFIX));
+        sprintf(journal, "%s%s", filename, JOURNAL_SUFFIX);
+        unlink(journal);
+        free(journal);
+    }
 
-        // Init the inode block at that free block.
-		initInodeblock(&buf, name);
+    for (i = 1; i < count; i++) {
+        free(nodes[i].hostPath);
+    }
+    free(nodes);
+    blockSize = mountedSize;
+    return ret < 0 ? ret : SUCCESS;
+}
 
-        // Update the first free in the super block.
-        writeBlock(diskNum, 0, &(super.mem));
+int tfs_mount(char *diskname) {
+    return tfs_mountPolicy(diskname, ALLOC_HEAD);
+}
 
-		// NGet a file descriptor to the next free block.
-        fd = firstFree;
+int tfs_mountSnapshot(char *diskname, char *snapshot) {
+    probeEnter("tfs_mountSnapshot", 0, 0);
+    syncMode = TFS_SYNC_NONE;
+    mountDirect = 0;
+    mountNoWrite = 0;
+    mountWriteThrough = 0;
+    return probeReturn("tfs_mountSnapshot", 0, mountImage(diskname, snapshot));
+}
 
-        // Get the current time.
-        time(&curTime);
+int tfs_mountStriped(char **members, int count, tfs_mountOptions *options) {
+    int ret;
 
-        // Write creation date.
-        memcpy(&(buf.mem[18]), &curTime, sizeof(time_t));
+    if (count < 1 || count > MAX_STRIPE_MEMBERS) {
+        return ERR_BAD_REQUEST;
+    }
+    mountMembers = members;
+    mountMemberCount = count;
+    ret = options ? tfs_mountWith(members[0], options) : tfs_mountPolicy(members[0], ALLOC_HEAD);
+    mountMembers = NULL;
+    mountMemberCount = 0;
+    return ret;
+}
 
-        // Write last modified date.
-        memcpy(&(buf.mem[18 + sizeof(time_t)]), &curTime, sizeof(time_t));
+int openMembers(char **members, int count) {
+    char super[SUPER_STRIPE_MEMBERS + 1];
+    int disk;
 
-        // Write last accessed date.
-        memcpy(&(buf.mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
+    // The start of the superblock is at the start of the first file
+    // whatever the stripe unit, so the geometry can be read from there.
+    if ((disk = openDiskReadOnly(members, 1, BLOCKSIZE)) < 0) {
+        return -1;
+    }
+    if (readBlockPart(disk, 0, 0, super, sizeof(super)) < 0) {
+        closeDisk(disk);
+        return -1;
+    }
+    closeDisk(disk);
+    if (super[1] != MAGIC_NUM || (unsigned char) super[SUPER_STRIPE_MEMBERS] != count ||
+        super[SUPER_STRIPE_SHIFT] > MAX_STRIPE_SHIFT) {
+        errno = EINVAL;
+        return -1;
+    }
+    return mountNoWrite ? openDiskReadOnly(members, count, 1 << super[SUPER_STRIPE_SHIFT])
+                        : openStripedDisk(members, count, 0, 1 << super[SUPER_STRIPE_SHIFT]);
+}
 
-		writeBlock(diskNum, fd, &(buf.mem));
+int mountImage(char *diskname, char *snapshot) {
+	tfs_block super;
+	int diskNum, i, ret;
 
-        strcpy(openFilesTable[fd], name);
+	// The last mount's inode table went with its arena.
+	if (!mountedDisk) {
+	    inodeTable = NULL;
+	    extentIndexes = NULL;
+	}
 
-		// Reset the file descriptor location.
-		openFilesLocation[fd] = 0;
+	// TFS is already mounted.
+	if (mountedDisk) {
+	    perror("mount: TFS already mounted");
+		return ERR_TFS_MOUNT;
 	}
 
-	// The file exists, we just need to open it.
+	// Not mounted, so mount it and verify the TFS type.
 	else {
-        openFilesTable[fd] = calloc(strlen(name), sizeof(char));
-		strcpy(openFilesTable[fd], name);
+	    // Open the disk, or every file of a striped one.
+		if ((diskNum = mountMemberCount > 1 ? openMembers(mountMembers, mountMemberCount)
+		               : mountNoWrite       ? openDiskReadOnly(&diskname, 1, BLOCKSIZE)
+		                                    : openDisk(diskname, 0)) < 0) {
+			perror("mount: could not open disk");
+			return ERR_TFS_MOUNT;
+		}
+        diskFD = diskNum;
 
-		// Reset the file descriptor location.
-		openFilesLocation[fd] = 0;
+		// Finish a batch whose commit was cut short, which a read-only
+		// mount can't do.
+		if (mountNoWrite && journalPending(diskNum)) {
+			fprintf(stderr, "mount: a batch journal is pending, mount read-write to replay it\n");
+			closeDisk(diskNum);
+			return ERR_TFS_MOUNT;
+		}
+		if (!mountNoWrite && recoverDisk(diskNum) < 0) {
+			perror("mount: could not replay the journal");
+			closeDisk(diskNum);
+			return ERR_TFS_MOUNT;
+		}
 
-        // Get the current time.
-        time(&curTime);
+		// Bypass the page cache if asked to, not every file system can.
+		if (mountDirect && setDirectIO(diskNum, 1) < 0) {
+			perror("mount: direct I/O not supported");
+			closeDisk(diskNum);
+			return ERR_INVALID_DISK;
+		}
 
-        // Write last accessed date.
-        memcpy(&(buf.mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
-	}
+		// Read the superblock, everything needed to size the rest fits in the
+		// smallest block.
+		if (readBlock(diskNum, 0, &(super.mem)) < 0) {
+			closeDisk(diskNum);
+			return ERR_READ;
+		}
 
-	return fd;
-}
+		// Check that the block is valid, and that a striped image isn't
+		// mounted from its first file alone.
+		if (super.mem[1] != 0x44 || (super.mem[SUPER_STRIPE_MEMBERS] > 1 && mountMemberCount < 2)) {
+			perror("mount: TFS is invalid");
+			closeDisk(diskNum);
+			return ERR_INVALID_TFS;
+		}
 
-int tfs_closeFile(fileDescriptor FD) {
+		// Switch the disk to the block size it was formatted with, images from
+		// before the field existed use the default.
+		if (super.mem[SUPER_BLOCK_SHIFT] != '\0') {
+			if (super.mem[SUPER_BLOCK_SHIFT] > 16 ||
+			    setBlockSize(diskNum, 1 << super.mem[SUPER_BLOCK_SHIFT]) < 0 ||
+			    readBlock(diskNum, 0, &(super.mem)) < 0) {
+				perror("mount: TFS has an invalid block size");
+				closeDisk(diskNum);
+				return ERR_INVALID_TFS;
+			}
+		}
+		blockSize = getBlockSize(diskNum);
+    }
+    numBlocks = (unsigned char) super.mem[4];
+    rootDir = (unsigned char) super.mem[SUPER_ROOT];
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        dirCache[i].bNum = 0;
+    }
 
-	// File is open, so close it.
-	if (openFilesTable[FD] != '\0') {
-		openFilesTable[FD] = '\0';
-		return SUCCESS;
+    // Images with snapshots address blocks through a map, which has to be
+    // in place before anything past the superblock is read.
+    if ((ret = loadBlockMap(diskNum, &super, snapshot)) < 0) {
+        fprintf(stderr, "mount: could not load the block map\n");
+        closeDisk(diskNum);
+        arenaFree();
+        return ret == ERR_NO_SUCH_SNAPSHOT ? ret : ERR_TFS_MOUNT;
+    }
+
+    // A clean image carries an accurate summary, so there is nothing to scan.
+    // A snapshot never allocates, so its summary doesn't matter.
+    if (super.mem[SUPER_CLEAN_FLAG] == SUPER_CLEAN || mountReadOnly) {
+        freeBlocks = (unsigned char) super.mem[SUPER_FREE_COUNT];
+        numInodes = (unsigned char) super.mem[SUPER_INODE_COUNT];
+    }
+    // Otherwise the last session never unmounted, so rebuild from the blocks.
+    else if (rebuildSummary(diskNum) < 0) {
+        perror("mount: could not rebuild allocation summary");
+        closeDisk(diskNum);
+        arenaFree();
+        return ERR_TFS_MOUNT;
+    }
+
+    // Mark the image dirty until tfs_unmount writes the summary back.
+    super.mem[SUPER_CLEAN_FLAG] = 0;
+    if (!mountReadOnly && writeBlock(diskNum, 0, super.mem) < 0) {
+        closeDisk(diskNum);
+        arenaFree();
+        return ERR_WRITE;
+    }
+
+	mountedDisk = diskname;
+
+	// The open file table starts empty and grows with the number of open files.
+	openFiles = NULL;
+	openFilesSize = 0;
+	openFilesFree = -1;
+	openFilesByInode = arenaAlloc(sizeof(int) * (MAX_BLOCKS + 1));
+	for (i = 0; i <= MAX_BLOCKS; i++) {
+	    openFilesByInode[i] = -1;
 	}
-	// Not open, so we can't close it.
-	else {
-		return ERR_FILE_CLOSE;
+	blockPins = arenaAlloc(sizeof(int) * (MAX_BLOCKS + 1));
+	memset(blockPins, 0, sizeof(int) * (MAX_BLOCKS + 1));
+	pinnedViews = 0;
+	inodeTable = arenaAlloc(sizeof(tfs_fileStat) * (MAX_BLOCKS + 1));
+	memset(inodeTable, 0, sizeof(tfs_fileStat) * (MAX_BLOCKS + 1));
+
+	// The allocator keeps its own copy of the free chain.
+	if (loadFreeList() < 0) {
+	    perror("mount: could not read the free chain");
 	}
-}
 
-int getNumBlocks(int size) {
-   int blocks = size / BLOCKSIZE;
+	// Images from before directories existed get a root built for them.
+	if (!rootDir && !mountReadOnly && upgradeFlatImage() < 0) {
+	    perror("mount: could not create root directory");
+	}
 
-   if (size % BLOCKSIZE)
-      blocks++;
+	// Every inode and directory is held in memory for tfs_stat and listings.
+	if (loadInodeTable() < 0) {
+	    perror("mount: could not load the inode table");
+	}
 
-   return blocks;
+	// Nothing moves on a read-only mount, so readers can share one index.
+	if (mountReadOnly && loadExtentIndex() < 0) {
+	    perror("mount: could not index the extents");
+	}
+
+	// Each call's writes go out sorted and merged when it ends.
+	if (!mountReadOnly && !mountWriteThrough && beginQueue(diskFD) < 0) {
+	    perror("mount: could not queue writes");
+	}
+
+	return SUCCESS;
 }
 
-int tfs_writeFile(fileDescriptor FD,char *buffer, int size) {
-    int ret, index = 0, reqBlocks = getNumBlocks(size), offset = 0, i, position;
-    tfs_block super, inode, temp;
-    time_t curTime;
+int upgradeFlatImage() {
+    tfs_block super, buf;
 
-    //check if file is mounted and that the file exists
-    if((ret = checkMountAndFile(FD)) < 0) {
-        return ret;
+    if ((rootDir = allocBlock()) < 0) {
+        rootDir = 0;
+        return ERR_INVALID_SPACE;
     }
+    initDirectoryblock(&buf, "", 0);
+    writeCachedBlock(rootDir, &buf);
+    numInodes++;
 
-    //read inode out
-    if(readBlock(diskFD, FD, &(inode.mem)) < 0) {
-        fprintf(stderr, "writeFile inode\n");
+    readFsBlock(0, &(super.mem));
+    super.mem[SUPER_ROOT] = rootDir;
+    writeFsBlock(0, super.mem);
+
+    // Every existing inode moves into the root directory.
+    return scanImage(SCAN_TYPE(2), moveToRoot, NULL);
+}
+
+int moveToRoot(int bNum, char *block, void *arg) {
+    tfs_block buf;
+
+    memcpy(buf.mem, block, blockSize);
+    buf.mem[INODE_PARENT] = rootDir;
+    writeFsBlock(bNum, buf.mem);
+    return dirInsert(rootDir, buf.mem + 5, bNum, 2) < 0 ? ERR_INVALID_SPACE : SUCCESS;
+}
+
+int rebuildSummary(int diskNum) {
+    freeBlocks = 0;
+    numInodes = 0;
+    // Punched blocks are free too, where nothing else is ever all zeros.
+    return scanImage(SCAN_TYPE(4) | SCAN_TYPE(2) | SCAN_TYPE(DIRECTORY_TYPE) | (blockMap ? 0 : SCAN_TYPE(0)),
+                     countBlock, NULL);
+}
+
+int countBlock(int bNum, char *block, void *arg) {
+    if (block[0] == 4 || block[0] == 0) {
+        freeBlocks++;
+    }
+    else {
+        numInodes++;
+    }
+    return SUCCESS;
+}
+
+int summarizeBlock(int bNum, char *block, void *arg) {
+    tfs_blockSummary *summary = arg;
+
+    summary->type[bNum] = block[0];
+    summary->next[bNum] = block[2];
+    return SUCCESS;
+}
+
+int summarizeImage(int types, tfs_blockSummary *summary) {
+    memset(summary, 0, sizeof(tfs_blockSummary));
+    return scanImage(types, summarizeBlock, summary);
+}
+
+void *scanReader(void *arg) {
+    tfs_scanChunk *chunk = arg;
+
+    chunk->result = readBlocks(diskFD, chunk->first, chunk->count, chunk->data);
+    return NULL;
+}
+
+int scanImage(int types, tfs_scanFn fn, void *arg) {
+    unsigned char first[MAX_BLOCKS + 1], next[MAX_BLOCKS + 1];
+    tfs_scanChunk chunks[SCAN_THREADS];
+    pthread_t threads[SCAN_THREADS];
+    int chunkBlocks, numChunks, count, i, bNum, start, end, type, ret = SUCCESS;
+    char *image, *block;
+
+    // Every name is listed under the physical block it reads from, so
+    // the image can be read front to back. Retired names have none.
+    memset(first, 0, sizeof(first));
+    for (bNum = numNames - 1; bNum > 0; bNum--) {
+        if (physBlock(bNum)) {
+            next[bNum] = first[physBlock(bNum)];
+            first[physBlock(bNum)] = bNum;
+        }
+    }
+
+    // Big images are read a few chunks at a time on as many threads.
+    chunkBlocks = SCAN_CHUNK_BYTES / blockSize > 0 ? SCAN_CHUNK_BYTES / blockSize : 1;
+    numChunks = numBlocks * blockSize >= SCAN_PARALLEL_BYTES ? SCAN_THREADS : 1;
+    if ((image = malloc((size_t) numChunks * chunkBlocks * blockSize)) == NULL) {
+        return ERR_READ;
+    }
+
+    for (start = 0; start < numBlocks && ret >= 0; start = end) {
+        for (count = 0, end = start; count < numChunks && end < numBlocks; count++) {
+            chunks[count].first = end;
+            chunks[count].count = numBlocks - end < chunkBlocks ? numBlocks - end : chunkBlocks;
+            chunks[count].data = image + (size_t) (end - start) * blockSize;
+            end += chunks[count].count;
+        }
+        if (count == 1) {
+            scanReader(&chunks[0]);
+        }
+        else {
+            for (i = 0; i < count; i++) {
+                pthread_create(&threads[i], NULL, scanReader, &chunks[i]);
+            }
+            for (i = 0; i < count; i++) {
+                pthread_join(threads[i], NULL);
+            }
+        }
+        for (i = 0; i < count; i++) {
+            if (chunks[i].result < 0) {
+                ret = ERR_READ;
+            }
+        }
+
+        // Only the type byte is looked at before handing a block over.
+        for (bNum = start; bNum < end && ret >= 0; bNum++) {
+            block = image + (size_t) (bNum - start) * blockSize;
+            type = (unsigned char) block[0];
+            if (types != SCAN_ANY && (type >= 32 || !(types & SCAN_TYPE(type)))) {
+                continue;
+            }
+            if (bNum == 0) {
+                ret = fn(0, block, arg);
+            }
+            for (i = first[bNum]; i && ret >= 0; i = next[i]) {
+                ret = fn(i, block, arg);
+            }
+        }
+    }
+
+    free(image);
+    return ret;
+}
+
+int checkMountAndFile(fileDescriptor FD)
+{
+   if (mountedDisk == NULL) {
+      perror("Error: disk not mounted");
+      return ERR_TFS_NOT_MOUNTED;
+   }
+   if(getOpenFile(FD) == NULL) {
+      perror("Error: file closed or does not exist");
+      return ERR_INVALID_TFS;
+   }
+
+   return SUCCESS;
+}
+
+tfs_openEntry *getOpenFile(fileDescriptor FD) {
+    int slot = FD & FD_SLOT_MASK;
+
+    // A stale descriptor's generation no longer matches its slot.
+    if (!mountedDisk || FD < 0 || slot >= openFilesSize ||
+        openFiles[slot].inode == 0 || openFiles[slot].generation != FD >> FD_SLOT_BITS) {
+        return NULL;
+    }
+
+    return &openFiles[slot];
+}
+
+fileDescriptor allocOpenFile(int inode, char *name) {
+    tfs_openEntry *grown;
+    int slot, i;
+
+    // Out of free slots, double the table.
+    if (openFilesFree < 0) {
+        if (openFilesSize * 2 > FD_SLOT_MASK + 1) {
+            return ERR_INVALID_SPACE;
+        }
+        i = openFilesSize ? openFilesSize * 2 : OPEN_FILES_INITIAL;
+        grown = arenaAlloc(sizeof(tfs_openEntry) * i);
+        if (openFilesSize) {
+            memcpy(grown, openFiles, sizeof(tfs_openEntry) * openFilesSize);
+        }
+        for (slot = i - 1; slot >= openFilesSize; slot--) {
+            grown[slot].inode = 0;
+            grown[slot].generation = 0;
+            grown[slot].nextFree = openFilesFree;
+            openFilesFree = slot;
+        }
+        openFiles = grown;
+        openFilesSize = i;
+    }
+
+    slot = openFilesFree;
+    openFilesFree = openFiles[slot].nextFree;
+    openFiles[slot].inode = inode;
+    openFiles[slot].location = 0;
+    strcpy(openFiles[slot].name, name);
+    openFilesByInode[inode] = slot;
+
+    return (openFiles[slot].generation << FD_SLOT_BITS) | slot;
+}
+
+void releaseOpenFile(tfs_openEntry *file) {
+    int slot = file - openFiles;
+
+    openFilesByInode[file->inode] = -1;
+    file->inode = 0;
+
+    // Bump the generation so descriptors to the old file stop working.
+    file->generation = (file->generation + 1) & FD_GENERATION_MASK;
+    file->nextFree = openFilesFree;
+    openFilesFree = slot;
+}
+
+void *arenaAlloc(int size) {
+    tfs_arenaChunk *chunk = mountArena;
+    int chunkSize;
+
+    // Keep everything pointer aligned.
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        if ((chunk = malloc(sizeof(tfs_arenaChunk) + chunkSize)) == NULL) {
+            return NULL;
+        }
+        chunk->next = mountArena;
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        mountArena = chunk;
+    }
+
+    chunk->used += size;
+    return chunk->data + chunk->used - size;
+}
+
+void arenaFree() {
+    tfs_arenaChunk *next;
+
+    while (mountArena) {
+        next = mountArena->next;
+        free(mountArena);
+        mountArena = next;
+    }
+}
+
+int tfs_unmount(void) {
+    probeEnter("tfs_unmount", 0, 0);
+    return probeReturn("tfs_unmount", 0, unmountImage());
+}
+
+int unmountImage(void) {
+    tfs_block super;
+	// TFS is already unmounted, so throw error.
+	if (!mountedDisk) {
+		perror("unmount: TFS already unmounted");
+		return ERR_TFS_UNMOUNT;
+
+	}
+	// Views point into the image, so they have to be released first.
+	else if (pinnedViews) {
+		fprintf(stderr, "unmount: %d file views still held\n", pinnedViews);
+		return ERR_FILE_BUSY;
+	}
+	// An open batch has to be committed or aborted first.
+	else if (batchOpen) {
+		fprintf(stderr, "unmount: batch still open\n");
+		return ERR_FILE_BUSY;
+	}
+	// TFS is mounted, so unmount it.
+	else {
+        // Persist the summary and mark the image clean for the next mount.
+        flushTrim(1);
+        checkpointLog();
+        if (!mountReadOnly && readFsBlock(0, &(super.mem)) == 0) {
+            super.mem[SUPER_FREE_COUNT] = freeBlocks;
+            super.mem[SUPER_INODE_COUNT] = numInodes;
+            super.mem[SUPER_CLEAN_FLAG] = SUPER_CLEAN;
+            writeFsBlock(0, super.mem);
+        }
+        if (syncMode != TFS_SYNC_NONE) {
+            syncDisk(diskFD);
+        }
+        closeDisk(diskFD);
+
+		mountedDisk = NULL;
+        diskFD = -1;
+		
+        // Every descriptor and the table itself live in the mount's arena.
+        arenaFree();
+        openFiles = NULL;
+        openFilesSize = 0;
+        blockMap = NULL;
+        blockRefs = NULL;
+        logState = NULL;
+        logMode = 0;
+        extentIndexes = NULL;
+        mountReadOnly = 0;
+		numBlocks = -1;
+	}
+
+	return SUCCESS;
+}
+
+int tfs_batchBegin() {
+    long long start = traceClock();
+
+    probeEnter("tfs_batchBegin", 0, 0);
+    return probeReturn("tfs_batchBegin", 0, traceCall(TRACE_OP_BATCH_BEGIN, 0, 0, NULL, start, batchBegin()));
+}
+
+int batchBegin() {
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+    // Views read the image directly and would miss the held blocks.
+    if (batchOpen || pinnedViews) {
+        return ERR_FILE_BUSY;
+    }
+
+    // Only what lives outside the blocks has to be put back on abort.
+    batchSaved.freeBlocks = freeBlocks;
+    batchSaved.numInodes = numInodes;
+    batchSaved.allocCursor = allocCursor;
+    batchSaved.freeTail = freeTail;
+    batchSaved.reclaimPending = reclaimPending;
+    batchSaved.mapped = blockMap != NULL;
+    batchSaved.blockMapBlock = blockMapBlock;
+    batchSaved.blockRefsBlock = blockRefsBlock;
+    batchSaved.snapshotBlock = snapshotBlock;
+    memcpy(batchSaved.freeNext, freeNext, MAX_BLOCKS + 1);
+    memcpy(batchSaved.freePrev, freePrev, MAX_BLOCKS + 1);
+    memcpy(batchSaved.freeState, freeState, MAX_BLOCKS + 1);
+    if (blockMap) {
+        memcpy(batchSaved.blockMap, blockMap, MAX_BLOCKS + 1);
+        memcpy(batchSaved.blockRefs, blockRefs, MAX_BLOCKS + 1);
+    }
+    if (logMode) {
+        batchSaved.logHead = logHead;
+        batchSaved.logSegment = logSegment;
+        memcpy(batchSaved.logState, logState, MAX_BLOCKS + 1);
+    }
+
+    if (beginBatch(diskFD) < 0) {
+        return ERR_WRITE;
+    }
+    batchOpen = 1;
+    return SUCCESS;
+}
+
+int tfs_batchCommit() {
+    long long start = traceClock();
+
+    probeEnter("tfs_batchCommit", 0, 0);
+    return probeReturn("tfs_batchCommit", 0, traceCall(TRACE_OP_BATCH_COMMIT, 0, 0, NULL, start, batchCommit()));
+}
+
+int batchCommit() {
+    int ret;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (!batchOpen) {
+        return ERR_BAD_REQUEST;
+    }
+
+    // If the blocks couldn't be written, the batch didn't happen.
+    if ((ret = commitBatch(diskFD)) < 0) {
+        restoreBatchState();
+        return ret;
+    }
+    batchOpen = 0;
+    flushTrim(0);
+    return SUCCESS;
+}
+
+int tfs_batchAbort() {
+    long long start = traceClock();
+
+    probeEnter("tfs_batchAbort", 0, 0);
+    return probeReturn("tfs_batchAbort", 0, traceCall(TRACE_OP_BATCH_ABORT, 0, 0, NULL, start, batchAbort()));
+}
+
+int batchAbort() {
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (!batchOpen) {
+        return ERR_BAD_REQUEST;
+    }
+    abortBatch(diskFD);
+    restoreBatchState();
+    return SUCCESS;
+}
+
+void restoreBatchState() {
+    tfs_block inode;
+    int i;
+
+    freeBlocks = batchSaved.freeBlocks;
+    numInodes = batchSaved.numInodes;
+    allocCursor = batchSaved.allocCursor;
+    freeTail = batchSaved.freeTail;
+    reclaimPending = batchSaved.reclaimPending;
+    memcpy(freeNext, batchSaved.freeNext, MAX_BLOCKS + 1);
+    memcpy(freePrev, batchSaved.freePrev, MAX_BLOCKS + 1);
+    memcpy(freeState, batchSaved.freeState, MAX_BLOCKS + 1);
+
+    // A first snapshot taken in the batch is undone with the rest.
+    if (batchSaved.mapped) {
+        memcpy(blockMap, batchSaved.blockMap, MAX_BLOCKS + 1);
+        memcpy(blockRefs, batchSaved.blockRefs, MAX_BLOCKS + 1);
+    }
+    else {
+        blockMap = NULL;
+        blockRefs = NULL;
+        numNames = numBlocks;
+    }
+    if (logMode) {
+        logHead = batchSaved.logHead;
+        logSegment = batchSaved.logSegment;
+        memcpy(logState, batchSaved.logState, MAX_BLOCKS + 1);
+    }
+    blockMapBlock = batchSaved.blockMapBlock;
+    blockRefsBlock = batchSaved.blockRefsBlock;
+    snapshotBlock = batchSaved.snapshotBlock;
+
+    // The caches may hold blocks that never made it out.
+    for (i = 0; i < DIR_CACHE_SIZE; i++) {
+        dirCache[i].bNum = 0;
+    }
+    memset(dedupIndex, 0, sizeof(dedupIndex));
+    loadInodeTable();
+
+    // Descriptors opened in the batch, or whose file it renamed, no
+    // longer match a file.
+    for (i = 0; i < openFilesSize; i++) {
+        if (openFiles[i].inode && (readFsBlock(openFiles[i].inode, &(inode.mem)) < 0 || inode.mem[0] != 2 ||
+            strncmp(inode.mem + 5, openFiles[i].name, MAX_FILE_NAME_LENGTH + 1))) {
+            releaseOpenFile(&openFiles[i]);
+        }
+    }
+    batchOpen = 0;
+}
+
+fileDescriptor tfs_openFile(char *name) {
+    long long start = traceClock();
+
+    probeEnter("tfs_openFile", 0, 0);
+    return probeReturn("tfs_openFile", 0, traceCall(TRACE_OP_OPEN, 0, 0, name, start, openFile(name)));
+}
+
+fileDescriptor openFile(char *name) {
+	fileDescriptor fd;
+	tfs_block buf;
+	int parent;
+	char leaf[MAX_FILE_NAME_LENGTH + 1];
+    time_t curTime;
+
+	// Disk is not mounted, so we can't open the file.
+	if (!mountedDisk) {
+		perror("openFile: TFS not mounted");
+		return ERR_TFS_NOT_MOUNTED;
+	}
+
+	// Walk the directories down to the one that holds the file.
+	if ((parent = resolvePath(name, leaf)) < 0) {
+		return parent;
+	}
+
+	// Look the name up in its directory's hash bucket.
+	if ((fd = dirLookup(parent, leaf, NULL)) < 0) {
+		return fd;
+	}
+
+	// Existing file wasn't found, so we need to create one.
+	if (!fd) {
+        // A snapshot can't gain files.
+        if (mountReadOnly) {
+            return ERR_READ_ONLY;
+        }
+
+        // Take a free block for the inode, near its directory.
+        if ((fd = allocInodeBlock(parent)) < 0) {
+            fprintf(stderr, "openFile: no free block for inode\n");
+            return fd;
+        }
+
+        // Init the inode block at that free block.
+		initInodeblock(&buf, leaf);
+		buf.mem[INODE_PARENT] = parent;
+
+        // Get the current time.
+        time(&curTime);
+
+        // Write creation date.
+        memcpy(&(buf.mem[18]), &curTime, sizeof(time_t));
+
+        // Write last modified date.
+        memcpy(&(buf.mem[18 + sizeof(time_t)]), &curTime, sizeof(time_t));
+
+        // Write last accessed date.
+        memcpy(&(buf.mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
+
+		writeFsBlock(fd, &(buf.mem));
+
+        // Link it into the directory, giving the block back if that fails.
+        if (dirInsert(parent, leaf, fd, 2) < 0) {
+            releaseBlock(fd);
+            return ERR_INVALID_SPACE;
+        }
+        numInodes++;
+        syncOp();
+	}
+
+	// The file exists, we just need to open it.
+	else {
+		readFsBlock(fd, &(buf.mem));
+
+		// Directories can't be opened as files.
+		if (buf.mem[0] != 2) {
+			fprintf(stderr, "openFile: %s is not a file\n", name);
+			return ERR_INVALID_INODE;
+		}
+
+		// Already open, so hand back the same descriptor.
+		if (openFilesByInode[fd] >= 0) {
+			return (openFiles[openFilesByInode[fd]].generation << FD_SLOT_BITS) | openFilesByInode[fd];
+		}
+
+        // Get the current time.
+        time(&curTime);
+
+        // Write last accessed date.
+        memcpy(&(buf.mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
+		writeFsBlock(fd, &(buf.mem));
+	}
+
+	// Hand out a descriptor, its location starts at 0.
+	return allocOpenFile(fd, leaf);
+}
+
+int tfs_closeFile(fileDescriptor FD) {
+    long long start = traceClock();
+
+    probeEnter("tfs_closeFile", FD, 0);
+    return probeReturn("tfs_closeFile", FD, traceCall(TRACE_OP_CLOSE, FD, 0, NULL, start, closeFile(FD)));
+}
+
+int closeFile(fileDescriptor FD) {
+	tfs_openEntry *file;
+
+	// File is open, so close it.
+	if ((file = getOpenFile(FD)) != NULL) {
+		releaseOpenFile(file);
+		return syncMode == TFS_SYNC_CLOSE && syncDisk(diskFD) < 0 ? ERR_WRITE : SUCCESS;
+	}
+	// Not open, so we can't close it.
+	else {
+		return ERR_FILE_CLOSE;
+	}
+}
+
+int fileSize(tfs_block *inode) {
+    tfs_block ext;
+    int size = 0, bNum;
+    char *end;
+
+    if (inode->mem[INODE_FORMAT] == INODE_SIZED) {
+        memcpy(&size, inode->mem + INODE_SIZE, sizeof(int));
+        return size;
+    }
+
+    // Older files end at their first null byte.
+    for (bNum = (unsigned char) inode->mem[2]; bNum; bNum = (unsigned char) ext.mem[2]) {
+        if (readFsBlock(bNum, &(ext.mem)) < 0) {
+            break;
+        }
+        if ((end = memchr(ext.mem + 4, '\0', EXTENT_PAYLOAD)) != NULL) {
+            return size + (end - (ext.mem + 4));
+        }
+        size += EXTENT_PAYLOAD;
+    }
+    return size;
+}
+
+void setFileSize(tfs_block *inode, int size) {
+    inode->mem[INODE_FORMAT] = INODE_SIZED;
+    memcpy(inode->mem + INODE_SIZE, &size, sizeof(int));
+}
+
+int extentIndex(tfs_block *inode, char *header, int position) {
+    return inode->mem[INODE_FORMAT] == INODE_SIZED ? (unsigned char) header[EXTENT_INDEX] : position;
+}
+
+int sizeFile(int inodeNum, tfs_block *inode) {
+    tfs_block ext;
+    int bNum, position = 0, size;
+
+    if (inode->mem[INODE_FORMAT] == INODE_SIZED) {
+        return SUCCESS;
+    }
+
+    // Number an older file's extents in chain order before anything can
+    // leave a hole in it.
+    size = fileSize(inode);
+    for (bNum = (unsigned char) inode->mem[2]; bNum; bNum = (unsigned char) ext.mem[2], position++) {
+        if (readFsBlock(bNum, &(ext.mem)) < 0) {
+            return ERR_READ;
+        }
+        ext.mem[EXTENT_INDEX] = position;
+        writeFsBlock(bNum, ext.mem);
+    }
+    setFileSize(inode, size);
+
+    return writeFsBlock(inodeNum, inode->mem);
+}
+
+int getNumBlocks(int size) {
+   int blocks = size / EXTENT_PAYLOAD;
+
+   if (size % EXTENT_PAYLOAD)
+      blocks++;
+
+   return blocks;
+}
+
+int tfs_writeFile(fileDescriptor FD,char *buffer, int size) {
+    long long start = traceClock();
+
+    probeEnter("tfs_writeFile", FD, size);
+    return probeReturn("tfs_writeFile", FD, traceCall(TRACE_OP_WRITE, FD, size, NULL, start, writeFile(FD, buffer, size)));
+}
+
+int writeFile(fileDescriptor FD, char *buffer, int size) {
+    int ret, index = 0, reqBlocks = getNumBlocks(size), offset = 0, i, reusable;
+    unsigned char blocks[MAX_BLOCKS];
+    tfs_block inode, temp;
+    tfs_openEntry *file;
+    time_t curTime;
+
+    //check if file is mounted and that the file exists
+    if((ret = checkMountAndFile(FD)) < 0) {
+        return ret;
+    }
+    file = getOpenFile(FD);
+
+    //read inode out
+    if(readFsBlock(file->inode, &(inode.mem)) < 0) {
+        fprintf(stderr, "writeFile inode\n");
+        return ERR_READ;
+    }
+
+    //check the file permission
+    if(inode.mem[3] == 0 || mountReadOnly)
+    {
+        return ERR_READ_ONLY;
+    }
+
+    //mapped views still point at the old extents
+    if (blockPins[file->inode]) {
+        return ERR_FILE_BUSY;
+    }
+
+    //hand back a little of any deleted snapshot while we're here, and
+    //empty a little of the log
+    reclaimSnapshots(RECLAIM_STEP);
+    cleanLog(LOG_CLEAN_STEP);
+    
+    //check to see if we have enough space to write the data, the file's
+    //current extents are freed first so they count as available, except
+    //the ones a snapshot holds, and a shared inode needs a copy
+    reusable = blockMap ? reusableBlocks((unsigned char) inode.mem[2]) - isShared(file->inode)
+                        : (unsigned char) inode.mem[14];
+    if (freeBlocks + reusable < reqBlocks) {
+        fprintf(stderr, "Error: not enough space available, numBlocks %d, freeBlocks %d, reqBlocks %d\n",
+        numBlocks, freeBlocks, reqBlocks);
+
+        return ERR_INVALID_SPACE;
+    }
+
+    //deallocate data blocks
+    if (resetFile(file->inode) < 0) {
+        fprintf(stderr, "could not reset file, FD is %d\n\n", FD);
+    }
+    
+    //lay the new extents out wherever the allocation policy puts them
+    if ((ret = allocRun(reqBlocks, file->inode, blocks)) < 0) {
+        return ret;
+    }
+    for (i = 0; i < reqBlocks; i++, index += offset) {
+        initExtent(&temp, i + 1 < reqBlocks ? blocks[i + 1] : 0);
+        temp.mem[EXTENT_INDEX] = i;
+        offset = (size - index >= EXTENT_PAYLOAD) ? (EXTENT_PAYLOAD) : (size - index);
+        memcpy(temp.mem + 4, buffer + index, offset);
+        writeFsBlock(blocks[i], temp.mem);
+    }
+
+    //update the inode block
+    inode.mem[2] = reqBlocks ? blocks[0] : 0;
+    inode.mem[14] = reqBlocks;
+    setFileSize(&inode, size);
+
+    // Get the time.
+    time(&curTime);
+
+    // Write last modified date.
+    memcpy(&(inode.mem[18 + sizeof(time_t)]), &curTime, sizeof(time_t));
+
+    // Write last accessed date.
+    memcpy(&inode.mem[18 + (2 * sizeof(time_t))], &curTime, sizeof(time_t));
+    writeFsBlock(file->inode, inode.mem);
+    file->location = 0;
+
+    //extents dedup shared leave their old blocks spare
+    if (dedupInline) {
+        reuseSpareBlocks();
+    }
+
+    return syncOp();
+}
+
+void initExtent(tfs_block *block, unsigned char next) {
+    int i;
+    block->mem[0] = 3;
+    block->mem[1] = MAGIC_NUM;
+    block->mem[2] = next;
+    
+    for (i = 3; i < blockSize; i++) {
+        block->mem[i] = 0x00;
+    }
+}
+
+int tfs_deleteFile(fileDescriptor FD) {
+    long long start = traceClock();
+
+    probeEnter("tfs_deleteFile", FD, 0);
+    return probeReturn("tfs_deleteFile", FD, traceCall(TRACE_OP_DELETE, FD, 0, NULL, start, deleteFile(FD)));
+}
+
+int deleteFile(fileDescriptor FD) {
+    tfs_block buf;
+    tfs_openEntry *file;
+    //ensure that disk is mounted
+    if (mountedDisk == NULL) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+
+    //the file has to be open
+    if ((file = getOpenFile(FD)) == NULL) {
+        return ERR_FILE_CLOSED;
+    }
+
+    //read in inode
+    readFsBlock(file->inode, &(buf.mem));
+    if (buf.mem[0] != 2) {
+        fprintf(stderr, "block is not inode, type: %d, FD %d\n\n", buf.mem[0], FD);
+        return ERR_INVALID_INODE;
+    }
+
+    //check file permission
+    if(buf.mem[3] == 0)
+    {
+        fprintf(stdout, "tfs_deleteFile: File is read-only\n");
+        return ERR_READ_ONLY;
+    }
+
+    //mapped views still point at its extents
+    if (blockPins[file->inode]) {
+        return ERR_FILE_BUSY;
+    }
+
+    //drop the name from its directory
+    if (dirRemove((unsigned char) buf.mem[INODE_PARENT], buf.mem + 5) < 0) {
+        return ERR_INVALID_INODE;
+    }
+
+    //give the extents and the inode back, blocks a snapshot shares are
+    //only given up, not freed
+    freeChain((unsigned char) buf.mem[2]);
+    releaseBlock(file->inode);
+    numInodes--;
+    releaseOpenFile(file);
+
+	return syncOp();
+}
+
+int tfs_readByte(fileDescriptor FD, char *buffer) {
+    long long start = traceClock();
+
+    probeEnter("tfs_readByte", FD, 0);
+    return probeReturn("tfs_readByte", FD, traceCall(TRACE_OP_READBYTE, FD, 0, NULL, start, readByte(FD, buffer)));
+}
+
+int readByte(fileDescriptor FD, char *buffer) {
+    int ret;
+    tfs_openEntry *file;
+
+    //check if file is mounted and that file exists
+    if((ret = checkMountAndFile(FD)) < 0) {
+        return ret;
+    }
+    file = getOpenFile(FD);
+
+    //past the end of the file
+    if ((ret = readFileRange(file, file->location, buffer, 1)) <= 0) {
+        return ret < 0 ? ret : ERR_READ;
+    }
+
+    //update the file pointer
+    file->location++;
+
+	return SUCCESS;
+}
+
+int tfs_readBytes(fileDescriptor FD, char *buffer, int size) {
+    long long start = traceClock();
+
+    probeEnter("tfs_readBytes", FD, size);
+    return probeReturn("tfs_readBytes", FD, traceCall(TRACE_OP_READBYTES, FD, size, NULL, start, readBytes(FD, buffer, size)));
+}
+
+int readBytes(fileDescriptor FD, char *buffer, int size) {
+    int ret;
+    tfs_openEntry *file;
+
+    //check if file is mounted and that file exists
+    if((ret = checkMountAndFile(FD)) < 0) {
+        return ret;
+    }
+    file = getOpenFile(FD);
+
+    if ((ret = readFileRange(file, file->location, buffer, size)) > 0) {
+        file->location += ret;
+    }
+    return ret;
+}
+
+int readFileRange(tfs_openEntry *file, int offset, char *buffer, int size) {
+    tfs_block inode, fileEx;
+    int bNum, position = 0, index, idx, chunk, count = 0, length;
+    time_t curTime;
+
+    if (readFsBlock(file->inode, &(inode.mem)) < 0) {
+        return ERR_READ;
+    }
+    length = fileSize(&inode);
+    if (offset >= length || size <= 0) {
+        return 0;
+    }
+    if (size > length - offset) {
+        size = length - offset;
+    }
+
+    // Write last accessed date.
+    time(&curTime);
+    memcpy(&(inode.mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
+    writeFsBlock(file->inode, inode.mem);
+
+    // Walk the chain once, copying out of each extent in turn.
+    bNum = (unsigned char) inode.mem[2];
+    if (bNum && readFsBlock(bNum, &(fileEx.mem)) < 0) {
+        return ERR_READ;
+    }
+    for (index = offset / EXTENT_PAYLOAD; count < size; index++) {
+        while (bNum && extentIndex(&inode, fileEx.mem, position) < index) {
+            bNum = (unsigned char) fileEx.mem[2];
+            position++;
+            if (bNum && readFsBlock(bNum, &(fileEx.mem)) < 0) {
+                return ERR_READ;
+            }
+        }
+
+        idx = (offset + count) % EXTENT_PAYLOAD;
+        chunk = EXTENT_PAYLOAD - idx < size - count ? EXTENT_PAYLOAD - idx : size - count;
+
+        // Holes read back as zeros without touching the disk.
+        if (bNum && extentIndex(&inode, fileEx.mem, position) == index) {
+            memcpy(buffer + count, fileEx.mem + 4 + idx, chunk);
+        }
+        else {
+            memset(buffer + count, 0, chunk);
+        }
+        count += chunk;
+    }
+
+    return count;
+}
+
+int tfs_seek(fileDescriptor FD, int offset) {
+    long long start = traceClock();
+
+    probeEnter("tfs_seek", FD, offset);
+    return probeReturn("tfs_seek", FD, traceCall(TRACE_OP_SEEK, FD, offset, NULL, start, seekFile(FD, offset)));
+}
+
+int seekFile(fileDescriptor FD, int offset) {
+	tfs_openEntry *file;
+
+    // Check if FD is in list of open files.
+	if ((file = getOpenFile(FD)) == NULL) {
+	    perror("seek: FD is not in list of open files");
+		return ERR_SEEK;
+	}
+
+	// Make sure the disk is mounted.
+	if (!mountedDisk) {
+		perror("seek: disk is not mounted");
+		return ERR_SEEK;
+	}
+
+	// Check that we have a valid offset.
+	if (offset < 0) {
+		perror("seek: offset is invalid");
+		return ERR_SEEK;
+	}
+
+	// If neither of these fails, set the FD to the offset.
+	file->location = offset;
+
+	return SUCCESS;
+}
+
+int tfs_mapFile(fileDescriptor FD, int offset, int len, tfs_view *view) {
+    probeEnter("tfs_mapFile", FD, len);
+    return probeReturn("tfs_mapFile", FD, mapRange(FD, offset, len, view));
+}
+
+int mapRange(fileDescriptor FD, int offset, int len, tfs_view *view) {
+    int ret, i, count, bNum, position = 0, index, hole, first, chunk, total, length;
+    tfs_block inode, fileEx;
+    tfs_openEntry *file;
+    char header[4], *image;
+
+    memset(view, 0, sizeof(tfs_view));
+
+    if ((ret = checkMountAndFile(FD)) < 0) {
+        return ret;
+    }
+    if (offset < 0 || len < 0) {
+        return ERR_SEEK;
+    }
+    if (batchOpen) {
+        return ERR_FILE_BUSY;
+    }
+    file = getOpenFile(FD);
+
+    if (readFsBlock(file->inode, &(inode.mem)) < 0) {
+        return ERR_READ;
+    }
+    length = fileSize(&inode);
+    if (offset >= length || len == 0) {
+        return 0;
+    }
+    len = len < length - offset ? len : length - offset;
+    view->inode = file->inode;
+
+    // One piece per block the range touches.
+    first = offset % EXTENT_PAYLOAD;
+    count = (first + len + EXTENT_PAYLOAD - 1) / EXTENT_PAYLOAD;
+    view->iov = malloc(sizeof(struct iovec) * count);
+    view->blocks = malloc(count);
+    view->count = count;
+    view->length = len;
+    ret = ERR_READ;
+    if (view->iov == NULL || view->blocks == NULL) {
+        goto fail;
+    }
+
+    // Without a mapping, fall back to copying the range into one buffer.
+    if ((image = mapDisk(diskFD)) == NULL) {
+        if ((view->copy = malloc(len)) == NULL) {
+            goto fail;
+        }
+        view->iov[0].iov_base = view->copy;
+        view->iov[0].iov_len = len;
+        view->count = 1;
+    }
+
+    bNum = (unsigned char) inode.mem[2];
+    if (bNum && readBlockPart(diskFD, physBlock(bNum), 0, header, sizeof(header)) < 0) {
+        goto fail;
+    }
+    for (i = 0, total = 0; i < count; i++, first = 0) {
+        // Skip the extents before this block, only their headers are read.
+        index = offset / EXTENT_PAYLOAD + i;
+        while (bNum && extentIndex(&inode, header, position) < index) {
+            bNum = (unsigned char) header[2];
+            position++;
+            if (bNum && readBlockPart(diskFD, physBlock(bNum), 0, header, sizeof(header)) < 0) {
+                goto fail;
+            }
+        }
+        hole = !bNum || extentIndex(&inode, header, position) != index;
+
+        chunk = EXTENT_PAYLOAD - first < len - total ? EXTENT_PAYLOAD - first : len - total;
+        if (image) {
+            view->iov[i].iov_base = hole ? holeBlock : image + (size_t) physBlock(bNum) * blockSize + 4 + first;
+            view->iov[i].iov_len = chunk;
+        }
+        else if (hole) {
+            memset(view->copy + total, 0, chunk);
+        }
+        else if (readFsBlock(bNum, &(fileEx.mem)) == 0) {
+            memcpy(view->copy + total, fileEx.mem + 4 + first, chunk);
+        }
+        else {
+            goto fail;
+        }
+        if (!hole) {
+            view->blocks[view->pinned++] = bNum;
+            blockPins[bNum]++;
+        }
+        total += chunk;
+    }
+    blockPins[view->inode]++;
+    pinnedViews++;
+
+    if (view->count == 1) {
+        view->data = view->iov[0].iov_base;
+    }
+    return view->length;
+
+fail:
+    // The caller gets no view to release, so give back what this one took.
+    for (i = 0; i < view->pinned; i++) {
+        blockPins[view->blocks[i]]--;
+    }
+    free(view->iov);
+    free(view->blocks);
+    free(view->copy);
+    memset(view, 0, sizeof(tfs_view));
+    return ret;
+}
+
+int tfs_releaseView(tfs_view *view) {
+    probeEnter("tfs_releaseView", view->inode, 0);
+    return probeReturn("tfs_releaseView", view->inode, releaseView(view));
+}
+
+int releaseView(tfs_view *view) {
+    int i;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    // Empty views pin nothing.
+    if (view->blocks == NULL) {
+        return SUCCESS;
+    }
+
+    for (i = 0; i < view->pinned; i++) {
+        blockPins[view->blocks[i]]--;
+    }
+    blockPins[view->inode]--;
+    pinnedViews--;
+
+    free(view->iov);
+    free(view->blocks);
+    free(view->copy);
+    memset(view, 0, sizeof(tfs_view));
+    return SUCCESS;
+}
+
+int allocExtents(int inodeNum, int size, unsigned char *blocks) {
+    tfs_block inode;
+    char header[4];
+    int reqBlocks = getNumBlocks(size), next, i;
+    time_t curTime;
+
+    if (readFsBlock(inodeNum, &(inode.mem)) < 0) {
+        return ERR_READ;
+    }
+    if (inode.mem[3] == 0) {
+        return ERR_READ_ONLY;
+    }
+    if (blockPins[inodeNum]) {
+        return ERR_FILE_BUSY;
+    }
+    if (freeBlocks + (unsigned char) inode.mem[14] < reqBlocks) {
+        return ERR_INVALID_SPACE;
+    }
+    if (resetFile(inodeNum) < 0 || readFsBlock(inodeNum, &(inode.mem)) < 0) {
+        return ERR_READ;
+    }
+    if ((next = allocRun(reqBlocks, inodeNum, blocks)) < 0) {
+        return next;
+    }
+
+    for (i = 0; i < reqBlocks; i++) {
+        header[0] = 3;
+        header[1] = MAGIC_NUM;
+        header[2] = i + 1 < reqBlocks ? blocks[i + 1] : 0;
+        header[EXTENT_INDEX] = i;
+        if (writeBlockPart(diskFD, exclusiveBlock(blocks[i], 1), 0, header, sizeof(header)) < 0) {
+            return ERR_WRITE;
+        }
+    }
+    time(&curTime);
+    memcpy(&(inode.mem[18 + sizeof(time_t)]), &curTime, sizeof(time_t));
+    memcpy(&(inode.mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
+    inode.mem[2] = reqBlocks ? blocks[0] : 0;
+    inode.mem[14] = reqBlocks;
+    setFileSize(&inode, size);
+    writeFsBlock(inodeNum, inode.mem);
+
+    return reqBlocks;
+}
+
+/* Copies one import's content into the extents laid out for it. The
+last extent's unused tail is zeroed so the content ends in a null. */
+int copyImport(tfs_import *job) {
+    char zeros[MAX_BLOCKSIZE] = {0};
+    int i, chunk, done = 0;
+
+    for (i = 0; i < job->numBlocks; i++, done += chunk) {
+        chunk = job->size - done < EXTENT_PAYLOAD ? job->size - done : EXTENT_PAYLOAD;
+        if (copyToDisk(diskFD, physBlock(job->blocks[i]), 4, job->hostFd, done, chunk) < 0) {
+            return ERR_WRITE;
+        }
+        if (chunk < EXTENT_PAYLOAD &&
+            writeBlockPart(diskFD, physBlock(job->blocks[i]), 4 + chunk, zeros, EXTENT_PAYLOAD - chunk) < 0) {
+            return ERR_WRITE;
+        }
+    }
+    return SUCCESS;
+}
+
+/* Worker for tfs_importFiles, takes imports off the shared list until
+none are left. */
+void *importWorker(void *arg) {
+    tfs_importQueue *queue = arg;
+    tfs_import *job;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        job = queue->next < queue->count ? &queue->jobs[queue->next++] : NULL;
+        pthread_mutex_unlock(&queue->lock);
+        if (job == NULL) {
+            return NULL;
+        }
+        job->result = copyImport(job);
+    }
+}
+
+fileDescriptor tfs_importFile(char *hostPath, char *name) {
+    fileDescriptor FD;
+    int ret;
+
+    if ((ret = tfs_importFiles(&hostPath, &name, 1, &FD)) < 0) {
+        return ret;
+    }
+    return FD;
+}
+
+int tfs_importFiles(char **hostPaths, char **names, int count, fileDescriptor *fds) {
+    probeEnter("tfs_importFiles", 0, count);
+    return probeReturn("tfs_importFiles", 0, importHostFiles(hostPaths, names, count, fds));
+}
+
+int importHostFiles(char **hostPaths, char **names, int count, fileDescriptor *fds) {
+    tfs_importQueue queue;
+    pthread_t threads[IMPORT_THREADS];
+    struct stat st;
+    tfs_import *job;
+    int i, numThreads, ret = SUCCESS;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+
+    queue.jobs = calloc(count, sizeof(tfs_import));
+    queue.count = 0;
+    queue.next = 0;
+
+    // Allocation touches the free list and the superblock, so it runs serially.
+    for (i = 0; i < count; i++) {
+        job = &queue.jobs[queue.count];
+        if ((job->hostFd = open(hostPaths[i], O_RDONLY)) < 0) {
+            perror("importFiles: could not open host file");
+            ret = ERR_READ;
+            break;
+        }
+        if (fstat(job->hostFd, &st) < 0 || st.st_size > MAX_BLOCKS * EXTENT_PAYLOAD) {
+            close(job->hostFd);
+            ret = ERR_INVALID_SPACE;
+            break;
+        }
+        job->size = st.st_size;
+        if ((fds[i] = openFile(names[i])) < 0) {
+            close(job->hostFd);
+            ret = fds[i];
+            break;
+        }
+        if ((job->numBlocks = allocExtents(getOpenFile(fds[i])->inode, job->size, job->blocks)) < 0) {
+            close(job->hostFd);
+            ret = job->numBlocks;
+            break;
+        }
+        getOpenFile(fds[i])->location = 0;
+        queue.count++;
+    }
+
+    // The copies land in blocks no one else owns, so they can run side by side.
+    pthread_mutex_init(&queue.lock, NULL);
+    numThreads = queue.count < IMPORT_THREADS ? queue.count : IMPORT_THREADS;
+    if (numThreads <= 1) {
+        importWorker(&queue);
+    }
+    else {
+        for (i = 0; i < numThreads; i++) {
+            pthread_create(&threads[i], NULL, importWorker, &queue);
+        }
+        for (i = 0; i < numThreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    pthread_mutex_destroy(&queue.lock);
+
+    for (i = 0; i < queue.count; i++) {
+        close(queue.jobs[i].hostFd);
+        if (queue.jobs[i].result < 0 && ret == SUCCESS) {
+            ret = queue.jobs[i].result;
+        }
+    }
+    free(queue.jobs);
+    return ret == SUCCESS ? syncOp() : ret;
+}
+
+int tfs_exportFile(fileDescriptor FD, int hostFd) {
+    probeEnter("tfs_exportFile", FD, 0);
+    return probeReturn("tfs_exportFile", FD, exportHostFile(FD, hostFd));
+}
+
+int exportHostFile(fileDescriptor FD, int hostFd) {
+    tfs_block inode;
+    tfs_openEntry *file;
+    char header[4];
+    int ret, bNum, position = 0, index, len, length, total = 0;
+    time_t curTime;
+
+    if ((ret = checkMountAndFile(FD)) < 0) {
+        return ret;
+    }
+    file = getOpenFile(FD);
+    if (readFsBlock(file->inode, &(inode.mem)) < 0) {
+        return ERR_READ;
+    }
+    length = fileSize(&inode);
+
+    for (bNum = (unsigned char) inode.mem[2]; bNum && total < length; bNum = (unsigned char) header[2], position++) {
+        if (readBlockPart(diskFD, physBlock(bNum), 0, header, sizeof(header)) < 0) {
+            return ERR_READ;
+        }
+
+        // Holes go out as zeros.
+        index = extentIndex(&inode, header, position);
+        if ((ret = writeZeros(hostFd, index * EXTENT_PAYLOAD - total)) < 0) {
+            return ret;
+        }
+        total = index * EXTENT_PAYLOAD;
+
+        len = length - total < EXTENT_PAYLOAD ? length - total : EXTENT_PAYLOAD;
+        if (len && copyFromDisk(diskFD, physBlock(bNum), 4, hostFd, len) < 0) {
+            return ERR_WRITE;
+        }
+        total += len;
+    }
+    if ((ret = writeZeros(hostFd, length - total)) < 0) {
+        return ret;
+    }
+
+    // Write last accessed date.
+    time(&curTime);
+    memcpy(&(inode.mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
+    writeFsBlock(file->inode, inode.mem);
+
+    return length;
+}
+
+int writeZeros(int hostFd, int len) {
+    int ret;
+
+    for (; len > 0; len -= ret) {
+        if ((ret = write(hostFd, holeBlock, len < blockSize ? len : blockSize)) <= 0) {
+            return ERR_WRITE;
+        }
+    }
+    return SUCCESS;
+}
+
+int tfs_rename(fileDescriptor FD, char* newName) {
+    long long start = traceClock();
+
+    probeEnter("tfs_rename", FD, 0);
+    return probeReturn("tfs_rename", FD, traceCall(TRACE_OP_RENAME, FD, 0, newName, start, renameFile(FD, newName)));
+}
+
+int renameFile(fileDescriptor FD, char *newName) {
+	tfs_block buf;
+    time_t curTime;
+    int oldParent, newParent;
+    char leaf[MAX_FILE_NAME_LENGTH + 1];
+    tfs_openEntry *file;
+	
+    //check if file is open
+	if ((file = getOpenFile(FD)) == NULL) {
+		perror("rename: file closed");
+		return ERR_FILE_CLOSED;
+	}
+	if (mountReadOnly) {
+		return ERR_READ_ONLY;
+	}
+
+	//read in inode of file to rename
+	readFsBlock(file->inode, &(buf.mem));
+	oldParent = (unsigned char) buf.mem[INODE_PARENT];
+
+    //a bare name stays in the same directory, a path may move the file
+    if (strchr(newName, '/')) {
+        if ((newParent = resolvePath(newName, leaf)) < 0) {
+            return newParent;
+        }
+    }
+    else {
+        //check for file name length
+	    if (strlen(newName) > MAX_FILE_NAME_LENGTH || strlen(newName) == 0) {
+		    perror("rename: invalid name");
+		    return ERR_FILE_NAME_LENGTH;
+	    }
+        newParent = oldParent;
+        strcpy(leaf, newName);
+    }
+
+    if (dirLookup(newParent, leaf, NULL) != 0) {
+        fprintf(stderr, "rename: %s already exists\n", newName);
+        return ERR_FILE_EXISTS;
+    }
+
+    //link the new name before dropping the old one
+    if (dirInsert(newParent, leaf, file->inode, 2) < 0) {
+        return ERR_INVALID_SPACE;
+    }
+    dirRemove(oldParent, buf.mem + 5);
+
+	//copy in new name
+	strncpy(&(buf.mem[5]), leaf, 9);
+	buf.mem[INODE_PARENT] = newParent;
+
+    // Get the current time.
+    time(&curTime);
+
+    // Write last modified date.
+    memcpy(&(buf.mem[18 + sizeof(time_t)]), &curTime, sizeof(time_t));
+
+    // Write last accessed date.
+    memcpy(&(buf.mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
+
+	strcpy(file->name, leaf);
+	//write block back with modifications
+	writeFsBlock(file->inode, buf.mem);
+
+    return syncOp();
+}
+
+void tfs_readdir() {
+    probeEnter("tfs_readdir", 0, 0);
+    readdirRoot();
+    (void) probeReturn("tfs_readdir", 0, SUCCESS);
+}
+
+void readdirRoot() {
+	int i, count, cursor = 0;
+	tfs_dirent page[READDIR_PAGE];
+
+	//walk the root directory a page at a time
+	while ((count = readdirPage("/", &cursor, page, READDIR_PAGE)) > 0) {
+		for (i = 0; i < count; i++) {
+			if (page[i].type == DIRECTORY_TYPE) {
+				printf("%s/\n", page[i].name);
+				continue;
+			}
+			//if it's a file, print the name and size
+			printf("%s : %d bytes\n", page[i].name, inodeTable[page[i].inode].size);
+		}
+	}
+}
+
+int tfs_mkdir(char *path) {
+    long long start = traceClock();
+
+    probeEnter("tfs_mkdir", 0, 0);
+    return probeReturn("tfs_mkdir", 0, traceCall(TRACE_OP_MKDIR, 0, 0, path, start, makeDir(path)));
+}
+
+int makeDir(char *path) {
+    tfs_block buf;
+    int parent, dir, ret;
+    char leaf[MAX_FILE_NAME_LENGTH + 1];
+
+    if (!mountedDisk) {
+        perror("mkdir: TFS not mounted");
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+    if ((parent = resolvePath(path, leaf)) < 0) {
+        return parent;
+    }
+    if ((ret = dirLookup(parent, leaf, NULL)) != 0) {
+        return ret < 0 ? ret : ERR_FILE_EXISTS;
+    }
+
+    if ((dir = allocInodeBlock(parent)) < 0) {
+        return dir;
+    }
+    initDirectoryblock(&buf, leaf, parent);
+    writeCachedBlock(dir, &buf);
+
+    if (dirInsert(parent, leaf, dir, DIRECTORY_TYPE) < 0) {
+        releaseBlock(dir);
+        return ERR_INVALID_SPACE;
+    }
+    numInodes++;
+
+    return syncOp();
+}
+
+int tfs_rmdir(char *path) {
+    long long start = traceClock();
+
+    probeEnter("tfs_rmdir", 0, 0);
+    return probeReturn("tfs_rmdir", 0, traceCall(TRACE_OP_RMDIR, 0, 0, path, start, removeDir(path)));
+}
+
+int removeDir(char *path) {
+    tfs_block buf;
+    int parent, dir, type, i;
+    char leaf[MAX_FILE_NAME_LENGTH + 1];
+
+    if (!mountedDisk) {
+        perror("rmdir: TFS not mounted");
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+    if ((parent = resolvePath(path, leaf)) < 0) {
+        return parent;
+    }
+    if ((dir = dirLookup(parent, leaf, &type)) <= 0 || type != DIRECTORY_TYPE) {
+        return ERR_NO_SUCH_DIR;
+    }
+
+    // Emptied entry blocks are released, so an empty directory has no buckets.
+    readCachedBlock(dir, &buf);
+    for (i = 0; i < DIR_BUCKETS; i++) {
+        if (buf.mem[DIR_BUCKET_START + i] != '\0') {
+            return ERR_DIR_NOT_EMPTY;
+        }
+    }
+
+    dirRemove(parent, leaf);
+    releaseBlock(dir);
+    numInodes--;
+
+    return syncOp();
+}
+
+int tfs_readdirPage(char *path, int *cursor, tfs_dirent *page, int max) {
+    probeEnter("tfs_readdirPage", 0, max);
+    return probeReturn("tfs_readdirPage", 0, readdirPage(path, cursor, page, max));
+}
+
+int readdirPage(char *path, int *cursor, tfs_dirent *page, int max) {
+    tfs_block dirInode, entries;
+    int dir, bucket, slot, next, i, count = 0;
+    char *entry;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if ((dir = resolveDir(path)) < 0) {
+        return dir;
+    }
+    readCachedBlock(dir, &dirInode);
+
+    // The cursor is the bucket in the high bits and the slot within its chain.
+    for (bucket = *cursor >> 16; bucket < DIR_BUCKETS; bucket++) {
+        next = (unsigned char) dirInode.mem[DIR_BUCKET_START + bucket];
+        slot = 0;
+        while (next) {
+            readCachedBlock(next, &entries);
+            for (i = 0; i < DIRENTS_PER_BLOCK; i++, slot++) {
+                entry = DIRENT(&entries, i);
+                if (slot < (*cursor & 0xffff) || entry[0] == '\0') {
+                    continue;
+                }
+                if (count == max) {
+                    *cursor = (bucket << 16) | slot;
+                    return count;
+                }
+                page[count].inode = (unsigned char) entry[0];
+                page[count].type = entry[1];
+                strncpy(page[count].name, entry + 2, MAX_FILE_NAME_LENGTH);
+                page[count].name[MAX_FILE_NAME_LENGTH] = '\0';
+                count++;
+            }
+            next = (unsigned char) entries.mem[2];
+        }
+        *cursor = (bucket + 1) << 16;
+    }
+
+    return count;
+}
+
+int allocBlock() {
+    return allocBlockNear(0);
+}
+
+int allocInodeBlock(int parent) {
+    int policy = allocPolicy, cursor = allocCursor, bNum;
+
+    // Inodes go as close to their directory as they can under every
+    // policy but the old one, so a directory's files stay together, and
+    // they don't move the next fit cursor.
+    if (allocPolicy != ALLOC_HEAD) {
+        allocPolicy = ALLOC_NEAR;
+    }
+    bNum = allocBlockNear(parent);
+    allocPolicy = policy;
+    allocCursor = cursor;
+
+    return bNum;
+}
+
+void releaseBlock(int bNum) {
+    tfs_block buf;
+    unsigned char link = bNum;
+    int i;
+
+    TFS_PROBE2(block__free, bNum, isShared(bNum));
+
+    // A snapshot still needs the block, so only the number is given up.
+    if (isShared(bNum)) {
+        blockRefs[blockMap[bNum]]--;
+        blockMap[bNum] = 0;
+        reuseSpareBlocks();
+    }
+    // Append it to the tail of the free chain, so blocks come back in
+    // the order they were freed. A log-structured image only unmaps it.
+    else {
+        if (logMode) {
+            retireLogBlock(blockMap[bNum]);
+            blockMap[bNum] = 0;
+        }
+        else {
+            initFreeblock(&buf, '\0');
+            writeFsBlock(bNum, buf.mem);
+            writeBlockPart(diskFD, physBlock(freeTail), 2, &link, 1);
+        }
+        freePrev[bNum] = freeTail;
+        freeNext[freeTail] = bNum;
+        freeTail = bNum;
+        freeState[bNum] = FREE_OPEN;
+        freeBlocks++;
+
+        // Without a block map the block's space can go back to the host.
+        if (!blockMap && !trimPending[bNum]) {
+            trimPending[bNum] = 1;
+            trimCount++;
+        }
+
+        // Whatever was reserved for the file ending here is open again.
+        for (i = bNum + 1; i < numNames && freeState[i] == FREE_RESERVED; i++) {
+            freeState[i] = FREE_OPEN;
+        }
+    }
+
+    if (dirCache[bNum % DIR_CACHE_SIZE].bNum == bNum) {
+        dirCache[bNum % DIR_CACHE_SIZE].bNum = 0;
+    }
+    if (inodeTable) {
+        inodeTable[bNum].type = 0;
+    }
+}
+
+void freeChain(int head) {
+    tfs_block buf;
+    int next;
+
+    while (head) {
+        readFsBlock(head, &(buf.mem));
+        next = (unsigned char) buf.mem[2];
+        releaseBlock(head);
+        head = next;
+    }
+}
+
+int loadFreeList() {
+    tfs_blockSummary summary;
+    int bNum, prev = 0;
+
+    freeNext = arenaAlloc(MAX_BLOCKS + 1);
+    freePrev = arenaAlloc(MAX_BLOCKS + 1);
+    freeState = arenaAlloc(MAX_BLOCKS + 1);
+    trimPending = arenaAlloc(MAX_BLOCKS + 1);
+    memset(freeNext, 0, MAX_BLOCKS + 1);
+    memset(freePrev, 0, MAX_BLOCKS + 1);
+    memset(freeState, 0, MAX_BLOCKS + 1);
+    memset(trimPending, 0, MAX_BLOCKS + 1);
+    freeTail = 0;
+    trimCount = 0;
+    allocCursor = 1;
+
+    // A snapshot never allocates, and its map hides the live free chain.
+    if (mountReadOnly) {
+        return SUCCESS;
+    }
+
+    // Free numbers of a log-structured image have no block behind them to
+    // hold a chain, the map is all there is.
+    if (logMode) {
+        for (bNum = 1, freeBlocks = 0; bNum < numNames; bNum++) {
+            if (!blockMap[bNum]) {
+                freeState[bNum] = FREE_OPEN;
+                freePrev[bNum] = prev;
+                freeNext[prev] = bNum;
+                prev = bNum;
+                freeBlocks++;
+            }
+        }
+        freeTail = prev;
+        return SUCCESS;
+    }
+
+    // Pick up every free block's link in one pass over the image, then
+    // follow the chain from the superblock, which stands in as block 0.
+    if (summarizeImage(SCAN_ANY, &summary) < 0) {
+        return ERR_READ;
+    }
+    for (bNum = summary.next[0]; bNum && summary.type[bNum] == 4 && !freeState[bNum]; bNum = summary.next[bNum]) {
+        freeState[bNum] = FREE_OPEN;
+        freePrev[bNum] = prev;
+        freeNext[prev] = bNum;
+        prev = bNum;
+    }
+
+    // The chain stops at a punched block, and whatever came after it
+    // follows in block order. Only the list in memory links them up.
+    for (bNum = 1; !blockMap && bNum < numNames; bNum++) {
+        if ((summary.type[bNum] == 4 || summary.type[bNum] == 0) && !freeState[bNum]) {
+            freeState[bNum] = FREE_OPEN;
+            freePrev[bNum] = prev;
+            freeNext[prev] = bNum;
+            prev = bNum;
+        }
+    }
+    freeTail = prev;
+
+    return SUCCESS;
+}
+
+void takeFreeBlock(int bNum) {
+    unsigned char next = freeNext[bNum];
+    int prev = freePrev[bNum];
+
+    // Unlink it on disk first, the predecessor (or the superblock) skips
+    // over it.
+    if (!logMode) {
+        writeBlockPart(diskFD, physBlock(prev), 2, &next, 1);
+    }
+    freeNext[prev] = next;
+    if (next) {
+        freePrev[next] = prev;
+    }
+    else {
+        freeTail = prev;
+    }
+    freeNext[bNum] = 0;
+    freePrev[bNum] = 0;
+    freeState[bNum] = 0;
+    freeBlocks--;
+    TFS_PROBE2(block__alloc, bNum, freeBlocks);
+
+    // It is about to hold something, punching it now would lose that.
+    if (trimPending[bNum]) {
+        trimPending[bNum] = 0;
+        trimCount--;
+    }
+}
+
+int findRun(int len, int hint, int open) {
+    int start, end, best = -1, bestScore = 0, score, pick;
+
+    for (start = 1; start < numNames; start = end + 1) {
+        // Find the next stretch of usable free blocks.
+        while (start < numNames && !(open ? freeState[start] == FREE_OPEN : freeState[start])) {
+            start++;
+        }
+        for (end = start; end < numNames && (open ? freeState[end] == FREE_OPEN : freeState[end]); end++)
+            ;
+        if (end - start < len) {
+            continue;
+        }
+
+        // Next fit takes the first run at or after the cursor, wrapping
+        // around. Best fit takes the shortest run that is long enough.
+        // Near takes the start closest to just after the hint.
+        pick = start;
+        if (allocPolicy == ALLOC_NEXT_FIT) {
+            pick = allocCursor > start && allocCursor <= end - len ? allocCursor : start;
+            score = (pick - allocCursor + numNames) % numNames;
+        }
+        else if (allocPolicy == ALLOC_BEST_FIT) {
+            score = end - start;
+        }
+        else {
+            pick = hint + 1 < start ? start : (hint + 1 > end - len ? end - len : hint + 1);
+            score = abs(pick - hint - 1);
+        }
+        if (best < 0 || score < bestScore) {
+            best = pick;
+            bestScore = score;
+        }
+    }
+
+    return best;
+}
+
+int allocBlockNear(int hint) {
+    int bNum;
+
+    if (!freeNext || !freeNext[0] || freeBlocks < 1) {
+        return ERR_INVALID_SPACE;
+    }
+
+    // The old policy pops the head of the chain. The others first extend
+    // whatever sits at the hint, then search, leaving other files'
+    // reserves alone as long as anything else is left.
+    if (allocPolicy == ALLOC_HEAD) {
+        bNum = freeNext[0];
+    }
+    else if (hint && hint + 1 < numNames && freeState[hint + 1]) {
+        bNum = hint + 1;
+    }
+    else if ((bNum = findRun(1, hint, 1)) < 0) {
+        bNum = findRun(1, hint, 0);
+    }
+
+    takeFreeBlock(bNum);
+    allocCursor = bNum + 1;
+    return bNum;
+}
+
+int allocRun(int count, int hint, unsigned char *blocks) {
+    int reserve = count * ALLOC_RESERVE / 100, start = -1, i, ret;
+
+    if (freeBlocks < count) {
+        return ERR_INVALID_SPACE;
+    }
+
+    // Look for one run with room to grow, then one that just fits, and
+    // otherwise fall back to placing blocks one at a time.
+    if (allocPolicy != ALLOC_HEAD && count > 0 &&
+        (start = findRun(count + reserve, hint, 1)) < 0) {
+        reserve = 0;
+        start = findRun(count, hint, 1);
+    }
+    TFS_PROBE3(alloc__run, count, start, hint);
+    for (i = 0; i < count; i++) {
+        if (start >= 0) {
+            takeFreeBlock(start + i);
+            blocks[i] = start + i;
+        }
+        else if ((ret = allocBlockNear(i ? blocks[i - 1] : hint)) < 0) {
+            return ret;
+        }
+        else {
+            blocks[i] = ret;
+        }
+    }
+
+    // The blocks past the end are held back for the file to grow into.
+    if (start >= 0) {
+        for (i = start + count; i < start + count + reserve; i++) {
+            freeState[i] = FREE_RESERVED;
+        }
+        allocCursor = start + count + reserve;
+    }
+
+    return count;
+}
+
+int tfs_mountPolicy(char *diskname, int policy) {
+    tfs_mountOptions options = {policy, TFS_SYNC_NONE, 0, 0, 0};
+
+    return tfs_mountWith(diskname, &options);
+}
+
+int tfs_mountWith(char *diskname, tfs_mountOptions *options) {
+    probeEnter("tfs_mountWith", 0, options->allocPolicy);
+    if (options->allocPolicy < ALLOC_HEAD || options->allocPolicy > ALLOC_NEAR ||
+        options->durability < TFS_SYNC_NONE || options->durability > TFS_SYNC_OP) {
+        return probeReturn("tfs_mountWith", 0, ERR_BAD_REQUEST);
+    }
+    allocPolicy = options->allocPolicy;
+    syncMode = options->durability;
+    mountDirect = options->directIO;
+    mountNoWrite = options->readOnly;
+    mountWriteThrough = options->writeThrough;
+    return probeReturn("tfs_mountWith", 0, mountImage(diskname, NULL));
+}
+
+int syncOp() {
+    flushTrim(0);
+    if (checkpointLog() < 0 || flushQueue(diskFD) < 0) {
+        return ERR_WRITE;
+    }
+
+    // A batch is synced once, when it commits.
+    if (syncMode == TFS_SYNC_OP && !batchOpen && syncDisk(diskFD) < 0) {
+        return ERR_WRITE;
+    }
+    return SUCCESS;
+}
+
+int tfs_sync() {
+    long long start = traceClock();
+
+    probeEnter("tfs_sync", 0, 0);
+    return probeReturn("tfs_sync", 0, traceCall(TRACE_OP_SYNC, 0, 0, NULL, start, syncImage()));
+}
+
+int syncImage() {
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    flushTrim(1);
+    if (checkpointLog() < 0) {
+        return ERR_WRITE;
+    }
+    return syncDisk(diskFD) < 0 ? ERR_WRITE : SUCCESS;
+}
+
+int flushTrim(int all) {
+    int start, end, punched = 0;
+
+    // The blocks a batch frees are only free once it commits.
+    if (!trimPending || !trimCount || batchOpen || (!all && trimCount < TRIM_BATCH)) {
+        return 0;
+    }
+
+    // One punch per run of consecutive blocks. A block a snapshot or an
+    // aborted batch took back in the meantime is left alone.
+    for (start = 1; start < numNames; start = end + 1) {
+        for (end = start; end < numNames && trimPending[end] && freeState[end] && !blockMap; end++) {
+            trimPending[end] = 0;
+        }
+        if (end > start && punchBlocks(diskFD, start, end - start) == 0) {
+            punched += end - start;
+        }
+        if (end < numNames) {
+            trimPending[end] = 0;
+        }
+    }
+    trimCount = 0;
+    return punched;
+}
+
+int writeFreeChain() {
+    char header[3] = {4, MAGIC_NUM, 0};
+    int bNum;
+
+    for (bNum = freeNext[0]; bNum; bNum = freeNext[bNum]) {
+        header[2] = freeNext[bNum];
+        if (writeBlockPart(diskFD, bNum, 0, header, sizeof(header)) < 0) {
+            return ERR_WRITE;
+        }
+    }
+    return SUCCESS;
+}
+
+int tfs_trim() {
+    probeEnter("tfs_trim", 0, 0);
+    return probeReturn("tfs_trim", 0, trimImage());
+}
+
+int trimImage() {
+    int bNum;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+    if (batchOpen) {
+        return ERR_FILE_BUSY;
+    }
+    if (blockMap) {
+        return 0;
+    }
+    for (bNum = 1; bNum < numNames; bNum++) {
+        trimPending[bNum] = freeState[bNum] != 0;
+    }
+    trimCount = freeBlocks;
+    return flushTrim(1);
+}
+
+int tfs_runStats(int *files, int *blocks, int *runs) {
+    probeEnter("tfs_runStats", 0, 0);
+    return probeReturn("tfs_runStats", 0, runStats(files, blocks, runs));
+}
+
+int runStats(int *files, int *blocks, int *runs) {
+    tfs_blockSummary summary;
+    int i, bNum, prev, steps;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (summarizeImage(SCAN_TYPE(2) | SCAN_TYPE(3), &summary) < 0) {
+        return ERR_READ;
+    }
+
+    // A run ends wherever the next extent isn't the very next block.
+    *files = *blocks = *runs = 0;
+    for (i = 1; i < numNames; i++) {
+        if (summary.type[i] != 2) {
+            continue;
+        }
+        (*files)++;
+        prev = -1;
+        for (bNum = summary.next[i], steps = 0; bNum && steps < numNames; bNum = summary.next[bNum], steps++) {
+            (*blocks)++;
+            *runs += bNum != prev + 1;
+            prev = bNum;
+        }
+    }
+
+    return SUCCESS;
+}
+
+int tfs_ioStats(long *readRequests, long *readCalls, long *writeRequests, long *writeCalls) {
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    return queueStats(diskFD, readRequests, readCalls, writeRequests, writeCalls) < 0 ? ERR_READ : SUCCESS;
+}
+
+int tfs_copyStats(long *copies) {
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    return copyStats(diskFD, copies) < 0 ? ERR_READ : SUCCESS;
+}
+
+int physBlock(int bNum) {
+    return blockMap ? blockMap[bNum] : bNum;
+}
+
+int isShared(int bNum) {
+    return blockMap && blockRefs[blockMap[bNum]] > 1;
+}
+
+int readFsBlock(int bNum, void *block) {
+    if (blockMap && bNum && !blockMap[bNum]) {
+        return ERR_READ;
+    }
+    return readBlock(diskFD, physBlock(bNum), block);
+}
+
+int writeFsBlock(int bNum, void *block) {
+    unsigned int hash = 0;
+    int phys, ret, dedup = dedupInline && ((char *) block)[0] == 3;
+
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+
+    // An extent matching one already on disk just shares its block.
+    if (dedup) {
+        hash = contentHash(block, blockSize);
+        if ((phys = shareBlock(bNum, block, hash)) != 0) {
+            return phys < 0 ? phys : 0;
+        }
+    }
+
+    if ((phys = exclusiveBlock(bNum, 0)) < 0) {
+        return phys;
+    }
+    if ((ret = writeBlock(diskFD, phys, block)) >= 0 && dedup) {
+        indexBlock(phys, hash);
+    }
+    if (ret >= 0) {
+        cacheInode(bNum, block);
+    }
+    return ret;
+}
+
+int exclusiveBlock(int bNum, int keep) {
+    tfs_block buf;
+    int spare, fresh, old;
+
+    if (logMode) {
+        return logBlock(bNum, keep);
+    }
+    if (!isShared(bNum)) {
+        return physBlock(bNum);
+    }
+
+    // Take a free block's physical block and point this number at it
+    // instead, the snapshots keep the old one.
+    if ((spare = allocBlock()) < 0) {
+        return spare;
+    }
+    old = blockMap[bNum];
+    fresh = blockMap[spare];
+    blockMap[spare] = 0;
+    if (keep && (readBlock(diskFD, old, buf.mem) < 0 || writeBlock(diskFD, fresh, buf.mem) < 0)) {
+        return ERR_WRITE;
+    }
+    blockMap[bNum] = fresh;
+    blockRefs[old]--;
+    saveBlockMap();
+
+    return fresh;
+}
+
+int saveBlockMap() {
+    tfs_block buf;
+
+    memset(buf.mem, 0, blockSize);
+    memcpy(buf.mem, blockMap, numNames);
+    if (writeBlock(diskFD, blockMapBlock, buf.mem) < 0) {
+        return ERR_WRITE;
+    }
+    memcpy(buf.mem, blockRefs, numBlocks);
+    return writeBlock(diskFD, blockRefsBlock, buf.mem);
+}
+
+int loadBlockMap(int diskNum, tfs_block *super, char *snapshot) {
+    tfs_block buf;
+    char *entry;
+    int i, map = 0;
+
+    blockMap = NULL;
+    blockRefs = NULL;
+    logState = NULL;
+    logMode = 0;
+    mountReadOnly = snapshot != NULL || mountNoWrite;
+    reclaimPending = 0;
+    numNames = numBlocks;
+    dedupInline = 0;
+    memset(dedupIndex, 0, sizeof(dedupIndex));
+
+    // Images that never had a snapshot use block numbers as they are.
+    if (!(blockMapBlock = (unsigned char) super->mem[SUPER_BLOCK_MAP])) {
+        return snapshot ? ERR_NO_SUCH_SNAPSHOT : SUCCESS;
+    }
+    blockRefsBlock = (unsigned char) super->mem[SUPER_BLOCK_REFS];
+    snapshotBlock = (unsigned char) super->mem[SUPER_SNAPSHOTS];
+
+    blockMap = arenaAlloc(MAX_BLOCKS + 1);
+    blockRefs = arenaAlloc(MAX_BLOCKS + 1);
+    logMode = super->mem[SUPER_LOG] != 0;
+    numNames = logMode ? logNames(numBlocks) : MAX_BLOCKS;
+    if (readBlock(diskNum, blockMapBlock, buf.mem) < 0) {
+        return ERR_READ;
+    }
+    memcpy(blockMap, buf.mem, numNames);
+    if (readBlock(diskNum, blockRefsBlock, buf.mem) < 0) {
+        return ERR_READ;
+    }
+    memcpy(blockRefs, buf.mem, numBlocks);
+
+    if (readBlock(diskNum, snapshotBlock, buf.mem) < 0) {
         return ERR_READ;
     }
+    for (i = 0; i < MAX_SNAPSHOTS; i++) {
+        entry = buf.mem + i * SNAPSHOT_ENTRY_SIZE;
+        if (entry[SNAPSHOT_STATE] == SNAPSHOT_DELETING) {
+            reclaimPending++;
+        }
+        else if (snapshot && entry[SNAPSHOT_STATE] == SNAPSHOT_ACTIVE &&
+                 !strncmp(entry, snapshot, MAX_FILE_NAME_LENGTH + 1)) {
+            map = (unsigned char) entry[SNAPSHOT_MAP];
+        }
+    }
+
+    // A snapshot is mounted by reading through its map instead.
+    if (snapshot) {
+        if (!map) {
+            return ERR_NO_SUCH_SNAPSHOT;
+        }
+        if (readBlock(diskNum, map, buf.mem) < 0) {
+            return ERR_READ;
+        }
+        memcpy(blockMap, buf.mem, numNames);
+    }
+
+    return logMode ? loadLogState() : SUCCESS;
+}
+
+int takeSystemBlock() {
+    int bNum, phys, i;
+
+    if ((bNum = allocBlock()) < 0) {
+        return bNum;
+    }
+    phys = blockMap[bNum];
+    blockMap[bNum] = 0;
+
+    // Whatever the dedup index remembers about it no longer holds.
+    for (i = 0; i < DEDUP_BUCKETS; i++) {
+        if (dedupIndex[i] == phys) {
+            dedupIndex[i] = 0;
+        }
+    }
+
+    return phys;
+}
+
+int giveBackBlock(int phys) {
+    blockRefs[phys] = 0;
+    return reuseSpareBlocks();
+}
+
+int reuseSpareBlocks() {
+    int name = 1, phys;
+
+    // Pair every physical block nothing uses with a retired number and
+    // free it. With no retired number left it waits for one.
+    for (phys = 1; phys < numBlocks; phys++) {
+        if (blockRefs[phys]) {
+            continue;
+        }
+        while (name < numNames && blockMap[name]) {
+            name++;
+        }
+        if (name == numNames) {
+            break;
+        }
+        blockMap[name] = phys;
+        blockRefs[phys] = 1;
+        releaseBlock(name);
+    }
+
+    return saveBlockMap();
+}
+
+int enterMappedMode() {
+    tfs_block super, buf;
+    int i;
+
+    if (freeBlocks < 3) {
+        return ERR_INVALID_SPACE;
+    }
+
+    // Free blocks are found by their chain from now on, so every one of
+    // them needs its link on disk, punched or not, and stays unpunched.
+    if (writeFreeChain() < 0) {
+        return ERR_WRITE;
+    }
+    memset(trimPending, 0, MAX_BLOCKS + 1);
+    trimCount = 0;
+
+    // Start from the identity map, then set aside three blocks for the
+    // map, the counts and the snapshot table. Numbers past the end of the
+    // disk start out retired, they give blocks shared by dedup a name.
+    blockMap = arenaAlloc(MAX_BLOCKS + 1);
+    blockRefs = arenaAlloc(MAX_BLOCKS + 1);
+    memset(blockMap, 0, MAX_BLOCKS + 1);
+    memset(blockRefs, 0, MAX_BLOCKS + 1);
+    for (i = 0; i < numBlocks; i++) {
+        blockMap[i] = i;
+        blockRefs[i] = 1;
+    }
+    numNames = MAX_BLOCKS;
+    blockMapBlock = takeSystemBlock();
+    blockRefsBlock = takeSystemBlock();
+    snapshotBlock = takeSystemBlock();
+
+    memset(buf.mem, 0, blockSize);
+    if (writeBlock(diskFD, snapshotBlock, buf.mem) < 0 || saveBlockMap() < 0) {
+        return ERR_WRITE;
+    }
+
+    // The superblock is the switch, so it goes last.
+    readBlock(diskFD, 0, super.mem);
+    super.mem[SUPER_BLOCK_MAP] = blockMapBlock;
+    super.mem[SUPER_BLOCK_REFS] = blockRefsBlock;
+    super.mem[SUPER_SNAPSHOTS] = snapshotBlock;
+    return writeBlock(diskFD, 0, super.mem);
+}
+
+int logNames(int blocks) {
+    // Names stop short enough that every one of them fits on the disk
+    // with LOG_RESERVE blocks still free, beside the superblock, the map,
+    // the counts and the snapshot table.
+    return blocks - 3 - LOG_RESERVE;
+}
+
+int loadLogState() {
+    int bNum;
+
+    // Only the map is checkpointed, the counts follow from it.
+    logState = arenaAlloc(MAX_BLOCKS + 1);
+    memset(logState, LOG_FREE, MAX_BLOCKS + 1);
+    memset(blockRefs, 0, MAX_BLOCKS + 1);
+    memset(blockMap + numNames, 0, MAX_BLOCKS + 1 - numNames);
+    logState[0] = logState[blockMapBlock] = logState[blockRefsBlock] = logState[snapshotBlock] = LOG_SYSTEM;
+    blockRefs[0] = blockRefs[blockMapBlock] = blockRefs[blockRefsBlock] = blockRefs[snapshotBlock] = 1;
+    for (bNum = 1; bNum < numNames; bNum++) {
+        if (blockMap[bNum]) {
+            logState[(unsigned char) blockMap[bNum]] = LOG_LIVE;
+            blockRefs[(unsigned char) blockMap[bNum]] = 1;
+        }
+    }
+
+    // The first append picks a segment.
+    logCleaning = -1;
+    logSegment = 0;
+    logHead = numBlocks;
+    return SUCCESS;
+}
+
+int segmentEnd(int seg) {
+    return (seg + 1) * LOG_SEGMENT < numBlocks ? (seg + 1) * LOG_SEGMENT : numBlocks;
+}
+
+int segmentFree(int seg) {
+    int phys, count = 0;
+
+    for (phys = seg * LOG_SEGMENT; phys < segmentEnd(seg); phys++) {
+        count += logState[phys] == LOG_FREE;
+    }
+    return count;
+}
+
+int appendLog() {
+    int segments = (numBlocks + LOG_SEGMENT - 1) / LOG_SEGMENT;
+    int seg, best, most, i, checkpointed = 0;
+
+    while (1) {
+        // Fill the rest of the current segment first.
+        for (; logHead < segmentEnd(logSegment); logHead++) {
+            if (logState[logHead] == LOG_FREE) {
+                return logHead++;
+            }
+        }
+
+        // Then move on to the emptiest segment, the next one on a tie.
+        // The one being cleaned is emptied, not filled.
+        for (i = 1, best = -1, most = 0; i <= segments; i++) {
+            seg = (logSegment + i) % segments;
+            if (seg != logCleaning && segmentFree(seg) > most) {
+                most = segmentFree(seg);
+                best = seg;
+            }
+        }
+        if (best >= 0) {
+            logSegment = best;
+            logHead = best * LOG_SEGMENT;
+        }
+        // Everything left is an old version this call replaced.
+        else if (!checkpointed++) {
+            checkpointLog();
+        }
+        else {
+            return ERR_INVALID_SPACE;
+        }
+    }
+}
+
+int logBlock(int bNum, int keep) {
+    int old = (unsigned char) blockMap[bNum];
+
+    // Nothing on disk points at a block written since the last
+    // checkpoint, so it can be written again where it is.
+    if (!bNum || (old && logState[old] == LOG_FRESH)) {
+        return old;
+    }
+    return moveLogBlock(bNum, keep);
+}
+
+int moveLogBlock(int bNum, int keep) {
+    tfs_block buf;
+    int old = (unsigned char) blockMap[bNum], fresh;
+
+    if ((fresh = appendLog()) < 0) {
+        return fresh;
+    }
+    if (keep && old && (readBlock(diskFD, old, buf.mem) < 0 || writeBlock(diskFD, fresh, buf.mem) < 0)) {
+        return ERR_WRITE;
+    }
+    blockMap[bNum] = fresh;
+    blockRefs[fresh] = 1;
+    logState[fresh] = LOG_FRESH;
+    if (old) {
+        retireLogBlock(old);
+    }
+    return fresh;
+}
+
+void retireLogBlock(int phys) {
+    // The map on disk may still point at a block it had at the last
+    // checkpoint, so that one waits for the next.
+    blockRefs[phys] = 0;
+    logState[phys] = logState[phys] == LOG_FRESH ? LOG_FREE : LOG_STALE;
+}
+
+int checkpointLog() {
+    tfs_block buf;
+    int phys;
+
+    if (!logMode || mountReadOnly) {
+        return SUCCESS;
+    }
+
+    // The blocks the new map points at have to reach the disk before it.
+    if (syncMode == TFS_SYNC_OP && !batchOpen && syncDisk(diskFD) < 0) {
+        return ERR_WRITE;
+    }
+    memset(buf.mem, 0, blockSize);
+    memcpy(buf.mem, blockMap, numNames);
+    if (writeBlock(diskFD, blockMapBlock, buf.mem) < 0) {
+        return ERR_WRITE;
+    }
+    for (phys = 1; phys < numBlocks; phys++) {
+        if (logState[phys] == LOG_STALE) {
+            logState[phys] = LOG_FREE;
+        }
+        else if (logState[phys] == LOG_FRESH) {
+            logState[phys] = LOG_LIVE;
+        }
+    }
+    return SUCCESS;
+}
+
+int cleanVictim() {
+    int segments = (numBlocks + LOG_SEGMENT - 1) / LOG_SEGMENT;
+    int usable[MAX_BLOCKS / LOG_SEGMENT + 1], live[MAX_BLOCKS / LOG_SEGMENT + 1];
+    int seg, phys, empty = 0, free = 0, victim = -1;
+
+    for (seg = 0; seg < segments; seg++) {
+        usable[seg] = live[seg] = 0;
+        for (phys = seg * LOG_SEGMENT; phys < segmentEnd(seg); phys++) {
+            usable[seg] += logState[phys] != LOG_SYSTEM;
+            live[seg] += logState[phys] == LOG_LIVE || logState[phys] == LOG_FRESH;
+        }
+        empty += segmentFree(seg) == usable[seg];
+        free += segmentFree(seg);
+    }
+    if (empty >= LOG_CLEAN_TARGET) {
+        return -1;
+    }
+
+    // The segment with the fewest live blocks, as long as it is mostly
+    // dead and they fit elsewhere.
+    for (seg = 0; seg < segments; seg++) {
+        if (seg != logSegment && live[seg] && live[seg] * 100 <= usable[seg] * LOG_CLEAN_LIVE &&
+            (victim < 0 || live[seg] < live[victim])) {
+            victim = seg;
+        }
+    }
+    if (victim >= 0 && free - segmentFree(victim) < live[victim]) {
+        return -1;
+    }
+    return victim;
+}
+
+int tfs_cleanLog(int budget) {
+    probeEnter("tfs_cleanLog", 0, budget);
+    return probeReturn("tfs_cleanLog", 0, cleanLog(budget));
+}
+
+int cleanLog(int budget) {
+    int seg, bNum, phys, ret;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+    // Views read the blocks where they are.
+    if (!logMode || pinnedViews) {
+        return 0;
+    }
+
+    while (budget > 0 && (seg = cleanVictim()) >= 0) {
+        logCleaning = seg;
+        for (bNum = 1; bNum < numNames && budget > 0; bNum++) {
+            phys = (unsigned char) blockMap[bNum];
+            if (phys && phys >= seg * LOG_SEGMENT && phys < segmentEnd(seg)) {
+                if ((ret = moveLogBlock(bNum, 1)) < 0) {
+                    logCleaning = -1;
+                    return ret;
+                }
+                budget--;
+            }
+        }
+        logCleaning = -1;
+        if ((ret = checkpointLog()) < 0) {
+            return ret;
+        }
+    }
+    return cleanVictim() >= 0;
+}
+
+int tfs_logStats(int *segments, int *emptySegments, int *liveBlocks) {
+    int seg, phys, usable;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (!logMode) {
+        return ERR_BAD_REQUEST;
+    }
+
+    *segments = *emptySegments = *liveBlocks = 0;
+    for (seg = 0; seg * LOG_SEGMENT < numBlocks; seg++) {
+        for (phys = seg * LOG_SEGMENT, usable = 0; phys < segmentEnd(seg); phys++) {
+            usable += logState[phys] != LOG_SYSTEM;
+            *liveBlocks += logState[phys] == LOG_LIVE || logState[phys] == LOG_FRESH;
+        }
+        *segments += usable > 0;
+        *emptySegments += usable > 0 && segmentFree(seg) == usable;
+    }
+    return SUCCESS;
+}
+
+int tfs_snapshot(char *name) {
+    probeEnter("tfs_snapshot", 0, 0);
+    return probeReturn("tfs_snapshot", 0, takeSnapshot(name));
+}
+
+int takeSnapshot(char *name) {
+    tfs_block table, map;
+    char *entry, *slot = NULL;
+    int i, phys, ret;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+    if (strlen(name) == 0 || strlen(name) > MAX_FILE_NAME_LENGTH) {
+        return ERR_FILE_NAME_LENGTH;
+    }
+    // The log reuses old versions as soon as the map moves on.
+    if (logMode) {
+        return ERR_BAD_REQUEST;
+    }
+    if (!blockMap && (ret = enterMappedMode()) < 0) {
+        return ret;
+    }
+
+    readBlock(diskFD, snapshotBlock, table.mem);
+    for (i = 0; i < MAX_SNAPSHOTS; i++) {
+        entry = table.mem + i * SNAPSHOT_ENTRY_SIZE;
+        if (!entry[SNAPSHOT_STATE]) {
+            slot = slot ? slot : entry;
+        }
+        else if (!strncmp(entry, name, MAX_FILE_NAME_LENGTH + 1)) {
+            return ERR_FILE_EXISTS;
+        }
+    }
+    if (!slot) {
+        return ERR_INVALID_SPACE;
+    }
+    if ((phys = takeSystemBlock()) < 0) {
+        return phys;
+    }
+
+    // The snapshot is the live map minus the free blocks, which the live
+    // side can keep writing without copying.
+    memset(map.mem, 0, blockSize);
+    memcpy(map.mem, blockMap, numNames);
+    map.mem[0] = 0;
+    for (i = 1; i < numNames; i++) {
+        if (freeState[i]) {
+            map.mem[i] = 0;
+        }
+        else if (map.mem[i]) {
+            blockRefs[(unsigned char) map.mem[i]]++;
+        }
+    }
+
+    memset(slot, 0, SNAPSHOT_ENTRY_SIZE);
+    strcpy(slot, name);
+    slot[SNAPSHOT_MAP] = phys;
+    slot[SNAPSHOT_STATE] = SNAPSHOT_ACTIVE;
+    if (writeBlock(diskFD, phys, map.mem) < 0 || saveBlockMap() < 0 ||
+        writeBlock(diskFD, snapshotBlock, table.mem) < 0) {
+        return ERR_WRITE;
+    }
+
+    return syncOp();
+}
+
+int tfs_deleteSnapshot(char *name) {
+    probeEnter("tfs_deleteSnapshot", 0, 0);
+    return probeReturn("tfs_deleteSnapshot", 0, dropSnapshot(name));
+}
+
+int dropSnapshot(char *name) {
+    tfs_block table;
+    char *entry;
+    int i;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+    if (!blockMap) {
+        return ERR_NO_SUCH_SNAPSHOT;
+    }
+
+    readBlock(diskFD, snapshotBlock, table.mem);
+    for (i = 0; i < MAX_SNAPSHOTS; i++) {
+        entry = table.mem + i * SNAPSHOT_ENTRY_SIZE;
+        if (entry[SNAPSHOT_STATE] == SNAPSHOT_ACTIVE && !strncmp(entry, name, MAX_FILE_NAME_LENGTH + 1)) {
+            // Reclaim walks its map later, this only has to mark it.
+            entry[SNAPSHOT_STATE] = SNAPSHOT_DELETING;
+            entry[SNAPSHOT_CURSOR] = 1;
+            reclaimPending++;
+            return writeBlock(diskFD, snapshotBlock, table.mem) < 0 || syncOp() < 0 ? ERR_WRITE : SUCCESS;
+        }
+    }
+
+    return ERR_NO_SUCH_SNAPSHOT;
+}
+
+int tfs_reclaim(int budget) {
+    probeEnter("tfs_reclaim", 0, budget);
+    return probeReturn("tfs_reclaim", 0, reclaimSnapshots(budget));
+}
+
+int reclaimSnapshots(int budget) {
+    tfs_block table, map;
+    char *entry;
+    int i, bNum, phys;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+    if (!reclaimPending) {
+        return 0;
+    }
+
+    readBlock(diskFD, snapshotBlock, table.mem);
+    for (i = 0; i < MAX_SNAPSHOTS && budget > 0; i++) {
+        entry = table.mem + i * SNAPSHOT_ENTRY_SIZE;
+        if (entry[SNAPSHOT_STATE] != SNAPSHOT_DELETING) {
+            continue;
+        }
+        readBlock(diskFD, (unsigned char) entry[SNAPSHOT_MAP], map.mem);
+
+        // Drop the snapshot's hold on each block, handing back the ones
+        // nothing else uses.
+        for (bNum = (unsigned char) entry[SNAPSHOT_CURSOR]; bNum < numNames && budget > 0; bNum++) {
+            if ((phys = (unsigned char) map.mem[bNum]) && --blockRefs[phys] == 0) {
+                giveBackBlock(phys);
+            }
+            budget--;
+        }
+        entry[SNAPSHOT_CURSOR] = bNum;
+
+        // Once it is done the map's own block goes too.
+        if (bNum == numNames) {
+            giveBackBlock((unsigned char) entry[SNAPSHOT_MAP]);
+            memset(entry, 0, SNAPSHOT_ENTRY_SIZE);
+            reclaimPending--;
+        }
+    }
+    saveBlockMap();
+    writeBlock(diskFD, snapshotBlock, table.mem);
+
+    return reclaimPending;
+}
+
+int tfs_listSnapshots() {
+    probeEnter("tfs_listSnapshots", 0, 0);
+    return probeReturn("tfs_listSnapshots", 0, listSnapshots());
+}
+
+int listSnapshots() {
+    tfs_block table;
+    char *entry;
+    int i;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (!blockMap) {
+        return SUCCESS;
+    }
+
+    readBlock(diskFD, snapshotBlock, table.mem);
+    for (i = 0; i < MAX_SNAPSHOTS; i++) {
+        entry = table.mem + i * SNAPSHOT_ENTRY_SIZE;
+        if (entry[SNAPSHOT_STATE] == SNAPSHOT_ACTIVE) {
+            printf("%s\n", entry);
+        }
+    }
+
+    return SUCCESS;
+}
 
-    //check the file permission
-    if(inode.mem[3] == 0)
-    {
-        return ERR_READ_ONLY;
+unsigned int contentHash(char *data, int len) {
+    unsigned int hash = 2166136261u;
+    int i;
+
+    // FNV-1a, the same as names
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
     }
-    
-    //check to see if we have enough space to write the data
-    if (freeBlocks  <  reqBlocks) {
-        fprintf(stderr, "Error: not enough space available, numBlocks %d, freeBlocks %d, reqBlocks %d\n",
-        numBlocks, freeBlocks, reqBlocks);
 
-        return ERR_INVALID_SPACE;
+    return hash;
+}
+
+void indexBlock(int phys, unsigned int hash) {
+    dedupIndex[hash % DEDUP_BUCKETS] = phys;
+    dedupHashes[hash % DEDUP_BUCKETS] = hash;
+}
+
+int shareBlock(int bNum, char *block, unsigned int hash) {
+    tfs_block buf;
+    int slot = hash % DEDUP_BUCKETS, match = dedupIndex[slot], old;
+
+    if (!blockMap || !match || dedupHashes[slot] != hash || blockRefs[match] >= DEDUP_MAX_REFS) {
+        return 0;
     }
 
-    //deallocate data blocks
-    if (resetFile(FD) < 0) {
-        fprintf(stderr, "could not reset file, FD is %d\n\n", FD);
+    // The hash only picks the candidate, the bytes have to match too.
+    if (readBlock(diskFD, match, buf.mem) < 0 || memcmp(buf.mem, block, blockSize)) {
+        return 0;
     }
-    
-    //get the super block to get the current number of free blocks
-    if(readBlock(diskFD, 0, &(super.mem)) < 0) {
-        perror("Error: reading super block failed\n");
-        return ERR_READ;
+
+    // Point the number at the match and drop the block it had. If that
+    // leaves the old block unused, the caller frees it with
+    // reuseSpareBlocks once it is done with the free chain.
+    if ((old = blockMap[bNum]) != match) {
+        blockMap[bNum] = match;
+        blockRefs[match]++;
+        blockRefs[old]--;
+        saveBlockMap();
     }
-    //update the inode block
-    inode.mem[14] = reqBlocks;
 
-    // Get the time.
-    time(&curTime);
+    return match;
+}
 
-    // Write last modified date.
-    memcpy(&(inode.mem[18 + sizeof(time_t)]), &curTime, sizeof(time_t));
+int tfs_setDedup(int enabled) {
+    probeEnter("tfs_setDedup", 0, enabled);
+    return probeReturn("tfs_setDedup", 0, setDedup(enabled));
+}
 
-    // Write last accessed date.
-    memcpy(&inode.mem[18 + (2 * sizeof(time_t))], &curTime, sizeof(time_t));
+int setDedup(int enabled) {
+    int ret;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+    if (enabled && logMode) {
+        return ERR_BAD_REQUEST;
+    }
+    if (enabled && !blockMap && (ret = enterMappedMode()) < 0) {
+        return ret;
+    }
+    dedupInline = enabled;
+
+    return SUCCESS;
+}
 
-    //at this point we have the inode and the super block
-    inode.mem[2] = super.mem[2];
-    writeBlock(diskFD, FD, inode.mem);
+int tfs_dedup() {
+    probeEnter("tfs_dedup", 0, 0);
+    return probeReturn("tfs_dedup", 0, dedupImage());
+}
 
-    //read in inode
-    readBlock(diskFD, super.mem[2], &(temp.mem));
-    //get the position of the first file extent
-    position = super.mem[2];
-    //initialize the file extent
-    initExtent(&temp, temp.mem[2]);
-
-    //check the offset to see if it's greater than 252 bytes
-    offset = (size - index >= 252) ? (252) : (size - index);
-    //copy the buffer into a temp/file extent block
-    memcpy(temp.mem + 4, buffer + index, offset);
-    //increment the current file pointer
-    index += offset;
-    //updae the file extent
-    writeBlock(diskFD, inode.mem[2], temp.mem);
-    freeBlocks--;
+int dedupImage() {
+    int ret, before;
 
-    //repeat the process for the next file extent blocks
-    for (i = 1; i < reqBlocks; i++) {
-        position = temp.mem[2];
-        readBlock(diskFD, temp.mem[2], &(temp.mem));
-        initExtent(&temp, temp.mem[2]);
-        offset = (size - index >= 252) ? (252) : (size - index);
-        memcpy(temp.mem + 4, buffer + index, offset);
-        index += offset;
-        writeBlock(diskFD, position, temp.mem);
-        freeBlocks--;
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+    if (logMode) {
+        return ERR_BAD_REQUEST;
+    }
+    if (!blockMap && (ret = enterMappedMode()) < 0) {
+        return ret;
     }
-    super.mem[2] = temp.mem[2];
-    temp.mem[2] = '\0';
-    //update super block
-    writeBlock(diskFD, 0, super.mem);
-    writeBlock(diskFD, position, temp.mem);
-    openFilesLocation[FD] = 0;
 
-    return SUCCESS;
+    // Index every extent, sharing each one with the first copy seen.
+    before = freeBlocks;
+    if ((ret = scanImage(SCAN_TYPE(3), dedupBlock, NULL)) < 0) {
+        return ret;
+    }
+    reuseSpareBlocks();
+    if ((ret = syncOp()) < 0) {
+        return ret;
+    }
+
+    return freeBlocks - before;
 }
 
-void initExtent(tfs_block *block, unsigned char next) {
-    int i;
-    block->mem[0] = 3;
-    block->mem[1] = MAGIC_NUM;
-    block->mem[2] = next;
-    
-    for (i = 3; i < BLOCKSIZE; i++) {
-        block->mem[i] = 0x00;
+int dedupBlock(int bNum, char *block, void *arg) {
+    unsigned int hash = contentHash(block, blockSize);
+
+    if (!shareBlock(bNum, block, hash)) {
+        indexBlock(blockMap[bNum], hash);
     }
+    return SUCCESS;
 }
 
-int tfs_deleteFile(fileDescriptor FD) {
-    unsigned char position;
-    tfs_block buf, lastFree;
-    //ensure that disk is mounted
-    if (mountedDisk == NULL) {
+int tfs_dedupSavings() {
+    unsigned char seen[MAX_BLOCKS + 1];
+    int i, saved = 0;
+
+    if (!mountedDisk) {
         return ERR_TFS_NOT_MOUNTED;
     }
-
-    //read in inode
-    readBlock(diskFD, FD, &(buf.mem));
-    if (buf.mem[0] != 2) {
-        fprintf(stderr, "block is not inode, type: %d, FD %d\n\n", buf.mem[0], FD);
-        return ERR_INVALID_INODE;
+    if (!blockMap) {
+        return 0;
     }
 
-    //check file permission
-    if(buf.mem[3] == 0)
-    {
-        fprintf(stdout, "tfs_deleteFile: File is read-only\n");
-        return ERR_READ_ONLY;
+    // Every live number past the first on a block is a block saved.
+    memset(seen, 0, sizeof(seen));
+    for (i = 1; i < numNames; i++) {
+        if (blockMap[i] && seen[blockMap[i]]++) {
+            saved++;
+        }
     }
 
-    //get last free block
-    readBlock(diskFD, 0, &(lastFree.mem));
-    
-    while (lastFree.mem[2] != '\0') {
-		position = lastFree.mem[2];
-        readBlock(diskFD, lastFree.mem[2], &(lastFree.mem));
+    return saved;
+}
+
+int reusableBlocks(int head) {
+    tfs_block buf;
+    int count = 0;
+
+    while (head) {
+        count += !isShared(head);
+        readFsBlock(head, &(buf.mem));
+        head = (unsigned char) buf.mem[2];
     }
 
-    //add inode to free chain of blocks
-    lastFree.mem[2] = (unsigned char) FD;
-	writeBlock(diskFD, position, lastFree.mem);
+    return count;
+}
+
+int readCachedBlock(int bNum, tfs_block *buf) {
+    tfs_cachedBlock *slot = &dirCache[bNum % DIR_CACHE_SIZE];
+    int ret;
 
-    //add all blocks to free chain except for last one
-    while (buf.mem[2] != '\0') {
-		freeBlocks++;
-        initFreeblock(&buf, buf.mem[2]);
-        writeBlock(diskFD, lastFree.mem[2], buf.mem);
-        lastFree = buf;
-        readBlock(diskFD, buf.mem[2], &(buf.mem));
+    if (slot->bNum == bNum) {
+        TFS_PROBE1(dircache__hit, bNum);
+    }
+    else {
+        TFS_PROBE1(dircache__miss, bNum);
+        if ((ret = readFsBlock(bNum, &(slot->block.mem))) < 0) {
+            slot->bNum = 0;
+            return ret;
+        }
+        slot->bNum = bNum;
     }
+    memcpy(buf->mem, slot->block.mem, blockSize);
 
-    //add last one to chain
-	freeBlocks++;
-    initFreeblock(&buf, '\0');
-    writeBlock(diskFD, lastFree.mem[2], buf.mem);
+    return SUCCESS;
+}
 
-    openFilesLocation[FD] = 0;
-    openFilesTable[FD] = '\0';
+int writeCachedBlock(int bNum, tfs_block *buf) {
+    tfs_cachedBlock *slot = &dirCache[bNum % DIR_CACHE_SIZE];
 
-	return SUCCESS;
+    // Write through so the image is never behind the cache.
+    memcpy(slot->block.mem, buf->mem, blockSize);
+    slot->bNum = bNum;
+
+    return writeFsBlock(bNum, buf->mem);
 }
 
-int tfs_readByte(fileDescriptor FD, char *buffer) {
-    int ret, idx;
-    tfs_block inode, fileEx;
-    time_t curTime;
+unsigned int dirHash(char *name) {
+    unsigned int hash = 2166136261u;
 
-    //check if file is mounted and that file exists
-    if((ret = checkMountAndFile(FD)) < 0) {
-        return ret;
+    // FNV-1a
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
     }
-   
-    //get the current location of the file pouinter
-    idx = openFilesLocation[FD];
 
-    //read from inode to get the first ref to file extent
-    if (readBlock(diskFD, FD, &(inode.mem)) < 0) {
-        fprintf(stderr, "inode\n");
+    return hash;
+}
+
+int dirLookup(int dir, char *name, int *type) {
+    tfs_block dirInode, entries;
+    int next, i;
+    char *entry;
+
+    if (readCachedBlock(dir, &dirInode) < 0) {
         return ERR_READ;
     }
-    
-    //get the location of the file extent
 
-    //if (readBlock(diskFD, FD, &(fileEx.mem)) < 0)
-    if (readBlock(diskFD, inode.mem[2], &(fileEx.mem)) < 0) {
-        fprintf(stderr, "file extent\n");
-        return ERR_READ;
+    // Only the chain for this name's bucket needs reading.
+    next = (unsigned char) dirInode.mem[DIR_BUCKET_START + dirHash(name) % DIR_BUCKETS];
+    while (next) {
+        if (readCachedBlock(next, &entries) < 0) {
+            return ERR_READ;
+        }
+        for (i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            entry = DIRENT(&entries, i);
+            if (entry[0] != '\0' && !strncmp(entry + 2, name, MAX_FILE_NAME_LENGTH + 1)) {
+                if (type) {
+                    *type = entry[1];
+                }
+                return (unsigned char) entry[0];
+            }
+        }
+        next = (unsigned char) entries.mem[2];
     }
 
-    // Get the time.
-    time(&curTime);
+    return 0;
+}
 
-    // Write last accessed date.
-    memcpy(&(inode.mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
+int dirInsert(int dir, char *name, int inode, int type) {
+    tfs_block dirInode, entries;
+    int bucket, next, i, bNum;
+    char *entry;
+
+    readCachedBlock(dir, &dirInode);
+    bucket = DIR_BUCKET_START + dirHash(name) % DIR_BUCKETS;
+
+    // Reuse a hole in the bucket chain if there is one.
+    next = (unsigned char) dirInode.mem[bucket];
+    while (next) {
+        readCachedBlock(next, &entries);
+        for (i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            entry = DIRENT(&entries, i);
+            if (entry[0] == '\0') {
+                entry[0] = inode;
+                entry[1] = type;
+                strncpy(entry + 2, name, MAX_FILE_NAME_LENGTH + 1);
+                entries.mem[3]++;
+                return writeCachedBlock(next, &entries);
+            }
+        }
+        next = (unsigned char) entries.mem[2];
+    }
 
-    // Write the date back to the inode.
-    writeBlock(diskFD, FD, inode.mem);
+    // Bucket is full, chain a new entry block onto its head.
+    if ((bNum = allocBlockNear(dir)) < 0) {
+        return bNum;
+    }
+    initDirEntryblock(&entries, dirInode.mem[bucket]);
+    entry = DIRENT(&entries, 0);
+    entry[0] = inode;
+    entry[1] = type;
+    strncpy(entry + 2, name, MAX_FILE_NAME_LENGTH + 1);
+    entries.mem[3] = 1;
+    writeCachedBlock(bNum, &entries);
+
+    dirInode.mem[bucket] = bNum;
+    return writeCachedBlock(dir, &dirInode);
+}
 
-    while ((idx >= 252) && (fileEx.mem[2] != '\0')) {
-        ret = fileEx.mem[2];
+int dirRemove(int dir, char *name) {
+    tfs_block dirInode, entries, prevEntries;
+    int bucket, prev = 0, next, i;
+    char *entry;
+
+    readCachedBlock(dir, &dirInode);
+    bucket = DIR_BUCKET_START + dirHash(name) % DIR_BUCKETS;
+
+    next = (unsigned char) dirInode.mem[bucket];
+    while (next) {
+        readCachedBlock(next, &entries);
+        for (i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            entry = DIRENT(&entries, i);
+            if (entry[0] == '\0' || strncmp(entry + 2, name, MAX_FILE_NAME_LENGTH + 1)) {
+                continue;
+            }
+            memset(entry, 0, DIRENT_SIZE);
 
-        if (readBlock(diskFD, ret, &(fileEx.mem)) < 0) {
-            perror("failed to read file extent");
-            return ERR_READ;
+            // Byte 3 counts up to 255, so it has to be treated as unsigned.
+            entries.mem[3] = (unsigned char) entries.mem[3] - 1;
+            if (entries.mem[3] != '\0') {
+                return writeCachedBlock(next, &entries);
+            }
+
+            // Last entry gone, unlink the block from the chain and free it.
+            if (prev) {
+                prevEntries.mem[2] = entries.mem[2];
+                writeCachedBlock(prev, &prevEntries);
+            }
+            else {
+                dirInode.mem[bucket] = entries.mem[2];
+                writeCachedBlock(dir, &dirInode);
+            }
+            releaseBlock(next);
+            return SUCCESS;
         }
+        prev = next;
+        prevEntries = entries;
+        next = (unsigned char) entries.mem[2];
+    }
+
+    return ERR_INVALID_INODE;
+}
+
+int resolvePath(char *path, char *leaf) {
+    char component[MAX_FILE_NAME_LENGTH + 1];
+    char *slash;
+    int dir = rootDir, len, type;
 
-        idx -= 252;
+    while (*path == '/') {
+        path++;
     }
-   
-    //check if EOF
-    if (idx >= 252) {
-        return ERR_INVALID_TFS;
+
+    for (;;) {
+        slash = strchr(path, '/');
+        len = slash ? slash - path : strlen(path);
+
+        // Make sure we have a valid name length.
+        if (len == 0 || len > MAX_FILE_NAME_LENGTH) {
+            fprintf(stderr, "resolvePath: invalid name length in %s\n", path);
+            return ERR_FILE_NAME_LENGTH;
+        }
+        memcpy(component, path, len);
+        component[len] = '\0';
+
+        // Last component, hand back the directory that should hold it.
+        if (!slash || slash[strspn(slash, "/")] == '\0') {
+            strcpy(leaf, component);
+            return dir;
+        }
+
+        if ((dir = dirLookup(dir, component, &type)) <= 0 || type != DIRECTORY_TYPE) {
+            fprintf(stderr, "resolvePath: no directory %s\n", component);
+            return ERR_NO_SUCH_DIR;
+        }
+        path = slash + strspn(slash, "/");
     }
+}
 
-    //get the reference to the first inode
-    memcpy(buffer, fileEx.mem + 4 + idx, sizeof(char));
+int resolveDir(char *path) {
+    char leaf[MAX_FILE_NAME_LENGTH + 1];
+    int parent, dir, type;
 
-    if (buffer[0] == '\0') {
-        return ERR_READ;
+    // The root has no name of its own.
+    if (path[strspn(path, "/")] == '\0') {
+        return rootDir;
+    }
+    if ((parent = resolvePath(path, leaf)) < 0) {
+        return parent;
+    }
+    if ((dir = dirLookup(parent, leaf, &type)) <= 0 || type != DIRECTORY_TYPE) {
+        return ERR_NO_SUCH_DIR;
     }
 
-    //update inode
-    openFilesLocation[FD]++;
+    return dir;
+}
 
-	return SUCCESS;
+time_t tfs_readFileInfo(fileDescriptor FD) {
+	probeEnter("tfs_readFileInfo", FD, 0);
+	return probeReturnTime("tfs_readFileInfo", FD, readFileTime(FD, TIME_CREATED));
 }
 
-int tfs_seek(fileDescriptor FD, int offset) {
-    // Check if FD is in list of open files.
-	if (openFilesTable[FD] == '\0') {
-	    perror("seek: FD is not in list of open files");
-		return ERR_SEEK;
-	}
+time_t tfs_readFileLastModified(fileDescriptor FD) {
+	probeEnter("tfs_readFileLastModified", FD, 0);
+	return probeReturnTime("tfs_readFileLastModified", FD, readFileTime(FD, TIME_MODIFIED));
+}
 
-	// Make sure the disk is mounted.
-	if (!mountedDisk) {
-		perror("seek: disk is not mounted");
-		return ERR_SEEK;
-	}
+time_t tfs_readFileLastAccessed(fileDescriptor FD) {
+	probeEnter("tfs_readFileLastAccessed", FD, 0);
+	return probeReturnTime("tfs_readFileLastAccessed", FD, readFileTime(FD, TIME_ACCESSED));
+}
 
-	// Check that we have a valid offset.
-	if (offset < 0) {
-		perror("seek: offset is invalid");
-		return ERR_SEEK;
+time_t probeReturnTime(char *call, fileDescriptor FD, time_t result) {
+	// A time doesn't fit the probe's int, so the return probe gets
+	// SUCCESS for one and the error code otherwise.
+	(void) probeReturn(call, FD, result < 0 ? (int) result : SUCCESS);
+	return result;
+}
+
+time_t readFileTime(fileDescriptor FD, int which) {
+	tfs_openEntry *file;
+
+	//check if file is open
+	if ((file = getOpenFile(FD)) == NULL) {
+		perror("readFileInfo: file closed");
+		return ERR_FILE_CLOSED;
 	}
 
-	// If neither of these fails, set the FD to the offset.
-	openFilesLocation[FD] = offset;
+	// The inode table keeps the times, no need to read the inode.
+	return which == TIME_CREATED ? inodeTable[file->inode].created
+	     : which == TIME_MODIFIED ? inodeTable[file->inode].modified
+	                             : inodeTable[file->inode].accessed;
+}
+
+//read only 0
+//read-write 1
+
+void tfs_makeRO(char *name) {
+    long long start = traceClock();
+
+    probeEnter("tfs_makeRO", 0, 0);
+    makeRO(name);
+    probeReturn("tfs_makeRO", 0, traceCall(TRACE_OP_MAKERO, 0, 0, name, start, SUCCESS));
+}
+
+void makeRO(char *name) {
+    int idx, parent, type;
+    tfs_block inode;
+    char leaf[MAX_FILE_NAME_LENGTH + 1];
+
+    //find the inode through its directory
+    if ((parent = resolvePath(name, leaf)) < 0 ||
+        (idx = dirLookup(parent, leaf, &type)) <= 0 || type != 2) {
+        fprintf(stderr, "tfs_makeRO: file %s not found\n", name);
+        return;
+    }
+    if (mountReadOnly) {
+        fprintf(stderr, "tfs_makeRO: snapshot is read-only\n");
+        return;
+    }
+
+    readFsBlock(idx, &(inode.mem));
+    inode.mem[3] = 0;
+    writeFsBlock(idx, inode.mem);
+    syncOp();
+    fprintf(stdout, "file %s is now read-only\n", name);
+}
+
+void tfs_makeRW(char *name) {
+    long long start = traceClock();
+
+    probeEnter("tfs_makeRW", 0, 0);
+    makeRW(name);
+    probeReturn("tfs_makeRW", 0, traceCall(TRACE_OP_MAKERW, 0, 0, name, start, SUCCESS));
+}
+
+void makeRW(char *name) {
+    int idx, parent, type;
+    tfs_block inode;
+    char leaf[MAX_FILE_NAME_LENGTH + 1];
+
+    //find the inode through its directory
+    if ((parent = resolvePath(name, leaf)) < 0 ||
+        (idx = dirLookup(parent, leaf, &type)) <= 0 || type != 2) {
+        fprintf(stderr, "tfs_makeRW: file %s not found\n", name);
+        return;
+    }
+    if (mountReadOnly) {
+        fprintf(stderr, "tfs_makeRW: snapshot is read-only\n");
+        return;
+    }
+
+    readFsBlock(idx, &(inode.mem));
+    inode.mem[3] = 1;
+    writeFsBlock(idx, inode.mem);
+    syncOp();
+}
+
+int writeByte(fileDescriptor FD, unsigned int data) {
+    char byte = (unsigned char) data;
+    int ret;
+
+    //check if file is mounted and that file exists
+    if((ret = checkMountAndFile(FD)) < 0) {
+        return ret;
+    }
+
+    //write at the file pointer without moving it
+    if ((ret = writeFileRange(getOpenFile(FD), getOpenFile(FD)->location, &byte, 1)) < 0) {
+        return ret;
+    }
 
 	return SUCCESS;
 }
 
-int tfs_rename(fileDescriptor FD, char* newName) {
-	tfs_block buf;
+int tfs_writeBytes(fileDescriptor FD, char *buffer, int size) {
+    long long start = traceClock();
+
+    probeEnter("tfs_writeBytes", FD, size);
+    return probeReturn("tfs_writeBytes", FD, traceCall(TRACE_OP_WRITEBYTES, FD, size, NULL, start, writeBytes(FD, buffer, size)));
+}
+
+int writeBytes(fileDescriptor FD, char *buffer, int size) {
+    tfs_openEntry *file;
+    int ret;
+
+    //check if file is mounted and that file exists
+    if((ret = checkMountAndFile(FD)) < 0) {
+        return ret;
+    }
+    file = getOpenFile(FD);
+
+    if ((ret = writeFileRange(file, file->location, buffer, size)) > 0) {
+        file->location += ret;
+    }
+    return ret;
+}
+
+int writeFileRange(tfs_openEntry *file, int offset, char *buffer, int size) {
+    tfs_block inode, prev, cur;
+    int prevNum = 0, curNum, index, idx, chunk, count = 0, ret;
     time_t curTime;
-	
-    //check for file name length
-	if (strlen(newName) > 8 || strlen(newName) == 0) {
-		perror("rename: invalid name");
-		return ERR_FILE_NAME_LENGTH;
-	}
-	
-    //check if file is open
-	if (openFilesTable[FD] == '\0') {
-		perror("rename: file closed");
-		return ERR_FILE_CLOSED;
-	}
 
-	//read in inode of file to rename
-	readBlock(diskFD, FD, &(buf.mem));
-	//copy in new name
-	strncpy(&(buf.mem[5]), newName, 9);
+    if (readFsBlock(file->inode, &(inode.mem)) < 0) {
+        return ERR_READ;
+    }
+
+    //check the file permission, snapshots can't be written either
+    if (inode.mem[3] == 0 || mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
+
+    //mapped views must not change under their readers
+    if (blockPins[file->inode]) {
+        return ERR_FILE_BUSY;
+    }
+    if (offset < 0 || size < 0) {
+        return ERR_SEEK;
+    }
+    if (offset + size > MAX_BLOCKS * EXTENT_PAYLOAD) {
+        return ERR_INVALID_SPACE;
+    }
+    if ((ret = sizeFile(file->inode, &inode)) < 0) {
+        return ret;
+    }
+
+    curNum = (unsigned char) inode.mem[2];
+    if (curNum && readFsBlock(curNum, &(cur.mem)) < 0) {
+        return ERR_READ;
+    }
+    for (index = offset / EXTENT_PAYLOAD; count < size; index++) {
+        //move along the chain to the first extent at or past this one
+        while (curNum && (unsigned char) cur.mem[EXTENT_INDEX] < index) {
+            prev = cur;
+            prevNum = curNum;
+            curNum = (unsigned char) cur.mem[2];
+            if (curNum && readFsBlock(curNum, &(cur.mem)) < 0) {
+                return ERR_READ;
+            }
+        }
+
+        //a hole, only now does it get a block, linked in after the last one
+        if (!curNum || (unsigned char) cur.mem[EXTENT_INDEX] > index) {
+            if ((ret = allocBlockNear(prevNum ? prevNum : file->inode)) < 0) {
+                break;
+            }
+            initExtent(&cur, curNum);
+            cur.mem[EXTENT_INDEX] = index;
+            curNum = ret;
+            if (prevNum) {
+                prev.mem[2] = curNum;
+                writeFsBlock(prevNum, prev.mem);
+            }
+            else {
+                inode.mem[2] = curNum;
+            }
+            inode.mem[14]++;
+        }
+
+        idx = (offset + count) % EXTENT_PAYLOAD;
+        chunk = EXTENT_PAYLOAD - idx < size - count ? EXTENT_PAYLOAD - idx : size - count;
+        memcpy(cur.mem + 4 + idx, buffer + count, chunk);
+        writeFsBlock(curNum, cur.mem);
+        count += chunk;
+    }
+    if (count == 0 && size > 0) {
+        return ERR_INVALID_SPACE;
+    }
 
-    // Get the current time.
-    time(&curTime);
+    if (offset + count > fileSize(&inode)) {
+        setFileSize(&inode, offset + count);
+    }
 
     // Write last modified date.
-    memcpy(&(buf.mem[18 + sizeof(time_t)]), &curTime, sizeof(time_t));
-
-    // Write last accessed date.
-    memcpy(&(buf.mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
+    time(&curTime);
+    memcpy(&(inode.mem[18 + sizeof(time_t)]), &curTime, sizeof(time_t));
+    writeFsBlock(file->inode, inode.mem);
 
-	strncpy(openFilesTable[FD], newName, 9);
-	//write block back with modifications
-	writeBlock(diskFD, FD, buf.mem);
+    //extents dedup shared leave their old blocks spare
+    if (dedupInline) {
+        reuseSpareBlocks();
+    }
 
-    return SUCCESS;
+    return syncOp() < 0 ? ERR_WRITE : count;
 }
 
-void tfs_readdir() {
-	int i;
-	tfs_block buf;
+int tfs_truncate(fileDescriptor FD, int size) {
+    long long start = traceClock();
 
-	for (i = 1; i < freeBlocks; i++) {
-		readBlock(diskFD, i, &(buf.mem));
-		//if it's a inode, print the name and size
-		if (buf.mem[0] == 2) {
-			printf("%s : %d blocks\n", &(buf.mem[5]), buf.mem[14]);
-		}
-	}
+    probeEnter("tfs_truncate", FD, size);
+    return probeReturn("tfs_truncate", FD, traceCall(TRACE_OP_TRUNCATE, FD, size, NULL, start, truncateFile(FD, size)));
 }
 
-time_t tfs_readFileInfo(fileDescriptor FD) {
-    time_t creationTime;
-	tfs_block buf;
+int tfs_fallocate(fileDescriptor FD, int size) {
+    long long start = traceClock();
 
-	//check if file is open
-	if (openFilesTable[FD] == '\0') {
-		perror("readFileInfo: file closed");
-		return ERR_FILE_CLOSED;
-	}
+    probeEnter("tfs_fallocate", FD, size);
+    return probeReturn("tfs_fallocate", FD, traceCall(TRACE_OP_FALLOCATE, FD, size, NULL, start, allocateFile(FD, size)));
+}
 
-	//read in inode of file to access time.
-	readBlock(diskFD, FD, &(buf.mem));
+/* Reads the inode of a file about to change size, and checks that it
+can and that ‘size’ fits. Older files get their size in bytes first. */
+int checkFileChange(tfs_openEntry *file, tfs_block *inode, int size) {
+    if (readFsBlock(file->inode, &(inode->mem)) < 0) {
+        return ERR_READ;
+    }
 
-	// Grab the creation time.
-	memcpy(&creationTime, &buf.mem[18], sizeof(time_t));
+    //check the file permission, snapshots can't be written either
+    if (inode->mem[3] == 0 || mountReadOnly) {
+        return ERR_READ_ONLY;
+    }
 
-	return creationTime;
+    //mapped views must not change under their readers
+    if (blockPins[file->inode]) {
+        return ERR_FILE_BUSY;
+    }
+    if (size < 0) {
+        return ERR_SEEK;
+    }
+    if (size > MAX_BLOCKS * EXTENT_PAYLOAD) {
+        return ERR_INVALID_SPACE;
+    }
+    return sizeFile(file->inode, inode);
 }
 
-time_t tfs_readFileLastModified(fileDescriptor FD) {
-    time_t lastModifiedTime;
-	tfs_block buf;
-
-	//check if file is open
-	if (openFilesTable[FD] == '\0') {
-		perror("readFileLastModified: file closed");
-		return ERR_FILE_CLOSED;
-	}
+int truncateFile(fileDescriptor FD, int size) {
+    tfs_block inode, prev, cur;
+    tfs_openEntry *file;
+    int ret, prevNum = 0, curNum, keep = getNumBlocks(size), kept = 0, idx, changed = 0;
+    time_t curTime;
 
-	//read in inode of file to access time.
-	readBlock(diskFD, FD, &(buf.mem));
+    if ((ret = checkMountAndFile(FD)) < 0) {
+        return ret;
+    }
+    file = getOpenFile(FD);
+    if ((ret = checkFileChange(file, &inode, size)) < 0) {
+        return ret;
+    }
 
-	// Grab the last modified time.
-	memcpy(&lastModifiedTime, &buf.mem[26], sizeof(time_t));
+    //find the first extent wholly past the new end, the chain is in
+    //file order
+    for (curNum = (unsigned char) inode.mem[2]; curNum; curNum = (unsigned char) cur.mem[2], kept++) {
+        if (readFsBlock(curNum, &(cur.mem)) < 0) {
+            return ERR_READ;
+        }
+        if ((unsigned char) cur.mem[EXTENT_INDEX] >= keep) {
+            break;
+        }
+        prev = cur;
+        prevNum = curNum;
+    }
 
-	return lastModifiedTime;
-}
-time_t tfs_readFileLastAccessed(fileDescriptor FD) {
-    time_t lastAccessedTime;
-	tfs_block buf;
+    //whatever the last extent kept holds past the end has to read as
+    //zeros if the file grows again
+    if (prevNum && (unsigned char) prev.mem[EXTENT_INDEX] == keep - 1 && size < fileSize(&inode)) {
+        idx = size - (keep - 1) * EXTENT_PAYLOAD;
+        memset(prev.mem + 4 + idx, 0, EXTENT_PAYLOAD - idx);
+        changed = 1;
+    }
 
-	//check if file is open
-	if (openFilesTable[FD] == '\0') {
-		perror("readFileLastAccessed: file closed");
-		return ERR_FILE_CLOSED;
-	}
+    //cut the chain off there
+    if (curNum && prevNum) {
+        prev.mem[2] = 0;
+        changed = 1;
+    }
+    else if (curNum) {
+        inode.mem[2] = 0;
+    }
+    if (changed && writeFsBlock(prevNum, prev.mem) < 0) {
+        return ERR_WRITE;
+    }
 
-	//read in inode of file to access time.
-	readBlock(diskFD, FD, &(buf.mem));
+    //the new size, extent count and modified date go out in one write
+    inode.mem[14] = kept;
+    setFileSize(&inode, size);
+    time(&curTime);
+    memcpy(&(inode.mem[18 + sizeof(time_t)]), &curTime, sizeof(time_t));
+    if (writeFsBlock(file->inode, inode.mem) < 0) {
+        return ERR_WRITE;
+    }
 
-	// Grab the last accessed time.
-	memcpy(&lastAccessedTime, &buf.mem[34], sizeof(time_t));
+    //only now that nothing points at them do the tail extents go
+    freeChain(curNum);
 
-	return lastAccessedTime;
+    return syncOp() < 0 ? ERR_WRITE : SUCCESS;
 }
 
-//read only 0
-//read-write 1
+int allocateFile(fileDescriptor FD, int size) {
+    tfs_block inode, ext;
+    tfs_openEntry *file;
+    unsigned char have[MAX_BLOCKS + 1], haveIndex[MAX_BLOCKS + 1], haveNext[MAX_BLOCKS + 1];
+    unsigned char chain[MAX_BLOCKS + 1], chainIndex[MAX_BLOCKS + 1], fresh[MAX_BLOCKS + 1], blocks[MAX_BLOCKS];
+    int ret, want = getNumBlocks(size), count = 0, missing, policy, i, j, k, n = 0, next;
+    time_t curTime;
 
-void tfs_makeRO(char *name) {
-    int idx, extentIdx = -1;
-    tfs_block inode;
+    if ((ret = checkMountAndFile(FD)) < 0) {
+        return ret;
+    }
+    file = getOpenFile(FD);
+    if ((ret = checkFileChange(file, &inode, size)) < 0) {
+        return ret;
+    }
 
-    for(idx = 1; idx <= numBlocks -freeBlocks; idx++) {
-        //read the inode
-        readBlock(diskFD, idx, &(inode.mem));
+    //note every extent the file has, and how many it lacks below ‘size’
+    missing = want;
+    for (i = (unsigned char) inode.mem[2]; i && count < MAX_BLOCKS; i = haveNext[count++]) {
+        if (readFsBlock(i, &(ext.mem)) < 0) {
+            return ERR_READ;
+        }
+        have[count] = i;
+        haveIndex[count] = ext.mem[EXTENT_INDEX];
+        haveNext[count] = ext.mem[2];
+        missing -= haveIndex[count] < want;
+    }
 
-        if (inode.mem[0] == 2)
-        {
-            //check to see if the file is in the disk
-            if (!strcmp(inode.mem + 5, name)) {
-                extentIdx = inode.mem[2];
-                inode.mem[3] = 0;
+    if (missing > 0) {
+        if (missing > freeBlocks) {
+            return ERR_INVALID_SPACE;
+        }
 
-                writeBlock(diskFD, idx, inode.mem);
-                fprintf(stdout, "file %s is now read-only\n", name);
-                break;
-            }
+        //one run after the file's last extent, whatever the policy
+        policy = allocPolicy;
+        if (allocPolicy == ALLOC_HEAD) {
+            allocPolicy = ALLOC_NEAR;
+        }
+        ret = allocRun(missing, count ? have[count - 1] : file->inode, blocks);
+        allocPolicy = policy;
+        if (ret < 0) {
+            return ret;
         }
-    }
-    if (extentIdx < 0)
-        fprintf(stderr, "tfs_makeRO: file %s not found\n", name);
-}
 
-void tfs_makeRW(char *name) {
-    int idx, extentIdx = -1;
-    tfs_block inode;
+        //merge the new extents in among the old ones in file order
+        for (i = 0, j = 0, k = 0; j < count || i < want; i++) {
+            if (j < count && haveIndex[j] == i) {
+                chain[n] = have[j++];
+                fresh[n] = 0;
+            }
+            else if (i < want) {
+                chain[n] = blocks[k++];
+                fresh[n] = 1;
+            }
+            else {
+                continue;
+            }
+            chainIndex[n++] = i;
+        }
 
-    for(idx = 1; idx <= numBlocks - freeBlocks; idx++) {
-        //read the inode
-        readBlock(diskFD, idx, &(inode.mem));
-            
-        //check to see if the file is in the disk
-        if (inode.mem[0] == 2)
-        {
-            if (!strcmp(inode.mem + 5, name)) {
-                extentIdx = inode.mem[2];
-                inode.mem[3] = 1;
-
-                writeBlock(diskFD, idx, inode.mem);
-                break;
+        //new extents are written before anything links to them
+        for (i = 0, j = 0; i < n; i++) {
+            next = i + 1 < n ? chain[i + 1] : 0;
+            if (fresh[i]) {
+                initExtent(&ext, next);
+                ext.mem[EXTENT_INDEX] = chainIndex[i];
+                writeFsBlock(chain[i], ext.mem);
+            }
+            else if (haveNext[j++] != next) {
+                readFsBlock(chain[i], &(ext.mem));
+                ext.mem[2] = next;
+                writeFsBlock(chain[i], ext.mem);
             }
         }
+        inode.mem[2] = chain[0];
+        inode.mem[14] += missing;
     }
-    if (extentIdx < 0)
-        fprintf(stderr, "tfs_makeRW: file %s not found\n", name);
-}
 
-int writeByte(fileDescriptor FD, unsigned int data) {
-    char buffer;
-    int ret, idx;
-    tfs_block inode, fileEx;
-    time_t curTime;
+    //the new size, extent count and modified date go out in one write
+    if (size > fileSize(&inode)) {
+        setFileSize(&inode, size);
+    }
+    time(&curTime);
+    memcpy(&(inode.mem[18 + sizeof(time_t)]), &curTime, sizeof(time_t));
+    if (writeFsBlock(file->inode, inode.mem) < 0) {
+        return ERR_WRITE;
+    }
 
+    return syncOp() < 0 ? ERR_WRITE : SUCCESS;
+}
 
-    //check if file is mounted and that file exists
-    if((ret = checkMountAndFile(FD)) < 0) {
+int seekExtent(fileDescriptor FD, int offset, int data) {
+    tfs_block inode;
+    tfs_openEntry *file;
+    char header[4];
+    int ret, bNum, position = 0, index, length, target, hole, found = -1;
+
+    if ((ret = checkMountAndFile(FD)) < 0) {
         return ret;
     }
-   
-    //get the current location of the file pointer
-    idx = openFilesLocation[FD];
-
-    //read from inode to get the first ref to file extent
-    if (readBlock(diskFD, FD, &(inode.mem)) < 0) {
-        fprintf(stderr, "writeByte: could not read inode\n");
+    file = getOpenFile(FD);
+    if (readFsBlock(file->inode, &(inode.mem)) < 0) {
         return ERR_READ;
     }
-    
-    //get the location of the file extent
-
-    //if (readBlock(diskFD, FD, &(fileEx.mem)) < 0)
-    if (readBlock(diskFD, inode.mem[2], &(fileEx.mem)) < 0) {
-        fprintf(stderr, "writeByte: could not read file extent\n");
-        return ERR_READ;
+    length = fileSize(&inode);
+    if (offset < 0 || offset >= length) {
+        return ERR_SEEK;
     }
 
-    // Get the time.
-    time(&curTime);
-
-    // Write last accessed/modified date.
-    memcpy(&(inode.mem[18 + sizeof(time_t)]), &curTime, sizeof(time_t));
-    memcpy(&(inode.mem[18 + (2 * sizeof(time_t))]), &curTime, sizeof(time_t));
-
-    // Write the date back to the inode.
-    writeBlock(diskFD, FD, inode.mem);
-    ret = inode.mem[2];
-    while ((idx >= 252) && (fileEx.mem[2] != '\0')) {
-        ret = fileEx.mem[2];
-
-        if (readBlock(diskFD, ret, &(fileEx.mem)) < 0) {
-            perror("failed to read file extent");
+    // Only the extent headers are needed to see where the holes are.
+    target = hole = offset / EXTENT_PAYLOAD;
+    for (bNum = (unsigned char) inode.mem[2]; bNum; bNum = (unsigned char) header[2], position++) {
+        if (readBlockPart(diskFD, physBlock(bNum), 0, header, sizeof(header)) < 0) {
             return ERR_READ;
         }
+        if ((index = extentIndex(&inode, header, position)) < target) {
+            continue;
+        }
+        if (data) {
+            found = index * EXTENT_PAYLOAD > offset ? index * EXTENT_PAYLOAD : offset;
+            break;
+        }
+        if (index != hole) {
+            break;
+        }
+        hole++;
+    }
 
-        idx -= 252;
+    // The end of the file counts as a hole.
+    if (!data) {
+        found = hole * EXTENT_PAYLOAD > offset ? hole * EXTENT_PAYLOAD : offset;
+        found = found < length ? found : length;
     }
-   
-    //check if EOF
-    if (idx >= 252) {
-        return ERR_INVALID_TFS;
+    if (found < 0 || (data && found >= length)) {
+        return ERR_SEEK;
     }
 
-    //get the reference to the first inode
-    memcpy(&buffer, fileEx.mem + 4 + idx, sizeof(char));
-
-    if (buffer == '\0') {
-        return ERR_READ;
-    }
+    file->location = found;
+    return found;
+}
 
-    fileEx.mem[4+idx] = (unsigned char) data;
-    writeBlock(diskFD, ret, fileEx.mem);
+int tfs_seekData(fileDescriptor FD, int offset) {
+    probeEnter("tfs_seekData", FD, offset);
+    return probeReturn("tfs_seekData", FD, seekExtent(FD, offset, 1));
+}
 
-	return SUCCESS;
+int tfs_seekHole(fileDescriptor FD, int offset) {
+    probeEnter("tfs_seekHole", FD, offset);
+    return probeReturn("tfs_seekHole", FD, seekExtent(FD, offset, 0));
 }
 
-int resetFile(fileDescriptor FD) {
+int resetFile(int inode) {
     unsigned char position;
-    tfs_block buf, lastFree;
+    tfs_block buf;
 
     //read in inode
-    readBlock(diskFD, FD, &(buf.mem));
+    readFsBlock(inode, &(buf.mem));
     if (buf.mem[0] != 2)
     {
-        fprintf(stderr, "block is not inode, type: %d, FD %d\n\n", buf.mem[0], FD);
+        fprintf(stderr, "block is not inode, type: %d, block %d\n\n", buf.mem[0], inode);
         return ERR_INVALID_INODE;
     }
-    //get last free block
-    readBlock(diskFD, 0, &(lastFree.mem));
-    while (lastFree.mem[2] != '\0') {
-		position = lastFree.mem[2];
-        readBlock(diskFD, lastFree.mem[2], &(lastFree.mem));
-    }
 
-    //don't do anything if there are no file extents
-    if (buf.mem[2] == '\0')
-        return SUCCESS;
-
-    lastFree.mem[2] = (unsigned char) buf.mem[2];
-	writeBlock(diskFD, position, lastFree.mem);
-
-    //update inode to point to nothing
+    //update inode to point to nothing, then free the old extents, blocks
+    //a snapshot shares are only given up
+    position = (unsigned char) buf.mem[2];
     buf.mem[2] = '\0';
-    writeBlock(diskFD, FD, buf.mem);
-
-    //add all blocks to free chain except for last one
-    readBlock(diskFD, lastFree.mem[2], &(buf.mem));
-    while (buf.mem[2] != '\0') {
-		freeBlocks++;
-        initFreeblock(&buf, buf.mem[2]);
-        writeBlock(diskFD, lastFree.mem[2], buf.mem);
-        lastFree = buf;
-        readBlock(diskFD, buf.mem[2], &(buf.mem));
-    }
-
-    //add last one to chain
-	freeBlocks++;
-    initFreeblock(&buf, '\0');
-    writeBlock(diskFD, lastFree.mem[2], buf.mem);
-
-    openFilesLocation[FD] = 0;
+    writeFsBlock(inode, buf.mem);
+    freeChain(position);
 
 	return SUCCESS;
 }
 
 int tfs_displayFragments() {
+    probeEnter("tfs_displayFragments", 0, 0);
+    return probeReturn("tfs_displayFragments", 0, showFragments());
+}
+
+int showFragments() {
     int i;
     int count = 0;
-    tfs_block buf;
+    tfs_blockSummary summary;
 
     // TFS is already unmounted, so throw error.
 	if (!mountedDisk) {
@@ -861,30 +4297,43 @@ int tfs_displayFragments() {
 		return ERR_TFS_UNMOUNT;
 	}
 
+    // Read every block's type in one pass over the image.
+    if (summarizeImage(SCAN_ANY, &summary) < 0) {
+        perror("displayFragments: read error");
+        return ERR_READ;
+    }
+
     // Loop through all of our memory and print out visual representation of each block.
-    for (i = 0; i < numBlocks; i++) {
-        // Read the current block into the buffer.
-        if (readBlock(diskFD, i, &(buf.mem)) < 0) {
-            perror("displayFragments: read error");
-            return ERR_READ;
+    for (i = 0; i < numNames; i++) {
+        // Block number is retired, a snapshot or its tables hold the block.
+        if (blockMap && i && !blockMap[i]) {
+            printf("[X]");
         }
 
         // Block is superblock.
-        if (buf.mem[0] == 1) {
+        else if (summary.type[i] == 1) {
             printf("[S]");
         }
         // Block is inode.
-        else if (buf.mem[0] == 2) {
+        else if (summary.type[i] == 2) {
             printf("[I]");
         }
         // Block is file extent.
-        else if (buf.mem[0] == 3) {
+        else if (summary.type[i] == 3) {
             printf("[E]");
         }
-        // Block is free.
-        else if (buf.mem[0] == 4) {
+        // Block is free, or punched and free.
+        else if (summary.type[i] == 4 || (!blockMap && summary.type[i] == 0)) {
             printf("[F]");
         }
+        // Block is directory.
+        else if (summary.type[i] == DIRECTORY_TYPE) {
+            printf("[D]");
+        }
+        // Block is directory entries.
+        else if (summary.type[i] == DIRENTRY_TYPE) {
+            printf("[H]");
+        }
         count++;
         if (count % 10 == 0) {
             printf("\n");
@@ -897,6 +4346,11 @@ int tfs_displayFragments() {
 }
 
 int tfs_defrag() {
+    probeEnter("tfs_defrag", 0, 0);
+    return probeReturn("tfs_defrag", 0, defragImage());
+}
+
+int defragImage() {
     int i;
    //unsigned char firstFree;
     tfs_block buf;
@@ -908,9 +4362,13 @@ int tfs_defrag() {
 	}
 
     // Loop through all of our memory.
-    for (i = 1; i < numBlocks; i++) {
+    for (i = 1; i < numNames; i++) {
+        // Retired block numbers have nothing behind them.
+        if (!physBlock(i)) {
+            continue;
+        }
         // Read the current block into the buffer.
-        if (readBlock(diskFD, i, &(buf.mem)) < 0) {
+        if (readFsBlock(i, &(buf.mem)) < 0) {
             perror("defrag: read error");
             return ERR_READ;
         }
@@ -922,3 +4380,303 @@ int tfs_defrag() {
 
     return SUCCESS;
 }
+
+int tfs_traceStart(char *path) {
+    tfs_traceHeader header;
+
+    if (traceFile) {
+        return ERR_BAD_REQUEST;
+    }
+    if ((traceFile = fopen(path, "wb")) == NULL) {
+        return ERR_WRITE;
+    }
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.blockSize = mountedDisk ? blockSize : 0;
+    header.numBlocks = mountedDisk ? numBlocks : 0;
+    if (fwrite(&header, sizeof(header), 1, traceFile) != 1) {
+        fclose(traceFile);
+        traceFile = NULL;
+        return ERR_WRITE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &traceEpoch);
+    return SUCCESS;
+}
+
+int tfs_traceStop() {
+    int ret;
+
+    if (!traceFile) {
+        return ERR_BAD_REQUEST;
+    }
+    pthread_mutex_lock(&traceLock);
+    ret = fclose(traceFile) == 0 ? SUCCESS : ERR_WRITE;
+    traceFile = NULL;
+    pthread_mutex_unlock(&traceLock);
+    return ret;
+}
+
+/* Nanoseconds since the trace began, or -1 when nothing is traced so
+untraced calls don't pay for the clock. */
+long long traceClock() {
+    struct timespec now;
+
+    if (!traceFile) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - traceEpoch.tv_sec) * 1000000000LL + (now.tv_nsec - traceEpoch.tv_nsec);
+}
+
+/* Appends one call to the trace and hands back its result. */
+int traceCall(int op, int fd, int arg, char *name, long long start, int result) {
+    tfs_traceRecord record;
+    long long end;
+
+    if (start < 0 || (end = traceClock()) < 0) {
+        return result;
+    }
+    record.start = start;
+    record.latency = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+    record.fd = fd;
+    record.arg = arg;
+    record.result = result;
+    record.op = op;
+    record.pad = 0;
+    record.nameLen = name ? strnlen(name, UINT16_MAX) : 0;
+
+    // importFiles copies on several threads, keep their records whole.
+    pthread_mutex_lock(&traceLock);
+    if (traceFile) {
+        fwrite(&record, sizeof(record), 1, traceFile);
+        fwrite(name, 1, record.nameLen, traceFile);
+    }
+    pthread_mutex_unlock(&traceLock);
+    return result;
+}
+
+void cacheInode(int bNum, char *block) {
+    tfs_fileStat *st;
+    int i;
+
+    if (!inodeTable || bNum <= 0 || bNum > MAX_BLOCKS) {
+        return;
+    }
+    st = &inodeTable[bNum];
+    if (block[0] != 2 && block[0] != DIRECTORY_TYPE) {
+        st->type = 0;
+        return;
+    }
+    st->type = block[0];
+    st->inode = bNum;
+    st->parent = (unsigned char) block[INODE_PARENT];
+    strncpy(st->name, block + 5, MAX_FILE_NAME_LENGTH);
+    st->name[MAX_FILE_NAME_LENGTH] = '\0';
+
+    // Directories have no content of their own and can't be made read-only.
+    st->size = st->type == 2 ? fileSize((tfs_block *) block) : 0;
+    st->writable = st->type == 2 ? block[3] == 1 : 1;
+    for (i = 0; i < 3; i++) {
+        memcpy(i == 0 ? &st->created : i == 1 ? &st->modified : &st->accessed,
+               block + 18 + i * sizeof(time_t), sizeof(time_t));
+    }
+}
+
+int loadInode(int bNum, char *block, void *arg) {
+    cacheInode(bNum, block);
+    return SUCCESS;
+}
+
+int loadInodeTable() {
+    memset(inodeTable, 0, sizeof(tfs_fileStat) * (MAX_BLOCKS + 1));
+    return scanImage(SCAN_TYPE(2) | SCAN_TYPE(DIRECTORY_TYPE), loadInode, NULL);
+}
+
+int tableLookup(int dir, char *name) {
+    int bNum;
+
+    for (bNum = 1; bNum <= MAX_BLOCKS; bNum++) {
+        if (inodeTable[bNum].type && inodeTable[bNum].parent == dir && bNum != dir &&
+            !strncmp(inodeTable[bNum].name, name, MAX_FILE_NAME_LENGTH + 1)) {
+            return bNum;
+        }
+    }
+    return 0;
+}
+
+int tfs_stat(char *path, tfs_fileStat *st) {
+    probeEnter("tfs_stat", 0, 0);
+    return probeReturn("tfs_stat", 0, statPath(path, st));
+}
+
+int statPath(char *path, tfs_fileStat *st) {
+    char component[MAX_FILE_NAME_LENGTH + 1];
+    int bNum = rootDir, len;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+
+    // Walk the path through the table, like resolvePath does on disk.
+    for (path += strspn(path, "/"); *path; path += strspn(path, "/")) {
+        len = strcspn(path, "/");
+        if (len > MAX_FILE_NAME_LENGTH) {
+            return ERR_FILE_NAME_LENGTH;
+        }
+        if (inodeTable[bNum].type != DIRECTORY_TYPE) {
+            return ERR_NO_SUCH_DIR;
+        }
+        memcpy(component, path, len);
+        component[len] = '\0';
+        if ((bNum = tableLookup(bNum, component)) == 0) {
+            return ERR_NO_SUCH_FILE;
+        }
+        path += len;
+    }
+
+    *st = inodeTable[bNum];
+    return SUCCESS;
+}
+
+int tfs_opendir(char *path, tfs_dir *dir) {
+    tfs_fileStat st;
+    int ret;
+
+    if ((ret = tfs_stat(path, &st)) < 0) {
+        return ret;
+    }
+    if (st.type != DIRECTORY_TYPE) {
+        return ERR_NO_SUCH_DIR;
+    }
+    dir->dir = st.inode;
+    dir->cursor = 1;
+    return SUCCESS;
+}
+
+int tfs_readdir_next(tfs_dir *dir, tfs_fileStat *st) {
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    for (; dir->cursor <= MAX_BLOCKS; dir->cursor++) {
+        if (inodeTable[dir->cursor].type && inodeTable[dir->cursor].parent == dir->dir &&
+            dir->cursor != dir->dir) {
+            *st = inodeTable[dir->cursor++];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int loadExtentIndex() {
+    tfs_block inode, fileEx;
+    tfs_extentIndex *file;
+    int bNum, ext, position, index;
+
+    extentIndexes = arenaAlloc(sizeof(tfs_extentIndex) * (MAX_BLOCKS + 1));
+    memset(extentIndexes, 0, sizeof(tfs_extentIndex) * (MAX_BLOCKS + 1));
+    for (bNum = 1; bNum <= MAX_BLOCKS; bNum++) {
+        if (inodeTable[bNum].type != 2 || readFsBlock(bNum, &(inode.mem)) < 0) {
+            continue;
+        }
+        file = &extentIndexes[bNum];
+        file->size = inodeTable[bNum].size;
+        file->count = (file->size + EXTENT_PAYLOAD - 1) / EXTENT_PAYLOAD;
+        file->blocks = arenaAlloc(file->count + 1);
+        memset(file->blocks, 0, file->count + 1);
+
+        // Extents past the size, or a chain that loops, are left out.
+        ext = (unsigned char) inode.mem[2];
+        for (position = 0; ext && position < numNames; position++) {
+            if (readFsBlock(ext, &(fileEx.mem)) < 0) {
+                return ERR_READ;
+            }
+            if ((index = extentIndex(&inode, fileEx.mem, position)) < file->count) {
+                file->blocks[index] = physBlock(ext);
+            }
+            ext = (unsigned char) fileEx.mem[2];
+        }
+    }
+    return SUCCESS;
+}
+
+int tfs_openReader(char *path, tfs_reader *reader) {
+    probeEnter("tfs_openReader", 0, 0);
+    return probeReturn("tfs_openReader", 0, openReader(path, reader));
+}
+
+int openReader(char *path, tfs_reader *reader) {
+    tfs_fileStat st;
+    int ret;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (!extentIndexes) {
+        return ERR_BAD_REQUEST;
+    }
+    if ((ret = statPath(path, &st)) < 0) {
+        return ret;
+    }
+    if (st.type != 2) {
+        return ERR_NO_SUCH_FILE;
+    }
+    reader->inode = st.inode;
+    reader->offset = 0;
+    return SUCCESS;
+}
+
+int tfs_readerRead(tfs_reader *reader, char *buffer, int size) {
+    int ret;
+
+    if ((ret = tfs_readerPread(reader, reader->offset, buffer, size)) > 0) {
+        reader->offset += ret;
+    }
+    return ret;
+}
+
+int tfs_readerPread(tfs_reader *reader, int offset, char *buffer, int size) {
+    probeEnter("tfs_readerPread", reader->inode, size);
+    return probeReturn("tfs_readerPread", reader->inode, readIndexed(reader, offset, buffer, size));
+}
+
+int readIndexed(tfs_reader *reader, int offset, char *buffer, int size) {
+    tfs_diskRequest reqs[MAX_BLOCKS + 1];
+    tfs_extentIndex *file;
+    int index, idx, chunk, count = 0, numReqs = 0;
+
+    if (!mountedDisk) {
+        return ERR_TFS_NOT_MOUNTED;
+    }
+    if (!extentIndexes || reader->inode < 1 || reader->inode > MAX_BLOCKS) {
+        return ERR_BAD_REQUEST;
+    }
+    if (offset < 0) {
+        return ERR_SEEK;
+    }
+    file = &extentIndexes[reader->inode];
+    if (offset >= file->size || size <= 0) {
+        return 0;
+    }
+    if (size > file->size - offset) {
+        size = file->size - offset;
+    }
+
+    // One request per extent straight into the caller's buffer, libDisk
+    // reads the extents that sit next to each other with one call.
+    while (count < size) {
+        index = (offset + count) / EXTENT_PAYLOAD;
+        idx = (offset + count) % EXTENT_PAYLOAD;
+        chunk = EXTENT_PAYLOAD - idx < size - count ? EXTENT_PAYLOAD - idx : size - count;
+        if (!file->blocks[index]) {
+            memset(buffer + count, 0, chunk);
+        }
+        else {
+            reqs[numReqs].bNum = file->blocks[index];
+            reqs[numReqs].offset = 4 + idx;
+            reqs[numReqs].len = chunk;
+            reqs[numReqs++].buf = buffer + count;
+        }
+        count += chunk;
+    }
+    return readRequests(diskFD, reqs, numReqs) < 0 ? ERR_READ : count;
+}
@@ -5,30 +5,442 @@
  * Due Date: 3/19/17
  */
 
+#include <time.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdio.h>
+#include "tfsTrace.h"
+
 #define MAGIC_NUM 0x44
 #define MAX_FILE_NAME_LENGTH 8
+
+/* Superblock allocation summary, valid only when the clean flag is set */
+#define SUPER_FREE_COUNT 5
+#define SUPER_INODE_COUNT 6
+#define SUPER_CLEAN_FLAG 7
+#define SUPER_CLEAN 1
+
+/* Superblock byte 8 holds log2 of the block size, 0 on older images */
+#define SUPER_BLOCK_SHIFT 8
+
+/* Striped images keep log2 of the stripe unit in superblock byte 12
+and the number of files in byte 13, which is 0 for a single file */
+#define SUPER_STRIPE_SHIFT 12
+#define SUPER_STRIPE_MEMBERS 13
+#define MAX_STRIPE_SHIFT 24
+
+/* Block addresses are one byte */
+#define MAX_BLOCKS 255
+
+/* File extents carry a 4 byte header, the rest is content */
+#define EXTENT_PAYLOAD (blockSize - 4)
+
+/* Inode byte 15 marks files whose size is kept in bytes at INODE_SIZE
+and whose extents carry their place in the file in header byte 3, so a
+missing one is a hole. Older files end at their first null byte. */
+#define INODE_FORMAT 15
+#define INODE_SIZED 0x53
+#define INODE_SIZE (18 + 3 * (int) sizeof(time_t))
+#define EXTENT_INDEX 3
+
+/* Which inode time readFileTime returns */
+#define TIME_CREATED 0
+#define TIME_MODIFIED 1
+#define TIME_ACCESSED 2
+
+/* Superblock byte 3 holds the root directory inode */
+#define SUPER_ROOT 3
+
+/* Directories: inode block type 5 keeps one head pointer per hash
+bucket, each bucket is a chain of type 6 entry blocks. An entry is the
+inode block, its type and the name. Byte 4 of every inode points at the
+directory holding it. */
+#define DIRECTORY_TYPE 5
+#define DIRENTRY_TYPE 6
+#define INODE_PARENT 4
+#define DIR_BUCKETS 16
+#define DIR_BUCKET_START 48
+#define DIRENT_SIZE (MAX_FILE_NAME_LENGTH + 3)
+#define DIRENTS_PER_BLOCK (((blockSize - 4) / DIRENT_SIZE) > 255 ? 255 : ((blockSize - 4) / DIRENT_SIZE))
+#define DIRENT(block, i) ((block)->mem + 4 + (i) * DIRENT_SIZE)
+#define DIR_CACHE_SIZE 16
+#define READDIR_PAGE 32
+
+#define FD_SLOT_BITS 16
+#define FD_SLOT_MASK ((1 << FD_SLOT_BITS) - 1)
+#define FD_GENERATION_MASK 0x7fff
+#define OPEN_FILES_INITIAL 8
+#define ARENA_CHUNK_SIZE 4096
+
+/* Most threads tfs_importFiles copies with */
+#define IMPORT_THREADS 4
+
+/* tfs_mkimage block kinds, and how many blocks it writes at a time */
+#define IMAGE_FREE 0
+#define IMAGE_SUPER 1
+#define IMAGE_INODE 2
+#define IMAGE_EXTENT 3
+#define IMAGE_DIRENTS 4
+#define IMAGE_STAGE_BLOCKS 64
+
+/* Snapshots: once the first one is taken, block numbers go through a
+map to the physical block holding them, and every physical block keeps
+a count of the maps using it. Superblock bytes 9-11 hold the physical
+blocks of the live map, the counts and the snapshot table. A table
+entry is the name, the physical block of the snapshot's map, its state
+and how far background reclaim has got through it. */
+#define SUPER_BLOCK_MAP 9
+#define SUPER_BLOCK_REFS 10
+#define SUPER_SNAPSHOTS 11
+#define MAX_SNAPSHOTS 16
+#define SNAPSHOT_ENTRY_SIZE 12
+#define SNAPSHOT_MAP 9
+#define SNAPSHOT_STATE 10
+#define SNAPSHOT_CURSOR 11
+#define SNAPSHOT_ACTIVE 1
+#define SNAPSHOT_DELETING 2
+#define RECLAIM_STEP 16
+
+/* Dedup shares identical extents through the block map. The index is
+direct mapped from content hash to physical block. */
+#define DEDUP_BUCKETS 1024
+#define DEDUP_MAX_REFS 200
+
+/* Log-structured images, made by tfs_mkfsLog and flagged in superblock
+byte 14, go through the block map too, which doubles as the inode map.
+A block the map on disk points at is never written again: its new
+version is appended at the log head, which fills the free blocks of one
+LOG_SEGMENT block segment before moving to the emptiest other one. The
+map is written back as a checkpoint once per call, after which the old
+versions are free. Block numbers only go up to what fits with
+LOG_RESERVE blocks to spare. The cleaner moves the live blocks out of
+the segments that are at most LOG_CLEAN_LIVE percent live, fewest
+first, while fewer than LOG_CLEAN_TARGET segments are empty. Each
+physical block is one of the LOG_ states. */
+#define SUPER_LOG 14
+#define LOG_SEGMENT 16
+#define LOG_RESERVE LOG_SEGMENT
+#define LOG_CLEAN_STEP 16
+#define LOG_CLEAN_LIVE 75
+#define LOG_CLEAN_TARGET 2
+#define LOG_FREE 0
+#define LOG_LIVE 1
+#define LOG_FRESH 2
+#define LOG_STALE 3
+#define LOG_SYSTEM 4
+
+/* Allocation policies, picked at mount. The head policy pops the free
+chain like older versions did. Next fit searches on from the last
+allocation, best fit takes the shortest free run a file fits in and
+near takes the run closest after a hint, usually the inode. A run is
+given ALLOC_RESERVE percent more room than asked for, which other
+files only use once nothing else is left. */
+#define ALLOC_HEAD 0
+#define ALLOC_NEXT_FIT 1
+#define ALLOC_BEST_FIT 2
+#define ALLOC_NEAR 3
+#define ALLOC_RESERVE 50
+#define FREE_OPEN 1
+#define FREE_RESERVED 2
+
+/* Blocks freed on an image without snapshots go back to the host with
+punchBlocks once this many are waiting, a run at a time, and on sync,
+unmount and tfs_trim. A punched block reads as zeros, so on such an
+image a block of type 0 is free; the free chain it was part of is
+rebuilt from the block types at mount. */
+#define TRIM_BATCH 16
+
+/* Durability modes. With TFS_SYNC_NONE the image is only as durable as
+the kernel makes it, TFS_SYNC_CLOSE syncs it when a file is closed and
+at unmount, and TFS_SYNC_OP before every call that changes it returns,
+once per batch inside tfs_batchBegin and tfs_batchCommit. */
+#define TFS_SYNC_NONE 0
+#define TFS_SYNC_CLOSE 1
+#define TFS_SYNC_OP 2
+
+/* Whole-image scans read SCAN_CHUNK_BYTES at a time, and images of
+SCAN_PARALLEL_BYTES or more SCAN_THREADS chunks at once. The filter
+passed to scanImage is a mask of SCAN_TYPE bits. */
+#define SCAN_CHUNK_BYTES (256 * 1024)
+#define SCAN_PARALLEL_BYTES (1024 * 1024)
+#define SCAN_THREADS 4
+#define SCAN_TYPE(type) (1 << (type))
+#define SCAN_ANY -1
 #include "tinyFS.h"
 
 typedef struct {
-	char mem[BLOCKSIZE];
+	char mem[MAX_BLOCKSIZE];
 } tfs_block;
 
+typedef struct {
+	int bNum;
+	tfs_block block;
+} tfs_cachedBlock;
+
+typedef struct {
+	char name[MAX_FILE_NAME_LENGTH + 1];
+	int inode;
+	int type;
+} tfs_dirent;
+
+/* What tfs_stat and tfs_readdir_next report about a file or directory.
+type is 2 for a file and DIRECTORY_TYPE for a directory, and size is 0
+for a directory. The inode table holds one for every inode block. */
+typedef struct {
+	char name[MAX_FILE_NAME_LENGTH + 1];
+	int inode;
+	int type;
+	int parent;
+	int size;
+	int writable;
+	time_t created;
+	time_t modified;
+	time_t accessed;
+} tfs_fileStat;
+
+/* Where a read-only mount keeps each file's extents: the physical
+block holding each EXTENT_PAYLOAD sized piece of the file, 0 for a
+hole */
+typedef struct {
+	int size;
+	int count;
+	unsigned char *blocks;
+} tfs_extentIndex;
+
+/* A cursor into one file of a read-only mount, owned by whoever opened
+it */
+typedef struct {
+	int inode;
+	int offset;
+} tfs_reader;
+
+/* Position of a tfs_readdir_next listing */
+typedef struct {
+	int dir;
+	int cursor;
+} tfs_dir;
+
+/* Open file table entry. A descriptor is the entry's slot in the low
+FD_SLOT_BITS and its generation above them; closing bumps the
+generation so stale descriptors are rejected. Free slots are chained
+through nextFree. */
+typedef struct {
+	int inode;
+	int location;
+	int generation;
+	int nextFree;
+	char name[MAX_FILE_NAME_LENGTH + 1];
+} tfs_openEntry;
+
+/* Per-mount allocations come out of chunks freed together at unmount */
+typedef struct tfs_arenaChunk {
+	struct tfs_arenaChunk *next;
+	int size;
+	int used;
+	char data[];
+} tfs_arenaChunk;
+
+/* Read-only view of part of a file from tfs_mapFile. The pieces point
+straight into the mapped image, one per extent touched since extent
+headers split the content; data is set when the range fits in one
+piece. If the image can't be mapped the view holds a private copy. */
+typedef struct {
+	struct iovec *iov;
+	int count;
+	int length;
+	char *data;
+	int inode;
+	unsigned char *blocks;
+	int pinned;
+	char *copy;
+} tfs_view;
+
+/* One host file being copied in by tfs_importFiles, along with the
+extents laid out for it */
+typedef struct {
+	int hostFd;
+	int size;
+	int numBlocks;
+	unsigned char blocks[MAX_BLOCKS];
+	int result;
+} tfs_import;
+
+/* A file or directory tfs_mkimage found under the host directory,
+and the blocks the layout gave it */
+typedef struct {
+	char name[MAX_FILE_NAME_LENGTH + 1];
+	char *hostPath;
+	int type;
+	int parent;
+	int size;
+	time_t modified;
+	int inode;
+	int firstBlock;
+	int numBlocks;
+	unsigned char buckets[DIR_BUCKETS];
+} tfs_imageNode;
+
+/* What one block of the image being built holds. ‘index’ is the
+extent's place in its file, or bucket << 8 | chunk for entry blocks. */
+typedef struct {
+	int kind;
+	int node;
+	int index;
+} tfs_imageBlock;
+
+/* Called by scanImage for every block number whose block passes the
+filter, with the block's content. A negative return stops the scan. */
+typedef int (*tfs_scanFn)(int bNum, char *block, void *arg);
+
+/* A run of physical blocks one scan thread reads */
+typedef struct {
+	int first;
+	int count;
+	char *data;
+	int result;
+} tfs_scanChunk;
+
+/* The type and next pointer of every block, as summarizeImage finds
+them */
+typedef struct {
+	unsigned char type[MAX_BLOCKS + 1];
+	unsigned char next[MAX_BLOCKS + 1];
+} tfs_blockSummary;
+
+/* How tfs_mountWith mounts an image: an ALLOC_ policy, a TFS_SYNC_
+durability mode, whether to bypass the page cache with O_DIRECT,
+whether to mount it read-only, and whether to write every block as it
+comes instead of queueing each call's writes in libDisk, which sorts
+and merges them when the call ends */
+typedef struct {
+	int allocPolicy;
+	int durability;
+	int directIO;
+	int readOnly;
+	int writeThrough;
+} tfs_mountOptions;
+
+/* What tfs_batchAbort puts back, everything else lives in blocks */
+typedef struct {
+	int freeBlocks;
+	int numInodes;
+	int allocCursor;
+	int freeTail;
+	int reclaimPending;
+	int mapped;
+	int blockMapBlock;
+	int blockRefsBlock;
+	int snapshotBlock;
+	int logHead;
+	int logSegment;
+	unsigned char freeNext[MAX_BLOCKS + 1];
+	unsigned char freePrev[MAX_BLOCKS + 1];
+	unsigned char freeState[MAX_BLOCKS + 1];
+	unsigned char blockMap[MAX_BLOCKS + 1];
+	unsigned char blockRefs[MAX_BLOCKS + 1];
+	unsigned char logState[MAX_BLOCKS + 1];
+} tfs_batchState;
+
+typedef struct {
+	tfs_import *jobs;
+	int count;
+	int next;
+	pthread_mutex_t lock;
+} tfs_importQueue;
+
 
 void tfs_makeRO(char *name);
 void tfs_makeRW(char *name);
 int writeByte(fileDescriptor FD, unsigned int data);
 int tfs_defrag();
+int defragImage();
 int tfs_displayFragments();
-int resetFile(fileDescriptor FD);
+int showFragments();
+int resetFile(int inode);
 time_t tfs_readFileInfo(fileDescriptor FD);
 time_t tfs_readFileLastModified(fileDescriptor FD);
 time_t tfs_readFileLastAccessed(fileDescriptor FD);
+time_t probeReturnTime(char *call, fileDescriptor FD, time_t result);
+time_t readFileTime(fileDescriptor FD, int which);
 int tfs_rename(fileDescriptor FD, char* newName);
 void tfs_readdir();
+void readdirRoot();
+int tfs_mkdir(char *path);
+int tfs_rmdir(char *path);
+int tfs_readdirPage(char *path, int *cursor, tfs_dirent *page, int max);
+int readdirPage(char *path, int *cursor, tfs_dirent *page, int max);
 void initFreeblock(tfs_block *block, unsigned char nextFree);
 void initExtent(tfs_block *block, unsigned char next);
 void initSuperblock(tfs_block *block, unsigned char firstFree, int nBytes);
 void initInodeblock(tfs_block *buf, char* name);
+void initDirectoryblock(tfs_block *buf, char *name, unsigned char parent);
+void initDirEntryblock(tfs_block *buf, unsigned char next);
+int rebuildSummary(int diskNum);
+int countBlock(int bNum, char *block, void *arg);
+void *scanReader(void *arg);
+int scanImage(int types, tfs_scanFn fn, void *arg);
+int summarizeBlock(int bNum, char *block, void *arg);
+int summarizeImage(int types, tfs_blockSummary *summary);
+int moveToRoot(int bNum, char *block, void *arg);
+int dedupBlock(int bNum, char *block, void *arg);
+int upgradeFlatImage();
+int allocBlock();
+int allocBlockNear(int hint);
+int allocInodeBlock(int parent);
+int allocRun(int count, int hint, unsigned char *blocks);
+int findRun(int len, int hint, int open);
+void takeFreeBlock(int bNum);
+int loadFreeList();
+void releaseBlock(int bNum);
+int flushTrim(int all);
+int writeFreeChain();
+int readCachedBlock(int bNum, tfs_block *buf);
+int writeCachedBlock(int bNum, tfs_block *buf);
+unsigned int dirHash(char *name);
+int dirLookup(int dir, char *name, int *type);
+int dirInsert(int dir, char *name, int inode, int type);
+int dirRemove(int dir, char *name);
+int resolvePath(char *path, char *leaf);
+int resolveDir(char *path);
+int checkMountAndFile(fileDescriptor FD);
+tfs_openEntry *getOpenFile(fileDescriptor FD);
+fileDescriptor allocOpenFile(int inode, char *name);
+void releaseOpenFile(tfs_openEntry *file);
+void *arenaAlloc(int size);
+int scanHostDir(char *path, int parent, tfs_imageNode **nodes, int *count, int *cap);
+int layoutImageDir(tfs_imageNode *nodes, int count, int dir, int next, int numBlocks, tfs_imageBlock *layout);
+int buildImageBlock(tfs_imageNode *nodes, int count, tfs_imageBlock *layout, int bNum, int total, int *hostFd, tfs_block *buf);
+int writeImage(tfs_imageNode *nodes, int count, tfs_imageBlock *layout, int used, int total, int out);
+int getNumBlocks(int size);
+int allocExtents(int inodeNum, int size, unsigned char *blocks);
+int copyImport(tfs_import *job);
+void *importWorker(void *arg);
+void arenaFree();
+int mountImage(char *diskname, char *snapshot);
+int loadBlockMap(int diskNum, tfs_block *super, char *snapshot);
+int physBlock(int bNum);
+int isShared(int bNum);
+int readFsBlock(int bNum, void *block);
+int writeFsBlock(int bNum, void *block);
+int exclusiveBlock(int bNum, int keep);
+int saveBlockMap();
+int enterMappedMode();
+int takeSystemBlock();
+int giveBackBlock(int phys);
+void freeChain(int head);
+int reusableBlocks(int head);
+int reuseSpareBlocks();
+int fileSize(tfs_block *inode);
+void setFileSize(tfs_block *inode, int size);
+int extentIndex(tfs_block *inode, char *header, int position);
+int sizeFile(int inodeNum, tfs_block *inode);
+int readFileRange(tfs_openEntry *file, int offset, char *buffer, int size);
+int writeFileRange(tfs_openEntry *file, int offset, char *buffer, int size);
+int seekExtent(fileDescriptor FD, int offset, int data);
+int writeZeros(int hostFd, int len);
+unsigned int contentHash(char *data, int len);
+void indexBlock(int phys, unsigned int hash);
+int shareBlock(int bNum, char *block, unsigned int hash);
 
 /* Makes a blank TinyFS file system of size nBytes on the unix file
 specified by ‘filename’. This function should use the emulated disk
@@ -38,6 +450,38 @@ file to be mountable disk. This includes initializing all data to
 and inodes, etc. Must return a specified success/error code. */
 int tfs_mkfs(char *filename, int nBytes);
 
+/* Same as tfs_mkfs, but formats with ‘blockSize’ byte blocks (a power
+of two from MIN_BLOCKSIZE to MAX_BLOCKSIZE). The size is recorded in
+the superblock and picked up again by tfs_mount. */
+int tfs_mkfsBlockSize(char *filename, int nBytes, int blockSize);
+
+/* Same as tfs_mkfsBlockSize, but spreads the file system over the
+‘count’ image files in ‘members’ (at most MAX_STRIPE_MEMBERS), which
+can sit on different devices. Blocks are dealt out across them
+‘stripeUnit’ bytes at a time, a power of two of at least MIN_BLOCKSIZE;
+a unit smaller than the block size splits every block across files. */
+int tfs_mkfsStriped(char **members, int count, int nBytes, int blockSize, int stripeUnit);
+int formatImage(char **members, int count, int nBytes, int size, int stripeUnit);
+
+/* Same as tfs_mkfsBlockSize, but the image is log-structured: every
+block written, data or metadata, goes to the next free block of the
+segment being filled instead of back where it was, so a stream of
+creates and rewrites reaches the disk as mostly sequential writes.
+Snapshots and dedup aren't available on it. Fails on images with fewer
+than LOG_RESERVE + LOG_SEGMENT + 4 blocks. */
+int tfs_mkfsLog(char *filename, int nBytes, int blockSize);
+int formatLog(char *filename, int nBytes, int size);
+
+/* Builds a TinyFS image of nBytes with ‘blockSize’ byte blocks holding
+a copy of the host directory tree under ‘hostDir’. The whole layout is
+planned first: each directory is followed by its entry blocks and then
+by its files, every file's extents in one contiguous run. The image is
+then written front to back in one pass. Host names longer than
+MAX_FILE_NAME_LENGTH are skipped. Returns success or an error code if
+the tree doesn't fit. */
+int tfs_mkimage(char *hostDir, char *filename, int nBytes, int blockSize);
+int buildImage(char *hostDir, char *filename, int nBytes, int size);
+
 /* tfs_mount(char *diskname) ​“mounts” a TinyFS file system located
 within ‘diskname’ unix file. tfs_unmount(void) “unmounts” the
 currently mounted file system. As part of the mount operation,
@@ -47,9 +491,135 @@ unmount the currently mounted file system. Must return a specified
 success/error code. */
 int tfs_mount(char *diskname);
 int tfs_unmount(void);
+int unmountImage(void);
+void restoreBatchState();
+
+/* tfs_batchBegin groups every call that follows, up to tfs_batchCommit,
+into one update of the image. Calls return their results as usual and
+see each other's changes, but nothing reaches the disk until the
+commit, which writes each block touched once, in block order, through
+a journal beside the image, so after a crash either all of the batch
+is there or none of it. tfs_batchAbort drops it instead, and closes
+descriptors opened or renamed in it. Views can't be mapped, nor the
+image unmounted, while a batch is open. */
+int tfs_batchBegin();
+int tfs_batchCommit();
+int tfs_batchAbort();
+
+/* records the current state of the file system as snapshot ‘name’.
+Only the block map is copied, the blocks themselves are shared and
+copied the first time either side writes them. Returns success or an
+error code. */
+int tfs_snapshot(char *name);
+int takeSnapshot(char *name);
+
+/* mounts snapshot ‘name’ of the image in ‘diskname’ read-only. Every
+call that would change it fails with ERR_READ_ONLY. Unmount with
+tfs_unmount. */
+int tfs_mountSnapshot(char *diskname, char *name);
+
+/* drops snapshot ‘name’. The blocks only it was holding are handed
+back a few at a time by tfs_reclaim, which tfs_writeFile also runs.
+Returns SUCCESS, or ERR_NO_SUCH_SNAPSHOT if there is no such snapshot. */
+int tfs_deleteSnapshot(char *name);
+int dropSnapshot(char *name);
+
+/* hands back up to ‘budget’ blocks' worth of deleted snapshots.
+Returns how many deleted snapshots are still being reclaimed. */
+int tfs_reclaim(int budget);
+int reclaimSnapshots(int budget);
+
+/* prints the name of every snapshot */
+int tfs_listSnapshots();
+int listSnapshots();
+
+/* turns inline dedup on or off for this mount. While it is on, every
+extent written that matches one already on disk, byte for byte, shares
+that block instead; writing to a shared block gives it a copy again. */
+int tfs_setDedup(int enabled);
+int setDedup(int enabled);
+
+/* dedups every extent already in the image. Returns the number of
+blocks freed or an error code. */
+int tfs_dedup();
+int dedupImage();
+
+/* returns how many blocks the live files currently save by sharing */
+int tfs_dedupSavings();
+
+/* moves up to ‘budget’ live blocks of a log-structured image out of
+the segments most worth emptying, then checkpoints. tfs_writeFile runs
+it too. Returns 1 while more cleaning would help, and 0 once enough
+segments are empty or on other images. tfs_logStats counts the
+segments, the empty ones and the blocks in use. */
+int tfs_cleanLog(int budget);
+int cleanLog(int budget);
+int tfs_logStats(int *segments, int *emptySegments, int *liveBlocks);
+int logNames(int blocks);
+int loadLogState();
+int segmentEnd(int seg);
+int segmentFree(int seg);
+int appendLog();
+int logBlock(int bNum, int keep);
+int moveLogBlock(int bNum, int keep);
+void retireLogBlock(int phys);
+int checkpointLog();
+int cleanVictim();
+
+/* mounts ‘diskname’ like tfs_mount, placing new blocks with allocation
+policy ‘policy’, one of the ALLOC_ constants. tfs_mount uses
+ALLOC_HEAD. */
+int tfs_mountPolicy(char *diskname, int policy);
+
+/* mounts ‘diskname’ like tfs_mount with the allocation policy,
+durability mode and page cache use in ‘options’. Fails with
+ERR_INVALID_DISK if direct I/O was asked for and the file system holding
+the image doesn't support it. A read-only mount opens the image O_RDONLY
+and never writes to it, not even to mark it in use; every call that
+would change it fails with ERR_READ_ONLY. An image with a batch journal
+still beside it can't be mounted read-only, since replaying it is a
+write, and fails with ERR_TFS_MOUNT. */
+int tfs_mountWith(char *diskname, tfs_mountOptions *options);
+int syncOp();
+
+/* waits until everything written to the mounted image so far is on
+stable storage, whatever the durability mode */
+int tfs_sync();
+
+/* hands the space behind every free block back to the host file system,
+so the image file only takes up room for what is in use and copies that
+skip holes skip them. Images with snapshots or dedup keep their free
+blocks as they are. Returns the number of free blocks it went over or
+an error code. */
+int tfs_trim();
+int trimImage();
+
+/* mounts the striped image made by tfs_mkfsStriped, given the same
+files in the same order, with ‘options’ as in tfs_mountWith or, when
+it is NULL, the tfs_mount defaults. Fails with ERR_TFS_MOUNT when the
+files don't match the image. tfs_mount refuses the first file on its
+own. */
+int tfs_mountStriped(char **members, int count, tfs_mountOptions *options);
+int openMembers(char **members, int count);
+
+/* counts the files, their extents and the runs of consecutive blocks
+those extents form. blocks / runs is the average run length. */
+int tfs_runStats(int *files, int *blocks, int *runs);
+int runStats(int *files, int *blocks, int *runs);
+
+/* reports libDisk's queueStats for the mounted image: block reads and
+writes requested through the request queue, batches and tfs_readerPread,
+and the preadv and pwritev calls they were merged into. */
+int tfs_ioStats(long *readRequests, long *readCalls, long *writeRequests, long *writeCalls);
+
+/* reports libDisk's copyStats for the mounted image: the
+copy_file_range calls imports and exports have made since it was
+mounted. */
+int tfs_copyStats(long *copies);
 
 /* Creates or Opens an existing file for reading and writing on the
-currently mounted file system. Creates a dynamic resource table entry
+currently mounted file system. ‘name’ may be a path such as "dir/file",
+every component but the last must be an existing directory. Creates a dynamic resource table entry
 for the file, and returns a file descriptor (integer) that can be
 used to reference this file while the filesystem is mounted. */
 fileDescriptor tfs_openFile(char *name);
@@ -74,6 +644,129 @@ tfs_readByte() should return an error and not increment the file
 pointer. */
 int tfs_readByte(fileDescriptor FD, char *buffer);
 
+/* reads up to ‘size’ bytes into buffer starting at the current file
+pointer, walking the extent chain once, and advances the file pointer
+past them. Returns the number of bytes read (0 at end of file) or an
+error code. */
+int tfs_readBytes(fileDescriptor FD, char *buffer, int size);
+
 /* change the file pointer location to offset (absolute). Returns
 success/error codes.*/
 int tfs_seek(fileDescriptor FD, int offset);
+
+/* writes ‘size’ bytes at the current file pointer and advances it past
+them. Writing past the end grows the file, and only the blocks written
+to are allocated; the ones skipped over are holes that read back as
+zeros. Returns the number of bytes written or an error code. */
+int tfs_writeBytes(fileDescriptor FD, char *buffer, int size);
+
+/* tfs_truncate sets the file's size to ‘size’ without rewriting it.
+Shrinking frees only the extents wholly past the new end and zeroes
+the rest of the last one, growing leaves a hole. tfs_fallocate gives
+every missing extent up to ‘size’ a block, all from one contiguous run
+where there is one, so later writes there allocate nothing, and grows
+the file to ‘size’ if it is shorter. New extents read as zeros. Both
+write the inode once and leave the file pointer alone. Return SUCCESS
+or an error code. */
+int tfs_truncate(fileDescriptor FD, int size);
+int tfs_fallocate(fileDescriptor FD, int size);
+
+/* move the file pointer to the first byte of data, or of a hole, at or
+after ‘offset’, like lseek's SEEK_DATA and SEEK_HOLE. The end of the
+file counts as a hole. Returns the new offset, or ERR_SEEK when offset
+is past the end or no data follows it. */
+int tfs_seekData(fileDescriptor FD, int offset);
+int tfs_seekHole(fileDescriptor FD, int offset);
+
+/* fills ‘view’ with up to ‘len’ bytes of the file starting at ‘offset’
+without copying them, and pins the file's blocks so they can't be
+rewritten or freed until tfs_releaseView. The view is cut at the end of
+the file, and pieces over holes point at a shared block of zeros.
+Writing to or deleting a pinned file fails with ERR_FILE_BUSY, and so
+does unmount while any view is held. Returns the number of bytes in the view or an
+error code. */
+int tfs_mapFile(fileDescriptor FD, int offset, int len, tfs_view *view);
+int mapRange(fileDescriptor FD, int offset, int len, tfs_view *view);
+int tfs_releaseView(tfs_view *view);
+int releaseView(tfs_view *view);
+
+/* copies the host file at ‘hostPath’ into the file ‘name’, creating
+or replacing it, without passing the data through user memory where
+the kernel allows. Returns the open file's descriptor or an error
+code. */
+fileDescriptor tfs_importFile(char *hostPath, char *name);
+
+/* imports ‘count’ host files at once, storing each file's descriptor
+in ‘fds’. Extents are laid out one file after another, then the data
+is copied by up to IMPORT_THREADS threads. Returns success or the
+first error. */
+int tfs_importFiles(char **hostPaths, char **names, int count, fileDescriptor *fds);
+int importHostFiles(char **hostPaths, char **names, int count, fileDescriptor *fds);
+
+/* appends the file's content to the open host file ‘hostFd’, copying
+extent by extent inside the kernel where possible. Returns the number
+of bytes written or an error code. */
+int tfs_exportFile(fileDescriptor FD, int hostFd);
+int exportHostFile(fileDescriptor FD, int hostFd);
+
+/* starts recording every call to the tfs_ file, directory, batch and
+sync functions in the trace log ‘path’ (see tfsTrace.h), with its
+arguments, sizes, start time, latency and result, until tfs_traceStop.
+Content isn't recorded. 'tfsReplay' plays a log back. Returns
+ERR_BAD_REQUEST if a trace is already being recorded. */
+int tfs_traceStart(char *path);
+int tfs_traceStop();
+long long traceClock();
+int traceCall(int op, int fd, int arg, char *name, long long start, int result);
+fileDescriptor openFile(char *name);
+int closeFile(fileDescriptor FD);
+int writeFile(fileDescriptor FD, char *buffer, int size);
+int writeBytes(fileDescriptor FD, char *buffer, int size);
+int truncateFile(fileDescriptor FD, int size);
+int allocateFile(fileDescriptor FD, int size);
+int checkFileChange(tfs_openEntry *file, tfs_block *inode, int size);
+int deleteFile(fileDescriptor FD);
+int readByte(fileDescriptor FD, char *buffer);
+int readBytes(fileDescriptor FD, char *buffer, int size);
+int seekFile(fileDescriptor FD, int offset);
+int renameFile(fileDescriptor FD, char *newName);
+int makeDir(char *path);
+int removeDir(char *path);
+void makeRO(char *name);
+void makeRW(char *name);
+int batchBegin();
+int batchCommit();
+int batchAbort();
+int syncImage();
+
+/* tfs_stat fills ‘st’ for the file or directory at ‘path’ ("/" is the
+root). tfs_opendir starts a listing of the directory at ‘path’, and
+each tfs_readdir_next call fills ‘st’ for the next thing in it,
+returning 1, or 0 once there is nothing left. All three are answered
+from the inode table built at mount and kept up to date by every
+inode write, so they never touch the disk. Entries come in block order,
+not name order. */
+int tfs_stat(char *path, tfs_fileStat *st);
+int statPath(char *path, tfs_fileStat *st);
+int tfs_opendir(char *path, tfs_dir *dir);
+int tfs_readdir_next(tfs_dir *dir, tfs_fileStat *st);
+void cacheInode(int bNum, char *block);
+int loadInode(int bNum, char *block, void *arg);
+int loadInodeTable();
+int tableLookup(int dir, char *name);
+
+/* Lock-free reading for read-only mounts. tfs_openReader points
+‘reader’ at the start of the file at ‘path’. tfs_readerRead reads up to
+‘size’ bytes at the reader's offset and moves it on, tfs_readerPread
+reads at ‘offset’ and leaves it alone. Both return the number of bytes
+read, 0 at the end of the file, or an error code. Each call is a few
+positional reads through an extent index built at mount that nothing
+changes afterwards, so any number of threads can read at once as long as
+each uses its own tfs_reader. The reader calls fail with ERR_BAD_REQUEST
+on a mount that can write, and aren't traced. */
+int tfs_openReader(char *path, tfs_reader *reader);
+int openReader(char *path, tfs_reader *reader);
+int tfs_readerRead(tfs_reader *reader, char *buffer, int size);
+int tfs_readerPread(tfs_reader *reader, int offset, char *buffer, int size);
+int readIndexed(tfs_reader *reader, int offset, char *buffer, int size);
+int loadExtentIndex();
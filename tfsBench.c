@@ -0,0 +1,770 @@
+/* Program 4
+ * Daniel Foxhoven
+ * Geoff Wacker
+ * Adair Camacho
+ * Due Date: 3/19/17
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "tinyFS.h"
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+
+#define BENCH_DISK_NAME "tfsBenchDisk"
+#define BENCH_ROUNDS 20
+#define BENCH_READ_BYTES 16384
+#define CHURN_FILES 24
+#define CHURN_STEPS 400
+#define CHURN_MAX_BLOCKS 12
+#define INGEST_FILES 100
+#define INGEST_ROUNDS 20
+#define INGEST_BATCH 20
+#define DURABILITY_FILES 60
+#define DURABILITY_ROUNDS 5
+#define DURABILITY_BATCH 10
+#define STRIPE_BLOCK_SIZE 65536
+#define STRIPE_UNIT 16384
+#define STRIPE_ROUNDS 5
+#define STAT_FILES 200
+#define STAT_ROUNDS 200
+#define READER_BLOCK_SIZE 4096
+#define READER_READS 40000
+#define READER_SIZE 4000
+#define READER_MAX_THREADS 8
+#define TRIM_BLOCK_SIZE 65536
+#define TRIM_FILES 8
+#define TRIM_ROUNDS 20
+#define TRIM_COPY_NAME "tfsBenchDisk.copy"
+#define TRUNCATE_BLOCK_SIZE 4096
+#define TRUNCATE_BLOCKS 200
+#define TRUNCATE_STEP 1000
+#define LOG_BLOCK_SIZE 4096
+#define LOG_FILES 40
+#define LOG_STEPS 2000
+#define LOG_MAX_BLOCKS 4
+#define QUEUE_BLOCK_SIZE 4096
+#define QUEUE_FILES 40
+#define QUEUE_STEPS 2000
+#define QUEUE_MAX_BLOCKS 16
+
+/* Block sizes to measure, smallest to largest */
+int benchSizes[] = {256, 4096, 65536};
+
+char *policyNames[] = {"head", "next fit", "best fit", "near"};
+
+/* Mount options for each durability mode benchDurability measures. The
+last two batch their ops or go through O_DIRECT. */
+tfs_mountOptions durabilityModes[] = {
+    {ALLOC_HEAD, TFS_SYNC_NONE, 0}, {ALLOC_HEAD, TFS_SYNC_CLOSE, 0}, {ALLOC_HEAD, TFS_SYNC_OP, 0},
+    {ALLOC_HEAD, TFS_SYNC_OP, 0},   {ALLOC_HEAD, TFS_SYNC_NONE, 1},
+};
+char *durabilityNames[] = {"none", "close", "op", "op+batch", "direct"};
+
+char *stripeMembers[] = {"tfsBenchDisk.0", "tfsBenchDisk.1", "tfsBenchDisk.2", "tfsBenchDisk.3"};
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Formats a fresh image with ‘size’ byte blocks, then times whole-file
+writes with tfs_writeFile and byte reads with tfs_readByte. The file
+fills most of the image so every block size moves the same share of
+its capacity. */
+int benchBlockSize(int size) {
+    fileDescriptor FD;
+    char *content, readBuffer;
+    int fileSize, i, round, readBytes;
+    double start, writeTime, readTime;
+
+    if (tfs_mkfsBlockSize(BENCH_DISK_NAME, MAX_BLOCKS * size, size) < 0 ||
+        tfs_mount(BENCH_DISK_NAME) < 0) {
+        fprintf(stderr, "bench: could not set up %d byte blocks\n", size);
+        return -1;
+    }
+
+    // Leave room for the superblock, root directory, its entries and the inode.
+    fileSize = (MAX_BLOCKS - 4) * (size - 4);
+    content = malloc(fileSize);
+    for (i = 0; i < fileSize; i++) {
+        content[i] = 'a' + (i % 26);
+    }
+
+    if ((FD = tfs_openFile("bench")) < 0) {
+        free(content);
+        tfs_unmount();
+        return -1;
+    }
+
+    start = now();
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        if (tfs_writeFile(FD, content, fileSize) < 0) {
+            fprintf(stderr, "bench: write failed at %d byte blocks\n", size);
+            break;
+        }
+    }
+    writeTime = now() - start;
+
+    // Byte reads walk the extent chain each call, so only time a prefix.
+    readBytes = fileSize < BENCH_READ_BYTES ? fileSize : BENCH_READ_BYTES;
+    tfs_seek(FD, 0);
+    start = now();
+    for (i = 0; i < readBytes && tfs_readByte(FD, &readBuffer) >= 0; i++)
+        ;
+    readTime = now() - start;
+
+    printf("%6d B blocks: %8.2f MB/s writeFile (%d x %d bytes), %8.3f MB/s readByte (%d bytes)\n",
+           size, (double) fileSize * BENCH_ROUNDS / writeTime / 1e6, BENCH_ROUNDS, fileSize,
+           (double) i / readTime / 1e6, i);
+
+    free(content);
+    tfs_closeFile(FD);
+    tfs_unmount();
+    remove(BENCH_DISK_NAME);
+    return 0;
+}
+
+/* Mounts a fresh image with allocation policy ‘policy’ and churns a
+set of files: each step rewrites, grows or deletes and recreates one of
+them at random. Reports how long the runs of consecutive blocks the
+files end up in are on average. Every policy sees the same steps. */
+int benchPolicy(int policy) {
+    fileDescriptor fds[CHURN_FILES];
+    char name[9], content[CHURN_MAX_BLOCKS * (BLOCKSIZE - 4)];
+    int sizes[CHURN_FILES], i, step, files, blocks, runs;
+
+    if (tfs_mkfs(BENCH_DISK_NAME, MAX_BLOCKS * BLOCKSIZE) < 0 ||
+        tfs_mountPolicy(BENCH_DISK_NAME, policy) < 0) {
+        fprintf(stderr, "bench: could not set up the %s policy\n", policyNames[policy]);
+        return -1;
+    }
+    memset(content, 'x', sizeof(content));
+
+    srand(1);
+    for (i = 0; i < CHURN_FILES; i++) {
+        snprintf(name, sizeof(name), "churn%d", i);
+        fds[i] = tfs_openFile(name);
+        sizes[i] = (rand() % CHURN_MAX_BLOCKS / 2 + 1) * (BLOCKSIZE - 4);
+        tfs_writeFile(fds[i], content, sizes[i]);
+    }
+    for (step = 0; step < CHURN_STEPS; step++) {
+        i = rand() % CHURN_FILES;
+        switch (rand() % 3) {
+        case 0:
+            sizes[i] = (rand() % CHURN_MAX_BLOCKS + 1) * (BLOCKSIZE - 4);
+            tfs_writeFile(fds[i], content, sizes[i]);
+            break;
+        case 1:
+            // Grow it by a block, if there is room.
+            if (sizes[i] + BLOCKSIZE - 4 <= sizeof(content)) {
+                tfs_seek(fds[i], sizes[i]);
+                if (tfs_writeBytes(fds[i], content, BLOCKSIZE - 4) > 0) {
+                    sizes[i] += BLOCKSIZE - 4;
+                }
+            }
+            break;
+        default:
+            snprintf(name, sizeof(name), "churn%d", i);
+            tfs_deleteFile(fds[i]);
+            fds[i] = tfs_openFile(name);
+            sizes[i] = (rand() % CHURN_MAX_BLOCKS + 1) * (BLOCKSIZE - 4);
+            tfs_writeFile(fds[i], content, sizes[i]);
+        }
+    }
+
+    if (tfs_runStats(&files, &blocks, &runs) >= 0 && runs) {
+        printf("%8s: %3d files, %4d extents in %4d runs, average run %5.2f blocks\n",
+               policyNames[policy], files, blocks, runs, (double) blocks / runs);
+    }
+
+    tfs_unmount();
+    remove(BENCH_DISK_NAME);
+    return 0;
+}
+
+/* Times creating and writing INGEST_FILES small files, each with its
+own calls or in batches of INGEST_BATCH files, under the ‘sync’
+durability mode. A batch is durable when it commits, so it pays two
+syncs (the journal, then the image) and a mount's first commit also
+creates the journal; against unsynced calls it only saves the per-call
+overhead, and it is meant to be compared with TFS_SYNC_OP. */
+int benchIngest(int batched, int sync) {
+    tfs_mountOptions options = {ALLOC_HEAD, sync, 0};
+    fileDescriptor FD;
+    char name[9], content[100];
+    int i, round, files = 0;
+    double start, elapsed = 0;
+
+    memset(content, 'i', sizeof(content));
+    for (round = 0; round < INGEST_ROUNDS; round++) {
+        if (tfs_mkfs(BENCH_DISK_NAME, MAX_BLOCKS * BLOCKSIZE) < 0 ||
+            tfs_mountWith(BENCH_DISK_NAME, &options) < 0) {
+            fprintf(stderr, "bench: could not set up ingest\n");
+            return -1;
+        }
+        start = now();
+        for (i = 0; i < INGEST_FILES; i++) {
+            if (batched && i % INGEST_BATCH == 0) {
+                tfs_batchBegin();
+            }
+            snprintf(name, sizeof(name), "in%d", i);
+            if ((FD = tfs_openFile(name)) >= 0 && tfs_writeFile(FD, content, sizeof(content)) >= 0) {
+                files++;
+            }
+            if (batched && (i % INGEST_BATCH == INGEST_BATCH - 1 || i == INGEST_FILES - 1)) {
+                tfs_batchCommit();
+            }
+        }
+        elapsed += now() - start;
+        tfs_unmount();
+    }
+
+    printf("%8s ingest: %10.0f files/s (%d files of %d bytes, %s)\n", batched ? "batched" : "unbatched",
+           files / elapsed, INGEST_FILES, (int) sizeof(content),
+           batched ? "durable per batch" : sync == TFS_SYNC_OP ? "durable per call" : "not synced");
+    remove(BENCH_DISK_NAME);
+    return 0;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Creates, writes and closes small files under one durability mode and
+reports the throughput along with the mean and 99th percentile time
+per file. In the batched mode the commit is charged to the last file
+of each batch. */
+int benchDurability(int mode) {
+    static double latency[DURABILITY_FILES * DURABILITY_ROUNDS];
+    fileDescriptor FD;
+    char name[9], content[100];
+    int i, round, count = 0, batched = mode == 3;
+    double start, total = 0;
+
+    memset(content, 'd', sizeof(content));
+    for (round = 0; round < DURABILITY_ROUNDS; round++) {
+        if (tfs_mkfs(BENCH_DISK_NAME, MAX_BLOCKS * BLOCKSIZE) < 0 ||
+            tfs_mountWith(BENCH_DISK_NAME, &durabilityModes[mode]) < 0) {
+            fprintf(stderr, "bench: could not mount in %s mode\n", durabilityNames[mode]);
+            return -1;
+        }
+        for (i = 0; i < DURABILITY_FILES; i++) {
+            snprintf(name, sizeof(name), "du%d", i);
+            start = now();
+            if (batched && i % DURABILITY_BATCH == 0) {
+                tfs_batchBegin();
+            }
+            if ((FD = tfs_openFile(name)) >= 0) {
+                tfs_writeFile(FD, content, sizeof(content));
+                tfs_closeFile(FD);
+            }
+            if (batched && i % DURABILITY_BATCH == DURABILITY_BATCH - 1) {
+                tfs_batchCommit();
+            }
+            latency[count] = now() - start;
+            total += latency[count++];
+        }
+        tfs_unmount();
+    }
+
+    qsort(latency, count, sizeof(double), compareDoubles);
+    printf("%8s durability: %10.0f files/s, mean %8.1f us, p99 %8.1f us\n", durabilityNames[mode],
+           count / total, total / count * 1e6, latency[count * 99 / 100] * 1e6);
+    remove(BENCH_DISK_NAME);
+    return 0;
+}
+
+/* Writes, in one batch, and reads back a file filling most of an image
+striped over ‘count’ files with 64 KiB blocks in 16 KiB units. The
+image is mounted with direct I/O so the times are those of the devices
+behind the files rather than of the page cache. */
+int benchStripe(int count) {
+    tfs_mountOptions options = {ALLOC_HEAD, TFS_SYNC_NONE, 1};
+    fileDescriptor FD;
+    char *content, *back;
+    int fileSize, i, round;
+    double start, writeTime = 0, readTime = 0;
+
+    fileSize = (MAX_BLOCKS - 4) * (STRIPE_BLOCK_SIZE - 4);
+    content = malloc(fileSize);
+    back = malloc(fileSize);
+    for (i = 0; i < fileSize; i++) {
+        content[i] = 'a' + (i % 26);
+    }
+
+    for (round = 0; round < STRIPE_ROUNDS; round++) {
+        if (tfs_mkfsStriped(stripeMembers, count, MAX_BLOCKS * STRIPE_BLOCK_SIZE, STRIPE_BLOCK_SIZE,
+                            STRIPE_UNIT) < 0 ||
+            tfs_mountStriped(stripeMembers, count, &options) < 0 || (FD = tfs_openFile("stripe")) < 0) {
+            fprintf(stderr, "bench: could not set up %d striped files\n", count);
+            free(content);
+            free(back);
+            return -1;
+        }
+        start = now();
+        tfs_batchBegin();
+        tfs_writeFile(FD, content, fileSize);
+        tfs_batchCommit();
+        writeTime += now() - start;
+        start = now();
+        if (tfs_readBytes(FD, back, fileSize) != fileSize || memcmp(back, content, fileSize) != 0) {
+            fprintf(stderr, "bench: striped read back wrong content\n");
+        }
+        readTime += now() - start;
+        tfs_unmount();
+    }
+
+    printf("%d striped files: %8.2f MB/s write, %8.2f MB/s read\n", count,
+           (double) fileSize * STRIPE_ROUNDS / writeTime / 1e6, (double) fileSize * STRIPE_ROUNDS / readTime / 1e6);
+    for (i = 0; i < count; i++) {
+        remove(stripeMembers[i]);
+    }
+    free(content);
+    free(back);
+    return 0;
+}
+
+/* Lists a directory of STAT_FILES empty files and gets every file's
+times, first through the inode table with tfs_opendir and
+tfs_readdir_next, then the old way with tfs_readdirPage and an open
+plus the three tfs_readFile calls per file. */
+int benchStat() {
+    tfs_dir dir;
+    tfs_fileStat st;
+    tfs_dirent page[READDIR_PAGE];
+    fileDescriptor FD;
+    char name[9];
+    int i, round, count, cursor, seen = 0;
+    double start, tableTime, oldTime;
+    time_t sum = 0;
+
+    if (tfs_mkfs(BENCH_DISK_NAME, MAX_BLOCKS * BLOCKSIZE) < 0 || tfs_mount(BENCH_DISK_NAME) < 0) {
+        fprintf(stderr, "bench: could not set up stat\n");
+        return -1;
+    }
+    for (i = 0; i < STAT_FILES; i++) {
+        snprintf(name, sizeof(name), "st%d", i);
+        tfs_closeFile(tfs_openFile(name));
+    }
+
+    start = now();
+    for (round = 0; round < STAT_ROUNDS; round++) {
+        tfs_opendir("/", &dir);
+        while (tfs_readdir_next(&dir, &st) == 1) {
+            sum += st.created + st.modified + st.accessed;
+            seen++;
+        }
+    }
+    tableTime = now() - start;
+
+    start = now();
+    for (round = 0; round < STAT_ROUNDS; round++) {
+        cursor = 0;
+        while ((count = tfs_readdirPage("/", &cursor, page, READDIR_PAGE)) > 0) {
+            for (i = 0; i < count; i++) {
+                FD = tfs_openFile(page[i].name);
+                sum += tfs_readFileInfo(FD) + tfs_readFileLastModified(FD) + tfs_readFileLastAccessed(FD);
+                tfs_closeFile(FD);
+            }
+        }
+    }
+    oldTime = now() - start;
+    tfs_unmount();
+
+    printf("stat %d files: %8.1f ns each from the inode table, %8.1f ns with open and readFileInfo (%ld)\n",
+           seen / STAT_ROUNDS, tableTime / seen * 1e9, oldTime / seen * 1e9, (long) (sum & 1));
+    remove(BENCH_DISK_NAME);
+    return 0;
+}
+
+/* One thread's share of benchReaders */
+typedef struct {
+    unsigned int seed;
+    int failed;
+} bench_reader;
+
+void *readerThread(void *arg) {
+    bench_reader *me = arg;
+    tfs_reader reader;
+    char buf[READER_SIZE];
+    int fileSize = (MAX_BLOCKS - 8) * (READER_BLOCK_SIZE - 4), i;
+
+    if (tfs_openReader("reader", &reader) < 0) {
+        me->failed = 1;
+        return NULL;
+    }
+    for (i = 0; i < READER_READS; i++) {
+        if (tfs_readerPread(&reader, rand_r(&me->seed) % (fileSize - READER_SIZE), buf, READER_SIZE) !=
+            READER_SIZE) {
+            me->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+/* Mounts a file filling most of an image read-only and times random
+READER_SIZE byte reads through tfs_readerPread from 1, 2, 4 and 8
+threads at once, then the same reads from one thread with tfs_seek and
+tfs_readBytes, which go through the open file table and read the inode
+every time. */
+int benchReaders() {
+    tfs_mountOptions readOnly = {ALLOC_HEAD, TFS_SYNC_NONE, 0, 1};
+    long readRequests, readCalls, writeRequests, writeCalls;
+    bench_reader readers[READER_MAX_THREADS];
+    pthread_t threads[READER_MAX_THREADS];
+    fileDescriptor FD;
+    char *content;
+    int fileSize = (MAX_BLOCKS - 8) * (READER_BLOCK_SIZE - 4), i, count;
+    unsigned int seed = 1;
+    double start, elapsed;
+
+    content = malloc(fileSize);
+    for (i = 0; i < fileSize; i++) {
+        content[i] = 'a' + (i % 26);
+    }
+    if (tfs_mkfsBlockSize(BENCH_DISK_NAME, MAX_BLOCKS * READER_BLOCK_SIZE, READER_BLOCK_SIZE) < 0 ||
+        tfs_mount(BENCH_DISK_NAME) < 0 || (FD = tfs_openFile("reader")) < 0 ||
+        tfs_writeFile(FD, content, fileSize) < 0 || tfs_unmount() < 0 ||
+        tfs_mountWith(BENCH_DISK_NAME, &readOnly) < 0) {
+        fprintf(stderr, "bench: could not set up readers\n");
+        free(content);
+        return -1;
+    }
+
+    for (count = 1; count <= READER_MAX_THREADS; count *= 2) {
+        start = now();
+        for (i = 0; i < count; i++) {
+            readers[i].seed = i + 1;
+            readers[i].failed = 0;
+            pthread_create(&threads[i], NULL, readerThread, &readers[i]);
+        }
+        for (i = 0; i < count; i++) {
+            pthread_join(threads[i], NULL);
+            if (readers[i].failed) {
+                fprintf(stderr, "bench: reader %d failed\n", i);
+            }
+        }
+        elapsed = now() - start;
+        printf("%d reader threads: %10.0f reads/s, %8.2f MB/s\n", count, count * READER_READS / elapsed,
+               (double) count * READER_READS * READER_SIZE / elapsed / 1e6);
+    }
+    if (tfs_ioStats(&readRequests, &readCalls, &writeRequests, &writeCalls) == SUCCESS && readCalls) {
+        printf("tfs_readerPread:  %ld blocks in %ld reads, %.2f blocks per read\n", readRequests, readCalls,
+               (double) readRequests / readCalls);
+    }
+
+    FD = tfs_openFile("reader");
+    start = now();
+    for (i = 0; i < READER_READS; i++) {
+        tfs_seek(FD, rand_r(&seed) % (fileSize - READER_SIZE));
+        tfs_readBytes(FD, content, READER_SIZE);
+    }
+    elapsed = now() - start;
+    printf("tfs_readBytes:    %10.0f reads/s, %8.2f MB/s\n", READER_READS / elapsed,
+           (double) READER_READS * READER_SIZE / elapsed / 1e6);
+
+    tfs_unmount();
+    remove(BENCH_DISK_NAME);
+    free(content);
+    return 0;
+}
+
+/* Copies ‘from’ to ‘to’ the way sparse-aware tools do, reading only
+what SEEK_DATA finds and leaving holes as holes. */
+int copySparse(char *from, char *to) {
+    char buf[65536];
+    off_t data, hole, size;
+    ssize_t got;
+    int in, out, ret = 0;
+
+    if ((in = open(from, O_RDONLY)) < 0 || (out = open(to, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+        return -1;
+    }
+    size = lseek(in, 0, SEEK_END);
+    for (data = lseek(in, 0, SEEK_DATA); data >= 0 && data < size; data = lseek(in, hole, SEEK_DATA)) {
+        hole = lseek(in, data, SEEK_HOLE);
+        for (; data < hole; data += got) {
+            if ((got = pread(in, buf, hole - data < sizeof(buf) ? hole - data : sizeof(buf), data)) <= 0 ||
+                pwrite(out, buf, got, data) != got) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    if (ftruncate(out, size) < 0) {
+        ret = -1;
+    }
+    close(in);
+    close(out);
+    return ret;
+}
+
+long hostKiB(char *path) {
+    struct stat st;
+
+    return stat(path, &st) == 0 ? (long) st.st_blocks * 512 / 1024 : -1;
+}
+
+/* Fills an image with 64 KiB blocks with TRIM_FILES files, then deletes
+all but one. Reports how much of the host file system the image takes
+up and how long a sparse-aware copy of it takes, full, after the
+deletes, which punch the freed blocks, and after a tfs_trim of a freshly
+formatted image. */
+int benchTrim() {
+    fileDescriptor FDs[TRIM_FILES];
+    char *content, name[9];
+    int fileSize = (MAX_BLOCKS - 4 - TRIM_FILES) / TRIM_FILES * (TRIM_BLOCK_SIZE - 4), i, stage, round;
+    char *stages[] = {"full", "deleted", "trimmed"};
+    double start;
+
+    content = malloc(fileSize);
+    for (i = 0; i < fileSize; i++) {
+        content[i] = 'a' + (i % 26);
+    }
+    if (tfs_mkfsBlockSize(BENCH_DISK_NAME, MAX_BLOCKS * TRIM_BLOCK_SIZE, TRIM_BLOCK_SIZE) < 0 ||
+        tfs_mount(BENCH_DISK_NAME) < 0) {
+        fprintf(stderr, "bench: could not set up trim\n");
+        free(content);
+        return -1;
+    }
+    for (i = 0; i < TRIM_FILES; i++) {
+        snprintf(name, sizeof(name), "tr%d", i);
+        FDs[i] = tfs_openFile(name);
+        tfs_writeFile(FDs[i], content, fileSize);
+    }
+
+    for (stage = 0; stage < 3; stage++) {
+        if (stage == 1) {
+            for (i = 1; i < TRIM_FILES; i++) {
+                tfs_deleteFile(FDs[i]);
+            }
+        }
+        else if (stage == 2) {
+            tfs_unmount();
+            tfs_mkfsBlockSize(BENCH_DISK_NAME, MAX_BLOCKS * TRIM_BLOCK_SIZE, TRIM_BLOCK_SIZE);
+            tfs_mount(BENCH_DISK_NAME);
+            tfs_trim();
+        }
+        tfs_sync();
+        start = now();
+        for (round = 0; round < TRIM_ROUNDS; round++) {
+            copySparse(BENCH_DISK_NAME, TRIM_COPY_NAME);
+        }
+        printf("trim %-8s %6ld KiB on the host, sparse copy %8.3f ms\n", stages[stage], hostKiB(BENCH_DISK_NAME),
+               (now() - start) / TRIM_ROUNDS * 1e3);
+    }
+    tfs_unmount();
+
+    remove(BENCH_DISK_NAME);
+    remove(TRIM_COPY_NAME);
+    free(content);
+    return 0;
+}
+
+/* Shrinks a file of TRUNCATE_BLOCKS 4 KiB blocks TRUNCATE_STEP bytes at a
+time, with tfs_truncate and then by writing the shorter content with
+tfs_writeFile. Then appends to two files in turn, 4092 bytes at a time,
+with and without a tfs_fallocate of the first one's final size, and
+counts the runs of consecutive blocks the files end up in. */
+int benchTruncate() {
+    fileDescriptor FD, other;
+    char *content;
+    int fileSize = TRUNCATE_BLOCKS * (TRUNCATE_BLOCK_SIZE - 4), size, steps, i, reserve, files, blocks, runs;
+    double start, truncateTime, rewriteTime;
+
+    content = malloc(fileSize);
+    for (i = 0; i < fileSize; i++) {
+        content[i] = 'a' + (i % 26);
+    }
+    for (i = 0; i < 2; i++) {
+        if (tfs_mkfsBlockSize(BENCH_DISK_NAME, MAX_BLOCKS * TRUNCATE_BLOCK_SIZE, TRUNCATE_BLOCK_SIZE) < 0 ||
+            tfs_mount(BENCH_DISK_NAME) < 0 || (FD = tfs_openFile("trunc")) < 0 ||
+            tfs_writeFile(FD, content, fileSize) < 0) {
+            fprintf(stderr, "bench: could not set up truncate\n");
+            free(content);
+            return -1;
+        }
+        start = now();
+        for (size = fileSize - TRUNCATE_STEP, steps = 0; size > 0; size -= TRUNCATE_STEP, steps++) {
+            if (i == 0) {
+                tfs_truncate(FD, size);
+            }
+            else {
+                tfs_writeFile(FD, content, size);
+            }
+        }
+        if (i == 0) {
+            truncateTime = (now() - start) / steps;
+        }
+        else {
+            rewriteTime = (now() - start) / steps;
+        }
+        tfs_unmount();
+    }
+    printf("shrink %d KiB file: %8.1f us with tfs_truncate, %8.1f us with tfs_writeFile\n",
+           fileSize / 1024, truncateTime * 1e6, rewriteTime * 1e6);
+
+    for (reserve = 1; reserve >= 0; reserve--) {
+        tfs_mkfsBlockSize(BENCH_DISK_NAME, MAX_BLOCKS * TRUNCATE_BLOCK_SIZE, TRUNCATE_BLOCK_SIZE);
+        tfs_mount(BENCH_DISK_NAME);
+        FD = tfs_openFile("log");
+        other = tfs_openFile("other");
+        if (reserve) {
+            tfs_fallocate(FD, 100 * (TRUNCATE_BLOCK_SIZE - 4));
+        }
+        for (i = 0; i < 100; i++) {
+            tfs_writeBytes(FD, content, TRUNCATE_BLOCK_SIZE - 4);
+            tfs_writeBytes(other, content, TRUNCATE_BLOCK_SIZE - 4);
+        }
+        tfs_runStats(&files, &blocks, &runs);
+        printf("interleaved appends %s tfs_fallocate: %d blocks in %d runs\n", reserve ? "after" : "without",
+               blocks, runs);
+        tfs_unmount();
+    }
+
+    remove(BENCH_DISK_NAME);
+    free(content);
+    return 0;
+}
+
+/* Rewrites and deletes small files at random on a plain and on a
+log-structured image, under one durability mode, and reports the files
+rewritten or deleted per second. For the log it also counts the segments left empty, before
+and after running the cleaner to the end. */
+int benchLog(int log, int durability) {
+    tfs_mountOptions options = {ALLOC_HEAD, durability, 0};
+    fileDescriptor FD;
+    char name[9], *content;
+    int i, size, segments, empty, live;
+    double start, elapsed;
+
+    content = malloc(LOG_MAX_BLOCKS * (LOG_BLOCK_SIZE - 4));
+    memset(content, 'l', LOG_MAX_BLOCKS * (LOG_BLOCK_SIZE - 4));
+    if ((log ? tfs_mkfsLog(BENCH_DISK_NAME, MAX_BLOCKS * LOG_BLOCK_SIZE, LOG_BLOCK_SIZE)
+             : tfs_mkfsBlockSize(BENCH_DISK_NAME, MAX_BLOCKS * LOG_BLOCK_SIZE, LOG_BLOCK_SIZE)) < 0 ||
+        tfs_mountWith(BENCH_DISK_NAME, &options) < 0) {
+        fprintf(stderr, "bench: could not set up the log\n");
+        free(content);
+        return -1;
+    }
+
+    srand(LOG_STEPS);
+    start = now();
+    for (i = 0; i < LOG_STEPS; i++) {
+        snprintf(name, sizeof(name), "lg%d", rand() % LOG_FILES);
+        size = rand() % (LOG_MAX_BLOCKS * (LOG_BLOCK_SIZE - 4)) + 1;
+        if ((FD = tfs_openFile(name)) < 0) {
+            continue;
+        }
+        if (rand() % 8 == 0) {
+            tfs_deleteFile(FD);
+        }
+        else {
+            tfs_writeFile(FD, content, size);
+            tfs_closeFile(FD);
+        }
+    }
+    elapsed = now() - start;
+
+    printf("%-8s image, %5s durability: %8.0f files/s", log ? "log" : "in-place", durabilityNames[durability],
+           LOG_STEPS / elapsed);
+    if (log && tfs_logStats(&segments, &empty, &live) == SUCCESS) {
+        printf(", %d of %d segments empty", empty, segments);
+        for (i = 0; i < MAX_BLOCKS && tfs_cleanLog(MAX_BLOCKS) > 0; i++) {
+        }
+        tfs_logStats(&segments, &empty, &live);
+        printf(", %d after cleaning", empty);
+    }
+    printf("\n");
+
+    tfs_unmount();
+    remove(BENCH_DISK_NAME);
+    free(content);
+    return 0;
+}
+
+/* Rewrites files of up to QUEUE_MAX_BLOCKS blocks at random on a
+churned image, with each call's writes queued and merged or written
+through one block at a time, and reports the files rewritten per second
+and how many block writes each pwritev carried. */
+int benchQueue(int writeThrough) {
+    tfs_mountOptions options = {ALLOC_HEAD, TFS_SYNC_NONE, 0, 0, writeThrough};
+    long readRequests, readCalls, writeRequests, writeCalls;
+    fileDescriptor fds[QUEUE_FILES];
+    char name[9], *content;
+    int i;
+    double start, elapsed;
+
+    content = malloc(QUEUE_MAX_BLOCKS * (QUEUE_BLOCK_SIZE - 4));
+    memset(content, 'q', QUEUE_MAX_BLOCKS * (QUEUE_BLOCK_SIZE - 4));
+    if (tfs_mkfsBlockSize(BENCH_DISK_NAME, MAX_BLOCKS * QUEUE_BLOCK_SIZE, QUEUE_BLOCK_SIZE) < 0 ||
+        tfs_mountWith(BENCH_DISK_NAME, &options) < 0) {
+        fprintf(stderr, "bench: could not set up the queue\n");
+        free(content);
+        return -1;
+    }
+    for (i = 0; i < QUEUE_FILES; i++) {
+        snprintf(name, sizeof(name), "qu%d", i);
+        fds[i] = tfs_openFile(name);
+    }
+
+    srand(QUEUE_STEPS);
+    start = now();
+    for (i = 0; i < QUEUE_STEPS; i++) {
+        tfs_writeFile(fds[rand() % QUEUE_FILES], content, rand() % (QUEUE_MAX_BLOCKS * (QUEUE_BLOCK_SIZE - 4)) + 1);
+    }
+    elapsed = now() - start;
+
+    printf("%-13s: %8.0f files/s", writeThrough ? "write-through" : "queued", QUEUE_STEPS / elapsed);
+    if (tfs_ioStats(&readRequests, &readCalls, &writeRequests, &writeCalls) == SUCCESS && writeCalls) {
+        printf(", %ld blocks in %ld writes, %.2f blocks per write", writeRequests, writeCalls,
+               (double) writeRequests / writeCalls);
+    }
+    printf("\n");
+
+    tfs_unmount();
+    remove(BENCH_DISK_NAME);
+    free(content);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int i;
+
+    for (i = 0; i < sizeof(benchSizes) / sizeof(benchSizes[0]); i++) {
+        benchBlockSize(benchSizes[i]);
+    }
+    for (i = ALLOC_HEAD; i <= ALLOC_NEAR; i++) {
+        benchPolicy(i);
+    }
+    benchIngest(0, TFS_SYNC_NONE);
+    benchIngest(0, TFS_SYNC_OP);
+    benchIngest(1, TFS_SYNC_NONE);
+    for (i = 0; i < sizeof(durabilityNames) / sizeof(durabilityNames[0]); i++) {
+        benchDurability(i);
+    }
+    for (i = 1; i <= 4; i *= 2) {
+        benchStripe(i);
+    }
+    benchStat();
+    benchReaders();
+    benchTrim();
+    benchTruncate();
+    benchLog(0, TFS_SYNC_NONE);
+    benchLog(1, TFS_SYNC_NONE);
+    benchLog(0, TFS_SYNC_OP);
+    benchLog(1, TFS_SYNC_OP);
+    benchQueue(1);
+    benchQueue(0);
+    return 0;
+}
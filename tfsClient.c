@@ -0,0 +1,255 @@
+/* Program 4
+ * Daniel Foxhoven
+ * Geoff Wacker
+ * Adair Camacho
+ * Due Date: 3/19/17
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "tfsClient.h"
+#include "tinyfsProto.h"
+#include "tinyFS_errno.h"
+
+/* A request that has been queued but not answered yet, and where its
+response data should go */
+typedef struct {
+	char *dest;
+	int destLen;
+} tfsc_pending;
+
+int clientSock = -1;
+int clientBatching = 0;
+char *clientOut = NULL;
+int clientOutLen = 0;
+int clientOutCap = 0;
+tfsc_pending *clientPending = NULL;
+int clientPendingCount = 0;
+int clientPendingCap = 0;
+
+int tfsc_connect(char *socketPath) {
+	struct sockaddr_un addr;
+
+	if (clientSock >= 0) {
+		errno = EISCONN;
+		return -1;
+	}
+	if ((clientSock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+	if (connect(clientSock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(clientSock);
+		clientSock = -1;
+		return -1;
+	}
+
+	return SUCCESS;
+}
+
+int tfsc_disconnect(void) {
+	if (clientSock < 0) {
+		return ERR_TFS_NOT_MOUNTED;
+	}
+	close(clientSock);
+	clientSock = -1;
+	clientBatching = 0;
+	clientOutLen = 0;
+	clientPendingCount = 0;
+	return SUCCESS;
+}
+
+int sendAll(int sock, char *buf, int len) {
+	int sent = 0, ret;
+
+	while (sent < len) {
+		if ((ret = write(sock, buf + sent, len - sent)) <= 0) {
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			}
+			return ERR_WRITE;
+		}
+		sent += ret;
+	}
+	return SUCCESS;
+}
+
+int recvAll(int sock, char *buf, int len) {
+	int got = 0, ret;
+
+	while (got < len) {
+		if ((ret = read(sock, buf + got, len - got)) <= 0) {
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			}
+			return ERR_READ;
+		}
+		got += ret;
+	}
+	return SUCCESS;
+}
+
+/* Appends one request to the outgoing buffer and remembers where its
+response data belongs. */
+int queueRequest(int op, int fd, int arg, char *name, char *data, int dataLen, char *dest, int destLen) {
+	tfsd_request req;
+	int nameLen = name ? strlen(name) : 0, need;
+
+	if (clientSock < 0) {
+		return ERR_TFS_NOT_MOUNTED;
+	}
+
+	need = clientOutLen + sizeof(req) + nameLen + dataLen;
+	if (need > clientOutCap) {
+		clientOutCap = need * 2;
+		clientOut = realloc(clientOut, clientOutCap);
+	}
+	if (clientPendingCount == clientPendingCap) {
+		clientPendingCap = clientPendingCap ? clientPendingCap * 2 : 16;
+		clientPending = realloc(clientPending, clientPendingCap * sizeof(tfsc_pending));
+	}
+
+	req.op = op;
+	req.pad = 0;
+	req.nameLen = nameLen;
+	req.fd = fd;
+	req.arg = arg;
+	// A pread asks for destLen bytes and sends none.
+	req.dataLen = op == TFSD_OP_PREAD ? destLen : dataLen;
+
+	memcpy(clientOut + clientOutLen, &req, sizeof(req));
+	clientOutLen += sizeof(req);
+	memcpy(clientOut + clientOutLen, name, nameLen);
+	clientOutLen += nameLen;
+	if (dataLen) {
+		memcpy(clientOut + clientOutLen, data, dataLen);
+		clientOutLen += dataLen;
+	}
+
+	clientPending[clientPendingCount].dest = dest;
+	clientPending[clientPendingCount].destLen = destLen;
+	clientPendingCount++;
+
+	return SUCCESS;
+}
+
+/* Sends everything queued and reads the responses back in order. */
+int flushRequests(int *results, int max) {
+	tfsd_response resp;
+	char discard[256];
+	int i, count = clientPendingCount, keep, left;
+
+	if (sendAll(clientSock, clientOut, clientOutLen) < 0) {
+		return ERR_WRITE;
+	}
+	clientOutLen = 0;
+	clientPendingCount = 0;
+
+	for (i = 0; i < count; i++) {
+		if (recvAll(clientSock, (char *) &resp, sizeof(resp)) < 0) {
+			return ERR_READ;
+		}
+		if (i < max) {
+			results[i] = resp.result;
+		}
+
+		// Copy what fits into the caller's buffer and drop the rest.
+		keep = resp.dataLen < clientPending[i].destLen ? resp.dataLen : clientPending[i].destLen;
+		if (keep && recvAll(clientSock, clientPending[i].dest, keep) < 0) {
+			return ERR_READ;
+		}
+		for (left = resp.dataLen - keep; left > 0; left -= sizeof(discard)) {
+			if (recvAll(clientSock, discard, left < sizeof(discard) ? left : sizeof(discard)) < 0) {
+				return ERR_READ;
+			}
+		}
+	}
+
+	return count;
+}
+
+int callRequest(int op, int fd, int arg, char *name, char *data, int dataLen, char *dest, int destLen) {
+	int ret, result;
+
+	if ((ret = queueRequest(op, fd, arg, name, data, dataLen, dest, destLen)) < 0) {
+		return ret;
+	}
+	if (clientBatching) {
+		return SUCCESS;
+	}
+	if ((ret = flushRequests(&result, 1)) < 0) {
+		return ret;
+	}
+	return result;
+}
+
+int tfsc_batchBegin(void) {
+	if (clientSock < 0) {
+		return ERR_TFS_NOT_MOUNTED;
+	}
+	clientBatching = 1;
+	return SUCCESS;
+}
+
+int tfsc_batchEnd(int *results, int max) {
+	clientBatching = 0;
+	return flushRequests(results, max);
+}
+
+fileDescriptor tfsc_openFile(char *name) {
+	return callRequest(TFSD_OP_OPEN, 0, 0, name, NULL, 0, NULL, 0);
+}
+
+int tfsc_closeFile(fileDescriptor FD) {
+	return callRequest(TFSD_OP_CLOSE, FD, 0, NULL, NULL, 0, NULL, 0);
+}
+
+int tfsc_writeFile(fileDescriptor FD, char *buffer, int size) {
+	return callRequest(TFSD_OP_WRITE, FD, 0, NULL, buffer, size, NULL, 0);
+}
+
+int tfsc_deleteFile(fileDescriptor FD) {
+	return callRequest(TFSD_OP_DELETE, FD, 0, NULL, NULL, 0, NULL, 0);
+}
+
+int tfsc_readByte(fileDescriptor FD, char *buffer) {
+	return callRequest(TFSD_OP_READBYTE, FD, 0, NULL, NULL, 0, buffer, 1);
+}
+
+int tfsc_seek(fileDescriptor FD, int offset) {
+	return callRequest(TFSD_OP_SEEK, FD, offset, NULL, NULL, 0, NULL, 0);
+}
+
+int tfsc_rename(fileDescriptor FD, char *newName) {
+	return callRequest(TFSD_OP_RENAME, FD, 0, newName, NULL, 0, NULL, 0);
+}
+
+int tfsc_mkdir(char *path) {
+	return callRequest(TFSD_OP_MKDIR, 0, 0, path, NULL, 0, NULL, 0);
+}
+
+int tfsc_rmdir(char *path) {
+	return callRequest(TFSD_OP_RMDIR, 0, 0, path, NULL, 0, NULL, 0);
+}
+
+int tfsc_makeRO(char *name) {
+	return callRequest(TFSD_OP_MAKERO, 0, 0, name, NULL, 0, NULL, 0);
+}
+
+int tfsc_makeRW(char *name) {
+	return callRequest(TFSD_OP_MAKERW, 0, 0, name, NULL, 0, NULL, 0);
+}
+
+int tfsc_pread(fileDescriptor FD, int offset, char *buffer, int size) {
+	return callRequest(TFSD_OP_PREAD, FD, offset, NULL, NULL, 0, buffer, size);
+}
@@ -0,0 +1,50 @@
+/* Program 4
+ * Daniel Foxhoven
+ * Geoff Wacker
+ * Adair Camacho
+ * Due Date: 3/19/17
+ */
+
+#ifndef TFS_CLIENT_H
+#define TFS_CLIENT_H
+
+#include "tinyFS.h"
+
+/* Client side of tinyfsd. Every tfsc_ call mirrors the tfs_ call of
+the same name and returns the same result codes, but runs inside the
+daemon that has the image mounted, so any number of processes can
+share one file system. Like libTinyFS, the library keeps a single
+connection per process. */
+
+/* Connects to the tinyfsd listening on the Unix socket ‘socketPath’.
+Returns SUCCESS or -1 with errno set. */
+int tfsc_connect(char *socketPath);
+int tfsc_disconnect(void);
+
+/* Between tfsc_batchBegin and tfsc_batchEnd calls are only queued and
+return SUCCESS; their output buffers are filled in once the batch is
+sent. tfsc_batchEnd sends every queued request in one write, waits for
+all the responses and stores up to ‘max’ results, in call order, in
+‘results’. Returns the number of requests in the batch or an error. */
+int tfsc_batchBegin(void);
+int tfsc_batchEnd(int *results, int max);
+
+fileDescriptor tfsc_openFile(char *name);
+int tfsc_closeFile(fileDescriptor FD);
+int tfsc_writeFile(fileDescriptor FD, char *buffer, int size);
+int tfsc_deleteFile(fileDescriptor FD);
+int tfsc_readByte(fileDescriptor FD, char *buffer);
+int tfsc_seek(fileDescriptor FD, int offset);
+int tfsc_rename(fileDescriptor FD, char *newName);
+int tfsc_mkdir(char *path);
+int tfsc_rmdir(char *path);
+int tfsc_makeRO(char *name);
+int tfsc_makeRW(char *name);
+
+/* Reads up to ‘size’ bytes at ‘offset’ without touching the shared
+file pointer. Returns the number of bytes read. The daemon merges
+overlapping and adjacent reads of a file from different clients into
+one pass over its extents. */
+int tfsc_pread(fileDescriptor FD, int offset, char *buffer, int size);
+
+#endif
@@ -0,0 +1,41 @@
+/* Program 4
+ * Daniel Foxhoven
+ * Geoff Wacker
+ * Adair Camacho
+ * Due Date: 3/19/17
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tinyFS.h"
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+
+/* Builds a TinyFS image from a host directory tree:
+   tfsMkimage <host dir> <image> [block size] [bytes]
+The image defaults to the largest size the block size allows. */
+int main(int argc, char *argv[]) {
+    struct timespec start, end;
+    int size = argc > 3 ? atoi(argv[3]) : BLOCKSIZE;
+    int nBytes = argc > 4 ? atoi(argv[4]) : MAX_BLOCKS * size;
+    double seconds;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: tfsMkimage <host dir> <image> [block size] [bytes]\n");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (tfs_mkimage(argv[1], argv[2], nBytes, size) < 0) {
+        fprintf(stderr, "tfsMkimage: could not build %s\n", argv[2]);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s: %d bytes in %.3f s (%.2f MB/s)\n", argv[2], nBytes / size * size, seconds,
+           nBytes / size * size / seconds / 1e6);
+    return 0;
+}
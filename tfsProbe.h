@@ -0,0 +1,62 @@
+/* Program 4
+ * Daniel Foxhoven
+ * Geoff Wacker
+ * Adair Camacho
+ * Due Date: 3/19/17
+ */
+
+#ifndef TFS_PROBE_H
+#define TFS_PROBE_H
+
+/* USDT probes, under the provider "tinyfs", that bpftrace, perf or
+SystemTap can attach to in a running process. They come from
+<sys/sdt.h> when it is installed, where each one is a nop and a note in
+the binary until something attaches. Without it, or when built with
+-DTFS_NO_PROBES, they compile to nothing.
+
+   call__entry(call, fd, arg)         a public call begins; call is its
+                                      name, "tfs_openFile" and so on, fd
+                                      the inode for reader calls
+   call__return(call, fd, result)     and returns
+   block__read(disk, bNum, len)       libDisk reads len bytes at block bNum
+   block__read__done(disk, bNum, ret)
+   block__write(disk, bNum, len)      and writes them
+   block__write__done(disk, bNum, ret)
+   alloc__run(count, start, hint)     a file asks for count blocks near
+                                      hint; start of the run found, or -1
+   block__alloc(bNum, free)           a free block is taken; free is how
+                                      many are left
+   block__free(bNum, shared)          a block is given up; shared if a
+                                      snapshot still holds it
+   dircache__hit(bNum)                a directory block is read from the
+   dircache__miss(bNum)               cache, or has to come from the disk
+
+Example scripts are in probes/. */
+
+#if !defined(TFS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TFS_PROBES 1
+#endif
+#endif
+
+#ifdef TFS_PROBES
+#define TFS_PROBE1(name, a) DTRACE_PROBE1(tinyfs, name, a)
+#define TFS_PROBE2(name, a, b) DTRACE_PROBE2(tinyfs, name, a, b)
+#define TFS_PROBE3(name, a, b, c) DTRACE_PROBE3(tinyfs, name, a, b, c)
+
+/* Fires call__return and hands back the call's result */
+static inline int probeReturn(char *call, int fd, int result) {
+    TFS_PROBE3(call__return, call, fd, result);
+    return result;
+}
+#else
+#define TFS_PROBE1(name, a) ((void) 0)
+#define TFS_PROBE2(name, a, b) ((void) 0)
+#define TFS_PROBE3(name, a, b, c) ((void) 0)
+#define probeReturn(call, fd, result) (result)
+#endif
+
+#define probeEnter(call, fd, arg) TFS_PROBE3(call__entry, call, fd, arg)
+
+#endif
@@ -0,0 +1,282 @@
+/* Program 4
+ * Daniel Foxhoven
+ * Geoff Wacker
+ * Adair Camacho
+ * Due Date: 3/19/17
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tinyFS.h"
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+#include "tfsTrace.h"
+
+/* Replays a trace recorded with tfs_traceStart:
+   tfsReplay <trace> <image> [original | max] [source image]
+The image is a copy of the source image when one is given, otherwise a
+fresh one the size of the image the trace was recorded on. Calls are
+issued at the times they were recorded, or back to back with "max".
+Writes carry generated content of the recorded size. Prints how long
+each kind of call took, and how many calls succeeded where the
+original failed or the other way round. */
+
+#define REPLAY_FDS 4096
+
+char *opNames[TRACE_OPS] = {"", "open", "close", "write", "writeBytes", "delete", "readByte", "readBytes",
+                            "seek", "rename", "mkdir", "rmdir", "makeRO", "makeRW", "batchBegin",
+                            "batchCommit", "batchAbort", "sync", "truncate", "fallocate"};
+
+/* Latencies of one kind of call, in nanoseconds */
+typedef struct {
+    double *times;
+    int count, cap, diverged;
+} replay_op;
+
+replay_op ops[TRACE_OPS];
+
+/* Recorded descriptors and the ones the replay got for them */
+int tracedFds[REPLAY_FDS], replayFds[REPLAY_FDS], numFds;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+int copyImage(char *from, char *to) {
+    char buf[65536];
+    FILE *in, *out;
+    size_t got;
+    int ret = 0;
+
+    if ((in = fopen(from, "rb")) == NULL) {
+        return -1;
+    }
+    if ((out = fopen(to, "wb")) == NULL) {
+        fclose(in);
+        return -1;
+    }
+    while ((got = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, got, out) != got) {
+            ret = -1;
+            break;
+        }
+    }
+    fclose(in);
+    return fclose(out) == 0 ? ret : -1;
+}
+
+/* Descriptors are looked up newest first, since a recorded number can
+come back once its file is closed. Unknown ones stay as recorded and
+fail the same way they did. */
+int replayFd(int fd) {
+    int i;
+
+    for (i = numFds - 1; i >= 0; i--) {
+        if (tracedFds[i] == fd) {
+            return replayFds[i];
+        }
+    }
+    return fd;
+}
+
+void rememberFd(int traced, int replayed) {
+    if (numFds == REPLAY_FDS) {
+        memmove(tracedFds, tracedFds + 1, (REPLAY_FDS - 1) * sizeof(int));
+        memmove(replayFds, replayFds + 1, (REPLAY_FDS - 1) * sizeof(int));
+        numFds--;
+    }
+    tracedFds[numFds] = traced;
+    replayFds[numFds++] = replayed;
+}
+
+int replayCall(tfs_traceRecord *rec, char *name, char *data) {
+    int fd = replayFd(rec->fd), ret = SUCCESS;
+    char byte;
+
+    switch (rec->op) {
+    case TRACE_OP_OPEN:
+        if ((ret = tfs_openFile(name)) >= 0 && rec->result >= 0) {
+            rememberFd(rec->result, ret);
+        }
+        break;
+    case TRACE_OP_CLOSE:
+        ret = tfs_closeFile(fd);
+        break;
+    case TRACE_OP_WRITE:
+        ret = tfs_writeFile(fd, data, rec->arg);
+        break;
+    case TRACE_OP_WRITEBYTES:
+        ret = tfs_writeBytes(fd, data, rec->arg);
+        break;
+    case TRACE_OP_DELETE:
+        ret = tfs_deleteFile(fd);
+        break;
+    case TRACE_OP_READBYTE:
+        ret = tfs_readByte(fd, &byte);
+        break;
+    case TRACE_OP_READBYTES:
+        ret = tfs_readBytes(fd, data, rec->arg);
+        break;
+    case TRACE_OP_SEEK:
+        ret = tfs_seek(fd, rec->arg);
+        break;
+    case TRACE_OP_RENAME:
+        ret = tfs_rename(fd, name);
+        break;
+    case TRACE_OP_MKDIR:
+        ret = tfs_mkdir(name);
+        break;
+    case TRACE_OP_RMDIR:
+        ret = tfs_rmdir(name);
+        break;
+    case TRACE_OP_MAKERO:
+        tfs_makeRO(name);
+        break;
+    case TRACE_OP_MAKERW:
+        tfs_makeRW(name);
+        break;
+    case TRACE_OP_BATCH_BEGIN:
+        ret = tfs_batchBegin();
+        break;
+    case TRACE_OP_BATCH_COMMIT:
+        ret = tfs_batchCommit();
+        break;
+    case TRACE_OP_BATCH_ABORT:
+        ret = tfs_batchAbort();
+        break;
+    case TRACE_OP_SYNC:
+        ret = tfs_sync();
+        break;
+    case TRACE_OP_TRUNCATE:
+        ret = tfs_truncate(fd, rec->arg);
+        break;
+    case TRACE_OP_FALLOCATE:
+        ret = tfs_fallocate(fd, rec->arg);
+        break;
+    }
+    return ret;
+}
+
+void report(double elapsed, long calls) {
+    replay_op *op;
+    double total;
+    int i, j;
+
+    printf("%ld calls in %.3f s\n", calls, elapsed);
+    printf("%-12s %8s %10s %10s %10s %10s %10s %8s\n", "call", "count", "mean us", "p50 us", "p99 us",
+           "p999 us", "max us", "diverged");
+    for (i = 1; i < TRACE_OPS; i++) {
+        op = &ops[i];
+        if (op->count == 0) {
+            continue;
+        }
+        qsort(op->times, op->count, sizeof(double), compareDoubles);
+        for (j = 0, total = 0; j < op->count; j++) {
+            total += op->times[j];
+        }
+        printf("%-12s %8d %10.2f %10.2f %10.2f %10.2f %10.2f %8d\n", opNames[i], op->count,
+               total / op->count / 1e3, op->times[op->count / 2] / 1e3, op->times[op->count * 99 / 100] / 1e3,
+               op->times[op->count * 999 / 1000] / 1e3, op->times[op->count - 1] / 1e3, op->diverged);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    tfs_traceHeader header;
+    tfs_traceRecord rec;
+    FILE *trace;
+    char *name = NULL, *data = NULL;
+    int size, dataCap = 0, maxSpeed, ret, i;
+    long calls = 0;
+    double start, begin, wait, elapsed;
+    struct timespec pause;
+    replay_op *op;
+
+    if (argc < 3 || (argc > 3 && strcmp(argv[3], "original") != 0 && strcmp(argv[3], "max") != 0)) {
+        fprintf(stderr, "usage: tfsReplay <trace> <image> [original | max] [source image]\n");
+        return 1;
+    }
+    maxSpeed = argc > 3 && strcmp(argv[3], "max") == 0;
+
+    if ((trace = fopen(argv[1], "rb")) == NULL || fread(&header, sizeof(header), 1, trace) != 1 ||
+        header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        fprintf(stderr, "tfsReplay: %s is not a trace\n", argv[1]);
+        return 1;
+    }
+
+    // Start from a copy of the image the trace ran against, or from scratch.
+    if (argc > 4) {
+        ret = copyImage(argv[4], argv[2]);
+    }
+    else {
+        size = header.blockSize ? header.blockSize : BLOCKSIZE;
+        ret = tfs_mkfsBlockSize(argv[2], (header.numBlocks ? header.numBlocks : MAX_BLOCKS) * size, size);
+    }
+    if (ret < 0 || tfs_mount(argv[2]) < 0) {
+        fprintf(stderr, "tfsReplay: could not set up %s\n", argv[2]);
+        return 1;
+    }
+
+    name = malloc(UINT16_MAX + 1);
+    begin = now();
+    while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+        if (fread(name, 1, rec.nameLen, trace) != rec.nameLen) {
+            break;
+        }
+        name[rec.nameLen] = '\0';
+        if (rec.op < 1 || rec.op >= TRACE_OPS) {
+            continue;
+        }
+
+        // Writes need that much content and reads that much room.
+        if ((rec.op == TRACE_OP_WRITE || rec.op == TRACE_OP_WRITEBYTES || rec.op == TRACE_OP_READBYTES) &&
+            rec.arg > dataCap) {
+            dataCap = rec.arg;
+            data = realloc(data, dataCap);
+            for (i = 0; i < dataCap; i++) {
+                data[i] = 'a' + i % 26;
+            }
+        }
+
+        if (!maxSpeed && (wait = begin + rec.start / 1e9 - now()) > 0) {
+            pause.tv_sec = (time_t) wait;
+            pause.tv_nsec = (long) ((wait - pause.tv_sec) * 1e9);
+            nanosleep(&pause, NULL);
+        }
+
+        start = now();
+        ret = replayCall(&rec, name, data);
+        elapsed = now() - start;
+
+        op = &ops[rec.op];
+        if (op->count == op->cap) {
+            op->cap = op->cap ? op->cap * 2 : 64;
+            op->times = realloc(op->times, op->cap * sizeof(double));
+        }
+        op->times[op->count++] = elapsed * 1e9;
+        if ((ret < 0) != (rec.result < 0)) {
+            op->diverged++;
+        }
+        calls++;
+    }
+    elapsed = now() - begin;
+    fclose(trace);
+    tfs_unmount();
+
+    report(elapsed, calls);
+    for (i = 0; i < TRACE_OPS; i++) {
+        free(ops[i].times);
+    }
+    free(name);
+    free(data);
+    return 0;
+}
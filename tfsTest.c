@@ -2,14 +2,36 @@
  *  * Foaad Khosmood, Cal Poly / modified Winter 2014
  *   */
 
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "tinyFS.h"
 #include "libTinyFS.h"
+#include "libDisk.h"
+#include "tfsClient.h"
+#include "tfsTrace.h"
+#include "tfsProbe.h"
 #include "tinyFS_errno.h"
 
+/* The checks after the demo run on images of their own */
+#define CHECK_DISK_NAME "tfsCheckDisk"
+#define CHECK_HOST_NAME "tfsCheckHost"
+#define CHECK_COPY_NAME "tfsCheckCopy"
+#define CHECK_SOCKET_NAME "tfsCheck.sock"
+#define CHECK_TREE_NAME "tfsCheckTree"
+#define CHECK_TRACE_NAME "tfsCheckTrace"
+
+int checkFailures = 0;
+
 /* simple helper function to fill Buffer with as many inPhrase strings as possible before reaching size */
 int
 fillBufferWithPhrase (char *inPhrase, char *Buffer, int size)
@@ -28,6 +50,1411 @@ fillBufferWithPhrase (char *inPhrase, char *Buffer, int size)
   return 0;
 }
 
+/* prints one check's result, counts it if it failed and returns it */
+int
+check (char *what, int ok)
+{
+  printf ("%s: %s\n", ok ? "ok" : "FAILED", what);
+  if (!ok)
+    checkFailures++;
+  return ok;
+}
+
+/* fills ‘buf’ with ‘size’ bytes that differ from one ‘seed’ to the next */
+void
+fillPattern (char *buf, int size, int seed)
+{
+  int i;
+
+  for (i = 0; i < size; i++)
+    buf[i] = 'a' + (i * 7 + seed) % 26;
+}
+
+/* whether the file at FD holds exactly the ‘size’ bytes of ‘expected’ */
+int
+fileMatches (fileDescriptor FD, char *expected, int size)
+{
+  char *got;
+  int ok;
+
+  if (tfs_seek (FD, 0) < 0)
+    return 0;
+  got = malloc (size + 1);
+  ok = tfs_readBytes (FD, got, size + 1) == size
+    && memcmp (got, expected, size) == 0;
+  free (got);
+  return ok;
+}
+
+/* writes ‘size’ bytes of ‘buf’ to a new host file at ‘path’ */
+int
+writeHostFile (char *path, char *buf, int size)
+{
+  int fd, ok;
+
+  if ((fd = open (path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+    return 0;
+  ok = write (fd, buf, size) == size;
+  return close (fd) == 0 && ok;
+}
+
+/* reads the host file at ‘path’ into a new buffer and sets ‘size’ */
+char *
+readHostFile (char *path, int *size)
+{
+  char *buf;
+  int fd;
+
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return NULL;
+  *size = lseek (fd, 0, SEEK_END);
+  buf = malloc (*size);
+  if (pread (fd, buf, *size, 0) != *size)
+    {
+      free (buf);
+      buf = NULL;
+    }
+  close (fd);
+  return buf;
+}
+
+/* counts the records in the trace log at ‘path’ and fills ‘header’,
+or returns -1 if it isn't a trace */
+int
+traceRecords (char *path, tfs_traceHeader *header)
+{
+  tfs_traceRecord rec;
+  char name[UINT16_MAX + 1];
+  int records = 0;
+  FILE *trace;
+
+  if ((trace = fopen (path, "rb")) == NULL)
+    return -1;
+  if (fread (header, sizeof (*header), 1, trace) != 1
+      || header->magic != TRACE_MAGIC)
+    records = -1;
+  while (records >= 0 && fread (&rec, sizeof (rec), 1, trace) == 1
+	 && fread (name, 1, rec.nameLen, trace) == rec.nameLen)
+    records++;
+  fclose (trace);
+  return records;
+}
+
+/* Unmounts cleanly and checks the summary, then clears the clean flag
+and the free count, as a session that never unmounted would leave
+them, and checks that mount rebuilds the same summary. */
+void
+checkSummary ()
+{
+  int size = 3 * (4096 - 4), imageSize;
+  char *content, *image, freeCount;
+
+  content = malloc (size);
+  fillPattern (content, size, 7);
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  image = readHostFile (CHECK_DISK_NAME, &imageSize);
+  freeCount = image[SUPER_FREE_COUNT];
+  free (image);
+  tfs_mount (CHECK_DISK_NAME);
+  tfs_writeFile (tfs_openFile ("a"), content, size);
+  tfs_writeFile (tfs_openFile ("b"), content, size / 2);
+  tfs_unmount ();
+  image = readHostFile (CHECK_DISK_NAME, &imageSize);
+  check ("unmount marks the image clean",
+	 image[SUPER_CLEAN_FLAG] == SUPER_CLEAN);
+  /* at least an inode and three blocks for a, an inode and two for b */
+  check ("summary counts the blocks taken",
+	 image[SUPER_FREE_COUNT] <= freeCount - 7);
+  freeCount = image[SUPER_FREE_COUNT];
+
+  image[SUPER_CLEAN_FLAG] = 0;
+  image[SUPER_FREE_COUNT] = 0;
+  writeHostFile (CHECK_DISK_NAME, image, imageSize);
+  free (image);
+  check ("unclean image mounts", tfs_mount (CHECK_DISK_NAME) == SUCCESS);
+  check ("files survive the rebuild",
+	 fileMatches (tfs_openFile ("a"), content, size)
+	 && fileMatches (tfs_openFile ("b"), content, size / 2));
+  tfs_unmount ();
+  image = readHostFile (CHECK_DISK_NAME, &imageSize);
+  check ("mount rebuilds the summary", image[SUPER_FREE_COUNT] == freeCount
+	 && image[SUPER_CLEAN_FLAG] == SUPER_CLEAN);
+
+  free (image);
+  free (content);
+}
+
+/* Formats images with the smallest, a middling and the largest block
+size, writes a file of a few blocks to each and reads it back after a
+remount, and checks sizes that aren't powers of two are refused. */
+void
+checkBlockSizes ()
+{
+  int sizes[] = { MIN_BLOCKSIZE, 4096, MAX_BLOCKSIZE }, i, size, ok = 1;
+  char *content;
+
+  for (i = 0; i < 3; i++)
+    {
+      size = 3 * sizes[i] + 17;
+      content = malloc (size);
+      fillPattern (content, size, i);
+      ok &= tfs_mkfsBlockSize (CHECK_DISK_NAME, 16 * sizes[i], sizes[i])
+	== SUCCESS;
+      tfs_mount (CHECK_DISK_NAME);
+      ok &= tfs_writeFile (tfs_openFile ("f"), content, size) == SUCCESS;
+      tfs_unmount ();
+      tfs_mount (CHECK_DISK_NAME);
+      ok &= fileMatches (tfs_openFile ("f"), content, size);
+      tfs_unmount ();
+      free (content);
+    }
+  check ("every block size survives a remount", ok);
+  check ("odd block sizes are refused",
+	 tfs_mkfsBlockSize (CHECK_DISK_NAME, 16 * 4096, 3000) < 0
+	 && tfs_mkfsBlockSize (CHECK_DISK_NAME, 16 * 4096,
+			       MIN_BLOCKSIZE / 2) < 0
+	 && tfs_mkfsBlockSize (CHECK_DISK_NAME, 16 * 4096,
+			       MAX_BLOCKSIZE * 2) < 0);
+}
+
+/* Opens more files than the table starts with, then closes and deletes
+some and checks their old descriptors are refused even once other
+files have taken their slots. */
+void
+checkDescriptors ()
+{
+  fileDescriptor fds[40], closed, deleted, reused;
+  char name[8], byte;
+  int i, ok = 1;
+
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 128 * 1024, 1024);
+  tfs_mount (CHECK_DISK_NAME);
+  for (i = 0; i < 40; i++)
+    {
+      sprintf (name, "o%d", i);
+      fds[i] = tfs_openFile (name);
+      ok &= fds[i] >= 0 && tfs_writeFile (fds[i], name, strlen (name) + 1)
+	== SUCCESS;
+    }
+  for (i = 0; i < 40; i++)
+    {
+      sprintf (name, "o%d", i);
+      ok &= fileMatches (fds[i], name, strlen (name) + 1);
+    }
+  check ("table grows with the open files", ok);
+
+  closed = fds[3];
+  deleted = fds[7];
+  tfs_closeFile (closed);
+  tfs_deleteFile (deleted);
+  check ("closed descriptor is refused", tfs_readByte (closed, &byte) < 0
+	 && tfs_closeFile (closed) < 0);
+  check ("deleted descriptor is refused", tfs_readByte (deleted, &byte) < 0);
+  reused = tfs_openFile ("new");
+  tfs_writeFile (tfs_openFile ("other"), "x", 1);
+  tfs_writeFile (reused, "new", 4);
+  check ("stale descriptors stay refused once their slots are reused",
+	 tfs_seek (closed, 0) < 0 && tfs_seek (deleted, 0) < 0
+	 && tfs_writeFile (closed, "bad", 4) < 0
+	 && tfs_writeFile (deleted, "bad", 4) < 0
+	 && fileMatches (reused, "new", 4));
+  tfs_unmount ();
+}
+
+/* Fills a directory with enough entries to spread over several of its
+hashed blocks, remounts and reads every file back through its path,
+then empties and removes it. */
+void
+checkDirectories ()
+{
+  char name[16], content[64];
+  int i, ok = 1;
+
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 128 * 1024, 1024);
+  tfs_mount (CHECK_DISK_NAME);
+  check ("directory is made", tfs_mkdir ("d") >= 0);
+  check ("nested directory is made", tfs_mkdir ("d/e") >= 0);
+  for (i = 0; i < 40; i++)
+    {
+      sprintf (name, "d/f%d", i);
+      fillPattern (content, sizeof (content), i);
+      ok &= tfs_writeFile (tfs_openFile (name), content, sizeof (content))
+	== SUCCESS;
+    }
+  check ("directory takes every file", ok);
+  check ("missing directory is refused", tfs_openFile ("x/f") < 0);
+  tfs_unmount ();
+
+  tfs_mount (CHECK_DISK_NAME);
+  for (i = 0, ok = 1; i < 40; i++)
+    {
+      sprintf (name, "d/f%d", i);
+      fillPattern (content, sizeof (content), i);
+      ok &= fileMatches (tfs_openFile (name), content, sizeof (content));
+    }
+  check ("directory survives a remount", ok);
+  check ("full directory isn't removed", tfs_rmdir ("d") < 0);
+  for (i = 0, ok = 1; i < 40; i++)
+    {
+      sprintf (name, "d/f%d", i);
+      ok &= tfs_deleteFile (tfs_openFile (name)) >= 0;
+    }
+  ok &= tfs_rmdir ("d/e") >= 0;
+  check ("emptied directory is removed", ok && tfs_rmdir ("d") >= 0);
+  tfs_unmount ();
+}
+
+/* Starts tinyfsd on an image, writes a file through a pipelined batch
+and reads part of it back with tfsc_pread, then stops the daemon and
+checks the file is in the image it unmounted. */
+void
+checkDaemon ()
+{
+  struct timespec wait = { 0, 10000000 };
+  int size = 2 * (4096 - 4), results[2], status, tries;
+  char *content, *back;
+  fileDescriptor FD;
+  pid_t pid;
+
+  content = malloc (size);
+  back = malloc (size);
+  fillPattern (content, size, 8);
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  fflush (stdout);
+  if ((pid = fork ()) == 0)
+    {
+      freopen ("/dev/null", "w", stdout);
+      execl ("./tinyfsd", "tinyfsd", CHECK_DISK_NAME, CHECK_SOCKET_NAME,
+	     (char *) NULL);
+      _exit (127);
+    }
+  for (tries = 0; tries < 200 && tfsc_connect (CHECK_SOCKET_NAME) < 0;
+       tries++)
+    nanosleep (&wait, NULL);
+  if (!check ("daemon starts", pid > 0 && tries < 200))
+    {
+      kill (pid, SIGTERM);
+      waitpid (pid, NULL, 0);
+      return;
+    }
+
+  FD = tfsc_openFile ("dm");
+  tfsc_batchBegin ();
+  tfsc_writeFile (FD, content, size);
+  tfsc_seek (FD, 5);
+  check ("batch comes back whole", tfsc_batchEnd (results, 2) == 2
+	 && results[0] == SUCCESS && results[1] == SUCCESS);
+  check ("pread reads through the daemon",
+	 tfsc_pread (FD, 100, back, size) == size - 100
+	 && memcmp (back, content + 100, size - 100) == 0);
+  tfsc_disconnect ();
+  kill (pid, SIGTERM);
+  check ("daemon stops cleanly", waitpid (pid, &status, 0) == pid
+	 && WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+  tfs_mount (CHECK_DISK_NAME);
+  check ("daemon's writes are in the image",
+	 fileMatches (tfs_openFile ("dm"), content, size));
+  tfs_unmount ();
+  free (content);
+  free (back);
+}
+
+/* Maps most of a file spanning several extents, gathers the view's
+pieces and compares them with what was written, and checks the file
+stays pinned until the view is released. */
+void
+checkViews ()
+{
+  int size = 3 * (4096 - 4), i, at = 0;
+  char *content, *back;
+  fileDescriptor FD;
+  tfs_view view;
+
+  content = malloc (size);
+  back = malloc (size);
+  fillPattern (content, size, 9);
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  tfs_mount (CHECK_DISK_NAME);
+  FD = tfs_openFile ("v");
+  tfs_writeFile (FD, content, size);
+  check ("view is cut at the end of the file",
+	 tfs_mapFile (FD, 100, size, &view) == size - 100
+	 && view.length == size - 100);
+  for (i = 0; i < view.count; i++)
+    {
+      memcpy (back + at, view.iov[i].iov_base, view.iov[i].iov_len);
+      at += view.iov[i].iov_len;
+    }
+  check ("view holds the file's bytes", view.count == 3 && at == size - 100
+	 && memcmp (back, content + 100, size - 100) == 0);
+  check ("mapped file is pinned",
+	 tfs_writeFile (FD, content, size) == ERR_FILE_BUSY
+	 && tfs_deleteFile (FD) == ERR_FILE_BUSY
+	 && tfs_unmount () == ERR_FILE_BUSY);
+  check ("view is released", tfs_releaseView (&view) >= 0);
+  check ("released file can be written",
+	 tfs_writeFile (FD, content, size / 2) == SUCCESS);
+  check ("one-extent view has data set",
+	 tfs_mapFile (FD, 10, 100, &view) == 100 && view.data
+	 && memcmp (view.data, content + 10, 100) == 0);
+  tfs_releaseView (&view);
+  check ("image unmounts once every view is released",
+	 tfs_unmount () == SUCCESS);
+  free (content);
+  free (back);
+}
+
+/* Imports several host files in one call, reads them back after a
+remount and exports one to a pipe, which takes the buffered copy. */
+void
+checkImportFiles ()
+{
+  char hostPaths[4][32], names[4][4], *hostList[4], *nameList[4];
+  int size = 2 * (4096 - 4) + 50, i, ok = 1, pipeFds[2];
+  char *content, *back;
+  tfs_traceHeader header;
+  fileDescriptor fds[4];
+
+  content = malloc (size);
+  back = malloc (size);
+  for (i = 0; i < 4; i++)
+    {
+      sprintf (hostPaths[i], "%s%d", CHECK_HOST_NAME, i);
+      sprintf (names[i], "m%d", i);
+      hostList[i] = hostPaths[i];
+      nameList[i] = names[i];
+      fillPattern (content, size - i, 20 + i);
+      writeHostFile (hostPaths[i], content, size - i);
+    }
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  tfs_mount (CHECK_DISK_NAME);
+  tfs_traceStart (CHECK_TRACE_NAME);
+  check ("several files import at once",
+	 tfs_importFiles (hostList, nameList, 4, fds) == SUCCESS);
+  tfs_traceStop ();
+  check ("import doesn't trace the opens it makes",
+	 traceRecords (CHECK_TRACE_NAME, &header) == 0);
+  remove (CHECK_TRACE_NAME);
+  tfs_unmount ();
+
+  tfs_mount (CHECK_DISK_NAME);
+  for (i = 0; i < 4; i++)
+    {
+      fillPattern (content, size - i, 20 + i);
+      ok &= fileMatches (tfs_openFile (names[i]), content, size - i);
+      remove (hostPaths[i]);
+    }
+  check ("imported files survive a remount", ok);
+  if (pipe (pipeFds) == 0)
+    {
+      check ("export to a pipe falls back to copying",
+	     tfs_exportFile (tfs_openFile ("m3"), pipeFds[1]) == size - 3
+	     && read (pipeFds[0], back, size) == size - 3
+	     && memcmp (back, content, size - 3) == 0);
+      close (pipeFds[0]);
+      close (pipeFds[1]);
+    }
+  tfs_unmount ();
+  free (content);
+  free (back);
+}
+
+/* Imports a host file on a queued and on a write-through mount,
+exports it again and counts the copy_file_range calls each made. The
+two must agree: the request queue mustn't push imports off the
+in-kernel copy. */
+void
+checkImport ()
+{
+  tfs_mountOptions options = { ALLOC_HEAD, TFS_SYNC_NONE, 0, 0, 0 };
+  int size = 3 * (4096 - 4) + 100, writeThrough, fd;
+  long before, after, copies[2];
+  char *content, *back;
+  fileDescriptor FD;
+
+  content = malloc (size);
+  back = malloc (size);
+  fillPattern (content, size, 1);
+  writeHostFile (CHECK_HOST_NAME, content, size);
+
+  for (writeThrough = 0; writeThrough < 2; writeThrough++)
+    {
+      options.writeThrough = writeThrough;
+      tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+      tfs_mountWith (CHECK_DISK_NAME, &options);
+      tfs_copyStats (&before);
+      FD = tfs_importFile (CHECK_HOST_NAME, "import");
+      check ("import reads back", FD >= 0 && fileMatches (FD, content, size));
+
+      fd = open (CHECK_COPY_NAME, O_CREAT | O_TRUNC | O_RDWR, 0644);
+      check ("export writes the file out", tfs_exportFile (FD, fd) == size
+	     && pread (fd, back, size, 0) == size
+	     && memcmp (back, content, size) == 0);
+      close (fd);
+      tfs_copyStats (&after);
+      copies[writeThrough] = after - before;
+      tfs_unmount ();
+    }
+  check ("queued import copies inside the kernel", copies[0] == copies[1]);
+  if (copies[1] == 0)
+    printf ("note: copy_file_range isn't available here\n");
+
+  remove (CHECK_HOST_NAME);
+  remove (CHECK_COPY_NAME);
+  free (content);
+  free (back);
+}
+
+/* Mounts a three-way stripe again in the order it was made, in another
+order and with a file from another stripe, then formats a stripe with
+no room past the root directory. */
+void
+checkStriped ()
+{
+  char *members[3] = { CHECK_DISK_NAME "0", CHECK_DISK_NAME "1", CHECK_DISK_NAME "2" };
+  char *other[3] = { CHECK_DISK_NAME "3", CHECK_DISK_NAME "4", CHECK_DISK_NAME "5" };
+  char *swapped[3] = { CHECK_DISK_NAME "0", CHECK_DISK_NAME "2", CHECK_DISK_NAME "1" };
+  char *mixed[3] = { CHECK_DISK_NAME "0", CHECK_DISK_NAME "4", CHECK_DISK_NAME "2" };
+  int size = 20000, i;
+  char *content;
+  fileDescriptor FD;
+
+  content = malloc (size);
+  fillPattern (content, size, 2);
+  tfs_mkfsStriped (other, 3, 64 * 4096, 4096, 1024);
+  tfs_mkfsStriped (members, 3, 64 * 4096, 4096, 1024);
+  tfs_mountStriped (members, 3, NULL);
+  FD = tfs_openFile ("x");
+  tfs_writeFile (FD, content, size);
+  tfs_unmount ();
+
+  check ("striped image mounts again", tfs_mountStriped (members, 3, NULL) == SUCCESS);
+  check ("striped file reads back", fileMatches (tfs_openFile ("x"), content, size));
+  tfs_unmount ();
+
+  if (!check ("stripe in the wrong order is refused",
+	      tfs_mountStriped (swapped, 3, NULL) == ERR_TFS_MOUNT))
+    tfs_unmount ();
+  if (!check ("stripe with another image's file is refused",
+	      tfs_mountStriped (mixed, 3, NULL) == ERR_TFS_MOUNT))
+    tfs_unmount ();
+  if (!check ("first stripe file on its own is refused", tfs_mount (members[0]) < 0))
+    tfs_unmount ();
+
+  check ("two block stripe formats", tfs_mkfsStriped (members, 2, 2 * 256, 256, 256) == SUCCESS
+	 && tfs_mountStriped (members, 2, NULL) == SUCCESS);
+  check ("two block stripe has no free block", tfs_openFile ("y") < 0);
+  tfs_unmount ();
+
+  for (i = 0; i < 3; i++)
+    {
+      remove (members[i]);
+      remove (other[i]);
+    }
+  free (content);
+}
+
+/* Builds an image from a small host tree with a subdirectory, mounts
+it and reads every file back, and checks a tree too big for the image
+is refused. */
+void
+checkMkimage ()
+{
+  int size = 2 * (4096 - 4) + 9, ok;
+  char *content;
+
+  content = malloc (size);
+  mkdir (CHECK_TREE_NAME, 0755);
+  mkdir (CHECK_TREE_NAME "/sub", 0755);
+  fillPattern (content, size, 10);
+  writeHostFile (CHECK_TREE_NAME "/top", content, size);
+  fillPattern (content, size, 11);
+  writeHostFile (CHECK_TREE_NAME "/sub/low", content, size);
+  writeHostFile (CHECK_TREE_NAME "/sub/empty", content, 0);
+
+  check ("image is built",
+	 tfs_mkimage (CHECK_TREE_NAME, CHECK_DISK_NAME, 64 * 4096, 4096)
+	 == SUCCESS);
+  check ("built image mounts", tfs_mount (CHECK_DISK_NAME) == SUCCESS);
+  ok = fileMatches (tfs_openFile ("sub/low"), content, size);
+  ok &= fileMatches (tfs_openFile ("sub/empty"), content, 0);
+  fillPattern (content, size, 10);
+  ok &= fileMatches (tfs_openFile ("top"), content, size);
+  check ("built image holds the tree", ok);
+  check ("built image takes new files",
+	 tfs_writeFile (tfs_openFile ("sub/new"), content, size) == SUCCESS);
+  tfs_unmount ();
+  check ("tree too big for the image is refused",
+	 tfs_mkimage (CHECK_TREE_NAME, CHECK_DISK_NAME, 4 * 4096, 4096) < 0);
+
+  remove (CHECK_TREE_NAME "/sub/empty");
+  remove (CHECK_TREE_NAME "/sub/low");
+  remove (CHECK_TREE_NAME "/top");
+  remove (CHECK_TREE_NAME "/sub");
+  remove (CHECK_TREE_NAME);
+  free (content);
+}
+
+/* Snapshots a file, rewrites it, reads the old content back through
+the snapshot, then deletes the snapshot and reclaims its blocks. */
+void
+checkSnapshots ()
+{
+  int size = 20 * (4096 - 4), bigSize = 25 * (4096 - 4);
+  char *old, *new, *big;
+  fileDescriptor FD;
+
+  old = malloc (bigSize);
+  new = malloc (size);
+  big = old;
+  fillPattern (old, bigSize, 3);
+  fillPattern (new, size, 4);
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  tfs_mount (CHECK_DISK_NAME);
+  tfs_writeFile (tfs_openFile ("s"), old, size);
+  check ("snapshot is taken", tfs_snapshot ("snap") == SUCCESS);
+  tfs_writeFile (tfs_openFile ("s"), new, size);
+  tfs_unmount ();
+
+  check ("snapshot mounts", tfs_mountSnapshot (CHECK_DISK_NAME, "snap") == SUCCESS);
+  FD = tfs_openFile ("s");
+  check ("snapshot keeps the old content", fileMatches (FD, old, size));
+  check ("snapshot is read-only", tfs_writeFile (FD, new, size) == ERR_READ_ONLY);
+  tfs_unmount ();
+
+  tfs_mount (CHECK_DISK_NAME);
+  check ("image has the new content", fileMatches (tfs_openFile ("s"), new, size));
+  check ("snapshot holds its blocks", tfs_writeFile (tfs_openFile ("t"), big, bigSize) < 0);
+  check ("snapshot is deleted", tfs_deleteSnapshot ("snap") == SUCCESS);
+  check ("deleted snapshot is gone", tfs_deleteSnapshot ("snap") == ERR_NO_SUCH_SNAPSHOT);
+  while (tfs_reclaim (MAX_BLOCKS) > 0)
+    ;
+  check ("reclaimed blocks are free", tfs_writeFile (tfs_openFile ("t"), big, bigSize) == SUCCESS);
+  tfs_unmount ();
+  check ("deleted snapshot doesn't mount", tfs_mountSnapshot (CHECK_DISK_NAME, "snap") < 0);
+
+  free (old);
+  free (new);
+}
+
+/* Writes the same content twice with inline dedup on and twice more
+without it, dedups those afterwards, and checks the sharing and the
+content survive a remount and that rewriting one copy leaves the
+other alone. Only the last extents match, headers included, so each
+pair shares one block. */
+void
+checkDedup ()
+{
+  int size = 3 * (4096 - 4), saved;
+  char *content, *other;
+
+  content = malloc (size);
+  other = malloc (size);
+  fillPattern (content, size, 12);
+  fillPattern (other, size, 13);
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  tfs_mount (CHECK_DISK_NAME);
+  tfs_setDedup (1);
+  tfs_writeFile (tfs_openFile ("p"), content, size);
+  tfs_writeFile (tfs_openFile ("q"), content, size);
+  check ("inline dedup shares the copy", tfs_dedupSavings () == 1);
+  tfs_setDedup (0);
+  tfs_writeFile (tfs_openFile ("r"), other, size);
+  tfs_writeFile (tfs_openFile ("s"), other, size);
+  check ("dedup pass frees the second copy", tfs_dedup () == 1);
+  saved = tfs_dedupSavings ();
+  tfs_unmount ();
+
+  tfs_mount (CHECK_DISK_NAME);
+  check ("sharing survives a remount", saved == 2
+	 && tfs_dedupSavings () == saved);
+  check ("shared files read back",
+	 fileMatches (tfs_openFile ("p"), content, size)
+	 && fileMatches (tfs_openFile ("q"), content, size)
+	 && fileMatches (tfs_openFile ("r"), other, size)
+	 && fileMatches (tfs_openFile ("s"), other, size));
+  tfs_writeFile (tfs_openFile ("q"), other, size / 2);
+  check ("rewriting a shared file leaves its twin alone",
+	 fileMatches (tfs_openFile ("p"), content, size)
+	 && fileMatches (tfs_openFile ("q"), other, size / 2));
+  tfs_unmount ();
+  free (content);
+  free (other);
+}
+
+/* Writes the first and fourth blocks of a file, leaving the two
+between as a hole, and checks the hole reads as zeros, holds no
+extents and is found by tfs_seekData and tfs_seekHole, before and
+after a remount. */
+void
+checkSparse ()
+{
+  int piece = 4096 - 4, size = 3 * piece + 60, i, ok = 1, files, blocks,
+    runs;
+  char *expected, head[100], tail[50];
+  fileDescriptor FD;
+
+  expected = calloc (size, 1);
+  fillPattern (head, sizeof (head), 14);
+  fillPattern (tail, sizeof (tail), 15);
+  memcpy (expected, head, sizeof (head));
+  memcpy (expected + 3 * piece + 10, tail, sizeof (tail));
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  tfs_mount (CHECK_DISK_NAME);
+  FD = tfs_openFile ("h");
+  tfs_writeBytes (FD, head, sizeof (head));
+  tfs_seek (FD, 3 * piece + 10);
+  check ("writing past the end grows the file",
+	 tfs_writeBytes (FD, tail, sizeof (tail)) == sizeof (tail));
+
+  for (i = 0; i < 2; i++)
+    {
+      ok &= fileMatches (FD, expected, size);
+      ok &= tfs_seekData (FD, 0) == 0 && tfs_seekHole (FD, 0) == piece;
+      ok &= tfs_seekData (FD, 200) == 200;
+      ok &= tfs_seekData (FD, piece) == 3 * piece;
+      ok &= tfs_seekHole (FD, 3 * piece) == size;
+      ok &= tfs_seekData (FD, size) == ERR_SEEK;
+      ok &= tfs_runStats (&files, &blocks, &runs) >= 0 && blocks == 2;
+      tfs_unmount ();
+      tfs_mount (CHECK_DISK_NAME);
+      FD = tfs_openFile ("h");
+    }
+  check ("hole reads as zeros and seeks skip it", ok);
+  tfs_unmount ();
+  free (expected);
+}
+
+/* Churns a few files under each allocation policy, then remounts with
+the default one and reads them all back. Under every policy but the
+head one each file should land in a single run. */
+void
+checkPolicies ()
+{
+  int policy, step, i, sizes[4], ok, contiguous, files, blocks, runs;
+  char name[4], *content;
+
+  content = malloc (4 * (1024 - 4));
+  for (policy = ALLOC_HEAD; policy <= ALLOC_NEAR; policy++)
+    {
+      ok = 1;
+      tfs_mkfsBlockSize (CHECK_DISK_NAME, 128 * 1024, 1024);
+      tfs_mountPolicy (CHECK_DISK_NAME, policy);
+      for (step = 0; step < 40; step++)
+	{
+	  i = step % 4;
+	  sizes[i] = (step * 977) % (4 * (1024 - 4)) + 1;
+	  fillPattern (content, sizes[i], step);
+	  sprintf (name, "c%d", i);
+	  if (step % 7 == 6)
+	    tfs_deleteFile (tfs_openFile (name));
+	  ok &= tfs_writeFile (tfs_openFile (name), content, sizes[i])
+	    == SUCCESS;
+	}
+      contiguous = tfs_runStats (&files, &blocks, &runs) >= 0
+	&& runs == files;
+      tfs_unmount ();
+
+      tfs_mount (CHECK_DISK_NAME);
+      for (i = 0; i < 4; i++)
+	{
+	  fillPattern (content, sizes[i], 36 + i);
+	  sprintf (name, "c%d", i);
+	  ok &= fileMatches (tfs_openFile (name), content, sizes[i]);
+	}
+      tfs_unmount ();
+      check (policy == ALLOC_HEAD ? "head policy keeps every file"
+	     : policy == ALLOC_NEXT_FIT ? "next fit keeps every file"
+	     : policy == ALLOC_BEST_FIT ? "best fit keeps every file"
+	     : "near policy keeps every file", ok);
+      if (policy != ALLOC_HEAD)
+	check ("policy places each file in one run", contiguous);
+    }
+  free (content);
+}
+
+/* Fills an image big enough for the threaded scan, then checks that a
+mount after a crash rebuilds the same summary from it, that
+tfs_runStats counts every file and that paging through the root with
+tfs_readdirPage lists each file once. */
+void
+checkScan ()
+{
+  int i, ok = 1, cursor = 0, got, listed = 0, imageSize, files, blocks,
+    runs;
+  char name[8], *content, *image, freeCount, seen[30];
+  tfs_dirent page[7];
+
+  content = malloc (3 * (8192 - 4));
+  memset (seen, 0, sizeof (seen));
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 200 * 8192, 8192);
+  tfs_mount (CHECK_DISK_NAME);
+  for (i = 0; i < 30; i++)
+    {
+      sprintf (name, "n%d", i);
+      fillPattern (content, (i % 3 + 1) * (8192 - 4) - i, i);
+      ok &= tfs_writeFile (tfs_openFile (name), content,
+			   (i % 3 + 1) * (8192 - 4) - i) == SUCCESS;
+    }
+  tfs_unmount ();
+  image = readHostFile (CHECK_DISK_NAME, &imageSize);
+  freeCount = image[SUPER_FREE_COUNT];
+  image[SUPER_CLEAN_FLAG] = 0;
+  image[SUPER_FREE_COUNT] = 0;
+  writeHostFile (CHECK_DISK_NAME, image, imageSize);
+  free (image);
+
+  tfs_mount (CHECK_DISK_NAME);
+  check ("scan counts every file",
+	 tfs_runStats (&files, &blocks, &runs) >= 0 && files == 30
+	 && blocks == 60);
+  while ((got = tfs_readdirPage ("/", &cursor, page, 7)) > 0)
+    for (i = 0; i < got; i++)
+      if (sscanf (page[i].name, "n%d", &files) == 1 && files >= 0
+	  && files < 30 && !seen[files]++)
+	listed++;
+  check ("readdir pages list each file once", got == 0 && listed == 30);
+  for (i = 0; i < 30; i++)
+    {
+      sprintf (name, "n%d", i);
+      fillPattern (content, (i % 3 + 1) * (8192 - 4) - i, i);
+      ok &= fileMatches (tfs_openFile (name), content,
+			 (i % 3 + 1) * (8192 - 4) - i);
+    }
+  check ("files read back after the rebuild", ok);
+  tfs_unmount ();
+  image = readHostFile (CHECK_DISK_NAME, &imageSize);
+  check ("threaded scan rebuilds the summary",
+	 image[SUPER_FREE_COUNT] == freeCount);
+  free (image);
+  free (content);
+}
+
+/* Writes and rewrites a file under each durability mode and with
+direct I/O, where the host file system allows it, and reads it back
+after a remount. */
+void
+checkDurability ()
+{
+  tfs_mountOptions options = { ALLOC_HEAD, TFS_SYNC_NONE, 0, 0, 0 };
+  int size = 2 * (4096 - 4) + 300, mode, ok = 1, mounted;
+  char *content;
+  fileDescriptor FD;
+
+  content = malloc (size);
+  for (mode = 0; mode < 4; mode++)
+    {
+      options.durability = mode < 3 ? mode : TFS_SYNC_NONE;
+      options.directIO = mode == 3;
+      fillPattern (content, size, 40 + mode);
+      tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+      if ((mounted = tfs_mountWith (CHECK_DISK_NAME, &options)) < 0)
+	{
+	  if (mode != 3 || mounted != ERR_INVALID_DISK)
+	    ok = 0;
+	  else
+	    printf ("note: direct I/O isn't available here\n");
+	  continue;
+	}
+      FD = tfs_openFile ("y");
+      ok &= tfs_writeFile (FD, content, size) == SUCCESS;
+      ok &= tfs_writeFile (FD, content, size - 1) == SUCCESS;
+      ok &= tfs_closeFile (FD) == SUCCESS && tfs_sync () >= 0;
+      tfs_unmount ();
+      tfs_mount (CHECK_DISK_NAME);
+      ok &= fileMatches (tfs_openFile ("y"), content, size - 1);
+      tfs_unmount ();
+    }
+  check ("every durability mode keeps the file", ok);
+  free (content);
+}
+
+/* Records a trace of a few calls, checks it holds one record per call,
+then plays it back with tfsReplay onto a fresh image and checks that
+image ends up with the same files. The content written is what
+tfsReplay generates, so the two must match byte for byte. */
+void
+checkTrace ()
+{
+  int size = 2 * (4096 - 4) + 20, i, status;
+  char *data, *patched;
+  tfs_traceHeader header = { 0, 0, 0, 0 };
+  fileDescriptor a, b, d;
+  tfs_fileStat st;
+  pid_t pid;
+
+  data = malloc (size);
+  patched = malloc (300);
+  for (i = 0; i < size; i++)
+    data[i] = 'a' + i % 26;
+  memcpy (patched, data, 300);
+  memcpy (patched + 100, data, 50);
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  tfs_mount (CHECK_DISK_NAME);
+  check ("trace starts", tfs_traceStart (CHECK_TRACE_NAME) == SUCCESS);
+  tfs_mkdir ("t");
+  a = tfs_openFile ("t/a");
+  tfs_writeFile (a, data, size);
+  b = tfs_openFile ("b");
+  tfs_writeFile (b, data, 300);
+  tfs_seek (b, 100);
+  tfs_writeBytes (b, data, 50);
+  tfs_rename (b, "c");
+  d = tfs_openFile ("d");
+  tfs_writeFile (d, data, 10);
+  tfs_deleteFile (d);
+  tfs_closeFile (a);
+  tfs_traceStop ();
+  tfs_unmount ();
+
+  check ("trace holds one record per call",
+	 traceRecords (CHECK_TRACE_NAME, &header) == 12
+	 && header.blockSize == 4096);
+
+  fflush (stdout);
+  if ((pid = fork ()) == 0)
+    {
+      freopen ("/dev/null", "w", stdout);
+      execl ("./tfsReplay", "tfsReplay", CHECK_TRACE_NAME, CHECK_COPY_NAME,
+	     "max", (char *) NULL);
+      _exit (127);
+    }
+  check ("tfsReplay runs the trace", pid > 0
+	 && waitpid (pid, &status, 0) == pid && WIFEXITED (status)
+	 && WEXITSTATUS (status) == 0);
+  tfs_mount (CHECK_COPY_NAME);
+  check ("replay leaves the same files",
+	 fileMatches (tfs_openFile ("t/a"), data, size)
+	 && tfs_stat ("c", &st) >= 0 && tfs_stat ("b", &st) < 0
+	 && tfs_stat ("d", &st) < 0
+	 && fileMatches (tfs_openFile ("c"), patched, 300));
+  tfs_unmount ();
+
+  remove (CHECK_TRACE_NAME);
+  remove (CHECK_COPY_NAME);
+  free (data);
+  free (patched);
+}
+
+/* Checks tfs_stat and a tfs_opendir listing agree with what was
+written, renamed and deleted, and still do after a remount rebuilds
+the inode table. */
+void
+checkStat ()
+{
+  int pass, ok = 1, seen, count;
+  tfs_fileStat st;
+  tfs_dir dir;
+  fileDescriptor FD;
+
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 1024, 1024);
+  tfs_mount (CHECK_DISK_NAME);
+  tfs_mkdir ("s");
+  tfs_writeFile (tfs_openFile ("s/one"), "12345", 5);
+  FD = tfs_openFile ("s/two");
+  tfs_writeFile (FD, "123", 3);
+  tfs_rename (FD, "three");
+  tfs_writeFile (tfs_openFile ("s/gone"), "1", 1);
+  tfs_deleteFile (tfs_openFile ("s/gone"));
+  tfs_makeRO ("s/one");
+
+  for (pass = 0; pass < 2; pass++)
+    {
+      ok &= tfs_stat ("s", &st) >= 0 && st.type == DIRECTORY_TYPE;
+      ok &= tfs_stat ("s/one", &st) >= 0 && st.size == 5 && !st.writable;
+      ok &= tfs_stat ("s/three", &st) >= 0 && st.size == 3 && st.writable;
+      ok &= tfs_stat ("s/two", &st) < 0 && tfs_stat ("s/gone", &st) < 0;
+      seen = count = 0;
+      ok &= tfs_opendir ("s", &dir) >= 0;
+      while (tfs_readdir_next (&dir, &st) == 1)
+	{
+	  count++;
+	  seen |= strcmp (st.name, "one") == 0 ? 1
+	    : strcmp (st.name, "three") == 0 ? 2 : 4;
+	}
+      ok &= count == 2 && seen == 3;
+      tfs_unmount ();
+      tfs_mount (CHECK_DISK_NAME);
+    }
+  check ("stat and readdir follow the image", ok);
+  tfs_unmount ();
+}
+
+/* what each reader thread of checkReadOnly reads and whether it
+matched */
+typedef struct
+{
+  char *expected;
+  int size;
+  int ok;
+} readerCheck;
+
+/* reads the file "r" through a reader of its own, in pieces and then
+whole */
+void *
+readWhole (void *arg)
+{
+  readerCheck *job = arg;
+  tfs_reader reader;
+  char *got;
+  int at = 0, n, round;
+
+  got = malloc (job->size);
+  job->ok = 1;
+  for (round = 0; round < 20 && job->ok; round++)
+    {
+      job->ok &= tfs_openReader ("r", &reader) == SUCCESS;
+      for (at = 0; (n = tfs_readerRead (&reader, got + at, 1000)) > 0;
+	   at += n)
+	;
+      job->ok &= at == job->size && memcmp (got, job->expected, at) == 0;
+      job->ok &= tfs_readerPread (&reader, 1, got, job->size) == job->size - 1
+	&& memcmp (got, job->expected + 1, job->size - 1) == 0;
+    }
+  free (got);
+  return NULL;
+}
+
+/* Mounts an image read-only, reads a file from four threads at once and
+checks writes are refused, then checks the image file is byte for
+byte what it was. */
+void
+checkReadOnly ()
+{
+  tfs_mountOptions readOnly = { ALLOC_HEAD, TFS_SYNC_NONE, 0, 1, 0 };
+  int size = 3 * (4096 - 4) + 77, imageSize, afterSize, i, ok = 1;
+  char *content, *before, *after;
+  readerCheck jobs[4];
+  pthread_t threads[4];
+  tfs_reader reader;
+
+  content = malloc (size);
+  fillPattern (content, size, 16);
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  tfs_mount (CHECK_DISK_NAME);
+  tfs_writeFile (tfs_openFile ("r"), content, size);
+  check ("readers refuse a writable mount",
+	 tfs_openReader ("r", &reader) == ERR_BAD_REQUEST);
+  tfs_unmount ();
+  before = readHostFile (CHECK_DISK_NAME, &imageSize);
+
+  check ("image mounts read-only",
+	 tfs_mountWith (CHECK_DISK_NAME, &readOnly) == SUCCESS);
+  for (i = 0; i < 4; i++)
+    {
+      jobs[i].expected = content;
+      jobs[i].size = size;
+      pthread_create (&threads[i], NULL, readWhole, &jobs[i]);
+    }
+  for (i = 0; i < 4; i++)
+    {
+      pthread_join (threads[i], NULL);
+      ok &= jobs[i].ok;
+    }
+  check ("readers on four threads read the file", ok);
+  check ("read-only mount refuses writes",
+	 tfs_writeFile (tfs_openFile ("r"), content, 1) == ERR_READ_ONLY
+	 && tfs_mkdir ("x") == ERR_READ_ONLY);
+  tfs_unmount ();
+  after = readHostFile (CHECK_DISK_NAME, &afterSize);
+  check ("read-only mount leaves the image unchanged",
+	 afterSize == imageSize && memcmp (after, before, imageSize) == 0);
+
+  free (content);
+  free (before);
+  free (after);
+}
+
+/* how many bytes of the host file at ‘path’ are allocated */
+long
+hostAllocated (char *path)
+{
+  struct stat st;
+
+  return stat (path, &st) == 0 ? (long) st.st_blocks * 512 : -1;
+}
+
+/* Writes two files, deletes the big one and checks the host file gives
+back its space, then trims the whole image and checks the small file
+reads back after a remount. */
+void
+checkPunch ()
+{
+  int size = 40 * (4096 - 4), small = 2 * (4096 - 4), trimmed;
+  long full, freed;
+  char *content;
+
+  content = malloc (size);
+  fillPattern (content, size, 17);
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  tfs_mount (CHECK_DISK_NAME);
+  tfs_writeFile (tfs_openFile ("k"), content, small);
+  tfs_writeFile (tfs_openFile ("big"), content, size);
+  tfs_sync ();
+  full = hostAllocated (CHECK_DISK_NAME);
+  tfs_deleteFile (tfs_openFile ("big"));
+  tfs_sync ();
+  freed = hostAllocated (CHECK_DISK_NAME);
+  trimmed = tfs_trim ();
+  tfs_unmount ();
+
+  check ("trim goes over the free blocks", trimmed > 40);
+  if (full == freed)
+    printf ("note: hole punching isn't available here\n");
+  else
+    check ("delete hands the space back", full - freed >= 36 * 4096);
+  tfs_mount (CHECK_DISK_NAME);
+  check ("trimmed image keeps its files",
+	 fileMatches (tfs_openFile ("k"), content, small));
+  check ("trimmed space is written again",
+	 tfs_writeFile (tfs_openFile ("big"), content, size) == SUCCESS
+	 && fileMatches (tfs_openFile ("big"), content, size));
+  tfs_unmount ();
+  free (content);
+}
+
+/* Shrinks a file with tfs_truncate, grows it again into a hole, fills
+the file out with tfs_fallocate, and checks the content, the size and
+the blocks held before and after a remount. */
+void
+checkTruncate ()
+{
+  int piece = 4096 - 4, ok = 1, pass, files, blocks, runs;
+  char *content, *expected;
+  fileDescriptor FD;
+  tfs_fileStat st;
+
+  content = malloc (3 * piece);
+  expected = calloc (5 * piece, 1);
+  fillPattern (content, 3 * piece, 18);
+  memcpy (expected, content, piece + piece / 2);
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  tfs_mount (CHECK_DISK_NAME);
+  FD = tfs_openFile ("z");
+  tfs_writeFile (FD, content, 3 * piece);
+  tfs_seek (FD, 7);
+  check ("truncate shrinks the file",
+	 tfs_truncate (FD, piece + piece / 2) == SUCCESS
+	 && fileMatches (FD, expected, piece + piece / 2)
+	 && tfs_runStats (&files, &blocks, &runs) >= 0 && blocks == 2);
+  check ("truncate grows the file with a hole",
+	 tfs_truncate (FD, 4 * piece) == SUCCESS
+	 && fileMatches (FD, expected, 4 * piece)
+	 && tfs_runStats (&files, &blocks, &runs) >= 0 && blocks == 2);
+  tfs_seek (FD, 11);
+  check ("fallocate gives every extent a block",
+	 tfs_fallocate (FD, 5 * piece) == SUCCESS
+	 && tfs_seekHole (FD, 0) == 5 * piece);
+  tfs_seek (FD, 11);
+  check ("size calls leave the file pointer alone",
+	 tfs_truncate (FD, 5 * piece) == SUCCESS
+	 && tfs_readBytes (FD, content, 1) == 1 && content[0] == expected[11]);
+
+  for (pass = 0; pass < 2; pass++)
+    {
+      ok &= tfs_stat ("z", &st) >= 0 && st.size == 5 * piece;
+      ok &= fileMatches (tfs_openFile ("z"), expected, 5 * piece);
+      ok &= tfs_runStats (&files, &blocks, &runs) >= 0 && blocks == 5;
+      tfs_unmount ();
+      tfs_mount (CHECK_DISK_NAME);
+    }
+  check ("sizes survive a remount", ok);
+  tfs_unmount ();
+  free (content);
+  free (expected);
+}
+
+/* Writes blocks through libDisk and reads them back with each call
+diskBench times: readBlock, readBlocks, a committed batch, the mapping
+and direct I/O where the host allows it. Then runs diskBench itself
+for a moment to check every run it makes completes. */
+void
+checkDiskCalls ()
+{
+  char *blocks, *expected, *map;
+  int disk, i, ok = 1, status;
+  void *aligned;
+  pid_t pid;
+
+  blocks = malloc (16 * 4096);
+  expected = malloc (16 * 4096);
+  for (i = 0; i < 16; i++)
+    fillPattern (expected + i * 4096, 4096, 50 + i);
+  disk = openDisk (CHECK_DISK_NAME, 64 * 4096);
+  setBlockSize (disk, 4096);
+  for (i = 0; i < 16; i++)
+    ok &= writeBlock (disk, i, expected + i * 4096) == 0;
+  ok &= readBlocks (disk, 0, 16, blocks) == 0
+    && memcmp (blocks, expected, 16 * 4096) == 0;
+  ok &= readBlock (disk, 5, blocks) == 0
+    && memcmp (blocks, expected + 5 * 4096, 4096) == 0;
+  check ("libDisk reads back its writes", ok);
+
+  fillPattern (expected + 3 * 4096, 4096, 70);
+  fillPattern (expected + 9 * 4096, 4096, 71);
+  beginBatch (disk);
+  writeBlock (disk, 9, expected + 9 * 4096);
+  writeBlock (disk, 3, expected + 3 * 4096);
+  check ("batch commits in libDisk", commitBatch (disk) == 0
+	 && readBlocks (disk, 0, 16, blocks) == 0
+	 && memcmp (blocks, expected, 16 * 4096) == 0);
+  check ("mapping shows the committed blocks",
+	 (map = mapDisk (disk)) != NULL
+	 && memcmp (map, expected, 16 * 4096) == 0);
+  if (setDirectIO (disk, 1) < 0)
+    printf ("note: direct I/O isn't available here\n");
+  else if (posix_memalign (&aligned, DIRECT_ALIGN, 4096) == 0)
+    {
+      check ("direct I/O reads the same blocks",
+	     readBlock (disk, 9, aligned) == 0
+	     && memcmp (aligned, expected + 9 * 4096, 4096) == 0);
+      free (aligned);
+    }
+  closeDisk (disk);
+
+  fflush (stdout);
+  if ((pid = fork ()) == 0)
+    {
+      freopen ("/dev/null", "w", stdout);
+      execl ("./diskBench", "diskBench", CHECK_DISK_NAME, "0.001",
+	     (char *) NULL);
+      _exit (127);
+    }
+  check ("diskBench completes", pid > 0 && waitpid (pid, &status, 0) == pid
+	 && WIFEXITED (status) && WEXITSTATUS (status) == 0);
+  free (blocks);
+  free (expected);
+}
+
+/* When the library was built with <sys/sdt.h>, checks this binary
+carries the stapsdt notes for the probes tracers attach to. */
+void
+checkProbes ()
+{
+#ifdef TFS_PROBES
+  char *names[] = { "call__entry", "call__return", "block__read",
+    "block__write", "block__alloc", "block__free"
+  };
+  int size, i, j, found, ok = 1;
+  char *binary;
+
+  binary = readHostFile ("/proc/self/exe", &size);
+  for (i = 0; binary && i < 6; i++)
+    {
+      for (j = found = 0; !found && j + strlen (names[i]) < size; j++)
+	found = memcmp (binary + j, names[i], strlen (names[i])) == 0;
+      ok &= found;
+    }
+  check ("probes are in the binary", binary && ok);
+  free (binary);
+#else
+  printf ("note: built without <sys/sdt.h>, so there are no probes\n");
+#endif
+}
+
+/* Rewrites a few files on a log-structured image until the cleaner
+has had to run, then mounts it again and reads every file back. */
+void
+checkLog ()
+{
+  int sizes[4], seeds[4], i, step, ok = 1, segments, empty, live;
+  char name[4], *content;
+
+  content = malloc (4 * (4096 - 4));
+  check ("log image formats", tfs_mkfsLog (CHECK_DISK_NAME, 64 * 4096, 4096) == SUCCESS);
+  tfs_mount (CHECK_DISK_NAME);
+  for (step = 0; step < 200; step++)
+    {
+      i = step % 4;
+      sizes[i] = (step * 1237) % (4 * (4096 - 4)) + 1;
+      seeds[i] = step;
+      fillPattern (content, sizes[i], seeds[i]);
+      sprintf (name, "l%d", i);
+      ok &= tfs_writeFile (tfs_openFile (name), content, sizes[i]) == SUCCESS;
+    }
+  check ("log takes every rewrite", ok);
+  check ("log cleaner runs", tfs_cleanLog (MAX_BLOCKS) >= 0);
+  tfs_unmount ();
+
+  check ("log image mounts again", tfs_mount (CHECK_DISK_NAME) == SUCCESS);
+  for (i = 0, ok = 1; i < 4; i++)
+    {
+      fillPattern (content, sizes[i], seeds[i]);
+      sprintf (name, "l%d", i);
+      ok &= fileMatches (tfs_openFile (name), content, sizes[i]);
+    }
+  check ("log files read back after the remount", ok);
+  check ("log has empty segments", tfs_logStats (&segments, &empty, &live) == SUCCESS && empty > 0);
+  tfs_unmount ();
+  free (content);
+}
+
+/* Runs every check and returns the number that failed */
+/* Writes a file of many blocks on a queued mount and checks libDisk
+merged the block writes into fewer pwritev calls, then reads the file
+back after a remount. */
+void
+checkQueue ()
+{
+  int size = 30 * (1024 - 4);
+  long readRequests, readCalls, writeRequests, writeCalls;
+  char *content;
+
+  content = malloc (size);
+  fillPattern (content, size, 19);
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 128 * 1024, 1024);
+  tfs_mount (CHECK_DISK_NAME);
+  tfs_writeFile (tfs_openFile ("w"), content, size);
+  check ("queue merges the file's block writes",
+	 tfs_ioStats (&readRequests, &readCalls, &writeRequests,
+		      &writeCalls) >= 0 && writeRequests >= 30
+	 && writeCalls < writeRequests / 4);
+  tfs_unmount ();
+  tfs_mount (CHECK_DISK_NAME);
+  check ("queued writes read back",
+	 fileMatches (tfs_openFile ("w"), content, size));
+  tfs_unmount ();
+  free (content);
+}
+
+/* Writes a journal for the blocks in which ‘after’ differs from
+‘before’, as a commit cut short after syncing its journal would leave
+it, with a checksum that is off by one when ‘torn’ is set. */
+int
+writeJournal (char *before, char *after, int size, int torn)
+{
+  tfs_journalHeader header = { JOURNAL_MAGIC, 4096, 0, 0 };
+  unsigned char bNums[MAX_BLOCKS + 1];
+  int fd, i, ok = 1;
+
+  for (i = 0; i < size / 4096; i++)
+    if (memcmp (before + i * 4096, after + i * 4096, 4096) != 0)
+      bNums[header.count++] = i;
+  header.checksum =
+    journalChecksum (2166136261u, (char *) bNums, header.count);
+  for (i = 0; i < header.count; i++)
+    header.checksum =
+      journalChecksum (header.checksum, after + bNums[i] * 4096, 4096);
+  header.checksum += torn;
+
+  if ((fd = open (CHECK_DISK_NAME JOURNAL_SUFFIX, O_CREAT | O_TRUNC | O_WRONLY,
+		  0644)) < 0)
+    return 0;
+  ok &= write (fd, &header, sizeof (header)) == sizeof (header);
+  ok &= write (fd, bNums, header.count) == header.count;
+  for (i = 0; i < header.count; i++)
+    ok &= write (fd, after + bNums[i] * 4096, 4096) == 4096;
+  return close (fd) == 0 && ok && header.count > 0;
+}
+
+/* Aborts a batch and checks the image didn't change, then commits one,
+puts the image back as it was before the commit with the commit's
+journal beside it, as a crash would, and checks that mount replays it
+and that a torn journal and a read-only mount leave the image alone. */
+void
+checkBatch ()
+{
+  tfs_mountOptions readOnly = { ALLOC_HEAD, TFS_SYNC_NONE, 0, 1, 0 };
+  int size = 3 * (4096 - 4), imageSize, afterSize;
+  char *old, *new, *before, *after, *image;
+
+  old = malloc (size);
+  new = malloc (size);
+  fillPattern (old, size, 5);
+  fillPattern (new, size, 6);
+  tfs_mkfsBlockSize (CHECK_DISK_NAME, 64 * 4096, 4096);
+  tfs_mount (CHECK_DISK_NAME);
+  tfs_writeFile (tfs_openFile ("b"), old, size);
+  tfs_writeFile (tfs_openFile ("d"), old, size);
+  tfs_unmount ();
+  before = readHostFile (CHECK_DISK_NAME, &imageSize);
+
+  tfs_mount (CHECK_DISK_NAME);
+  tfs_batchBegin ();
+  tfs_writeFile (tfs_openFile ("b"), new, size);
+  tfs_writeFile (tfs_openFile ("c"), new, size);
+  tfs_deleteFile (tfs_openFile ("d"));
+  check ("batch aborts", tfs_batchAbort () >= 0);
+  tfs_unmount ();
+  image = readHostFile (CHECK_DISK_NAME, &afterSize);
+  check ("aborted batch leaves the image unchanged", image
+	 && afterSize == imageSize
+	 && memcmp (image, before, imageSize) == 0);
+  free (image);
+
+  tfs_mount (CHECK_DISK_NAME);
+  tfs_batchBegin ();
+  tfs_writeFile (tfs_openFile ("b"), new, size);
+  tfs_writeFile (tfs_openFile ("c"), new, size);
+  tfs_deleteFile (tfs_openFile ("d"));
+  check ("batch commits", tfs_batchCommit () >= 0);
+  tfs_unmount ();
+  after = readHostFile (CHECK_DISK_NAME, &afterSize);
+  check ("commit removes the journal",
+	 access (CHECK_DISK_NAME JOURNAL_SUFFIX, F_OK) < 0);
+
+  writeHostFile (CHECK_DISK_NAME, before, imageSize);
+  writeJournal (before, after, imageSize, 1);
+  tfs_mount (CHECK_DISK_NAME);
+  check ("torn journal isn't replayed",
+	 fileMatches (tfs_openFile ("b"), old, size)
+	 && fileMatches (tfs_openFile ("d"), old, size));
+  tfs_unmount ();
+
+  writeHostFile (CHECK_DISK_NAME, before, imageSize);
+  check ("journal is written", writeJournal (before, after, imageSize, 0));
+  check ("read-only mount refuses a pending journal",
+	 tfs_mountWith (CHECK_DISK_NAME, &readOnly) < 0);
+  check ("mount replays the journal",
+	 tfs_mount (CHECK_DISK_NAME) == SUCCESS);
+  check ("replayed batch is all there",
+	 fileMatches (tfs_openFile ("b"), new, size)
+	 && fileMatches (tfs_openFile ("c"), new, size)
+	 && tfs_deleteFile (tfs_openFile ("d")) >= 0);
+  tfs_unmount ();
+
+  free (old);
+  free (new);
+  free (before);
+  free (after);
+}
+
+int
+runChecks ()
+{
+  checkSummary ();
+  checkBlockSizes ();
+  checkDescriptors ();
+  checkDirectories ();
+  checkDaemon ();
+  checkViews ();
+  checkImportFiles ();
+  checkImport ();
+  checkStriped ();
+  checkMkimage ();
+  checkSnapshots ();
+  checkDedup ();
+  checkSparse ();
+  checkPolicies ();
+  checkScan ();
+  checkDurability ();
+  checkTrace ();
+  checkStat ();
+  checkReadOnly ();
+  checkPunch ();
+  checkTruncate ();
+  checkDiskCalls ();
+  checkProbes ();
+  checkLog ();
+  checkQueue ();
+  checkBatch ();
+
+  remove (CHECK_DISK_NAME);
+  printf ("%d checks failed\n", checkFailures);
+  return checkFailures;
+}
+
 /* This program will create 2 files (of sizes 200 and 1000) to be read from or stored in the TinyFS file system. */
 int
 main ()
@@ -158,6 +1585,6 @@ main ()
     perror ("tfs_unmount failed");
 
   printf ("\nend of demo\n\n");
-  return 0;
+  return runChecks () ? 1 : 0;
 }
 
@@ -0,0 +1,67 @@
+/* Program 4
+ * Daniel Foxhoven
+ * Geoff Wacker
+ * Adair Camacho
+ * Due Date: 3/19/17
+ */
+
+#ifndef TFS_TRACE_H
+#define TFS_TRACE_H
+
+#include <stdint.h>
+
+/* Trace log written by tfs_traceStart and read by tfsReplay. A header
+is followed by one record per traced call, in the order the calls
+returned. Everything is in host byte order; traces are replayed on the
+kind of machine that recorded them. */
+
+#define TRACE_MAGIC 0x54534654
+#define TRACE_VERSION 1
+
+#define TRACE_OP_OPEN 1
+#define TRACE_OP_CLOSE 2
+#define TRACE_OP_WRITE 3
+#define TRACE_OP_WRITEBYTES 4
+#define TRACE_OP_DELETE 5
+#define TRACE_OP_READBYTE 6
+#define TRACE_OP_READBYTES 7
+#define TRACE_OP_SEEK 8
+#define TRACE_OP_RENAME 9
+#define TRACE_OP_MKDIR 10
+#define TRACE_OP_RMDIR 11
+#define TRACE_OP_MAKERO 12
+#define TRACE_OP_MAKERW 13
+#define TRACE_OP_BATCH_BEGIN 14
+#define TRACE_OP_BATCH_COMMIT 15
+#define TRACE_OP_BATCH_ABORT 16
+#define TRACE_OP_SYNC 17
+#define TRACE_OP_TRUNCATE 18
+#define TRACE_OP_FALLOCATE 19
+#define TRACE_OPS 20
+
+/* The block size and block count of the image mounted when the trace
+began, both 0 if none was */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	int32_t blockSize;
+	int32_t numBlocks;
+} tfs_traceHeader;
+
+/* Followed by nameLen bytes of name (no terminator). start is when the
+call began, in nanoseconds since the trace did, and latency how long it
+took. arg is the size for writes, reads, truncates and fallocates and
+the offset for seeks.
+Content is never recorded. */
+typedef struct {
+	uint64_t start;
+	uint32_t latency;
+	int32_t fd;
+	int32_t arg;
+	int32_t result;
+	uint8_t op;
+	uint8_t pad;
+	uint16_t nameLen;
+} tfs_traceRecord;
+
+#endif
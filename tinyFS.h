@@ -8,7 +8,10 @@
 #ifndef TINYFS_H
 #define TINYFS_H
 
+/* The default block size, tfs_mkfsBlockSize can pick any power of two in range */
 #define BLOCKSIZE 256
+#define MIN_BLOCKSIZE 256
+#define MAX_BLOCKSIZE 65536
 #define DEFAULT_DISK_SIZE 10240
 #define DEFAULT_DISK_NAME "tinyFSDisk"
 
@@ -24,3 +24,11 @@
 #define ERR_INVALID_SPACE -14
 #define ERR_FILE_CLOSED -15
 #define ERR_READ_ONLY -16
+#define ERR_NO_SUCH_DIR -17
+#define ERR_FILE_EXISTS -18
+#define ERR_DIR_NOT_EMPTY -19
+#define ERR_INVALID_DISK -20
+#define ERR_BAD_REQUEST -21
+#define ERR_FILE_BUSY -22
+#define ERR_NO_SUCH_SNAPSHOT -23
+#define ERR_NO_SUCH_FILE -24
@@ -72,17 +72,17 @@ int main(int argc, char *argv[]) {
 
     waitForEnter();
     printf("Writing content to files\n");
-    if (tfs_writeFile(FD1, content1, 20) < 0)
+    if (tfs_writeFile(FD1, content1, strlen(content1)) < 0)
         perror("write to File1 failed");
     else
         printf("Wrote to File1\n");
     
-    if (tfs_writeFile(FD2, content2, 20) < 0)
+    if (tfs_writeFile(FD2, content2, strlen(content2)) < 0)
         perror("write to File2 failed");
     else
         printf("Wrote to File2\n");
 
-    if (tfs_writeFile(FD3, content3, 20) < 0)
+    if (tfs_writeFile(FD3, content3, strlen(content3)) < 0)
         perror("write to File3 failed");
     else
         printf("Wrote to File3\n");
@@ -152,7 +152,7 @@ int main(int argc, char *argv[]) {
     
     waitForEnter();
     printf("Writing to file1\n");
-    if (tfs_writeFile(FD1, content1, 20) < 0)
+    if (tfs_writeFile(FD1, content1, strlen(content1)) < 0)
         fprintf(stderr, "tfs_writeFile: File is read-only\n");
     else
         printf("Wrote to File1\n");
@@ -0,0 +1,147 @@
+/* Program 4
+ * Daniel Foxhoven
+ * Geoff Wacker
+ * Adair Camacho
+ * Due Date: 3/19/17
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "tfsClient.h"
+#include "tinyfsProto.h"
+#include "tinyFS_errno.h"
+
+/* Load generator for tinyfsd. For 1, 2, 4, ... clients it forks that
+many processes, each of which keeps reading small pieces of a shared
+file and of a file of its own in pipelined batches, and reports the
+combined throughput. */
+
+#define LOAD_SHARED_NAME "shared"
+#define LOAD_SHARED_SIZE 4000
+#define LOAD_OWN_SIZE 200
+#define LOAD_READ_SIZE 32
+#define LOAD_BATCH 16
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void fillContent(char *buf, int size, char first) {
+    int i;
+
+    for (i = 0; i < size; i++) {
+        buf[i] = first + (i % 26);
+    }
+}
+
+/* Runs in the child. Returns the number of requests completed. */
+long runClient(char *socketPath, int id, double seconds) {
+    char name[9], own[LOAD_OWN_SIZE], buffers[LOAD_BATCH][LOAD_READ_SIZE];
+    int results[LOAD_BATCH], shared, mine, i, offset;
+    long done = 0;
+    double end;
+
+    if (tfsc_connect(socketPath) < 0) {
+        perror("tinyfsLoad: connect");
+        return -1;
+    }
+
+    snprintf(name, sizeof(name), "ld%d", id);
+    fillContent(own, LOAD_OWN_SIZE, 'A');
+    if ((shared = tfsc_openFile(LOAD_SHARED_NAME)) < 0 || (mine = tfsc_openFile(name)) < 0 ||
+        tfsc_writeFile(mine, own, LOAD_OWN_SIZE) < 0) {
+        fprintf(stderr, "tinyfsLoad: client %d could not set up its files\n", id);
+        tfsc_disconnect();
+        return -1;
+    }
+
+    srand(id + 1);
+    end = now() + seconds;
+    while (now() < end) {
+        tfsc_batchBegin();
+        for (i = 0; i < LOAD_BATCH; i++) {
+            if (i % 4 == 3) {
+                offset = rand() % (LOAD_OWN_SIZE - LOAD_READ_SIZE);
+                tfsc_pread(mine, offset, buffers[i], LOAD_READ_SIZE);
+            } else {
+                offset = rand() % (LOAD_SHARED_SIZE - LOAD_READ_SIZE);
+                tfsc_pread(shared, offset, buffers[i], LOAD_READ_SIZE);
+            }
+        }
+        if (tfsc_batchEnd(results, LOAD_BATCH) < 0) {
+            break;
+        }
+        done += LOAD_BATCH;
+    }
+
+    tfsc_deleteFile(mine);
+    tfsc_disconnect();
+    return done;
+}
+
+int main(int argc, char *argv[]) {
+    char *socketPath = argc > 1 ? argv[1] : TFSD_DEFAULT_SOCKET;
+    int maxClients = argc > 2 ? atoi(argv[2]) : 8;
+    double seconds = argc > 3 ? atof(argv[3]) : 2.0;
+    char content[LOAD_SHARED_SIZE];
+    int pipes[2], clients, i, FD;
+    long count, total;
+
+    if (maxClients < 1 || maxClients > 32) {
+        fprintf(stderr, "usage: tinyfsLoad [socket] [max clients, 1-32] [seconds]\n");
+        return 1;
+    }
+
+    // Create the shared file once before any client starts.
+    if (tfsc_connect(socketPath) < 0) {
+        perror("tinyfsLoad: connect");
+        return 1;
+    }
+    fillContent(content, LOAD_SHARED_SIZE, 'a');
+    if ((FD = tfsc_openFile(LOAD_SHARED_NAME)) < 0 || tfsc_writeFile(FD, content, LOAD_SHARED_SIZE) < 0) {
+        fprintf(stderr, "tinyfsLoad: could not write %s\n", LOAD_SHARED_NAME);
+        return 1;
+    }
+    tfsc_disconnect();
+
+    for (clients = 1; clients <= maxClients; clients *= 2) {
+        if (pipe(pipes) < 0) {
+            perror("tinyfsLoad: pipe");
+            return 1;
+        }
+        for (i = 0; i < clients; i++) {
+            if (fork() == 0) {
+                close(pipes[0]);
+                count = runClient(socketPath, i, seconds);
+                if (write(pipes[1], &count, sizeof(count)) != sizeof(count)) {
+                    _exit(1);
+                }
+                _exit(0);
+            }
+        }
+        close(pipes[1]);
+
+        total = 0;
+        for (i = 0; i < clients; i++) {
+            if (read(pipes[0], &count, sizeof(count)) == sizeof(count) && count > 0) {
+                total += count;
+            }
+        }
+        close(pipes[0]);
+        while (wait(NULL) > 0)
+            ;
+
+        printf("%2d clients: %10.0f requests/s\n", clients, total / seconds);
+        fflush(stdout);
+    }
+
+    return 0;
+}
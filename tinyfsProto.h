@@ -0,0 +1,55 @@
+/* Program 4
+ * Daniel Foxhoven
+ * Geoff Wacker
+ * Adair Camacho
+ * Due Date: 3/19/17
+ */
+
+#ifndef TINYFS_PROTO_H
+#define TINYFS_PROTO_H
+
+#include <stdint.h>
+
+/* Wire protocol between tinyfsd and the client library. A client
+writes any number of requests back to back without waiting; tinyfsd
+answers each one, in the order it was sent, with a response. Both
+headers are sent in host byte order since both ends run on the same
+machine. */
+
+#define TFSD_DEFAULT_SOCKET "tinyfsd.sock"
+
+/* Largest name or data payload a single request may carry */
+#define TFSD_MAX_PAYLOAD (16 * 1024 * 1024)
+
+#define TFSD_OP_OPEN 1
+#define TFSD_OP_CLOSE 2
+#define TFSD_OP_WRITE 3
+#define TFSD_OP_DELETE 4
+#define TFSD_OP_READBYTE 5
+#define TFSD_OP_SEEK 6
+#define TFSD_OP_RENAME 7
+#define TFSD_OP_MKDIR 8
+#define TFSD_OP_RMDIR 9
+#define TFSD_OP_MAKERO 10
+#define TFSD_OP_MAKERW 11
+#define TFSD_OP_PREAD 12
+
+/* Followed by nameLen bytes of name (no terminator) and dataLen bytes
+of data. For TFSD_OP_PREAD, arg is the offset and dataLen is the number
+of bytes wanted, with no data following. */
+typedef struct {
+	uint8_t op;
+	uint8_t pad;
+	uint16_t nameLen;
+	int32_t fd;
+	int32_t arg;
+	uint32_t dataLen;
+} tfsd_request;
+
+/* Followed by dataLen bytes of data */
+typedef struct {
+	int32_t result;
+	uint32_t dataLen;
+} tfsd_response;
+
+#endif
@@ -0,0 +1,500 @@
+/* Program 4
+ * Daniel Foxhoven
+ * Geoff Wacker
+ * Adair Camacho
+ * Due Date: 3/19/17
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "tinyFS.h"
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+#include "tinyfsProto.h"
+
+/* tinyfsd mounts one image and serves it to any number of local
+clients over a Unix socket, so libTinyFS' process globals are only
+ever touched by this one process.
+
+Requests are served in rounds. Each round takes at most one segment
+from every client with a complete request waiting: either a single
+request that may change the file system, or the whole run of preads
+at the front of its queue. Changes run first. The preads of the round
+are then sorted by file and offset, and overlapping or adjacent ranges
+are read with one walk of the file's extents and sliced back out to
+each client. */
+
+#define TFSD_MAX_CLIENTS 64
+#define TFSD_READ_CHUNK 65536
+#define TFSD_DISK_SIZE (MAX_BLOCKS * BLOCKSIZE)
+#define TFSD_IDLE_MS 100
+
+typedef struct {
+	int sock;
+	char *in;
+	int inLen, inCap;
+	int taken;	// bytes of ‘in’ handed to the current round
+	char *out;
+	int outLen, outCap, outSent;
+} tfsd_client;
+
+/* A pread waiting for the end of its round */
+typedef struct {
+	tfsd_client *client;
+	int fd, offset, size, got;
+	int dataOff;	// where its bytes go in roundData
+} tfsd_read;
+
+tfsd_client clients[TFSD_MAX_CLIENTS];
+int numClients = 0;
+
+tfsd_read *roundReads = NULL;
+int *roundOrder = NULL;
+int roundReadCount = 0, roundReadCap = 0;
+char *roundData = NULL;
+int roundDataLen = 0, roundDataCap = 0;
+char *mergeBuf = NULL;
+int mergeCap = 0;
+char nameBuf[UINT16_MAX + 1];
+
+volatile sig_atomic_t stopping = 0;
+long statRequests = 0, statReads = 0, statReadPasses = 0, statRounds = 0;
+
+void onSignal(int sig) {
+	stopping = 1;
+}
+
+void *growBuffer(void *buf, int *cap, int need, int unit) {
+	if (need <= *cap) {
+		return buf;
+	}
+	*cap = need * 2 > 64 ? need * 2 : 64;
+	if ((buf = realloc(buf, (size_t) *cap * unit)) == NULL) {
+		perror("tinyfsd: out of memory");
+		exit(1);
+	}
+	return buf;
+}
+
+void appendResponse(tfsd_client *c, int result, char *data, int dataLen) {
+	tfsd_response resp;
+
+	resp.result = result;
+	resp.dataLen = dataLen;
+	c->out = growBuffer(c->out, &c->outCap, c->outLen + sizeof(resp) + dataLen, 1);
+	memcpy(c->out + c->outLen, &resp, sizeof(resp));
+	c->outLen += sizeof(resp);
+	if (dataLen) {
+		memcpy(c->out + c->outLen, data, dataLen);
+		c->outLen += dataLen;
+	}
+}
+
+/* Length of the complete request at ‘pos’, 0 if it has not all
+arrived yet, or -1 if it is malformed. */
+int requestLength(tfsd_client *c, int pos) {
+	tfsd_request req;
+	int len;
+
+	if (c->inLen - pos < sizeof(req)) {
+		return 0;
+	}
+	memcpy(&req, c->in + pos, sizeof(req));
+	if (req.dataLen > TFSD_MAX_PAYLOAD) {
+		return -1;
+	}
+
+	len = sizeof(req) + req.nameLen;
+	if (req.op != TFSD_OP_PREAD) {
+		len += req.dataLen;
+	}
+	return c->inLen - pos < len ? 0 : len;
+}
+
+char *requestName(tfsd_request *req, char *payload) {
+	memcpy(nameBuf, payload, req->nameLen);
+	nameBuf[req->nameLen] = '\0';
+	return nameBuf;
+}
+
+/* Runs anything other than a pread directly against the mounted image */
+void runRequest(tfsd_client *c, tfsd_request *req, char *payload) {
+	char *data = payload + req->nameLen, byte;
+	int result;
+
+	switch (req->op) {
+	case TFSD_OP_OPEN:
+		result = tfs_openFile(requestName(req, payload));
+		break;
+	case TFSD_OP_CLOSE:
+		result = tfs_closeFile(req->fd);
+		break;
+	case TFSD_OP_WRITE:
+		result = tfs_writeFile(req->fd, data, req->dataLen);
+		break;
+	case TFSD_OP_DELETE:
+		result = tfs_deleteFile(req->fd);
+		break;
+	case TFSD_OP_READBYTE:
+		result = tfs_readByte(req->fd, &byte);
+		appendResponse(c, result, &byte, result < 0 ? 0 : 1);
+		return;
+	case TFSD_OP_SEEK:
+		result = tfs_seek(req->fd, req->arg);
+		break;
+	case TFSD_OP_RENAME:
+		result = tfs_rename(req->fd, requestName(req, payload));
+		break;
+	case TFSD_OP_MKDIR:
+		result = tfs_mkdir(requestName(req, payload));
+		break;
+	case TFSD_OP_RMDIR:
+		result = tfs_rmdir(requestName(req, payload));
+		break;
+	case TFSD_OP_MAKERO:
+		tfs_makeRO(requestName(req, payload));
+		result = SUCCESS;
+		break;
+	case TFSD_OP_MAKERW:
+		tfs_makeRW(requestName(req, payload));
+		result = SUCCESS;
+		break;
+	default:
+		result = ERR_BAD_REQUEST;
+		break;
+	}
+
+	appendResponse(c, result, NULL, 0);
+}
+
+void queueRead(tfsd_client *c, tfsd_request *req) {
+	tfsd_read *r;
+
+	roundReads = growBuffer(roundReads, &roundReadCap, roundReadCount + 1, sizeof(tfsd_read));
+	r = &roundReads[roundReadCount++];
+	r->client = c;
+	r->fd = req->fd;
+	r->offset = req->arg;
+	r->size = req->dataLen;
+	r->got = 0;
+	r->dataOff = roundDataLen;
+
+	roundData = growBuffer(roundData, &roundDataCap, roundDataLen + r->size, 1);
+	roundDataLen += r->size;
+}
+
+int compareReads(const void *a, const void *b) {
+	tfsd_read *x = &roundReads[*(const int *) a], *y = &roundReads[*(const int *) b];
+
+	if (x->fd != y->fd) {
+		return x->fd < y->fd ? -1 : 1;
+	}
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Reads ‘size’ bytes at ‘offset’ into mergeBuf, leaving the file's
+shared position where the clients last put it. */
+int readRange(fileDescriptor FD, int offset, int size) {
+	tfs_openEntry *file;
+	int saved, ret;
+
+	if ((file = getOpenFile(FD)) == NULL || offset < 0) {
+		return ERR_FILE_CLOSED;
+	}
+	mergeBuf = growBuffer(mergeBuf, &mergeCap, size, 1);
+
+	saved = file->location;
+	file->location = offset;
+	ret = tfs_readBytes(FD, mergeBuf, size);
+	if ((file = getOpenFile(FD)) != NULL) {
+		file->location = saved;
+	}
+	return ret;
+}
+
+/* Serves every pread of the round, one extent walk per run of
+overlapping or adjacent ranges in the same file. */
+void runReads(void) {
+	tfsd_read *first, *r;
+	int i, j, k, start, end, got;
+
+	roundOrder = realloc(roundOrder, (roundReadCount ? roundReadCount : 1) * sizeof(int));
+	for (i = 0; i < roundReadCount; i++) {
+		roundOrder[i] = i;
+	}
+	qsort(roundOrder, roundReadCount, sizeof(int), compareReads);
+
+	for (i = 0; i < roundReadCount; i = j) {
+		first = &roundReads[roundOrder[i]];
+		start = first->offset;
+		end = start + first->size;
+		for (j = i + 1; j < roundReadCount; j++) {
+			r = &roundReads[roundOrder[j]];
+			if (r->fd != first->fd || r->offset > end) {
+				break;
+			}
+			if (r->offset + r->size > end) {
+				end = r->offset + r->size;
+			}
+		}
+
+		got = readRange(first->fd, start, end - start);
+		statReadPasses++;
+
+		for (k = i; k < j; k++) {
+			r = &roundReads[roundOrder[k]];
+			if (got < 0) {
+				r->got = got;
+				continue;
+			}
+			r->got = start + got - r->offset;
+			r->got = r->got < 0 ? 0 : r->got > r->size ? r->size : r->got;
+			memcpy(roundData + r->dataOff, mergeBuf + (r->offset - start), r->got);
+		}
+	}
+
+	// Answer in arrival order, which keeps each client's replies in order.
+	for (i = 0; i < roundReadCount; i++) {
+		r = &roundReads[i];
+		appendResponse(r->client, r->got, roundData + r->dataOff, r->got < 0 ? 0 : r->got);
+	}
+	statReads += roundReadCount;
+}
+
+void dropClient(int idx) {
+	close(clients[idx].sock);
+	free(clients[idx].in);
+	free(clients[idx].out);
+	clients[idx] = clients[--numClients];
+}
+
+/* Runs one round. Returns 1 if some client still has a complete
+request waiting afterwards. */
+int runRound(void) {
+	tfsd_client *c;
+	tfsd_request req;
+	int i, pos, len, pending = 0;
+
+	roundReadCount = 0;
+	roundDataLen = 0;
+
+	for (i = 0; i < numClients; i++) {
+		c = &clients[i];
+		c->taken = 0;
+
+		// Let a client that is not reading its replies fall behind.
+		if (c->outLen - c->outSent > TFSD_MAX_PAYLOAD) {
+			continue;
+		}
+		if ((len = requestLength(c, 0)) <= 0) {
+			if (len < 0) {
+				fprintf(stderr, "tinyfsd: dropping client sending a bad request\n");
+				dropClient(i--);
+			}
+			continue;
+		}
+
+		memcpy(&req, c->in, sizeof(req));
+		if (req.op != TFSD_OP_PREAD) {
+			runRequest(c, &req, c->in + sizeof(req));
+			c->taken = len;
+			statRequests++;
+			continue;
+		}
+
+		// Take the whole run of preads at the front of the queue.
+		for (pos = 0; (len = requestLength(c, pos)) > 0; pos += len) {
+			memcpy(&req, c->in + pos, sizeof(req));
+			if (req.op != TFSD_OP_PREAD) {
+				break;
+			}
+			queueRead(c, &req);
+			statRequests++;
+		}
+		c->taken = pos;
+	}
+
+	if (roundReadCount) {
+		runReads();
+	}
+	statRounds++;
+
+	for (i = 0; i < numClients; i++) {
+		c = &clients[i];
+		if (c->taken) {
+			c->inLen -= c->taken;
+			memmove(c->in, c->in + c->taken, c->inLen);
+		}
+		if (requestLength(c, 0) != 0) {
+			pending = 1;
+		}
+	}
+	return pending;
+}
+
+/* Returns -1 once the client has gone away */
+int readClient(tfsd_client *c) {
+	int ret;
+
+	c->in = growBuffer(c->in, &c->inCap, c->inLen + TFSD_READ_CHUNK, 1);
+	if ((ret = read(c->sock, c->in + c->inLen, TFSD_READ_CHUNK)) <= 0) {
+		return ret < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	}
+	c->inLen += ret;
+	return 0;
+}
+
+int flushClient(tfsd_client *c) {
+	int ret;
+
+	while (c->outSent < c->outLen) {
+		if ((ret = write(c->sock, c->out + c->outSent, c->outLen - c->outSent)) < 0) {
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+		}
+		c->outSent += ret;
+	}
+	c->outLen = c->outSent = 0;
+	return 0;
+}
+
+void acceptClient(int listenSock) {
+	int sock;
+
+	if ((sock = accept(listenSock, NULL, NULL)) < 0) {
+		return;
+	}
+	if (numClients == TFSD_MAX_CLIENTS) {
+		fprintf(stderr, "tinyfsd: too many clients\n");
+		close(sock);
+		return;
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	memset(&clients[numClients], 0, sizeof(tfsd_client));
+	clients[numClients++].sock = sock;
+}
+
+int openSocket(char *path) {
+	struct sockaddr_un addr;
+	int sock;
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("tinyfsd: socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, TFSD_MAX_CLIENTS) < 0) {
+		perror("tinyfsd: bind");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+int main(int argc, char *argv[]) {
+	struct pollfd fds[TFSD_MAX_CLIENTS + 1];
+	struct sigaction sa;
+	char *image = argc > 1 ? argv[1] : DEFAULT_DISK_NAME;
+	char *path = argc > 2 ? argv[2] : TFSD_DEFAULT_SOCKET;
+	char *tracePath = argc > 3 ? argv[3] : NULL;
+	int listenSock, i, n, ready, pending = 0, background = 1;
+	long readRequests = 0, readCalls = 0, writeRequests = 0, writeCalls = 0;
+
+	if (tfs_mount(image) < 0) {
+		if (tfs_mkfs(image, TFSD_DISK_SIZE) < 0 || tfs_mount(image) < 0) {
+			fprintf(stderr, "tinyfsd: could not mount %s\n", image);
+			return 1;
+		}
+	}
+	if ((listenSock = openSocket(path)) < 0) {
+		tfs_unmount();
+		return 1;
+	}
+	if (tracePath && tfs_traceStart(tracePath) < 0) {
+		fprintf(stderr, "tinyfsd: could not trace to %s\n", tracePath);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("tinyfsd: serving %s on %s\n", image, path);
+	fflush(stdout);
+
+	while (!stopping) {
+		fds[0].fd = listenSock;
+		fds[0].events = POLLIN;
+		for (i = 0; i < numClients; i++) {
+			fds[i + 1].fd = clients[i].sock;
+			fds[i + 1].events = POLLIN | (clients[i].outLen > clients[i].outSent ? POLLOUT : 0);
+		}
+		n = numClients;
+
+		// Don't sleep while there is still work queued from the last round,
+		// and wake up now and then while deleted snapshots are being reclaimed
+		// or the log still has segments worth cleaning.
+		if ((ready = poll(fds, n + 1, pending ? 0 : background ? TFSD_IDLE_MS : -1)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("tinyfsd: poll");
+			break;
+		}
+		if (!ready && !pending) {
+			background = tfs_reclaim(RECLAIM_STEP) > 0;
+			background |= tfs_cleanLog(LOG_CLEAN_STEP) > 0;
+			continue;
+		}
+
+		// Walk backwards so dropping a client doesn't shift ones not yet seen.
+		for (i = n - 1; i >= 0; i--) {
+			if ((fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) && readClient(&clients[i]) < 0) {
+				dropClient(i);
+			}
+		}
+		if (fds[0].revents & POLLIN) {
+			acceptClient(listenSock);
+		}
+
+		pending = runRound();
+		background = 1;
+
+		for (i = numClients - 1; i >= 0; i--) {
+			if (flushClient(&clients[i]) < 0) {
+				dropClient(i);
+			}
+		}
+	}
+
+	while (numClients) {
+		dropClient(numClients - 1);
+	}
+	close(listenSock);
+	unlink(path);
+	if (tracePath) {
+		tfs_traceStop();
+	}
+	tfs_ioStats(&readRequests, &readCalls, &writeRequests, &writeCalls);
+	tfs_unmount();
+
+	printf("tinyfsd: %ld requests in %ld rounds, %ld preads served by %ld extent walks\n",
+	       statRequests, statRounds, statReads, statReadPasses);
+	printf("tinyfsd: %ld block reads in %ld preadv, %ld block writes in %ld pwritev\n",
+	       readRequests, readCalls, writeRequests, writeCalls);
+	return 0;
+}